@@ -0,0 +1,610 @@
+﻿#include "CpuRayMarcher.h"
+
+#include <chrono>
+#include <sstream>
+#include <algorithm>
+#include <cstring>
+
+using namespace glm;
+using namespace std;
+
+// 距離関数（shader.frag と同じシーン） ========================================
+namespace
+{
+	// 球の距離関数
+	float sphere_d(vec3 rp)
+	{
+		vec3 sp = vec3(0, 0, 0);
+		float r = 1.0f;
+		return length(rp - sp) - r;
+	}
+
+	// Round Box
+	float rbox_d(vec3 rp)
+	{
+		float r = 0.1f;
+		vec3 bp = vec3(0, -2.0f, 0);
+		vec3 b = vec3(0.5f, 0.5f, 0.5f);
+		vec3 d = abs(rp - bp) - b;
+		return length(max(d, 0.0f)) - r + std::min(std::max(d.x, std::max(d.y, d.z)), 0.0f);
+	}
+
+	// Torus
+	float torus_d(vec3 rp)
+	{
+		vec2 t = vec2(0.5f, 0.2f);
+		vec3 p = rp - vec3(2.0f, 0, 0);
+		vec2 q = vec2(length(vec2(p.x, p.y)) - t.x, p.z);
+		return length(q) - t.y;
+	}
+
+	// Hexagonal Prism
+	float hexPrizm_d(vec3 rp)
+	{
+		vec2 h = vec2(0.5f, 0.25f);
+		vec3 p = rp - vec3(-2.0f, 0, 0);
+		const vec3 k = vec3(-0.8660254f, 0.5f, 0.57735f);
+		p = abs(p);
+		vec2 pxy = vec2(p.x, p.y);
+		pxy -= 2.0f * std::min(dot(vec2(k.x, k.y), pxy), 0.0f) * vec2(k.x, k.y);
+		p.x = pxy.x;
+		p.y = pxy.y;
+		vec2 d = vec2(
+			length(vec2(p.x, p.y) - vec2(glm::clamp(p.x, -k.z * h.x, k.z * h.x), h.x)) * glm::sign(p.y - h.x), p.z - h.y);
+		return std::min(std::max(d.x, d.y), 0.0f) + length(max(d, 0.0f)) - 0.1f;
+	}
+
+	// Octahedron
+	float octahedron_d(vec3 rp)
+	{
+		float s = 0.5f;
+		vec3 p = abs(rp - vec3(0, 2.0f, 0));
+		return (p.x + p.y + p.z - s) * 0.57735027f;
+	}
+
+	// Plane - Y
+	float planey_d(vec3 rp)
+	{
+		return dot(rp, vec3(0, 1.0f, 0)) + 3.0f;
+	}
+
+	// 距離関数（総合）
+	float sceneDistance(vec3 pos)
+	{
+		return std::min(std::min(std::min(std::min(sphere_d(pos), octahedron_d(pos)), rbox_d(pos)), torus_d(pos)), hexPrizm_d(pos));
+	}
+
+	// 法線
+	vec3 calcNormal(vec3 pos)
+	{
+		const float eps = 0.0001f;
+		const vec3 hx = vec3(eps, 0, 0);
+		const vec3 hy = vec3(0, eps, 0);
+		const vec3 hz = vec3(0, 0, eps);
+		return normalize(vec3(sceneDistance(pos + hx) - sceneDistance(pos - hx),
+			sceneDistance(pos + hy) - sceneDistance(pos - hy),
+			sceneDistance(pos + hz) - sceneDistance(pos - hz)));
+	}
+
+	// 平面の法線
+	vec3 calcPlaneNormal(vec3 pos)
+	{
+		const float eps = 0.0001f;
+		const vec3 hx = vec3(eps, 0, 0);
+		const vec3 hy = vec3(0, eps, 0);
+		const vec3 hz = vec3(0, 0, eps);
+		return normalize(vec3(planey_d(pos + hx) - planey_d(pos - hx),
+			planey_d(pos + hy) - planey_d(pos - hy),
+			planey_d(pos + hz) - planey_d(pos - hz)));
+	}
+
+	// 色を決定する（ライティング）
+	vec3 getColor(const DistanceFunction::ShaderParameters& params, vec3 pos, vec3 normal)
+	{
+		float u = (std::floor(glm::mod(pos.x * 4.0f, 2.0f)) - 0.5f) * 2; // -1 or 1 の範囲に変換
+		float v = (std::floor(glm::mod(pos.y * 4.0f, 2.0f)) - 0.5f) * 2;
+		float w = (std::floor(glm::mod(pos.z * 4.0f, 2.0f)) - 0.5f) * 2;
+		vec3 albedo = mix(vec3(0.9f, 0.5f, 0.8f), vec3(0.45f, 0.25f, 0.4f), u * v * w);
+
+		// ambient Color
+		float NoY = dot(normal, vec3(0, 1, 0));
+		float ambient_intencity = (NoY + 1.0f) * 0.5f;
+		vec3 ambient = mix(vec3(params.sky_color_light), vec3(params.sky_color), ambient_intencity);
+
+		// diffuse
+		float NoL = dot(normal, vec3(params.light_dir));
+		vec3 diffuse = max(vec3(params.light_color) * NoL, vec3(0));
+
+		return albedo * (diffuse + ambient);
+	}
+
+	// 色を決定する（平面ライティング）
+	vec3 getColor_plane(const DistanceFunction::ShaderParameters& params, vec3 pos, vec3 normal)
+	{
+		float u = (std::floor(glm::mod(pos.x, 2.0f)) - 0.5f) * 2; // -1 or 1 の範囲に変換
+		float v = (std::floor(glm::mod(pos.z, 2.0f)) - 0.5f) * 2;
+		vec3 albedo = mix(vec3(0.9f, 0.9f, 0.9f), vec3(0.5f, 0.5f, 0.5f), u * v);
+
+		// ambient Color
+		float NoY = dot(normal, vec3(0, 1, 0));
+		float ambient_intencity = (NoY + 1.0f) * 0.5f;
+		vec3 ambient = mix(vec3(params.sky_color_light), vec3(params.sky_color), ambient_intencity) * albedo;
+
+		// diffuse
+		float NoL = dot(normal, vec3(params.light_dir));
+		vec3 diffuse = max(vec3(params.light_color) * NoL, vec3(0)) * albedo;
+
+		return albedo * (diffuse + ambient);
+	}
+
+	// 色を決定する（シーン記述のマテリアル）
+	vec3 getColorMaterial(const DistanceFunction::ShaderParameters& params, vec3 pos, vec3 normal, const SdfScene::Material& mat)
+	{
+		// 周波数が 0 の軸は模様に使わない
+		float c = 1.0f;
+		for (int i = 0; i < 3; i++)
+		{
+			if (mat.checker[i] != 0.0f)
+			{
+				c *= (std::floor(glm::mod(pos[i] * mat.checker[i], 2.0f)) - 0.5f) * 2;
+			}
+		}
+		vec3 albedo = mix(vec3(mat.color0), vec3(mat.color1), c);
+		// 平面はアルベドを2回掛ける
+		vec3 surface = (mat.checker.w > 1.5f) ? albedo : vec3(1.0f);
+
+		// ambient Color
+		float NoY = dot(normal, vec3(0, 1, 0));
+		float ambient_intencity = (NoY + 1.0f) * 0.5f;
+		vec3 ambient = mix(vec3(params.sky_color_light), vec3(params.sky_color), ambient_intencity) * surface;
+
+		// diffuse
+		float NoL = dot(normal, vec3(params.light_dir));
+		vec3 diffuse = max(vec3(params.light_color) * NoL, vec3(0)) * surface;
+
+		return albedo * (diffuse + ambient);
+	}
+
+	// スカイボックスの色を決定する
+	vec3 skyBoxColor(const DistanceFunction::ShaderParameters& params, vec3 ray_dir)
+	{
+		float s = (dot(ray_dir, vec3(0, 1, 0)) + 1.0f) * 0.5f;
+		return mix(vec3(params.sky_color_light), vec3(params.sky_color), s);
+	}
+}
+
+
+// public ===================================================================
+
+CpuRayMarcher::CpuRayMarcher(uint32_t threadCount, uint32_t tileSize)
+	:m_threadPool(threadCount)
+	,m_tileSize(tileSize)
+	,m_scene(nullptr)
+	,m_bvh(nullptr)
+	,m_brickMap(nullptr)
+	,m_isa(PacketRayMarcher::IsaNone)
+	,m_marchFunc(nullptr)
+	,m_laneCount(1)
+	,m_coneTileSize(0)
+	,m_coneTilesX(0)
+	,m_frames(0)
+	,m_pixels(0)
+	,m_steps(0)
+	,m_prepassTexels(0)
+	,m_prepassSteps(0)
+{
+	setIsa(PacketRayMarcher::detectIsa());
+}
+
+// シーン記述を描画する
+void CpuRayMarcher::setScene(const SdfScene* scene, const SdfBvh* bvh, const SdfBrickMap* brickMap)
+{
+	m_scene = scene;
+	m_bvh = bvh;
+	m_brickMap = bvh ? brickMap : nullptr;
+
+	// レイパケットのカーネルには glm を持ち込まないので、同じレイアウトの構造体に写す
+	static_assert(sizeof(PacketRayMarcher::ScenePrimitive) == sizeof(SdfScene::Primitive), "ScenePrimitive layout mismatch");
+	static_assert(sizeof(PacketRayMarcher::SceneNode) == sizeof(SdfBvh::Node), "SceneNode layout mismatch");
+	m_packetPrimitives.clear();
+	m_packetNodes.clear();
+	m_packetScene = PacketRayMarcher::Scene{};
+	if (!scene)
+	{
+		return;
+	}
+	const auto& primitives = bvh ? bvh->getPrimitives() : scene->getPrimitives();
+	m_packetPrimitives.resize(primitives.size());
+	memcpy(m_packetPrimitives.data(), primitives.data(), primitives.size() * sizeof(SdfScene::Primitive));
+	m_packetScene.primitives = m_packetPrimitives.data();
+	m_packetScene.unboundedCount = uint32_t(primitives.size());
+	if (bvh)
+	{
+		const auto& nodes = bvh->getNodes();
+		m_packetNodes.resize(nodes.size());
+		memcpy(m_packetNodes.data(), nodes.data(), nodes.size() * sizeof(SdfBvh::Node));
+		m_packetScene.unboundedCount = bvh->getUnboundedCount();
+		m_packetScene.nodes = m_packetNodes.data();
+		m_packetScene.nodeCount = uint32_t(nodes.size());
+	}
+}
+
+// レイを進める命令セットを指定する
+void CpuRayMarcher::setIsa(PacketRayMarcher::Isa isa)
+{
+	m_marchFunc = PacketRayMarcher::getMarchFunc(isa);
+	m_isa = m_marchFunc ? isa : PacketRayMarcher::IsaNone;
+	m_laneCount = PacketRayMarcher::getLaneCount(m_isa);
+}
+
+// 1フレーム描画する
+void CpuRayMarcher::render(const DistanceFunction::ShaderParameters& params, uint32_t width, uint32_t height, vector<uint8_t>* pixels)
+{
+	pixels->resize(size_t(width) * height * 4);
+
+	const uint32_t tilesX = (width + m_tileSize - 1) / m_tileSize;
+	const uint32_t tilesY = (height + m_tileSize - 1) / m_tileSize;
+	uint8_t* dst = pixels->data();
+
+	// 前処理パス：低解像度のタイルごとにレイを始めてよい距離を求める
+	m_coneDepth.clear();
+	if (m_scene && m_coneTileSize > 0)
+	{
+		m_coneTilesX = (width + m_coneTileSize - 1) / m_coneTileSize;
+		const uint32_t coneTilesY = (height + m_coneTileSize - 1) / m_coneTileSize;
+		m_coneDepth.resize(size_t(m_coneTilesX) * coneTilesY);
+		m_threadPool.parallelFor(coneTilesY, [&](uint32_t y)
+		{
+			uint64_t steps = 0;
+			for (uint32_t x = 0; x < m_coneTilesX; x++)
+			{
+				uint32_t n;
+				m_coneDepth[size_t(y) * m_coneTilesX + x] = coneMarchScene(params, x, y, &n);
+				steps += n;
+			}
+			m_prepassSteps += steps;
+		});
+		m_prepassTexels += m_coneDepth.size();
+	}
+	if (m_scene)
+	{
+		m_frames++;
+		m_pixels += uint64_t(width) * height;
+	}
+
+	// タイル単位でタスクを積み、空いたワーカーが他のワーカーから盗んで処理する
+	m_threadPool.parallelFor(tilesX * tilesY, [&](uint32_t tile)
+	{
+		uint32_t x0 = (tile % tilesX) * m_tileSize;
+		uint32_t y0 = (tile / tilesX) * m_tileSize;
+		uint32_t x1 = (std::min)(x0 + m_tileSize, width);
+		uint32_t y1 = (std::min)(y0 + m_tileSize, height);
+		// ブリックマップの標本化はパケットに対応していないので1ピクセルずつ処理する
+		if (m_marchFunc && !m_brickMap)
+		{
+			renderTilePacket(params, x0, y0, x1, y1, width, height, dst);
+		}
+		else
+		{
+			renderTile(params, x0, y0, x1, y1, width, height, dst);
+		}
+	});
+}
+
+// これまでのステップ数を返す
+ConeMarchPrepass::Statistics CpuRayMarcher::collectStatistics()
+{
+	ConeMarchPrepass::Statistics stats{};
+	stats.frames = m_frames.exchange(0);
+	stats.pixels = m_pixels.exchange(0);
+	stats.steps = m_steps.exchange(0);
+	stats.prepassTexels = m_prepassTexels.exchange(0);
+	stats.prepassSteps = m_prepassSteps.exchange(0);
+	return stats;
+}
+
+// スレッド数ごとの描画性能を計測する
+void CpuRayMarcher::benchmark(const DistanceFunction::ShaderParameters& params, uint32_t width, uint32_t height, uint32_t frameCount)
+{
+	const uint32_t maxThreads = (std::max)(1u, thread::hardware_concurrency());
+	const PacketRayMarcher::Isa isaList[] = { PacketRayMarcher::IsaNone, PacketRayMarcher::detectIsa() };
+	const uint32_t isaCount = (isaList[1] == PacketRayMarcher::IsaNone) ? 1 : 2;
+	vector<uint8_t> pixels;
+
+	double baseMpixPerSec = 0.0;
+	for (uint32_t threads = 1; ; threads = (std::min)(threads * 2, maxThreads))
+	{
+		CpuRayMarcher marcher(threads);
+
+		for (uint32_t i = 0; i < isaCount; i++)
+		{
+			marcher.setIsa(isaList[i]);
+
+			// ウォームアップ
+			marcher.render(params, width, height, &pixels);
+
+			auto start = chrono::steady_clock::now();
+			for (uint32_t j = 0; j < frameCount; j++)
+			{
+				marcher.render(params, width, height, &pixels);
+			}
+			double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+			double mpixPerSec = double(width) * height * frameCount / seconds / 1.0e6;
+			if (threads == 1 && i == 0)
+			{
+				baseMpixPerSec = mpixPerSec;
+			}
+
+			stringstream ss;
+			ss << "[CpuRayMarcher] threads:" << threads
+				<< " " << PacketRayMarcher::getIsaName(marcher.getIsa())
+				<< " " << mpixPerSec << " Mpix/s"
+				<< " (x" << mpixPerSec / baseMpixPerSec << ")" << endl;
+			OutputDebugStringA(ss.str().c_str());
+		}
+
+		if (threads == maxThreads)
+		{
+			break;
+		}
+	}
+}
+
+
+// private ==================================================================
+
+// タイル1枚分を描画する
+void CpuRayMarcher::renderTile(const DistanceFunction::ShaderParameters& params, uint32_t x0, uint32_t y0, uint32_t x1, uint32_t y1, uint32_t width, uint32_t height, uint8_t* pixels)
+{
+	uint64_t totalSteps = 0;
+	for (uint32_t y = y0; y < y1; y++)
+	{
+		for (uint32_t x = x0; x < x1; x++)
+		{
+			// gl_FragCoord と同じくピクセル中心をサンプルする
+			float fragX = float(x) + 0.5f, fragY = float(y) + 0.5f;
+			vec4 col;
+			if (m_scene)
+			{
+				uint32_t steps;
+				col = traceRayScene(params, fragX, fragY, getStartT(x, y), &steps);
+				totalSteps += steps;
+			}
+			else
+			{
+				col = traceRay(params, fragX, fragY);
+			}
+			writePixel(col, pixels + (size_t(y) * width + x) * 4);
+		}
+	}
+	m_steps += totalSteps;
+}
+
+// タイル1枚分をレイパケットで描画する
+// 横に並んだ m_laneCount ピクセルを1パケットとし、レイを進める部分だけをSIMDで行う
+void CpuRayMarcher::renderTilePacket(const DistanceFunction::ShaderParameters& params, uint32_t x0, uint32_t y0, uint32_t x1, uint32_t y1, uint32_t width, uint32_t height, uint8_t* pixels)
+{
+	PacketRayMarcher::Packet packet;
+	packet.origin[0] = params.camera_pos.x;
+	packet.origin[1] = params.camera_pos.y;
+	packet.origin[2] = params.camera_pos.z;
+	packet.scene = m_scene ? &m_packetScene : nullptr;
+
+	vec3 dirs[PacketRayMarcher::MaxWidth];
+	uint64_t totalSteps = 0;
+
+	for (uint32_t y = y0; y < y1; y++)
+	{
+		for (uint32_t x = x0; x < x1; x += m_laneCount)
+		{
+			packet.count = (std::min)(m_laneCount, x1 - x);
+			for (uint32_t i = 0; i < m_laneCount; i++)
+			{
+				// 余ったレーンは最後のピクセルと同じレイで埋める（結果は使わない）
+				uint32_t px = x + (std::min)(i, packet.count - 1);
+				dirs[i] = rayDirection(params, float(px) + 0.5f, float(y) + 0.5f);
+				packet.dirX[i] = dirs[i].x;
+				packet.dirY[i] = dirs[i].y;
+				packet.dirZ[i] = dirs[i].z;
+				// 前処理パスがあれば、そのタイルの距離から始める
+				packet.startT[i] = m_scene ? getStartT(px, y) : 0.0f;
+			}
+
+			m_marchFunc(&packet);
+
+			if (m_scene)
+			{
+				// 法線と色は1ピクセルずつ求める
+				for (uint32_t i = 0; i < packet.count; i++)
+				{
+					vec3 pos = vec3(packet.posX[i], packet.posY[i], packet.posZ[i]);
+					bool hit = (packet.objectBits & (1u << i)) != 0;
+					writePixel(shadeScene(params, pos, dirs[i], hit, packet.material[i]), pixels + (size_t(y) * width + x + i) * 4);
+					totalSteps += packet.steps[i];
+				}
+				continue;
+			}
+
+			for (uint32_t i = 0; i < packet.count; i++)
+			{
+				HitType hit = HitNone;
+				if (packet.objectBits & (1u << i))
+				{
+					hit = HitObject;
+				}
+				else if (packet.planeBits & (1u << i))
+				{
+					hit = HitPlane;
+				}
+
+				vec3 pos = vec3(packet.posX[i], packet.posY[i], packet.posZ[i]);
+				writePixel(shade(params, pos, dirs[i], hit), pixels + (size_t(y) * width + x + i) * 4);
+			}
+		}
+	}
+	m_steps += totalSteps;
+}
+
+// 1ピクセル分のレイマーチング
+vec4 CpuRayMarcher::traceRay(const DistanceFunction::ShaderParameters& params, float fragX, float fragY)
+{
+	// レイの位置、飛ぶ方向を定義する
+	const vec3 camera_pos = vec3(params.camera_pos);
+	vec3 ray_pos = camera_pos;
+	vec3 ray_dir = rayDirection(params, fragX, fragY);
+
+	float t = 0.0f, d, d2;
+
+	// レイを飛ばす
+	for (int i = 0; i < 256; i++)
+	{
+		d = sceneDistance(ray_pos);
+
+		// ヒット判定
+		if (d < 0.001f)
+		{
+			return shade(params, ray_pos, ray_dir, HitObject);
+		}
+
+		// 平面
+		d2 = planey_d(ray_pos);
+		// ヒット判定
+		if (d2 < 0.001f)
+		{
+			return shade(params, ray_pos, ray_dir, HitPlane);
+		}
+
+		// 次のレイは最小距離 d * ray_dir のぶんだけ進める
+		t += std::min(d, d2);
+		ray_pos = camera_pos + t * ray_dir;
+	}
+
+	return shade(params, ray_pos, ray_dir, HitNone);
+}
+
+// シーン記述に対するレイマーチング（shader.frag の main と同じ処理）
+vec4 CpuRayMarcher::traceRayScene(const DistanceFunction::ShaderParameters& params, float fragX, float fragY, float startT, uint32_t* steps) const
+{
+	const vec3 camera_pos = vec3(params.camera_pos);
+	vec3 ray_dir = rayDirection(params, fragX, fragY);
+
+	float t = startT;
+	vec3 ray_pos = camera_pos + t * ray_dir;
+	*steps = 256;
+	for (int i = 0; i < 256; i++)
+	{
+		uint32_t material;
+		float d = evaluateScene(ray_pos, &material);
+
+		// ヒット判定
+		if (d < 0.001f)
+		{
+			*steps = uint32_t(i + 1);
+			return shadeScene(params, ray_pos, ray_dir, true, material);
+		}
+
+		t += d;
+		ray_pos = camera_pos + t * ray_dir;
+	}
+
+	return shadeScene(params, ray_pos, ray_dir, false, 0);
+}
+
+// シーン記述のレイが止まった位置の色を決める
+vec4 CpuRayMarcher::shadeScene(const DistanceFunction::ShaderParameters& params, const vec3& pos, const vec3& dir, bool hit, uint32_t material) const
+{
+	if (!hit)
+	{
+		return vec4(skyBoxColor(params, dir), 1.0f);
+	}
+
+	const float eps = 0.0001f;
+	const vec3 hx = vec3(eps, 0, 0);
+	const vec3 hy = vec3(0, eps, 0);
+	const vec3 hz = vec3(0, 0, eps);
+	uint32_t unused;
+	vec3 normal = normalize(vec3(
+		evaluateScene(pos + hx, &unused) - evaluateScene(pos - hx, &unused),
+		evaluateScene(pos + hy, &unused) - evaluateScene(pos - hy, &unused),
+		evaluateScene(pos + hz, &unused) - evaluateScene(pos - hz, &unused)));
+	return vec4(getColorMaterial(params, pos, normal, m_scene->getMaterials()[material]), 1.0f);
+}
+
+// ピクセルのレイを始める距離
+float CpuRayMarcher::getStartT(uint32_t x, uint32_t y) const
+{
+	return m_coneDepth.empty() ? 0.0f : m_coneDepth[size_t(y / m_coneTileSize) * m_coneTilesX + x / m_coneTileSize];
+}
+
+// 前処理パスの1タイル分（shader.frag の CONE_PREPASS と同じ処理）
+float CpuRayMarcher::coneMarchScene(const DistanceFunction::ShaderParameters& params, uint32_t tileX, uint32_t tileY, uint32_t* steps) const
+{
+	// タイルの中心を通るレイ
+	const float tile = float(m_coneTileSize);
+	const vec3 camera_pos = vec3(params.camera_pos);
+	vec3 ray_dir = rayDirection(params, (float(tileX) + 0.5f) * tile, (float(tileY) + 0.5f) * tile);
+
+	// 距離 1 あたりのコーンの半径（タイルの対角線の半分に余裕を持たせる）
+	const float k = tile * 1.5f / (std::max)(params.resolution.x, params.resolution.y);
+
+	float t = 0.0f;
+	*steps = 0;
+	for (int i = 0; i < 64; i++)
+	{
+		uint32_t material;
+		float d = evaluateScene(camera_pos + t * ray_dir, &material);
+		(*steps)++;
+		if (d <= k * t + 0.001f)
+		{
+			break;
+		}
+		t += (d - k * t) / (1.0f + k);
+	}
+	return t;
+}
+
+float CpuRayMarcher::evaluateScene(const vec3& pos, uint32_t* material) const
+{
+	if (m_brickMap)
+	{
+		// 焼き込んだ距離に境界を持たないグループを解析的に合成する
+		float d = m_brickMap->distance(pos, material);
+		SdfScene::evaluate(m_bvh->getPrimitives().data(), m_bvh->getUnboundedCount(), pos, &d, material);
+		return d;
+	}
+	return m_bvh ? m_bvh->distance(pos, material) : m_scene->distance(pos, material);
+}
+
+// ピクセル座標からレイの方向を求める
+vec3 CpuRayMarcher::rayDirection(const DistanceFunction::ShaderParameters& params, float fragX, float fragY)
+{
+	// 画面座標の正規化。
+	const vec2 resolution = vec2(params.resolution.x, params.resolution.y);
+	vec2 pos = (vec2(fragX, fragY) * 2.0f - resolution) / std::max(resolution.x, resolution.y) * vec2(1, -1);
+
+	return normalize(pos.x * vec3(params.camera_side) + pos.y * vec3(params.camera_up) + vec3(params.camera_dir));
+}
+
+// レイが止まった位置の色を決める
+vec4 CpuRayMarcher::shade(const DistanceFunction::ShaderParameters& params, const vec3& pos, const vec3& dir, HitType hit)
+{
+	switch (hit)
+	{
+	case HitObject:
+		return vec4(getColor(params, pos, calcNormal(pos)), 1.0f);
+	case HitPlane:
+		return vec4(getColor_plane(params, pos, calcPlaneNormal(pos)), 1.0f);
+	default:
+		return vec4(skyBoxColor(params, dir), 1.0f);
+	}
+}
+
+// RGBA8 で書き込む
+void CpuRayMarcher::writePixel(const vec4& color, uint8_t* dst)
+{
+	vec4 col = clamp(color, 0.0f, 1.0f);
+	dst[0] = uint8_t(col.r * 255.0f + 0.5f);
+	dst[1] = uint8_t(col.g * 255.0f + 0.5f);
+	dst[2] = uint8_t(col.b * 255.0f + 0.5f);
+	dst[3] = uint8_t(col.a * 255.0f + 0.5f);
+}
@@ -0,0 +1,108 @@
+﻿#pragma once
+
+#include "DistanceFunction.h"
+#include "PacketRayMarcher.h"
+#include "../common/SdfScene.h"
+#include "../common/SdfBvh.h"
+#include "../common/SdfBrickMap.h"
+#include "../common/ThreadPool.h"
+#include "../common/ConeMarchPrepass.h"
+
+#include <atomic>
+
+// DistanceFunction のシーンをCPUでレイマーチングするリファレンス実装
+// 画面をタイルに分割し、ワークスティーリングのスレッドプールで並列に描画する
+// CPUがSIMDに対応していれば、横に並んだピクセルをレイパケットとしてまとめて進める（ブリックマップを使う場合を除く）
+class CpuRayMarcher
+{
+public:
+	// threadCount:ワーカースレッド数（0 の場合はハードウェアスレッド数）
+	// tileSize:タイルの一辺のピクセル数
+	explicit CpuRayMarcher(uint32_t threadCount = 0, uint32_t tileSize = 32);
+
+	// 1フレーム描画する
+	// pixels:RGBA8 のピクセル列（左上原点）
+	void render(const DistanceFunction::ShaderParameters& params, uint32_t width, uint32_t height, std::vector<uint8_t>* pixels);
+
+	uint32_t getThreadCount() const { return m_threadPool.getThreadCount(); }
+
+	// シーン記述を描画する（nullptr の場合は組み込みのシーン）
+	// bvh を指定するとBVHで評価するプリミティブを絞り込む（nullptr の場合は全プリミティブを評価する）
+	// brickMap を指定すると境界を持つグループはそちらから標本化する（bvh も必要）
+	void setScene(const SdfScene* scene, const SdfBvh* bvh, const SdfBrickMap* brickMap = nullptr);
+
+	// コーンマーチングの前処理パス（GPU の ConeMarchPrepass と同じ処理）のタイルの大きさ
+	// 0 の場合は前処理なしでカメラ位置から進める（シーン記述を描画する場合のみ有効）
+	void setConeMarchTileSize(uint32_t tileSize) { m_coneTileSize = tileSize; }
+
+	// これまでに描画したフレームのステップ数を返し、カウンタを空にする（シーン記述を描画する場合のみ）
+	ConeMarchPrepass::Statistics collectStatistics();
+
+	// レイを進める命令セットを指定する（IsaNone の場合は1ピクセルずつ処理する）
+	void setIsa(PacketRayMarcher::Isa isa);
+	PacketRayMarcher::Isa getIsa() const { return m_isa; }
+
+	// スレッド数を 1, 2, 4, ... と変えて描画し、スレッド数ごとの Mpix/s を出力する
+	// スカラー版と検出した命令セットのパケット版をそれぞれ計測する
+	static void benchmark(const DistanceFunction::ShaderParameters& params, uint32_t width, uint32_t height, uint32_t frameCount);
+
+private:
+	enum HitType
+	{
+		HitNone,
+		HitObject,
+		HitPlane,
+	};
+
+	// タイル1枚分を描画する
+	void renderTile(const DistanceFunction::ShaderParameters& params, uint32_t x0, uint32_t y0, uint32_t x1, uint32_t y1, uint32_t width, uint32_t height, uint8_t* pixels);
+	void renderTilePacket(const DistanceFunction::ShaderParameters& params, uint32_t x0, uint32_t y0, uint32_t x1, uint32_t y1, uint32_t width, uint32_t height, uint8_t* pixels);
+
+	// 1ピクセル分のレイマーチング（shader.frag の main と同じ処理）
+	static glm::vec4 traceRay(const DistanceFunction::ShaderParameters& params, float fragX, float fragY);
+
+	// シーン記述に対するレイマーチング
+	// startT:レイを始める距離 steps:進めた回数
+	glm::vec4 traceRayScene(const DistanceFunction::ShaderParameters& params, float fragX, float fragY, float startT, uint32_t* steps) const;
+	// シーン記述のレイが止まった位置の色を決める
+	glm::vec4 shadeScene(const DistanceFunction::ShaderParameters& params, const glm::vec3& pos, const glm::vec3& dir, bool hit, uint32_t material) const;
+	// ピクセルのレイを始める距離（前処理パスが無い場合は 0）
+	float getStartT(uint32_t x, uint32_t y) const;
+	// 前処理パスの1タイル分（タイル内のどのレイも表面に当たらない距離）
+	float coneMarchScene(const DistanceFunction::ShaderParameters& params, uint32_t tileX, uint32_t tileY, uint32_t* steps) const;
+	float evaluateScene(const glm::vec3& pos, uint32_t* material) const;
+
+	// ピクセル座標からレイの方向を求める
+	static glm::vec3 rayDirection(const DistanceFunction::ShaderParameters& params, float fragX, float fragY);
+
+	// レイが止まった位置の色を決める
+	static glm::vec4 shade(const DistanceFunction::ShaderParameters& params, const glm::vec3& pos, const glm::vec3& dir, HitType hit);
+
+	static void writePixel(const glm::vec4& color, uint8_t* dst);
+
+	ThreadPool m_threadPool;
+	uint32_t m_tileSize;
+	const SdfScene* m_scene;
+	const SdfBvh* m_bvh;
+	const SdfBrickMap* m_brickMap;
+	PacketRayMarcher::Isa m_isa;
+	PacketRayMarcher::MarchFunc m_marchFunc;
+	uint32_t m_laneCount;
+
+	// レイパケットに渡すシーン記述（SdfScene / SdfBvh の写し）
+	PacketRayMarcher::Scene m_packetScene;
+	std::vector<PacketRayMarcher::ScenePrimitive> m_packetPrimitives;
+	std::vector<PacketRayMarcher::SceneNode> m_packetNodes;
+
+	// 前処理パスの結果（タイルごとのレイの開始距離）
+	uint32_t m_coneTileSize;
+	uint32_t m_coneTilesX;
+	std::vector<float> m_coneDepth;
+
+	// ステップ数の統計
+	std::atomic<uint64_t> m_frames;
+	std::atomic<uint64_t> m_pixels;
+	std::atomic<uint64_t> m_steps;
+	std::atomic<uint64_t> m_prepassTexels;
+	std::atomic<uint64_t> m_prepassSteps;
+};
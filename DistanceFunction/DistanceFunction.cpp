@@ -1,4 +1,6 @@
 ﻿#include "DistanceFunction.h"
+#include "../common/SdfSceneCompiler.h"
+#include "../common/ThreadPool.h"
 
 #include <fstream>
 #include <array>
@@ -14,58 +16,40 @@ using namespace std;
 // 準備
 void DistanceFunction::prepare()
 {
-	// 頂点情報構築
-	prepareGeometry();
+	// シーン記述
+	prepareSceneBuffer();
+	prepareBrickMap();
 
-	// ユニフォームバッファ
-	prepareUniformBuffer();
+	// コンピュートシェーダーの描画先
+	prepareComputeTarget();
+
+	// 統計は実行時にコンパイルしたシェーダーだけが書く（事前にコンパイルしたものに戻した場合は prepareMarchShader で落とす）
+	m_coneMarchPrepass.setStatisticsShader(isMarchStatisticsSupported());
+
+	// 毎フレーム変わるパラメータをプッシュ定数で渡すかどうか
+	preparePushConstants();
 
 	prepareDescriptorSetLayout();
 	prepareDescriptorPool();
 	prepareDescriptorSet();
 
 
-	// 頂点の入力設定
-	VkVertexInputBindingDescription inputBinding{
-		0,							// binding
-		sizeof(Vertex),				// stride
-		VK_VERTEX_INPUT_RATE_VERTEX	// inputRate
-	};
-
-	array<VkVertexInputAttributeDescription, 2> inputAttribs{
-		{
-			{ 0, 0, VK_FORMAT_R32G32B32_SFLOAT, offsetof(Vertex, pos) },
-			{ 1, 0, VK_FORMAT_R32G32B32_SFLOAT, offsetof(Vertex, color) },
-		}
-	};
+	// 頂点の入力は無い（頂点シェーダーが gl_VertexIndex から画面全体を覆う三角形を作る）
 	VkPipelineVertexInputStateCreateInfo vertexInputCI{};
 	vertexInputCI.sType = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO;
-	vertexInputCI.vertexBindingDescriptionCount = 1;
-	vertexInputCI.pVertexBindingDescriptions = &inputBinding;
-	vertexInputCI.vertexAttributeDescriptionCount = uint32_t(inputAttribs.size());
-	vertexInputCI.pVertexAttributeDescriptions = inputAttribs.data();
 	
 
 	/* ビューポートの設定 */
-	VkViewport viewport;
-	{
-		viewport.x = 0.0f;
-		viewport.y = float(m_swapchainExtent.height);
-		viewport.width = float(m_swapchainExtent.width);
-		viewport.height = -1.0f * float(m_swapchainExtent.height);
-		viewport.minDepth = 0.0f;
-		viewport.maxDepth = 1.0f;
-	}
-	VkRect2D scissor = {
-		{0,0},	// offset
-		m_swapchainExtent
-	};
+	// 値は動的ステートにして記録のときに設定する（VulkanAppBase::recordCommand、ウィンドウの大きさが変わってもそのまま使う）
 	VkPipelineViewportStateCreateInfo viewportCI{};
 	viewportCI.sType = VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO;
 	viewportCI.viewportCount = 1;
-	viewportCI.pViewports = &viewport;
 	viewportCI.scissorCount = 1;
-	viewportCI.pScissors = &scissor;
+	const VkDynamicState dynamicStates[] = { VK_DYNAMIC_STATE_VIEWPORT, VK_DYNAMIC_STATE_SCISSOR };
+	VkPipelineDynamicStateCreateInfo dynamicCI{};
+	dynamicCI.sType = VK_STRUCTURE_TYPE_PIPELINE_DYNAMIC_STATE_CREATE_INFO;
+	dynamicCI.dynamicStateCount = _countof(dynamicStates);
+	dynamicCI.pDynamicStates = dynamicStates;
 	
 
 	// プリミティブトポロジー設定
@@ -91,6 +75,12 @@ void DistanceFunction::prepare()
 	pipelineLayoutCI.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
 	pipelineLayoutCI.setLayoutCount = 1;
 	pipelineLayoutCI.pSetLayouts = &m_descriptorSetLayout;
+	VkPushConstantRange pushConstantRange{ MarchStages, 0, sizeof(FrameConstants) };
+	if (m_usePushConstants)
+	{
+		pipelineLayoutCI.pushConstantRangeCount = 1;
+		pipelineLayoutCI.pPushConstantRanges = &pushConstantRange;
+	}
 	vkCreatePipelineLayout(m_device, &pipelineLayoutCI, nullptr, &m_pipelineLayout);
 
 	// AlphaPipeline
@@ -112,10 +102,28 @@ void DistanceFunction::prepare()
 		ci.pDepthStencilState = &depthStencilCI;
 		ci.pMultisampleState = &multisampleCI;
 		ci.pViewportState = &viewportCI;
+		ci.pDynamicState = &dynamicCI;
 		ci.pColorBlendState = &cbCI;
 		ci.renderPass = m_renderPass;
 		ci.layout = m_pipelineLayout;
-		vkCreateGraphicsPipelines(m_device, VK_NULL_HANDLE, 1, &ci, nullptr, &m_pipeline_alpha);
+		vkCreateGraphicsPipelines(m_device, m_pipelineCache.getHandle(), 1, &ci, nullptr, &m_pipeline_alpha);
+
+		// 前処理パス（同じ頂点シェーダーと CONE_PREPASS を定義したフラグメントシェーダー）
+		m_pipeline_prepass = VK_NULL_HANDLE;
+		VkPipelineShaderStageCreateInfo prepassStage;
+		if (prepareMarchShader("#define CONE_PREPASS\n", "shader_prepass.frag.spv", SdfSceneCompiler::StageFragment, &prepassStage))
+		{
+			VkPipelineShaderStageCreateInfo prepassStages[] = { shaderStages[0], prepassStage };
+			ci.stageCount = _countof(prepassStages);
+			ci.pStages = prepassStages;
+			m_pipeline_prepass = m_coneMarchPrepass.createPipeline(ci, m_pipelineCache.getHandle());
+			m_coneMarchPrepass.setAvailable(true);
+			shaderStages.push_back(prepassStage);
+		}
+		else
+		{
+			OutputDebugStringA("prepass shader not found. cone march prepass unavailable.\n");
+		}
 
 		// ShaderModule はもう不要なので破棄
 		for (const auto& v : shaderStages)
@@ -123,27 +131,58 @@ void DistanceFunction::prepare()
 			vkDestroyShaderModule(m_device, v.module, nullptr);
 		}
 	}
+
+	// コンピュートシェーダーで描画する場合のパイプライン
+	prepareComputePipeline();
+
+	// 事前にコンパイルしたシェーダーに戻した場合は統計のバッファが作り直されているので書き直す
+	if (!m_coneMarchPrepass.hasStatisticsShader())
+	{
+		updateTargetDescriptorSet();
+	}
 }
 
 // クリーンアップ
 void DistanceFunction::cleanup()
 {
-	for (auto& v : m_uniformBuffers)
+	m_memoryAllocator.destroyBuffer(m_primitiveBuffer.buffer, m_primitiveBuffer.memory);
+	m_memoryAllocator.destroyBuffer(m_materialBuffer.buffer, m_materialBuffer.memory);
+	m_memoryAllocator.destroyBuffer(m_bvhBuffer.buffer, m_bvhBuffer.memory);
+	if (m_useBrickMap)
+	{
+		destroyImage(m_brickAtlas);
+		destroyImage(m_brickCells);
+		vkDestroySampler(m_device, m_linearSampler, nullptr);
+		vkDestroySampler(m_device, m_nearestSampler, nullptr);
+	}
+	if (m_usePushConstants)
 	{
-		vkDestroyBuffer(m_device, v.buffer, nullptr);
-		vkFreeMemory(m_device, v.memory, nullptr);
+		m_memoryAllocator.destroyBuffer(m_constantBuffer.buffer, m_constantBuffer.memory);
 	}
 
 	vkDestroyPipelineLayout(m_device, m_pipelineLayout, nullptr);
 	vkDestroyPipeline(m_device, m_pipeline_alpha, nullptr);
+	vkDestroyPipeline(m_device, m_pipeline_prepass, nullptr);
+	vkDestroyPipeline(m_device, m_pipeline_compute, nullptr);
+	m_computeTarget.destroy();
 
 	vkDestroyDescriptorPool(m_device, m_descriptorPool, nullptr);
 	vkDestroyDescriptorSetLayout(m_device, m_descriptorSetLayout, nullptr);
+}
+
+// フレームごとのパラメータを更新
+void DistanceFunction::update()
+{
+	auto shaderParam = createShaderParameters();
+	if (m_usePushConstants)
+	{
+		// 記録のときにプッシュ定数として渡す（バッファへの書き込みは無い）
+		m_frameConstants = createFrameConstants(shaderParam);
+		return;
+	}
 
-	vkFreeMemory(m_device, m_vertexBuffer.memory, nullptr);
-	vkFreeMemory(m_device, m_indexBuffer.memory, nullptr);
-	vkDestroyBuffer(m_device, m_vertexBuffer.buffer, nullptr);
-	vkDestroyBuffer(m_device, m_indexBuffer.buffer, nullptr);
+	// シェーダーパラメータはリングバッファに書き、動的オフセットで参照する
+	m_parameterOffset = m_uniformRing.push(shaderParam);
 }
 
 // コマンド作成
@@ -151,37 +190,89 @@ void DistanceFunction::makeCommand(VkCommandBuffer command)
 {
 	{
 		// Alpha
-		auto shaderParam = createShaderParameters();
-		{
-			auto memory = m_uniformBuffers[m_imageIndex].memory;
-			void* p;
-			vkMapMemory(m_device, memory, 0, VK_WHOLE_SIZE, 0, &p);
-			memcpy(p, &shaderParam, sizeof(shaderParam));
-			vkUnmapMemory(m_device, memory);
-		}
+		beginProfileSection(command, "alpha");
 
 		// 作成したパイプラインをセット
 		vkCmdBindPipeline(command, VK_PIPELINE_BIND_POINT_GRAPHICS, m_pipeline_alpha);
 
-		// 各バッファオブジェクトのセット
-		VkDeviceSize offset = 0;
-		vkCmdBindVertexBuffers(command, 0, 1, &m_vertexBuffer.buffer, &offset);
-		vkCmdBindIndexBuffer(command, m_indexBuffer.buffer, offset, VK_INDEX_TYPE_UINT32);
-
-		// ディスクリプタセットをセット
-		VkDescriptorSet descriptorSets[] = {
-			m_descriptorSet[m_imageIndex]
-		};
-		vkCmdBindDescriptorSets(command, VK_PIPELINE_BIND_POINT_GRAPHICS, m_pipelineLayout, 0, 1, descriptorSets, 0, nullptr);
+		// ディスクリプタセットとパラメータをセット
+		bindParameters(command, VK_PIPELINE_BIND_POINT_GRAPHICS);
 
 		// 三角形描画
-		vkCmdDrawIndexed(command, m_indexCount, 1, 0, 0, 0);
+		vkCmdDraw(command, 3, 1, 0, 0);
+
+		endProfileSection(command);
+	}
+}
+
+// 前処理パスのコマンド作成
+void DistanceFunction::makePrepassCommand(VkCommandBuffer command)
+{
+	// パラメータは update で用意済み
+	if (m_coneMarchPrepass.begin(command, m_frameIndex))
+	{
+		vkCmdBindPipeline(command, VK_PIPELINE_BIND_POINT_GRAPHICS, m_pipeline_prepass);
+
+		bindParameters(command, VK_PIPELINE_BIND_POINT_GRAPHICS);
+
+		vkCmdDraw(command, 3, 1, 0, 0);
 	}
+	m_coneMarchPrepass.end(command);
+}
+
+// コンピュートシェーダーで描画するコマンド作成
+bool DistanceFunction::makeComputeCommand(VkCommandBuffer command)
+{
+	if (!m_useCompute)
+	{
+		return false;
+	}
+
+	vkCmdBindPipeline(command, VK_PIPELINE_BIND_POINT_COMPUTE, m_pipeline_compute);
+
+	bindParameters(command, VK_PIPELINE_BIND_POINT_COMPUTE);
+
+	// 8x8 のタイルごとに描画し、スワップチェインのイメージへブリットする
+	beginProfileSection(command, "compute");
+	m_computeTarget.dispatch(command, m_frameIndex);
+	endProfileSection(command);
+
+	beginProfileSection(command, "blit");
+	m_computeTarget.blit(command, m_frameIndex, m_swapchainImages[m_imageIndex], getSwapchainFinalLayout());
+	endProfileSection(command);
+	return true;
+}
+
+// ウィンドウの大きさに合わせて描画先を作り直す（パイプラインはビューポートが動的ステートなのでそのまま使う）
+void DistanceFunction::onSwapchainRecreated()
+{
+	if (m_useCompute)
+	{
+		m_computeTarget.resize(m_swapchainExtent);
+	}
+	updateTargetDescriptorSet();
 }
 
 
 // Private ==================================================================
 
+// 今のフレームのディスクリプタセットとパラメータをセットする
+void DistanceFunction::bindParameters(VkCommandBuffer command, VkPipelineBindPoint bindPoint)
+{
+	VkDescriptorSet descriptorSets[] = {
+		m_descriptorSet[m_frameIndex]
+	};
+	if (m_usePushConstants)
+	{
+		vkCmdBindDescriptorSets(command, bindPoint, m_pipelineLayout, 0, 1, descriptorSets, 0, nullptr);
+		vkCmdPushConstants(command, m_pipelineLayout, MarchStages, 0, sizeof(m_frameConstants), &m_frameConstants);
+	}
+	else
+	{
+		vkCmdBindDescriptorSets(command, bindPoint, m_pipelineLayout, 0, 1, descriptorSets, 1, &m_parameterOffset);
+	}
+}
+
 // バッファオブジェクトを作成する
 DistanceFunction::BufferObject DistanceFunction::createBuffer(uint32_t size, VkBufferUsageFlags usage, VkMemoryPropertyFlags flags)
 {
@@ -190,35 +281,94 @@ DistanceFunction::BufferObject DistanceFunction::createBuffer(uint32_t size, VkB
 	ci.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
 	ci.usage = usage;
 	ci.size = size;
-	auto result = vkCreateBuffer(m_device, &ci, nullptr, &obj.buffer);
+	// ブロックから切り出してバインドする（vkAllocateMemory はブロックを足すときだけ）
+	auto result = m_memoryAllocator.createBuffer(ci, flags, &obj.buffer, &obj.memory);
 	checkResult(result);
+	return obj;
+}
 
-	// メモリ量の算出
-	VkMemoryRequirements reqs;
-	vkGetBufferMemoryRequirements(m_device, obj.buffer, &reqs);
-	VkMemoryAllocateInfo info{};
-	info.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-	info.allocationSize = reqs.size;
-
-	// メモリタイプの判定
-	info.memoryTypeIndex = getMemoryTypeIndex(reqs.memoryTypeBits, flags);
+// デバイスローカルのバッファを作成し、data を転送する
+// 転送は prepare の後にまとめて送信され、描画より前に終わる
+DistanceFunction::BufferObject DistanceFunction::createStaticBuffer(uint32_t size, VkBufferUsageFlags usage, const void* data)
+{
+	BufferObject obj;
+	VkBufferCreateInfo ci{};
+	ci.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+	ci.usage = usage;
+	ci.size = size;
+	const VkAccessFlags access = (usage & VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT) ? VK_ACCESS_UNIFORM_READ_BIT : VK_ACCESS_SHADER_READ_BIT;
+	auto result = m_uploader.createBuffer(ci, data, access, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, &obj.buffer, &obj.memory);
+	checkResult(result);
+	return obj;
+}
 
-	// メモリの確保
-	vkAllocateMemory(m_device, &info, nullptr, &obj.memory);
+// 3Dテクスチャを作成し、m_uploader で data を転送する
+DistanceFunction::ImageObject DistanceFunction::createTexture3D(VkFormat format, const uvec3& extent, const void* data, size_t size)
+{
+	ImageObject obj;
+	VkImageCreateInfo ci{};
+	ci.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+	ci.imageType = VK_IMAGE_TYPE_3D;
+	ci.format = format;
+	ci.extent = { extent.x, extent.y, extent.z };
+	ci.mipLevels = 1;
+	ci.arrayLayers = 1;
+	ci.samples = VK_SAMPLE_COUNT_1_BIT;
+	ci.tiling = VK_IMAGE_TILING_OPTIMAL;
+	ci.usage = VK_IMAGE_USAGE_SAMPLED_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT;
+	ci.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+	auto result = m_memoryAllocator.createImage(ci, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &obj.image, &obj.memory);
+	checkResult(result);
 
-	// メモリのバインド
-	vkBindBufferMemory(m_device, obj.buffer, obj.memory, 0);
+	// コピーとシェーダーから読む状態への遷移は転送用のキューで行い、描画用のキューへ所有権を移す
+	m_uploader.uploadImage(obj.image, VK_IMAGE_ASPECT_COLOR_BIT, ci.extent, data, size, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT);
+
+	VkImageViewCreateInfo viewCI{};
+	viewCI.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
+	viewCI.viewType = VK_IMAGE_VIEW_TYPE_3D;
+	viewCI.image = obj.image;
+	viewCI.format = format;
+	viewCI.components = { VK_COMPONENT_SWIZZLE_R, VK_COMPONENT_SWIZZLE_G, VK_COMPONENT_SWIZZLE_B, VK_COMPONENT_SWIZZLE_A };
+	viewCI.subresourceRange = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1 };
+	result = vkCreateImageView(m_device, &viewCI, nullptr, &obj.view);
+	checkResult(result);
 	return obj;
 }
 
+void DistanceFunction::destroyImage(ImageObject& image)
+{
+	vkDestroyImageView(m_device, image.view, nullptr);
+	m_memoryAllocator.destroyImage(image.image, image.memory);
+}
+
+// 毎フレーム変わる部分（shader.frag の FrameConstants）
+DistanceFunction::FrameConstants DistanceFunction::createFrameConstants(const ShaderParameters& shaderParam)
+{
+	FrameConstants constants;
+	constants.resolution = shaderParam.resolution;
+	constants.camera_pos = shaderParam.camera_pos;
+	constants.camera_dir = shaderParam.camera_dir;
+	constants.camera_up = shaderParam.camera_up;
+	constants.camera_side = shaderParam.camera_side;
+	constants.light_dir = shaderParam.light_dir;
+	return constants;
+}
+
 DistanceFunction::ShaderParameters DistanceFunction::createShaderParameters()
+{
+	auto shaderParam = createShaderParameters(width, height, currentTime);
+	shaderParam.resolution.z = m_coneMarchPrepass.getShaderTileSize();
+	return shaderParam;
+}
+
+DistanceFunction::ShaderParameters DistanceFunction::createShaderParameters(int width, int height, double time) const
 {
 	// ユニフォームバッファの中身を更新する
 	ShaderParameters shaderParam{};
 	shaderParam.resolution = vec4(width, height, 0.0f, 0.0f);
 
 
-	auto rotation = glm::rotate(glm::identity<glm::mat4>(), glm::radians(float(45.0 * currentTime)), glm::vec3(0, 1.0, 0));
+	auto rotation = glm::rotate(glm::identity<glm::mat4>(), glm::radians(float(45.0 * time)), glm::vec3(0, 1.0, 0));
 	auto translation = glm::translate(glm::identity<glm::mat4>(), vec3(0, 1.0, -4.0));
 
 	shaderParam.camera_pos = rotation * translation * vec4(0, 0, 0, 1.0);
@@ -248,45 +398,186 @@ DistanceFunction::ShaderParameters DistanceFunction::createShaderParameters()
 	return shaderParam;
 }
 
-void DistanceFunction::prepareGeometry()
+void DistanceFunction::prepareSceneBuffer()
 {
-	Vertex vertices[] = {
-		{ vec3(-1.0f, 1.0f, 0.0f), blue },
-		{ vec3(-1.0f, -1.0f, 0.0f), lightBlue},
-		{ vec3(1.0f, 1.0f, 0.0f), blue },
-		{ vec3(1.0f, -1.0f, 0.0f), lightBlue },
+	// シーン記述を読み込み、プリミティブとマテリアルをそれぞれストレージバッファに置く
+	if (!m_scene.load("scene.txt"))
+	{
+		OutputDebugStringA("failed to load scene.\n");
+		DebugBreak();
+	}
+
+	// プリミティブはBVHのリーフ順に並べ替えたものを置く
+	m_bvh.build(m_scene);
+	const auto& primitives = m_bvh.getPrimitives();
+	const auto& materials = m_scene.getMaterials();
+	const auto& nodes = m_bvh.getNodes();
+	const SdfBvh::Header header = m_bvh.getHeader();
+	uint32_t primitiveSize = uint32_t(sizeof(SdfScene::Primitive) * primitives.size());
+	uint32_t materialSize = uint32_t(sizeof(SdfScene::Material) * materials.size());
+	uint32_t nodeSize = uint32_t(sizeof(SdfBvh::Node) * nodes.size());
+
+	// 起動中変わらないのでデバイスローカルのメモリに置く
+	m_primitiveBuffer = createStaticBuffer(primitiveSize, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, primitives.data());
+	m_materialBuffer = createStaticBuffer(materialSize, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, materials.data());
+
+	// ヘッダーの後ろにノードを並べる
+	vector<uint8_t> bvhData(sizeof(header) + nodeSize);
+	memcpy(bvhData.data(), &header, sizeof(header));
+	memcpy(bvhData.data() + sizeof(header), nodes.data(), nodeSize);
+	m_bvhBuffer = createStaticBuffer(uint32_t(bvhData.size()), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, bvhData.data());
+}
+
+// 毎フレーム変わるパラメータをプッシュ定数で渡せるか調べ、残りをユニフォームバッファに置く
+void DistanceFunction::preparePushConstants()
+{
+	if (!m_usePushConstants)
+	{
+		return;
+	}
+
+	// 記録したコマンドを使い回す場合、プッシュ定数は記録したときの値のままになる
+	if (isReuseCommands())
+	{
+		OutputDebugStringA("push constants cannot be used with reused commands. falling back to uniform buffer.\n");
+		m_usePushConstants = false;
+		return;
+	}
+
+	VkPhysicalDeviceProperties physProps;
+	vkGetPhysicalDeviceProperties(m_physDev, &physProps);
+	if (physProps.limits.maxPushConstantsSize < sizeof(FrameConstants))
+	{
+		OutputDebugStringA("push constants too small. falling back to uniform buffer.\n");
+		m_usePushConstants = false;
+		return;
+	}
+
+	// 事前にコンパイルしたシェーダーはユニフォームバッファで受け取るので、同じパイプラインレイアウトで作る
+	// すべてのシェーダー（フラグメント・前処理パス・コンピュート）の PUSH_CONSTANTS 版をコンパイルできるか試す
+	// 結果はキャッシュに残るので、パイプラインを作るときはそれを読み込む
+	struct Variant
+	{
+		const char* defines;
+		SdfSceneCompiler::Stage stage;
+		bool used;
+	};
+	const Variant variants[] = {
+		{ "", SdfSceneCompiler::StageFragment, true },
+		{ "#define CONE_PREPASS\n", SdfSceneCompiler::StageFragment, true },
+		{ "#define COMPUTE_MARCH\n", SdfSceneCompiler::StageCompute, m_useCompute },
 	};
-	uint32_t indices[] = { 0,1,2, 2,1,3 };
+	for (const auto& v : variants)
+	{
+		vector<uint32_t> spirv;
+		if (v.used && !compileMarchShader(v.defines, v.stage, &spirv))
+		{
+			OutputDebugStringA("shader with push constants not compiled. falling back to uniform buffer.\n");
+			m_usePushConstants = false;
+			return;
+		}
+	}
 
-	m_vertexBuffer = createBuffer(sizeof(vertices), VK_BUFFER_USAGE_VERTEX_BUFFER_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT);
-	m_indexBuffer = createBuffer(sizeof(indices), VK_BUFFER_USAGE_INDEX_BUFFER_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT);
+	// 残りは起動中変わらないので一度だけ書き込む
+	auto shaderParam = createShaderParameters();
+	SceneConstants constants;
+	constants.light_color = shaderParam.light_color;
+	constants.sky_color_light = shaderParam.sky_color_light;
+	constants.sky_color = shaderParam.sky_color;
 
-	// 頂点データの書き込み
+	m_constantBuffer = createStaticBuffer(sizeof(SceneConstants), VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT, &constants);
+}
+
+void DistanceFunction::prepareBrickMap()
+{
+	if (!m_useBrickMap)
 	{
-		void* p;
-		vkMapMemory(m_device, m_vertexBuffer.memory, 0, VK_WHOLE_SIZE, 0, &p);
-		memcpy(p, vertices, sizeof(vertices));
-		vkUnmapMemory(m_device, m_vertexBuffer.memory);
+		return;
 	}
-	// インデックスデータの書き込み
+
+	// 境界を持つグループの距離場を焼き込む（アトラスの大きさはデバイスの上限に合わせる）
+	VkPhysicalDeviceProperties props;
+	vkGetPhysicalDeviceProperties(m_physDev, &props);
+	auto settings = SdfBrickMap::getDefaultSettings();
+	settings.maxAtlasDimension = (std::min)(props.limits.maxImageDimension3D, 2048u);
 	{
-		void* p;
-		vkMapMemory(m_device, m_indexBuffer.memory, 0, VK_WHOLE_SIZE, 0, &p);
-		memcpy(p, indices, sizeof(indices));
-		vkUnmapMemory(m_device, m_indexBuffer.memory);
+		ThreadPool pool;
+		if (!m_brickMap.bake(m_bvh, settings, pool))
+		{
+			OutputDebugStringA("failed to bake brick map. falling back to analytic distance.\n");
+			m_useBrickMap = false;
+			return;
+		}
 	}
-	m_indexCount = _countof(indices);
+	OutputDebugStringA(m_brickMap.createReport(m_bvh).c_str());
+
+	const auto& atlas = m_brickMap.getAtlas();
+	const auto& cells = m_brickMap.getCells();
+	m_brickAtlas = createTexture3D(VK_FORMAT_R16_SFLOAT, m_brickMap.getAtlasSize(), atlas.data(), m_brickMap.getAtlasBytes());
+	m_brickCells = createTexture3D(VK_FORMAT_R32G32_SFLOAT, m_brickMap.getGridSize(), cells.data(), m_brickMap.getCellBytes());
+
+	// アトラスはブリック内で線形補間し、インダイレクションテーブルは texelFetch で読む
+	VkSamplerCreateInfo ci{};
+	ci.sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO;
+	ci.magFilter = VK_FILTER_LINEAR;
+	ci.minFilter = VK_FILTER_LINEAR;
+	ci.mipmapMode = VK_SAMPLER_MIPMAP_MODE_NEAREST;
+	ci.addressModeU = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+	ci.addressModeV = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+	ci.addressModeW = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+	ci.maxLod = 0.0f;
+	auto result = vkCreateSampler(m_device, &ci, nullptr, &m_linearSampler);
+	checkResult(result);
+
+	ci.magFilter = VK_FILTER_NEAREST;
+	ci.minFilter = VK_FILTER_NEAREST;
+	result = vkCreateSampler(m_device, &ci, nullptr, &m_nearestSampler);
+	checkResult(result);
 }
 
-void DistanceFunction::prepareUniformBuffer()
+void DistanceFunction::prepareComputeTarget()
 {
-	// ユニフォームバッファ
-	m_uniformBuffers.resize(m_swapchainViews.size());
-	for (auto& v : m_uniformBuffers)
+	m_pipeline_compute = VK_NULL_HANDLE;
+	if (!m_useCompute)
+	{
+		return;
+	}
+
+	// ストレージイメージに書き、スワップチェインのイメージへブリットできる場合だけ使う
+	if (!ComputeMarchTarget::isSupported(m_physDev) || !isSwapchainBlitSupported())
 	{
-		VkMemoryPropertyFlags uboFlags = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
-		v = createBuffer(sizeof(ShaderParameters), VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT, uboFlags);
+		OutputDebugStringA("compute raymarching is not supported. falling back to fragment shader.\n");
+		m_useCompute = false;
+		return;
 	}
+	m_computeTarget.create(m_device, m_memoryAllocator, m_swapchainExtent, m_framesInFlight);
+}
+
+void DistanceFunction::prepareComputePipeline()
+{
+	if (!m_useCompute)
+	{
+		return;
+	}
+
+	// フラグメントシェーダーと同じソースを COMPUTE_MARCH を定義してコンパイルしたもの
+	VkPipelineShaderStageCreateInfo computeStage;
+	if (!prepareMarchShader("#define COMPUTE_MARCH\n", "shader_march.comp.spv", SdfSceneCompiler::StageCompute, &computeStage))
+	{
+		OutputDebugStringA("compute shader not found. falling back to fragment shader.\n");
+		m_useCompute = false;
+		return;
+	}
+
+	// ディスクリプタセットはフラグメントシェーダーと共用する
+	VkComputePipelineCreateInfo ci{};
+	ci.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
+	ci.stage = computeStage;
+	ci.layout = m_pipelineLayout;
+	auto result = vkCreateComputePipelines(m_device, m_pipelineCache.getHandle(), 1, &ci, nullptr, &m_pipeline_compute);
+	checkResult(result);
+
+	vkDestroyShaderModule(m_device, computeStage.module, nullptr);
 }
 
 VkPipelineShaderStageCreateInfo DistanceFunction::loadShaderModule(const char* fileName, VkShaderStageFlagBits stage)
@@ -297,18 +588,24 @@ VkPipelineShaderStageCreateInfo DistanceFunction::loadShaderModule(const char* f
 		OutputDebugStringA("file not found.\n");
 		DebugBreak();
 	}
-	vector<char> filedata;
-	filedata.resize(uint32_t(infile.seekg(0, ifstream::end).tellg()));
-	infile.seekg(0, ifstream::beg).read(filedata.data(), filedata.size());
+	vector<uint32_t> filedata;
+	filedata.resize(uint32_t(infile.seekg(0, ifstream::end).tellg()) / sizeof(uint32_t));
+	infile.seekg(0, ifstream::beg).read(reinterpret_cast<char*>(filedata.data()), filedata.size() * sizeof(uint32_t));
 
+	return createShaderModule(filedata, stage);
+}
+
+VkPipelineShaderStageCreateInfo DistanceFunction::createShaderModule(const vector<uint32_t>& code, VkShaderStageFlagBits stage)
+{
 	VkShaderModule shaderModule;
 	VkShaderModuleCreateInfo ci{};
 	ci.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
-	ci.pCode = reinterpret_cast<uint32_t*>(filedata.data());
-	ci.codeSize = filedata.size();
+	ci.pCode = code.data();
+	ci.codeSize = code.size() * sizeof(uint32_t);
 	vkCreateShaderModule(m_device, &ci, nullptr, &shaderModule);
 
 	VkPipelineShaderStageCreateInfo shaderStageCI{};
+	shaderStageCI.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
 	shaderStageCI.stage = stage;
 	shaderStageCI.module = shaderModule;
 	shaderStageCI.pName = "main";
@@ -348,19 +645,131 @@ void DistanceFunction::createAlphaPipelineInfo(
 
 	// シェーダーバイナリ読み込み
 	shaderStages->push_back(loadShaderModule("shader.vert.spv", VK_SHADER_STAGE_VERTEX_BIT));
-	shaderStages->push_back(loadShaderModule("shader.frag.spv", VK_SHADER_STAGE_FRAGMENT_BIT));
+
+	VkPipelineShaderStageCreateInfo fragmentStage{};
+	if (!prepareMarchShader(string(), "shader.frag.spv", SdfSceneCompiler::StageFragment, &fragmentStage))
+	{
+		OutputDebugStringA("file not found.\n");
+		DebugBreak();
+		return;
+	}
+	shaderStages->push_back(fragmentStage);
+}
+
+// レイマーチングするシェーダーを shader.frag からコンパイルする
+// 距離場を焼き込んだ場合はそれを標本化するシェーダー、
+// プリミティブが少なければシーンに特殊化したシェーダー、多ければBVHをたどる汎用版
+bool DistanceFunction::compileMarchShader(const string& defines, SdfSceneCompiler::Stage stage, vector<uint32_t>* spirv)
+{
+	string allDefines = defines;
+	if (m_coneMarchPrepass.hasStatisticsShader())
+	{
+		allDefines = "#define MARCH_STATS\n" + allDefines;
+	}
+	if (m_usePushConstants)
+	{
+		allDefines = "#define PUSH_CONSTANTS\n" + allDefines;
+	}
+	if (m_useBrickMap && SdfSceneCompiler::compile("shader.frag", SdfSceneCompiler::generateBrickMapDistanceFunction(m_bvh, m_brickMap), spirv, allDefines, stage))
+	{
+		return true;
+	}
+	if (m_scene.getPrimitives().size() <= SpecializePrimitiveLimit && SdfSceneCompiler::compile("shader.frag", m_scene, spirv, allDefines, stage))
+	{
+		return true;
+	}
+	return SdfSceneCompiler::compileGeneric("shader.frag", spirv, allDefines, stage);
+}
+
+// レイマーチングするシェーダー（shader.frag から作るフラグメント・コンピュートシェーダー）を用意する
+// コンパイルできなかった場合は事前にコンパイルした汎用版（spvFile、無ければ false を返す）
+bool DistanceFunction::prepareMarchShader(const string& defines, const char* spvFile, SdfSceneCompiler::Stage stage, VkPipelineShaderStageCreateInfo* stageCI)
+{
+	VkShaderStageFlagBits vkStage = (stage == SdfSceneCompiler::StageCompute) ? VK_SHADER_STAGE_COMPUTE_BIT : VK_SHADER_STAGE_FRAGMENT_BIT;
+	vector<uint32_t> spirv;
+	if (compileMarchShader(defines, stage, &spirv))
+	{
+		*stageCI = createShaderModule(spirv, vkStage);
+	}
+	else
+	{
+		// 事前にコンパイルしたものはパラメータをすべてユニフォームバッファで受け取り、ステップ数の統計は取らない
+		if (m_usePushConstants || !ifstream(spvFile, std::ios::binary))
+		{
+			return false;
+		}
+		*stageCI = loadShaderModule(spvFile, vkStage);
+		m_coneMarchPrepass.setStatisticsShader(false);
+	}
+	// ステップ数の上限などは品質の設定で特殊化する
+	stageCI->pSpecializationInfo = &m_marchSpecialization;
+	return true;
 }
 
 void DistanceFunction::prepareDescriptorSetLayout()
 {
+	// フラグメントシェーダーとコンピュートシェーダーで同じディスクリプタセットを使う
+	const VkShaderStageFlags marchStages = MarchStages;
+
 	vector<VkDescriptorSetLayoutBinding> bindings;
 	VkDescriptorSetLayoutBinding bindingUBO{};
 	bindingUBO.binding = 0;
-	bindingUBO.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
-	bindingUBO.stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT;
+	bindingUBO.descriptorType = getParameterDescriptorType();
+	bindingUBO.stageFlags = marchStages;
 	bindingUBO.descriptorCount = 1;
 	bindings.push_back(bindingUBO);
 
+	// シーン記述（プリミティブ、マテリアル、BVH）
+	for (uint32_t i = 1; i <= 3; i++)
+	{
+		VkDescriptorSetLayoutBinding bindingScene{};
+		bindingScene.binding = i;
+		bindingScene.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+		bindingScene.stageFlags = marchStages;
+		bindingScene.descriptorCount = 1;
+		bindings.push_back(bindingScene);
+	}
+
+	// 焼き込んだ距離場（アトラス、インダイレクションテーブル）
+	if (m_useBrickMap)
+	{
+		for (uint32_t i = 4; i <= 5; i++)
+		{
+			VkDescriptorSetLayoutBinding bindingBrickMap{};
+			bindingBrickMap.binding = i;
+			bindingBrickMap.descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+			bindingBrickMap.stageFlags = marchStages;
+			bindingBrickMap.descriptorCount = 1;
+			bindings.push_back(bindingBrickMap);
+		}
+	}
+
+	// コーンマーチングの前処理パスの結果とステップ数の統計
+	VkDescriptorSetLayoutBinding bindingPrepass{};
+	bindingPrepass.binding = 6;
+	bindingPrepass.descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+	bindingPrepass.stageFlags = marchStages;
+	bindingPrepass.descriptorCount = 1;
+	bindings.push_back(bindingPrepass);
+
+	VkDescriptorSetLayoutBinding bindingStats{};
+	bindingStats.binding = 7;
+	bindingStats.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+	bindingStats.stageFlags = marchStages;
+	bindingStats.descriptorCount = 1;
+	bindings.push_back(bindingStats);
+
+	// コンピュートシェーダーの描画先
+	if (m_useCompute)
+	{
+		VkDescriptorSetLayoutBinding bindingOutput{};
+		bindingOutput.binding = 8;
+		bindingOutput.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
+		bindingOutput.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+		bindingOutput.descriptorCount = 1;
+		bindings.push_back(bindingOutput);
+	}
+
 	VkDescriptorSetLayoutCreateInfo ci{};
 	ci.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
 	ci.bindingCount = uint32_t(bindings.size());
@@ -370,13 +779,19 @@ void DistanceFunction::prepareDescriptorSetLayout()
 
 void DistanceFunction::prepareDescriptorPool()
 {
-	array<VkDescriptorPoolSize, 1> descPoolSize;
-	descPoolSize[0].descriptorCount = 1;
-	descPoolSize[0].type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+	array<VkDescriptorPoolSize, 4> descPoolSize;
+	descPoolSize[0].descriptorCount = m_framesInFlight;
+	descPoolSize[0].type = getParameterDescriptorType();
+	descPoolSize[1].descriptorCount = m_framesInFlight * 4;
+	descPoolSize[1].type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+	descPoolSize[2].descriptorCount = m_framesInFlight * 3;
+	descPoolSize[2].type = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+	descPoolSize[3].descriptorCount = m_framesInFlight;
+	descPoolSize[3].type = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
 
 	VkDescriptorPoolCreateInfo ci{};
 	ci.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
-	ci.maxSets = uint32_t(m_uniformBuffers.size());
+	ci.maxSets = m_framesInFlight;
 	ci.poolSizeCount = uint32_t(descPoolSize.size());
 	ci.pPoolSizes = descPoolSize.data();
 	vkCreateDescriptorPool(m_device, &ci, nullptr, &m_descriptorPool);
@@ -385,37 +800,120 @@ void DistanceFunction::prepareDescriptorPool()
 void DistanceFunction::prepareDescriptorSet()
 {
 	vector<VkDescriptorSetLayout> layouts;
-	for (int i = 0; i< int(m_uniformBuffers.size()); ++i)
+	for (int i = 0; i< int(m_framesInFlight); ++i)
 	{
 		layouts.push_back(m_descriptorSetLayout);
 	}
 	VkDescriptorSetAllocateInfo ai{};
 	ai.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
 	ai.descriptorPool = m_descriptorPool;
-	ai.descriptorSetCount = uint32_t(m_uniformBuffers.size());
+	ai.descriptorSetCount = m_framesInFlight;
 	ai.pSetLayouts = layouts.data();
-	m_descriptorSet.resize(m_uniformBuffers.size());
+	m_descriptorSet.resize(m_framesInFlight);
 	vkAllocateDescriptorSets(m_device, &ai, m_descriptorSet.data());
 
 	// ディスクリプタセットへ書き込み
-	for (int i = 0;i<int(m_uniformBuffers.size()); ++i)
+	for (int i = 0;i<int(m_framesInFlight); ++i)
 	{
-		VkDescriptorBufferInfo descUBO{};
-		descUBO.buffer = m_uniformBuffers[i].buffer;
-		descUBO.offset = 0;
-		descUBO.range = VK_WHOLE_SIZE;
+		// リングバッファの場合、位置は描画時に動的オフセットで指定する
+		VkDescriptorBufferInfo descUBO = m_usePushConstants ?
+			VkDescriptorBufferInfo{ m_constantBuffer.buffer, 0, VK_WHOLE_SIZE } :
+			m_uniformRing.getDescriptorInfo(sizeof(ShaderParameters));
 
 		VkWriteDescriptorSet ubo{};
 		ubo.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
 		ubo.dstBinding = 0;
 		ubo.descriptorCount = 1;
-		ubo.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+		ubo.descriptorType = getParameterDescriptorType();
 		ubo.pBufferInfo = &descUBO;
 		ubo.dstSet = m_descriptorSet[i];
 
+		VkDescriptorBufferInfo descPrimitives{ m_primitiveBuffer.buffer, 0, VK_WHOLE_SIZE };
+		VkDescriptorBufferInfo descMaterials{ m_materialBuffer.buffer, 0, VK_WHOLE_SIZE };
+
+		VkWriteDescriptorSet primitives{};
+		primitives.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+		primitives.dstBinding = 1;
+		primitives.descriptorCount = 1;
+		primitives.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+		primitives.pBufferInfo = &descPrimitives;
+		primitives.dstSet = m_descriptorSet[i];
+
+		VkWriteDescriptorSet materials = primitives;
+		materials.dstBinding = 2;
+		materials.pBufferInfo = &descMaterials;
+
+		VkDescriptorBufferInfo descBvh{ m_bvhBuffer.buffer, 0, VK_WHOLE_SIZE };
+		VkWriteDescriptorSet bvh = primitives;
+		bvh.dstBinding = 3;
+		bvh.pBufferInfo = &descBvh;
+
 		vector<VkWriteDescriptorSet> writeSets = {
-			ubo
+			ubo, primitives, materials, bvh
 		};
+
+		VkDescriptorImageInfo descAtlas{ m_linearSampler, m_brickAtlas.view, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL };
+		VkDescriptorImageInfo descCells{ m_nearestSampler, m_brickCells.view, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL };
+		if (m_useBrickMap)
+		{
+			VkWriteDescriptorSet atlas{};
+			atlas.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+			atlas.dstBinding = 4;
+			atlas.descriptorCount = 1;
+			atlas.descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+			atlas.pImageInfo = &descAtlas;
+			atlas.dstSet = m_descriptorSet[i];
+
+			VkWriteDescriptorSet cells = atlas;
+			cells.dstBinding = 5;
+			cells.pImageInfo = &descCells;
+			writeSets.push_back(atlas);
+			writeSets.push_back(cells);
+		}
+		vkUpdateDescriptorSets(m_device, uint32_t(writeSets.size()), writeSets.data(), 0, nullptr);
+	}
+	updateTargetDescriptorSet();
+}
+
+void DistanceFunction::updateTargetDescriptorSet()
+{
+	for (int i = 0; i < int(m_framesInFlight); ++i)
+	{
+		VkDescriptorImageInfo descPrepass = m_coneMarchPrepass.getImageInfo(i);
+		VkWriteDescriptorSet prepass{};
+		prepass.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+		prepass.dstBinding = 6;
+		prepass.descriptorCount = 1;
+		prepass.descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+		prepass.pImageInfo = &descPrepass;
+		prepass.dstSet = m_descriptorSet[i];
+
+		VkDescriptorBufferInfo descStats = m_coneMarchPrepass.getStatisticsBufferInfo(i);
+		VkWriteDescriptorSet stats{};
+		stats.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+		stats.dstBinding = 7;
+		stats.descriptorCount = 1;
+		stats.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+		stats.pBufferInfo = &descStats;
+		stats.dstSet = m_descriptorSet[i];
+
+		vector<VkWriteDescriptorSet> writeSets = {
+			prepass, stats
+		};
+
+		VkDescriptorImageInfo descOutput{};
+		if (m_useCompute)
+		{
+			descOutput = m_computeTarget.getImageInfo(i);
+			VkWriteDescriptorSet output{};
+			output.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+			output.dstBinding = 8;
+			output.descriptorCount = 1;
+			output.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
+			output.pImageInfo = &descOutput;
+			output.dstSet = m_descriptorSet[i];
+			writeSets.push_back(output);
+		}
 		vkUpdateDescriptorSets(m_device, uint32_t(writeSets.size()), writeSets.data(), 0, nullptr);
 	}
 }
\ No newline at end of file
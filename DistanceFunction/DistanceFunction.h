@@ -1,34 +1,56 @@
 ﻿#pragma once
 
 #include "../common/VulkanAppBase.h"
+#include "../common/SdfScene.h"
+#include "../common/SdfBvh.h"
+#include "../common/SdfBrickMap.h"
+#include "../common/SdfSceneCompiler.h"
+#include "../common/ComputeMarchTarget.h"
 #include "glm/glm.hpp"
 
 
 class DistanceFunction : public VulkanAppBase
 {
 public:
-	DistanceFunction() : VulkanAppBase() {}
+	DistanceFunction() : VulkanAppBase(), m_parameterOffset(0), m_usePushConstants(false), m_useBrickMap(false), m_useCompute(false) {}
+
+	// 起動時にシーンの距離場をブリックマップに焼き込み、シェーダーではそれを標本化する
+	// initialize の前に呼ぶこと
+	void setUseBrickMap(bool enable) { m_useBrickMap = enable; }
+
+	// フラグメントシェーダーの代わりにコンピュートシェーダーでレイマーチングする
+	// 対応していない場合はフラグメントシェーダーで描画する（initialize の前に呼ぶこと）
+	void setUseCompute(bool enable) { m_useCompute = enable; }
+
+	// 毎フレーム変わるパラメータ（カメラ・ライト・解像度）をプッシュ定数で渡す（既定で無効）
+	// 大きさが足りない場合、シェーダーをコンパイルできない場合、コマンドを使い回す場合はユニフォームバッファで渡す
+	// initialize の前に呼ぶこと
+	void setUsePushConstants(bool enable) { m_usePushConstants = enable; }
 
 	virtual void prepare() override;
 	virtual void cleanup() override;
 
+	virtual void update() override;
 	virtual void makeCommand(VkCommandBuffer command) override;
+	virtual void makePrepassCommand(VkCommandBuffer command) override;
+	virtual bool makeComputeCommand(VkCommandBuffer command) override;
+	virtual void onSwapchainRecreated() override;
 
-	struct Vertex
-	{
-		glm::vec3 pos;
-		glm::vec3 color;
-	};
-
-private:
-	// バッファを管理するオブジェクト
-	struct BufferObject
+	struct ShaderParameters
 	{
-		VkBuffer buffer;		// バッファ
-		VkDeviceMemory memory;	// デバイスメモリオブジェクトのOpaqueハンドル
+		glm::vec4 resolution;
+		glm::vec4 camera_pos;
+		glm::vec4 camera_dir;
+		glm::vec4 camera_up;
+		glm::vec4 camera_side;
+		glm::vec4 light_dir;
+		glm::vec4 light_color;
+		glm::vec4 sky_color_light;
+		glm::vec4 sky_color;
 	};
 
-	struct ShaderParameters
+	// ShaderParameters のうち毎フレーム変わる部分（shader.frag の FrameConstants、プッシュ定数）
+	struct FrameConstants
 	{
 		glm::vec4 resolution;
 		glm::vec4 camera_pos;
@@ -36,20 +58,60 @@ private:
 		glm::vec4 camera_up;
 		glm::vec4 camera_side;
 		glm::vec4 light_dir;
+	};
+
+	// 残りの変わらない部分（プッシュ定数を使う場合のユニフォームバッファ）
+	struct SceneConstants
+	{
 		glm::vec4 light_color;
 		glm::vec4 sky_color_light;
 		glm::vec4 sky_color;
 	};
 
+	// 解像度と時刻を指定してシェーダーパラメータを作成する（CPUレイマーチングと共用）
+	ShaderParameters createShaderParameters(int width, int height, double time) const;
+
+private:
+	// バッファを管理するオブジェクト
+	struct BufferObject
+	{
+		VkBuffer buffer;		// バッファ
+		DeviceMemoryAllocator::Allocation memory;	// 切り出したデバイスメモリ（ホストから見える場合は mapped に書き込む）
+	};
+
+	// テクスチャを管理するオブジェクト
+	struct ImageObject
+	{
+		VkImage image;
+		DeviceMemoryAllocator::Allocation memory;
+		VkImageView view;
+	};
+
 	const glm::vec3 lightBlue = glm::vec3(0.6f, 0.7f, 0.9f);
 	const glm::vec3 blue = glm::vec3(0.1f, 0.1f, 0.5f);
 
-	void prepareGeometry();
-	void prepareUniformBuffer();
+	void prepareSceneBuffer();
+	void prepareBrickMap();
+	void prepareComputeTarget();
+	void prepareComputePipeline();
+	void preparePushConstants();
 	ShaderParameters createShaderParameters();
+	static FrameConstants createFrameConstants(const ShaderParameters& shaderParam);
+	void bindParameters(VkCommandBuffer command, VkPipelineBindPoint bindPoint);
+	VkDescriptorType getParameterDescriptorType() const
+	{
+		return m_usePushConstants ? VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER : VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
+	}
 
 	BufferObject createBuffer(uint32_t size, VkBufferUsageFlags usage, VkMemoryPropertyFlags flags);
+	// デバイスローカルのバッファを作成し、m_uploader で data を転送する（シェーダーから読むだけのもの）
+	BufferObject createStaticBuffer(uint32_t size, VkBufferUsageFlags usage, const void* data);
+	ImageObject createTexture3D(VkFormat format, const glm::uvec3& extent, const void* data, size_t size);
+	void destroyImage(ImageObject& image);
 	VkPipelineShaderStageCreateInfo loadShaderModule(const char* fileName, VkShaderStageFlagBits stage);
+	VkPipelineShaderStageCreateInfo createShaderModule(const std::vector<uint32_t>& code, VkShaderStageFlagBits stage);
+	bool compileMarchShader(const std::string& defines, SdfSceneCompiler::Stage stage, std::vector<uint32_t>* spirv);
+	bool prepareMarchShader(const std::string& defines, const char* spvFile, SdfSceneCompiler::Stage stage, VkPipelineShaderStageCreateInfo* stageCI);
 
 	void createAlphaPipelineInfo(
 		std::vector<VkPipelineShaderStageCreateInfo>* shaderStages,
@@ -60,16 +122,49 @@ private:
 	void prepareDescriptorSetLayout();
 	void prepareDescriptorPool();
 	void prepareDescriptorSet();
-
-	BufferObject m_vertexBuffer;
-	BufferObject m_indexBuffer;
-	std::vector<BufferObject> m_uniformBuffers;
-
+	// 描画先の大きさに依存するもの（前処理パスの結果と統計、コンピュートシェーダーの描画先）を書く
+	void updateTargetDescriptorSet();
+
+	// 今のフレームのシェーダーパラメータ（m_uniformRing の動的オフセット）
+	uint32_t m_parameterOffset;
+
+	// プッシュ定数で渡す場合の今のフレームの値と、変わらない部分のユニフォームバッファ（binding 0）
+	bool m_usePushConstants;
+	FrameConstants m_frameConstants;
+	BufferObject m_constantBuffer;
+
+	// プッシュ定数とパラメータのディスクリプタを使うステージ
+	static const VkShaderStageFlags MarchStages = VK_SHADER_STAGE_FRAGMENT_BIT | VK_SHADER_STAGE_COMPUTE_BIT;
+
+	// シーン記述（ストレージバッファ）
+	SdfScene m_scene;
+	SdfBvh m_bvh;
+	BufferObject m_primitiveBuffer;
+	BufferObject m_materialBuffer;
+	BufferObject m_bvhBuffer;
+
+	// 焼き込んだ距離場（binding 4:アトラス 5:インダイレクションテーブル）
+	bool m_useBrickMap;
+	SdfBrickMap m_brickMap;
+	ImageObject m_brickAtlas;
+	ImageObject m_brickCells;
+	VkSampler m_linearSampler;
+	VkSampler m_nearestSampler;
+
+	// これ以下のプリミティブ数ならシーンに特殊化したシェーダーを使い、超える場合はBVHをたどる
+	static const uint32_t SpecializePrimitiveLimit = 64;
+
+	// コンピュートシェーダーで描画する場合の描画先（binding 8）
+	bool m_useCompute;
+	ComputeMarchTarget m_computeTarget;
+
+	// binding 6:前処理パスの結果 7:ステップ数の統計 は m_coneMarchPrepass のものを使う
 	VkDescriptorSetLayout m_descriptorSetLayout;
 	VkDescriptorPool m_descriptorPool;
 	std::vector<VkDescriptorSet> m_descriptorSet;
 
 	VkPipelineLayout m_pipelineLayout;
 	VkPipeline m_pipeline_alpha;
-	uint32_t m_indexCount;
+	VkPipeline m_pipeline_prepass;
+	VkPipeline m_pipeline_compute;
 };
\ No newline at end of file
@@ -0,0 +1,80 @@
+﻿#include "PacketRayMarcher.h"
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+// public ===================================================================
+
+// 実行中のCPUで使える最も幅の広い命令セットを返す
+PacketRayMarcher::Isa PacketRayMarcher::detectIsa()
+{
+#if defined(_MSC_VER)
+	int info[4];
+	__cpuid(info, 0);
+	const int maxLeaf = info[0];
+
+	__cpuid(info, 1);
+	const bool sse2 = (info[3] & (1 << 26)) != 0;
+	const bool osxsave = (info[2] & (1 << 27)) != 0;
+	const bool fma = (info[2] & (1 << 12)) != 0;
+
+	// OS が YMM/ZMM レジスタを保存するか
+	unsigned long long xcr0 = osxsave ? _xgetbv(0) : 0;
+	const bool osAvx = (xcr0 & 0x6) == 0x6;
+	const bool osAvx512 = (xcr0 & 0xE6) == 0xE6;
+
+	bool avx2 = false, avx512 = false;
+	if (maxLeaf >= 7)
+	{
+		__cpuidex(info, 7, 0);
+		avx2 = (info[1] & (1 << 5)) != 0;
+		avx512 = (info[1] & (1 << 16)) != 0;
+	}
+
+	if (avx512 && osAvx512 && getMarchFuncAVX512()) return IsaAVX512;
+	if (avx2 && fma && osAvx && getMarchFuncAVX2()) return IsaAVX2;
+	if (sse2) return IsaSSE;
+	return IsaNone;
+#else
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx512f") && getMarchFuncAVX512()) return IsaAVX512;
+	if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma") && getMarchFuncAVX2()) return IsaAVX2;
+	if (__builtin_cpu_supports("sse2")) return IsaSSE;
+	return IsaNone;
+#endif
+}
+
+// 命令セットに対応したカーネルを返す
+PacketRayMarcher::MarchFunc PacketRayMarcher::getMarchFunc(Isa isa)
+{
+	switch (isa)
+	{
+	case IsaSSE:	return getMarchFuncSSE();
+	case IsaAVX2:	return getMarchFuncAVX2();
+	case IsaAVX512:	return getMarchFuncAVX512();
+	default:		return nullptr;
+	}
+}
+
+uint32_t PacketRayMarcher::getLaneCount(Isa isa)
+{
+	switch (isa)
+	{
+	case IsaSSE:	return 4;
+	case IsaAVX2:	return 8;
+	case IsaAVX512:	return 16;
+	default:		return 1;
+	}
+}
+
+const char* PacketRayMarcher::getIsaName(Isa isa)
+{
+	switch (isa)
+	{
+	case IsaSSE:	return "SSE";
+	case IsaAVX2:	return "AVX2";
+	case IsaAVX512:	return "AVX-512";
+	default:		return "Scalar";
+	}
+}
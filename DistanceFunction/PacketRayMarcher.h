@@ -0,0 +1,90 @@
+﻿#pragma once
+
+#include <stdint.h>
+
+// DistanceFunction の組み込みのシーンとシーン記述（SdfScene / SdfBvh）をレイパケット単位で進めるSIMDカーネル
+// 実行時にCPUが対応する最も幅の広い命令セット（SSE/AVX2/AVX-512）の実装を選ぶ
+// 命令セットごとの翻訳単位には glm や STL を持ち込まない（インライン関数の実体が混ざるのを防ぐ）
+class PacketRayMarcher
+{
+public:
+	// 1パケットの最大レーン数
+	static const uint32_t MaxWidth = 16;
+
+	enum Isa
+	{
+		IsaNone,
+		IsaSSE,
+		IsaAVX2,
+		IsaAVX512,
+	};
+
+	// SdfScene::Primitive と同じレイアウト（glm を持ち込まないための写し）
+	struct ScenePrimitive
+	{
+		float position[4];		// xyz:中心 w:角の丸み
+		float size[4];			// xyz:形状ごとの大きさ w:smooth の幅
+		float rotation[4];		// ワールド -> ローカルの回転（クォータニオン）
+		uint32_t info[4];		// x:種類 y:合成方法 z:マテリアル番号
+	};
+
+	// SdfBvh::Node と同じレイアウト
+	struct SceneNode
+	{
+		float boundsMin[4];
+		float boundsMax[4];
+		uint32_t info[4];		// 内部ノード x:左の子 y:右の子 z:0 / リーフ x:先頭のプリミティブ z:プリミティブ数
+	};
+
+	// シーン記述（SdfScene / SdfBvh の内容）
+	struct Scene
+	{
+		const ScenePrimitive* primitives;
+		uint32_t unboundedCount;	// 先頭から常に評価するプリミティブ数（BVH が無い場合は全プリミティブ）
+		const SceneNode* nodes;		// BVH のノード（無い場合は nullptr）
+		uint32_t nodeCount;
+	};
+
+	// 1パケット分のレイ
+	struct Packet
+	{
+		// 入力：レイの始点と各レーンのレイ方向
+		float origin[3];
+		float dirX[MaxWidth];
+		float dirY[MaxWidth];
+		float dirZ[MaxWidth];
+		uint32_t count;		// 有効なレーン数
+
+		// 入力：シーン記述（nullptr の場合は組み込みのシーン）と各レーンのレイを始める距離（シーン記述の場合のみ）
+		const Scene* scene;
+		float startT[MaxWidth];
+
+		// 出力：停止位置とヒットしたレーンのビット
+		float posX[MaxWidth];
+		float posY[MaxWidth];
+		float posZ[MaxWidth];
+		uint32_t objectBits;
+		uint32_t planeBits;		// 組み込みのシーンのみ（シーン記述では平面も objectBits に入る）
+
+		// 出力：シーン記述の場合のみ、ヒットしたマテリアル番号と進めた回数
+		uint32_t material[MaxWidth];
+		uint32_t steps[MaxWidth];
+	};
+
+	typedef void(*MarchFunc)(Packet* packet);
+
+	// 実行中のCPUで使える最も幅の広い命令セットを返す
+	static Isa detectIsa();
+
+	// 命令セットに対応したカーネルを返す（使えない場合は nullptr）
+	static MarchFunc getMarchFunc(Isa isa);
+
+	static uint32_t getLaneCount(Isa isa);
+	static const char* getIsaName(Isa isa);
+
+private:
+	// 命令セットごとの実装（コンパイラが対応していない場合は nullptr）
+	static MarchFunc getMarchFuncSSE();
+	static MarchFunc getMarchFuncAVX2();
+	static MarchFunc getMarchFuncAVX512();
+};
@@ -0,0 +1,11 @@
+﻿// このファイルは AVX2 を有効にしてコンパイルする（/arch:AVX2, -mavx2 -mfma）
+#include "PacketRayMarcherImpl.h"
+
+PacketRayMarcher::MarchFunc PacketRayMarcher::getMarchFuncAVX2()
+{
+#if defined(__AVX2__) || defined(_MSC_VER)
+	return &marchPacket<SimdFloat8>;
+#else
+	return nullptr;
+#endif
+}
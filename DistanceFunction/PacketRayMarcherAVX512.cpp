@@ -0,0 +1,12 @@
+﻿// このファイルは AVX-512 を有効にしてコンパイルする（-mavx512f）
+// MSVC は /arch の指定が無くても組み込み関数を使えるので、プロジェクト既定のままでよい
+#include "PacketRayMarcherImpl.h"
+
+PacketRayMarcher::MarchFunc PacketRayMarcher::getMarchFuncAVX512()
+{
+#if defined(__AVX512F__) || defined(_MSC_VER)
+	return &marchPacket<SimdFloat16>;
+#else
+	return nullptr;
+#endif
+}
@@ -0,0 +1,321 @@
+﻿#pragma once
+
+// PacketRayMarcherSSE/AVX2/AVX512.cpp から命令セットごとにインクルードされる
+
+#include "PacketRayMarcher.h"
+#include "../common/SdfPacket.h"
+
+namespace
+{
+	// 組み込みのシーンの配置（shader.frag と同じ）
+	const float SpherePos[3] = { 0.0f, 0.0f, 0.0f };
+	const float OctahedronPos[3] = { 0.0f, 2.0f, 0.0f };
+	const float RBoxPos[3] = { 0.0f, -2.0f, 0.0f };
+	const float RBoxSize[3] = { 0.5f, 0.5f, 0.5f };
+	const float TorusPos[3] = { 2.0f, 0.0f, 0.0f };
+	const float TorusSize[2] = { 0.5f, 0.2f };
+	const float HexPrizmPos[3] = { -2.0f, 0.0f, 0.0f };
+	const float HexPrizmSize[2] = { 0.5f, 0.25f };
+
+	// 距離関数（総合）
+	template<class F>
+	F sceneDistance(const PacketVec3<F>& p)
+	{
+		return vmin(vmin(vmin(vmin(
+			sphere_d(p, SpherePos, 1.0f),
+			octahedron_d(p, OctahedronPos, 0.5f)),
+			rbox_d(p, RBoxPos, RBoxSize, 0.1f)),
+			torus_d(p, TorusPos, TorusSize)),
+			hexPrizm_d(p, HexPrizmPos, HexPrizmSize));
+	}
+
+	// シーン記述 ===============================================================
+
+	// SdfScene::PrimitiveType / Operation と同じ値
+	enum
+	{
+		TypeSphere,
+		TypeBox,
+		TypeTorus,
+		TypeHexPrism,
+		TypeOctahedron,
+		TypePlaneY,
+	};
+	enum
+	{
+		OpUnion,
+		OpSubtract,
+		OpIntersect,
+		OpSmoothUnion,
+	};
+
+	const float LocalOrigin[3] = { 0.0f, 0.0f, 0.0f };
+
+	// プリミティブ単体の距離（SdfScene::primitiveDistance と同じ計算）
+	template<class F>
+	F primitiveDistance(const PacketRayMarcher::ScenePrimitive& prim, const PacketVec3<F>& pos)
+	{
+		PacketVec3<F> p = { pos.x - prim.position[0], pos.y - prim.position[1], pos.z - prim.position[2] };
+
+		// クォータニオンで回転する（回転していなければ省く）
+		const float* q = prim.rotation;
+		if (q[0] != 0.0f || q[1] != 0.0f || q[2] != 0.0f)
+		{
+			F cx = p.z * q[1] - p.y * q[2] + p.x * q[3];
+			F cy = p.x * q[2] - p.z * q[0] + p.y * q[3];
+			F cz = p.y * q[0] - p.x * q[1] + p.z * q[3];
+			p.x = p.x + (cz * q[1] - cy * q[2]) * 2.0f;
+			p.y = p.y + (cx * q[2] - cz * q[0]) * 2.0f;
+			p.z = p.z + (cy * q[0] - cx * q[1]) * 2.0f;
+		}
+
+		const float* s = prim.size;
+		F d(0.0f);
+		switch (prim.info[0])
+		{
+		case TypeSphere:		d = sphere_d(p, LocalOrigin, s[0]); break;
+		case TypeBox:			d = box_d(p, LocalOrigin, s); break;
+		case TypeTorus:			d = torus_d(p, LocalOrigin, s); break;
+		case TypeHexPrism:		d = hexPrism_d(p, LocalOrigin, s); break;
+		case TypeOctahedron:	d = octahedron_d(p, LocalOrigin, s[0]); break;
+		case TypePlaneY:		d = p.y; break;
+		}
+		return d - prim.position[3];
+	}
+
+	// グループ単位で並んだプリミティブ列を評価し、d と material を更新する（SdfScene::evaluate と同じ計算）
+	// マテリアル番号はレーンごとに選ぶため浮動小数点で持つ
+	template<class F>
+	void evaluateGroups(const PacketRayMarcher::ScenePrimitive* primitives, uint32_t count, const PacketVec3<F>& pos, F* d, F* material)
+	{
+		typedef typename F::Mask Mask;
+
+		F dg(1.0e10f);
+		F mg(0.0f);
+		for (uint32_t i = 0; i < count; i++)
+		{
+			const auto& prim = primitives[i];
+			F di = primitiveDistance(prim, pos);
+			switch (prim.info[1])
+			{
+			case OpUnion:
+			{
+				// 新しいグループを始める
+				Mask closer = dg < *d;
+				*d = select(closer, dg, *d);
+				*material = select(closer, mg, *material);
+				dg = di;
+				mg = F(float(prim.info[2]));
+				break;
+			}
+			case OpSubtract:
+				dg = vmax(dg, F(0.0f) - di);
+				break;
+			case OpIntersect:
+				dg = vmax(dg, di);
+				break;
+			case OpSmoothUnion:
+			{
+				float k = (prim.size[3] > 1.0e-5f) ? prim.size[3] : 1.0e-5f;
+				F h = vmin(vmax((dg - di) * (0.5f / k) + 0.5f, F(0.0f)), F(1.0f));
+				dg = dg + (di - dg) * h - h * (F(1.0f) - h) * k;
+				mg = select(h > F(0.5f), F(float(prim.info[2])), mg);
+				break;
+			}
+			}
+		}
+
+		Mask closer = dg < *d;
+		*d = select(closer, dg, *d);
+		*material = select(closer, mg, *material);
+	}
+
+	// 点から境界ボックスまでの距離（内側は 0）
+	template<class F>
+	F boxDistance(const PacketVec3<F>& pos, const PacketRayMarcher::SceneNode& node)
+	{
+		const F zero(0.0f);
+		F dx = vmax(vmax(F(node.boundsMin[0]) - pos.x, pos.x - node.boundsMax[0]), zero);
+		F dy = vmax(vmax(F(node.boundsMin[1]) - pos.y, pos.y - node.boundsMax[1]), zero);
+		F dz = vmax(vmax(F(node.boundsMin[2]) - pos.z, pos.z - node.boundsMax[2]), zero);
+		return packetLength(dx, dy, dz);
+	}
+
+	// 有効なレーンの中の最小値
+	template<class F>
+	float minLane(F v, uint32_t laneBits)
+	{
+		float lanes[F::Width];
+		v.store(lanes);
+		float m = 1.0e30f;
+		for (uint32_t i = 0; i < F::Width; i++)
+		{
+			if ((laneBits & (1u << i)) && lanes[i] < m)
+			{
+				m = lanes[i];
+			}
+		}
+		return m;
+	}
+
+	// BVH をパケットでたどる（SdfBvh::traverse と同じ結果）
+	// どの有効なレーンから見てもこれまでの最小距離より遠いノードだけを飛ばす
+	template<class F>
+	void traverse(const PacketRayMarcher::Scene& scene, const PacketVec3<F>& pos, typename F::Mask active, F* d, F* material)
+	{
+		if (scene.nodeCount == 0)
+		{
+			return;
+		}
+
+		uint32_t stack[64];
+		uint32_t sp = 0;
+		stack[sp++] = 0;
+		while (sp > 0)
+		{
+			const auto& node = scene.nodes[stack[--sp]];
+			if (!any(active & (boxDistance(pos, node) < *d)))
+			{
+				continue;
+			}
+
+			if (node.info[2] > 0)
+			{
+				evaluateGroups(scene.primitives + node.info[0], node.info[2], pos, d, material);
+				continue;
+			}
+
+			// 有効なレーンの中で近い方の子を後に積み、先に評価する
+			uint32_t nearChild = node.info[0], farChild = node.info[1];
+			const uint32_t laneBits = bits(active);
+			if (minLane(boxDistance(pos, scene.nodes[farChild]), laneBits) < minLane(boxDistance(pos, scene.nodes[nearChild]), laneBits))
+			{
+				uint32_t tmp = nearChild;
+				nearChild = farChild;
+				farChild = tmp;
+			}
+			stack[sp++] = farChild;
+			stack[sp++] = nearChild;
+		}
+	}
+
+	// シーン記述に対して1パケット分のレイを進める（CpuRayMarcher::traceRayScene と同じ処理）
+	template<class F>
+	void marchPacketScene(PacketRayMarcher::Packet* packet)
+	{
+		typedef typename F::Mask Mask;
+
+		const PacketRayMarcher::Scene& scene = *packet->scene;
+		const F originX(packet->origin[0]);
+		const F originY(packet->origin[1]);
+		const F originZ(packet->origin[2]);
+		const F dirX = F::load(packet->dirX);
+		const F dirY = F::load(packet->dirY);
+		const F dirZ = F::load(packet->dirZ);
+		const F eps(0.001f);
+
+		Mask active = F::laneMask(packet->count);
+		Mask hitObject = F::noneMask();
+		F hitMaterial(0.0f);
+		F steps(256.0f);
+
+		F t = F::load(packet->startT);
+		PacketVec3<F> pos = { originX + t * dirX, originY + t * dirY, originZ + t * dirZ };
+
+		for (int i = 0; i < 256 && any(active); i++)
+		{
+			F d(1.0e10f);
+			F material(0.0f);
+			evaluateGroups(scene.primitives, scene.unboundedCount, pos, &d, &material);
+			traverse(scene, pos, active, &d, &material);
+
+			// ヒット判定
+			Mask hit = active & (d < eps);
+			hitObject = hitObject | hit;
+			hitMaterial = select(hit, material, hitMaterial);
+			steps = select(hit, F(float(i + 1)), steps);
+			active = andNot(active, hit);
+
+			t = select(active, t + d, t);
+			pos.x = select(active, originX + t * dirX, pos.x);
+			pos.y = select(active, originY + t * dirY, pos.y);
+			pos.z = select(active, originZ + t * dirZ, pos.z);
+		}
+
+		pos.x.store(packet->posX);
+		pos.y.store(packet->posY);
+		pos.z.store(packet->posZ);
+		packet->objectBits = bits(hitObject);
+		packet->planeBits = 0;
+
+		float lanes[F::Width];
+		hitMaterial.store(lanes);
+		for (uint32_t i = 0; i < F::Width; i++)
+		{
+			packet->material[i] = uint32_t(lanes[i]);
+		}
+		steps.store(lanes);
+		for (uint32_t i = 0; i < F::Width; i++)
+		{
+			packet->steps[i] = uint32_t(lanes[i]);
+		}
+	}
+
+	// 組み込みのシーン =========================================================
+
+	// 1パケット分のレイを進める
+	// ヒットしたレーンはマスクから外し、全レーンが止まるか最大ステップ数に達するまで続ける
+	template<class F>
+	void marchPacket(PacketRayMarcher::Packet* packet)
+	{
+		typedef typename F::Mask Mask;
+
+		if (packet->scene)
+		{
+			marchPacketScene<F>(packet);
+			return;
+		}
+
+		const F originX(packet->origin[0]);
+		const F originY(packet->origin[1]);
+		const F originZ(packet->origin[2]);
+		const F dirX = F::load(packet->dirX);
+		const F dirY = F::load(packet->dirY);
+		const F dirZ = F::load(packet->dirZ);
+		const F eps(0.001f);
+
+		Mask active = F::laneMask(packet->count);
+		Mask hitObject = F::noneMask();
+		Mask hitPlane = F::noneMask();
+
+		F t(0.0f);
+		PacketVec3<F> pos = { originX, originY, originZ };
+
+		for (int i = 0; i < 256 && any(active); i++)
+		{
+			// ヒット判定
+			F d = sceneDistance(pos);
+			Mask hit = active & (d < eps);
+			hitObject = hitObject | hit;
+			active = andNot(active, hit);
+
+			// 平面
+			F d2 = planey_d(pos, 3.0f);
+			Mask hit2 = active & (d2 < eps);
+			hitPlane = hitPlane | hit2;
+			active = andNot(active, hit2);
+
+			// 動いているレーンだけ最小距離ぶん進める
+			t = select(active, t + vmin(d, d2), t);
+			pos.x = select(active, originX + t * dirX, pos.x);
+			pos.y = select(active, originY + t * dirY, pos.y);
+			pos.z = select(active, originZ + t * dirZ, pos.z);
+		}
+
+		pos.x.store(packet->posX);
+		pos.y.store(packet->posY);
+		pos.z.store(packet->posZ);
+		packet->objectBits = bits(hitObject);
+		packet->planeBits = bits(hitPlane);
+	}
+}
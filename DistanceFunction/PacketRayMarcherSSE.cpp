@@ -0,0 +1,6 @@
+﻿#include "PacketRayMarcherImpl.h"
+
+PacketRayMarcher::MarchFunc PacketRayMarcher::getMarchFuncSSE()
+{
+	return &marchPacket<SimdFloat4>;
+}
@@ -1,29 +1,37 @@
+#ifdef _WIN32
 #define WIN32_LEAN_AND_MEAN
 #include <windows.h>
+#endif
 
 #include <vector>
 #include <array>
 #include <cassert>
 #include <sstream>
 #include <numeric>
+#include <chrono>
+#include <cstring>
 
 #include "DistanceFunction.h"
+#include "CpuRayMarcher.h"
+#include "Benchmark.h"
 
+#ifdef _WIN32
 // VulkanCũN
 #pragma comment(lib, "vulkan-1.lib")
+#endif
 
 const int WindowWidth = 1280;
 const int WindowHeight = 1024;
 
 const char* AppTitle = "RayMarching - DistanceFunction";
 
+#ifdef _WIN32
 int WINAPI wWinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, LPWSTR lpCmdLine, int nCmdShow)
 {
 	UNREFERENCED_PARAMETER(hPrevInstance);
-	UNREFERENCED_PARAMETER(lpCmdLine);
 	glfwInit();
 	glfwWindowHint(GLFW_CLIENT_API, GLFW_NO_API);
-	glfwWindowHint(GLFW_RESIZABLE, 0);
+	glfwWindowHint(GLFW_RESIZABLE, 1);
 	auto window = glfwCreateWindow(WindowWidth, WindowHeight, AppTitle, nullptr, nullptr);
 
 	//::AllocConsole();
@@ -32,7 +40,52 @@ int WINAPI wWinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, LPWSTR lpCmdLi
 	//freopen_s(&fp, "CONIN$", "r", stdin);
 
 	// Vulkan 
+	//  brick w肷ƋĂŕ`悷
+	// compute w肷ƃRs[gVF[_[ŕ`悷
+	// push w肷Ɩt[ςp[^vbV萔œn
+	// reuse w肷ƋL^R}hobt@g
+	// prepass w肷ƃR[}[`ȎOpXg
+	// preview / final w肷ƃXebv̏ȂǂĩvZbgɍ킹
+	// device=<O|UUID|ԍ> w肷ƂɈv镨foCXŕ`悷
+	// present=<fifo|fifo_relaxed|mailbox|immediate> w肷Ƃ̕\[hgiEBhȆ傫͕ςj
 	DistanceFunction theApp;
+	theApp.setUseBrickMap(wcsstr(lpCmdLine, L"brick") != nullptr);
+	theApp.setUseCompute(wcsstr(lpCmdLine, L"compute") != nullptr);
+	theApp.setUsePushConstants(wcsstr(lpCmdLine, L"push") != nullptr);
+	theApp.setReuseCommands(wcsstr(lpCmdLine, L"reuse") != nullptr);
+	theApp.getConeMarchPrepass().setEnabled(wcsstr(lpCmdLine, L"prepass") != nullptr);
+	if (wcsstr(lpCmdLine, L"preview") != nullptr)
+	{
+		theApp.setMarchQualityPreset(MarchQuality::PresetPreview);
+	}
+	else if (wcsstr(lpCmdLine, L"final") != nullptr)
+	{
+		theApp.setMarchQualityPreset(MarchQuality::PresetFinal);
+	}
+	if (auto device = wcsstr(lpCmdLine, L"device="))
+	{
+		// ̋󔒂܂łoiOEUUIDEԍ ASCII ͈̔͂Ŏw肷j
+		std::string filter;
+		for (device += 7; *device != L'\0' && *device != L' '; device++)
+		{
+			filter.push_back(char(*device));
+		}
+		theApp.setPhysicalDeviceFilter(filter.c_str());
+	}
+	if (auto present = wcsstr(lpCmdLine, L"present="))
+	{
+		// ̋󔒂܂łoififo / fifo_relaxed / mailbox / immediateAΉĂȂ fifo ɂȂj
+		std::string name;
+		for (present += 8; *present != L'\0' && *present != L' '; present++)
+		{
+			name.push_back(char(*present));
+		}
+		VkPresentModeKHR mode;
+		if (VulkanAppBase::findPresentMode(name.c_str(), &mode))
+		{
+			theApp.setPresentMode(mode);
+		}
+	}
 	theApp.initialize(window, AppTitle);
 
 	while (glfwWindowShouldClose(window) == GLFW_FALSE)
@@ -48,4 +101,227 @@ int WINAPI wWinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, LPWSTR lpCmdLi
 	//::FreeConsole();
 
 	return 0;
-}
\ No newline at end of file
+}
+#else
+// brick / compute / push / reuse / prepass / ĩvZbg / device= ̎w𔽉fiǂłȂ falsej
+bool applyOption(DistanceFunction& app, const char* option)
+{
+	MarchQuality::Preset preset;
+	if (MarchQuality::findPreset(option, &preset))
+	{
+		app.setMarchQualityPreset(preset);
+	}
+	else if (strcmp(option, "brick") == 0)
+	{
+		app.setUseBrickMap(true);
+	}
+	else if (strcmp(option, "compute") == 0)
+	{
+		app.setUseCompute(true);
+	}
+	else if (strcmp(option, "push") == 0)
+	{
+		app.setUsePushConstants(true);
+	}
+	else if (strcmp(option, "reuse") == 0)
+	{
+		app.setReuseCommands(true);
+	}
+	else if (strcmp(option, "prepass") == 0)
+	{
+		app.getConeMarchPrepass().setEnabled(true);
+	}
+	else if (strncmp(option, "device=", 7) == 0)
+	{
+		app.setPhysicalDeviceFilter(option + 7);
+	}
+	else
+	{
+		return false;
+	}
+	return true;
+}
+
+// wbhXł̓ItXN[`悵ʂ摜Ƃĕۑ
+// : [`t[] [o̓t@C] [brick] [compute] [push] [reuse] [prepass] [preview|final] [profile] [heatmap] [device=<O|UUID|ԍ>]
+//       brick w肷ƋĂŕ`悷
+//       compute w肷ƃRs[gVF[_[ŕ`悷
+//       push w肷Ɩt[ςp[^vbV萔œnigȂꍇ̓jtH[obt@œnj
+//       reuse w肷ƋL^R}hobt@g
+//       prepass w肷ƃR[}[`ȎOpXgiXebv̓v͑OpXȂE̗o͂j
+//       preview / final w肷ƃXebv̏ȂǂĩvZbgɍ킹ishader.frag ̓ꉻ萔j
+//       profile w肷Ƒēt[`悵AGPU ̋ԂƂ̏Ԃo͂
+//       heatmap w肷ƍŌɃsNZƂ̃XebvWvA[J[̉摜 heatmap.ppm ɕۑ
+//       device= w肷ƖÖꕔEUUID ̐擪E񋓂ԍv镨foCXŕ`悷i͓_ł́j
+//       bench [vt[] [EH[Abṽt[] [𑜓x] [o̓t@C] [brick] ... ̏ꍇ͌Œ̎ԍ݂ŕ`悵A
+//       𑜓xi1280x1024,640x480 ̂悤ɃJ}ŋ؂jƂ CPUEGPU ̎Ԃ CSV ƓO JSON ɏo͂
+//       cpu [o̓t@C] ̏ꍇGPUg킸CPUŕ`悵AXbhƂ̐\o͂
+//       cpu <o̓t@C> <V[t@C> ̏ꍇ̓V[LqCPUŕ`悵ABVH̗LƃubN}bvŐ\ׂ
+//       iđOpX̗LŃXebvׂj
+int main(int argc, char** argv)
+{
+	if (argc > 1 && strcmp(argv[1], "bench") == 0)
+	{
+		auto settings = Benchmark::getDefaultSettings();
+		settings.resolutions = { { WindowWidth, WindowHeight } };
+		const char* benchFile = "benchmark.csv";
+		int next = Benchmark::parseArguments(argc, argv, 2, &settings, &benchFile);
+
+		std::vector<Benchmark::Result> results;
+		for (auto extent : settings.resolutions)
+		{
+			DistanceFunction theApp;
+			for (int i = next; i < argc; i++)
+			{
+				applyOption(theApp, argv[i]);
+			}
+			results.push_back(Benchmark::run(theApp, AppTitle, extent, settings));
+			OutputDebugStringA(Benchmark::createReport(results.back()).c_str());
+		}
+		bool written = Benchmark::writeCsv(benchFile, results);
+		written &= Benchmark::writeJson(Benchmark::getJsonFileName(benchFile).c_str(), results);
+		return written ? 0 : 1;
+	}
+
+	if (argc > 1 && strcmp(argv[1], "cpu") == 0)
+	{
+		const char* outputFile = argc > 2 ? argv[2] : "output_cpu.ppm";
+
+		DistanceFunction scene;
+		auto params = scene.createShaderParameters(WindowWidth, WindowHeight, 0.0);
+
+		CpuRayMarcher marcher;
+		std::vector<uint8_t> pixels;
+
+		if (argc > 3)
+		{
+			SdfScene sdfScene;
+			if (!sdfScene.load(argv[3]))
+			{
+				return 1;
+			}
+			SdfBvh bvh;
+			bvh.build(sdfScene);
+
+			// Ă݁Agpʂƌ덷o͂
+			SdfBrickMap brickMap;
+			{
+				ThreadPool pool;
+				if (brickMap.bake(bvh, SdfBrickMap::getDefaultSettings(), pool))
+				{
+					OutputDebugStringA(brickMap.createReport(bvh).c_str());
+				}
+			}
+
+			// Sv~eBu]ꍇABVHōi荞ޏꍇAĂ񂾋gꍇ
+			struct Mode
+			{
+				const char* name;
+				const SdfBvh* bvh;
+				const SdfBrickMap* brickMap;
+			};
+			const Mode modes[] = {
+				{ "brute force", nullptr, nullptr },
+				{ "bvh", &bvh, nullptr },
+				{ "brick map", &bvh, brickMap.isEmpty() ? nullptr : &brickMap },
+			};
+			std::vector<uint8_t> reference;
+			for (const auto& mode : modes)
+			{
+				marcher.setScene(&sdfScene, mode.bvh, mode.brickMap);
+				auto start = std::chrono::steady_clock::now();
+				marcher.render(params, WindowWidth, WindowHeight, &pixels);
+
+				std::stringstream ss;
+				ss << "[CpuRayMarcher] primitives:" << sdfScene.getPrimitives().size()
+					<< " " << mode.name << " " << std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count() << " ms";
+				if (reference.empty())
+				{
+					reference = pixels;
+				}
+				else
+				{
+					// Sv~eBu]ʂƈႤsNZ
+					size_t diff = 0;
+					for (size_t i = 0; i < pixels.size(); i += 4)
+					{
+						diff += (memcmp(&pixels[i], &reference[i], 3) != 0) ? 1 : 0;
+					}
+					ss << " (" << diff << " pixels differ)";
+				}
+				ss << std::endl;
+				OutputDebugStringA(ss.str().c_str());
+			}
+
+			// R[}[`ȎOpXȂEŃXebvׂiŌ̃[ĥ܂ܕ`悷j
+			marcher.collectStatistics();
+			marcher.render(params, WindowWidth, WindowHeight, &reference);
+			OutputDebugStringA(ConeMarchPrepass::createReport("without prepass", marcher.collectStatistics()).c_str());
+
+			marcher.setConeMarchTileSize(ConeMarchPrepass::DefaultTileSize);
+			marcher.render(params, WindowWidth, WindowHeight, &pixels);
+			OutputDebugStringA(ConeMarchPrepass::createReport("with prepass", marcher.collectStatistics()).c_str());
+			{
+				size_t diff = 0;
+				for (size_t i = 0; i < pixels.size(); i += 4)
+				{
+					diff += (memcmp(&pixels[i], &reference[i], 3) != 0) ? 1 : 0;
+				}
+				std::stringstream ss;
+				ss << "[ConeMarchPrepass] " << diff << " pixels differ" << std::endl;
+				OutputDebugStringA(ss.str().c_str());
+			}
+
+			VulkanAppBase::writePPM(outputFile, WindowWidth, WindowHeight, pixels);
+			return 0;
+		}
+
+		marcher.render(params, WindowWidth, WindowHeight, &pixels);
+		VulkanAppBase::writePPM(outputFile, WindowWidth, WindowHeight, pixels);
+
+		CpuRayMarcher::benchmark(params, WindowWidth, WindowHeight, 4);
+		return 0;
+	}
+
+	int frameCount = argc > 1 ? atoi(argv[1]) : 1;
+	const char* outputFile = argc > 2 ? argv[2] : "output.ppm";
+
+	// Vulkan 
+	DistanceFunction theApp;
+	bool profile = false, heatmap = false;
+	for (int i = 3; i < argc; i++)
+	{
+		if (strcmp(argv[i], "profile") == 0)
+		{
+			profile = true;
+		}
+		else if (strcmp(argv[i], "heatmap") == 0)
+		{
+			heatmap = true;
+		}
+		else
+		{
+			applyOption(theApp, argv[i]);
+		}
+	}
+	theApp.setGpuProfilingEnabled(profile);
+	theApp.initializeOffscreen(WindowWidth, WindowHeight, AppTitle);
+
+	// OpXȂẼXebvׁAw肵ݒŕ`悵ʂۑ
+	theApp.renderWithMarchStatistics(frameCount);
+	if (profile)
+	{
+		theApp.renderWithGpuProfile(frameCount);
+	}
+	theApp.saveImage(outputFile);
+	if (heatmap)
+	{
+		theApp.renderWithMarchHeatmap("heatmap.ppm");
+	}
+
+	// Vulkan I
+	theApp.terminate();
+
+	return 0;
+}
+#endif
\ No newline at end of file
@@ -1,8 +1,36 @@
 #version 450
 
+#ifdef COMPUTE_MARCH
+// Rs[gVF[_[Ƃ 8x8 sNZ̃^CƂɎsiComputeMarchTargetj
+layout(local_size_x=8, local_size_y=8) in;
+layout(binding=8, rgba8) uniform writeonly image2D outImage;
+#else
 layout(location=0) in vec4 inColor;
 layout(location=0) out vec4 outColor;
+#endif
 
+#ifdef PUSH_CONSTANTS
+// t[ς̂̓vbV萔Ŏ󂯎iDistanceFunction::FrameConstants Ɠсj
+layout(push_constant) uniform FrameConstants
+{
+  vec4 resolution;
+  vec4 camera_pos;
+  vec4 camera_dir;
+  vec4 camera_up;
+  vec4 camera_side;
+
+  vec4 light_dir;
+};
+
+// ςȂ́iDistanceFunction::SceneConstantsj
+layout(std140) uniform Resolution
+{
+  vec4 light_color;
+
+  vec4 sky_color_light;
+  vec4 sky_color;
+};
+#else
 layout(std140) uniform Resolution
 {
   vec4 resolution;
@@ -17,93 +45,291 @@ layout(std140) uniform Resolution
   vec4 sky_color_light;
   vec4 sky_color;
 };
+#endif
+
+// V[LqiSdfScene::Primitive / Material ƓCAEgj
+struct Primitive {
+  vec4 position;  // xyz:S w:p̊ۂ
+  vec4 size;      // xyz:`󂲂Ƃ̑傫 w:smooth ̕
+  vec4 rotation;  // [h -> [J̉]iNH[^jIj
+  uvec4 info;     // x: y:@ z:}eAԍ
+};
 
-// ̋֐
-float sphere_d(vec3 rp){
-  vec3 sp = vec3(0,0,0);
-  float r = 1.0;
-  return length(rp - sp) - r;
+struct Material {
+  vec4 color0;
+  vec4 color1;
+  vec4 checker;   // xyz:s͗l̎g w:Axh̏搔
+};
+
+layout(std430, binding=2) readonly buffer Materials
+{
+  Material materials[];
+};
+
+// R[}[`ȎOpXiConeMarchPrepassj
+// resolution.z:^C̑傫i0 ̏ꍇ͑OȂj
+#ifndef CONE_PREPASS
+layout(binding=6) uniform sampler2D prepassDepth;
+#endif
+
+#ifdef MARCH_STATS
+// Xebv̓viConeMarchPrepass::Counters ƓCAEgj
+// tOgVF[_[珑ɂ fragmentStoresAndAtomics KvȂ̂ŁAΉĂꍇ MARCH_STATS `
+// statsHeatmap  0 ȊOȂsNZƂ̃XebvƏIRiMarchHeatmapj statsPixels ɏ
+layout(std430, binding=7) buffer MarchStats
+{
+  uint statsEnabled;
+  uint statsSteps;
+  uint statsPrepassSteps;
+  uint statsHeatmap;
+  uint statsPixels[];
+};
+#endif
+
+// iiMarchQuality ̓ꉻ萔Al MarchQuality::getDefaultSettings Ɠj
+layout(constant_id = 0) const int MAX_STEPS = 256;
+layout(constant_id = 1) const float HIT_EPSILON = 0.001;
+layout(constant_id = 2) const float NORMAL_EPSILON = 0.0001;
+layout(constant_id = 3) const int PREPASS_STEPS = 64;
+
+// IRiMarchHeatmap::Reason Ɠlj
+const uint REASON_HIT = 0;
+const uint REASON_MISS = 1;
+const uint REASON_PLANE = 2;
+const uint REASON_EXHAUSTED = 3;
+
+// 炸ɏ܂Ői񂾃ĈA艓܂Ői񂾂̂͋ɔƂ݂Ȃ
+const float MISS_DISTANCE = 100.0;
+
+#ifdef MARCH_STATS
+void writeHeatmap(vec2 fragCoord, uint steps, uint reason)
+{
+  ivec2 p = ivec2(fragCoord);
+  statsPixels[p.y * int(resolution.x) + p.x] = steps | (reason << 16);
 }
+#endif
 
-// Box
-float box_d(vec3 rp)
+// v~eBu̎
+const uint TYPE_SPHERE = 0;
+const uint TYPE_BOX = 1;
+const uint TYPE_TORUS = 2;
+const uint TYPE_HEXPRISM = 3;
+const uint TYPE_OCTAHEDRON = 4;
+const uint TYPE_PLANEY = 5;
+
+// distance() Ԃ}eAԍ̂Aʂ̃v~eBuł邱Ƃ\rbg
+const uint MATERIAL_PLANE_BIT = 0x80000000u;
+
+// @
+const uint OP_UNION = 0;
+const uint OP_SUBTRACT = 1;
+const uint OP_INTERSECT = 2;
+const uint OP_SMOOTH_UNION = 3;
+
+// ̋֐
+float sphere_d(vec3 p, float r)
 {
-  vec3 bp = vec3(0, 2.0, 0);
-  vec3 b = vec3(0.5, 0.5, 0.5);
-  vec3 d = abs(rp - bp) - b;
-  return length(max(d,0.0)) + min(max(d.x, max(d.y, d.z)), 0.0);
+  return length(p) - r;
 }
 
-// Round Box
-float rbox_d(vec3 rp)
+// Box
+float box_d(vec3 p, vec3 b)
 {
-  float r = 0.1;
-  vec3 bp = vec3(0, -2.0, 0);
-  vec3 b = vec3(0.5, 0.5, 0.5);
-  vec3 d = abs(rp - bp) - b;
-  return length(max(d, 0.0)) - r + min(max(d.x, max(d.y, d.z)), 0.0);
+  vec3 d = abs(p) - b;
+  return length(max(d,0.0)) + min(max(d.x, max(d.y, d.z)), 0.0);
 }
 
 // Torus
-float torus_d(vec3 rp)
+float torus_d(vec3 p, vec2 t)
 {
-  vec2 t = vec2(0.5, 0.2);
-  vec3 p = rp - vec3(2.0, 0, 0);
   vec2 q = vec2(length (p.xy) - t.x, p.z);
   return length(q) - t.y;
 }
 
 // Hexagonal Prism
-float hexPrizm_d(vec3 rp)
+float hexPrizm_d(vec3 p, vec2 h)
 {
-  vec2 h = vec2(0.5, 0.25);
-  vec3 p = rp - vec3(-2.0, 0, 0);
   const vec3 k = vec3(-0.8660254, 0.5, 0.57735);
   p = abs(p);
   p.xy -= 2.0 * min(dot(k.xy, p.xy), 0.0) * k.xy;
   vec2 d = vec2(
     length(p.xy - vec2(clamp(p.x, -k.z*h.x, k.z*h.x), h.x))*sign(p.y-h.x), p.z-h.y);
-  return min(max(d.x, d.y), 0.0) + length(max(d,0.0)) - 0.1;
+  return min(max(d.x, d.y), 0.0) + length(max(d,0.0));
 }
 
 // Octahedron
-float octahedron_d(vec3 rp)
+float octahedron_d(vec3 p, float s)
 {
-  float s = 0.5;
-  vec3 p = abs(rp - vec3(0, 2.0, 0));
+  p = abs(p);
   return ((p.x+p.y+p.z-s)*0.57735027);
 }
 
-
 // Plane - Y
-float planey_d(vec3 rp)
+float planey_d(vec3 p)
 {
-  return dot(rp, vec3(0, 1.0, 0)) + 3.0;
+  return p.y;
 }
 
-vec3 calcPlaneNormal(vec3 pos)
+// NH[^jIŃxNg]
+vec3 rotate(vec4 q, vec3 v)
 {
-  const float eps = 0.0001;
-  const vec2 h = vec2(eps, 0);
-  return normalize (vec3 (planey_d(pos + h.xyy) - planey_d(pos - h.xyy),
-                          planey_d(pos + h.yxy) - planey_d(pos - h.yxy),
-						  planey_d(pos + h.yyx) - planey_d(pos - h.yyx)));
+  return v + 2.0 * cross(q.xyz, cross(q.xyz, v) + q.w * v);
+}
+
+// @SCENE_BEGIN
+//  @SCENE_END ܂ł SdfSceneCompiler V[ɓꉻR[hɒu
+// Ă񂾏ꍇ binding 4, 5 3DeNX`iSdfBrickMapjW{R[hɂȂ
+layout(std430, binding=1) readonly buffer Primitives
+{
+  Primitive primitives[];
+};
+
+// SdfBvh::Node ƓCAEg
+struct BvhNode {
+  vec4 boundsMin;
+  vec4 boundsMax;
+  uvec4 info;     // m[h x:̎q y:E̎q z:0 / [t x:擪̃v~eBu z:v~eBu
+};
+
+layout(std430, binding=3) readonly buffer Bvh
+{
+  uvec4 bvhInfo;  // x:ɕ]v~eBu y:m[h
+  BvhNode nodes[];
+};
+
+// SdfBvh::MaxDepth Ŗ؂̐[𐧌Ă̂ŁAςސ͂𒴂Ȃ
+const int BVH_STACK_SIZE = 32;
+
+// distance() Ԃ}eAԍiʂ MATERIAL_PLANE_BIT 𗧂Ăj
+uint primitiveMaterial(Primitive prim)
+{
+  return prim.info.z | (prim.info.x == TYPE_PLANEY ? MATERIAL_PLANE_BIT : 0u);
+}
+
+// v~eBuP̂̋
+float primitive_d(Primitive prim, vec3 pos)
+{
+  vec3 p = rotate(prim.rotation, pos - prim.position.xyz);
+  float d = 0.0;
+  switch(prim.info.x)
+  {
+  case TYPE_SPHERE:     d = sphere_d(p, prim.size.x); break;
+  case TYPE_BOX:        d = box_d(p, prim.size.xyz); break;
+  case TYPE_TORUS:      d = torus_d(p, prim.size.xy); break;
+  case TYPE_HEXPRISM:   d = hexPrizm_d(p, prim.size.xy); break;
+  case TYPE_OCTAHEDRON: d = octahedron_d(p, prim.size.x); break;
+  case TYPE_PLANEY:     d = planey_d(p); break;
+  }
+  return d - prim.position.w;
+}
+
+// [first, first + count) ̃v~eBu
+// union 玟 union ̎O܂łO[vƂAO[v subtract ȂǂKp
+void evaluate(uint first, uint count, vec3 pos, inout float d, inout uint material)
+{
+  float dg = 1.0e10;
+  uint mg = 0;
+  for(uint i = first; i < first + count; i++)
+  {
+    Primitive prim = primitives[i];
+    float di = primitive_d(prim, pos);
+    switch(prim.info.y)
+    {
+    case OP_UNION:
+      // VO[vn߂
+      if(dg < d) {
+        d = dg;
+        material = mg;
+      }
+      dg = di;
+      mg = primitiveMaterial(prim);
+      break;
+    case OP_SUBTRACT:
+      dg = max(dg, -di);
+      break;
+    case OP_INTERSECT:
+      dg = max(dg, di);
+      break;
+    case OP_SMOOTH_UNION: {
+      float k = max(prim.size.w, 1.0e-5);
+      float h = clamp(0.5 + 0.5 * (dg - di) / k, 0.0, 1.0);
+      dg = mix(dg, di, h) - k * h * (1.0 - h);
+      if(h > 0.5) {
+        mg = primitiveMaterial(prim);
+      }
+      break;
+    }
+    }
+  }
+  if(dg < d) {
+    d = dg;
+    material = mg;
+  }
+}
+
+// _狫E{bNX܂ł̋i 0j
+float boxDistance(vec3 pos, BvhNode node)
+{
+  vec3 d = max(node.boundsMin.xyz - pos, pos - node.boundsMax.xyz);
+  return length(max(d, 0.0));
 }
 
 // ֐ij
+// BVH ǂA܂ł̍ŏ艓m[h͕]Ȃ
+float distance(vec3 pos, out uint material)
+{
+  float d = 1.0e10;
+  material = 0;
+
+  // EȂv~eBuiʂȂǁj
+  evaluate(0, bvhInfo.x, pos, d, material);
+  if(bvhInfo.y == 0) {
+    return d;
+  }
+
+  uint stack[BVH_STACK_SIZE];
+  int sp = 0;
+  stack[sp++] = 0;
+  while(sp > 0)
+  {
+    BvhNode node = nodes[stack[--sp]];
+    if(boxDistance(pos, node) >= d) {
+      continue;
+    }
+
+    // [t
+    if(node.info.z > 0) {
+      evaluate(node.info.x, node.info.z, pos, d, material);
+      continue;
+    }
+
+    // ߂̎qɐς݁Aɕ]
+    uint nearChild = node.info.x;
+    uint farChild = node.info.y;
+    if(boxDistance(pos, nodes[farChild]) < boxDistance(pos, nodes[nearChild])) {
+      nearChild = node.info.y;
+      farChild = node.info.x;
+    }
+    stack[sp++] = farChild;
+    stack[sp++] = nearChild;
+  }
+  return d;
+}
+// @SCENE_END
+
 float distance(vec3 pos)
 {
-  return min(min(min(min(sphere_d(pos), octahedron_d(pos)), rbox_d(pos)), torus_d(pos)), hexPrizm_d(pos));
+  uint material;
+  return distance(pos, material);
 }
 
 // @
 vec3 calcNormal(vec3 pos)
 {
-  const float eps = 0.0001;
-  const vec2 h = vec2(eps, 0);
+  const vec2 h = vec2(NORMAL_EPSILON, 0);
   return normalize (vec3 (distance(pos + h.xyy) - distance(pos - h.xyy),
                           distance(pos + h.yxy) - distance(pos - h.yxy),
-						  distance(pos + h.yyx) - distance(pos - h.yyx)));
+                          distance(pos + h.yyx) - distance(pos - h.yyx)));
 }
 
 struct Ray {
@@ -112,44 +338,24 @@ struct Ray {
 };
 
 // F肷iCeBOj
-vec3 getColor(vec3 pos, vec3 normal, vec3 light_dir, vec3 light_color)
+vec3 getColor(vec3 pos, vec3 normal, Material mat, vec3 light_dir, vec3 light_color)
 {
-  float u = (floor(mod(pos.x * 4.0, 2.0)) - 0.5) * 2; // -1 or 1 ͈̔͂ɕϊ
-  float v = (floor(mod(pos.y * 4.0, 2.0)) - 0.5) * 2;
-  float w = (floor(mod(pos.z * 4.0, 2.0)) - 0.5) * 2;
-  vec3 albedo = mix(vec3(0.9, 0.5, 0.8), vec3(0.45, 0.25, 0.4), u*v*w);
+  // g 0 ͖̎͗lɎgȂ
+  vec3 c = mix(vec3(1.0), (floor(mod(pos * mat.checker.xyz, 2.0)) - 0.5) * 2, notEqual(mat.checker.xyz, vec3(0))); // -1 or 1 ͈̔͂ɕϊ
+  vec3 albedo = mix(mat.color0.xyz, mat.color1.xyz, c.x*c.y*c.z);
+  // ʂ̓Axh2|
+  vec3 surface = (mat.checker.w > 1.5) ? albedo : vec3(1.0);
 
   // ambient Color
   // NormalxNgY̎ˉe̒ɐF肷
   float NoY = dot(normal, vec3(0,1,0));
   // 0 - 1ɐK
   float ambient_intencity = (NoY + 1.0) * 0.5;
-  vec3 ambient = mix(sky_color_light.xyz, sky_color.xyz, ambient_intencity);
+  vec3 ambient = mix(sky_color_light.xyz, sky_color.xyz, ambient_intencity) * surface;
 
   // diffuse
   float NoL = dot(normal, light_dir);
-  vec3 diffuse = max(light_color * NoL, vec3(0));
-
-  return albedo * (diffuse + ambient);
-}
-
-// F肷iʃCeBOj
-vec3 getColor_plane(vec3 pos, vec3 normal, vec3 light_dir, vec3 light_color)
-{
-  float u = (floor(mod(pos.x, 2.0)) - 0.5) * 2; // -1 or 1 ͈̔͂ɕϊ
-  float v = (floor(mod(pos.z, 2.0)) - 0.5) * 2;
-  vec3 albedo = mix(vec3(0.9, 0.9, 0.9), vec3(0.5, 0.5, 0.5), u*v);
-
-  // ambient Color
-  // NormalxNgY̎ˉe̒ɐF肷
-  float NoY = dot(normal, vec3(0,1,0));
-  // 0 - 1ɐK
-  float ambient_intencity = (NoY + 1.0) * 0.5;
-  vec3 ambient = mix(sky_color_light.xyz, sky_color.xyz, ambient_intencity) * albedo;
-
-  // diffuse
-  float NoL = dot(normal, light_dir);
-  vec3 diffuse = max(light_color * NoL, vec3(0)) * albedo;
+  vec3 diffuse = max(light_color * NoL, vec3(0)) * surface;
 
   return albedo * (diffuse + ambient);
 }
@@ -161,42 +367,107 @@ vec3 skyBoxColor(vec3 ray_dir)
   return mix(sky_color_light.xyz, sky_color.xyz, s);
 }
 
+#ifdef CONE_PREPASS
+// 𑜓x1eNZi^Cj𕢂R[i߁A^Ĉǂ̃C\ʂɓȂo
 void main()
+{
+  // ^C̒Sit𑜓x̃sNZWjʂ郌C
+  float tile = resolution.z;
+  vec2 pos = ((gl_FragCoord.xy * tile * 2.0 - resolution.xy) / max(resolution.x, resolution.y) * vec2(1, -1));
+  vec3 dir = normalize(pos.x * camera_side.xyz + pos.y * camera_up.xyz + camera_dir.xyz);
+
+  //  1 ̃R[̔ai^C̑Ίp̔ɗ]Tj
+  float k = tile * 1.5 / max(resolution.x, resolution.y);
+
+  // _ t ł̋̋a k*t ̒fʂ܂ފԂ́A̐ (d - k*t) / (1 + k) ܂ŕ\ʂ͖
+  float t = 0.0;
+  uint steps = 0;
+  for(int i=0 ; i < PREPASS_STEPS ; i++)
+  {
+    float d = distance(camera_pos.xyz + t * dir);
+    steps++;
+    if(d <= k * t + HIT_EPSILON){
+      break;
+    }
+    t += (d - k * t) / (1.0 + k);
+  }
+
+#ifdef MARCH_STATS
+  if(statsEnabled != 0){
+    atomicAdd(statsPrepassSteps, steps);
+  }
+#endif
+  outColor = vec4(t);
+}
+#else
+// fragCoord:sNZS̍Wigl_FragCoord.xy Ɠj
+vec4 march(vec2 fragCoord)
 {
   // ʍW̐KB
-  vec2 pos = ((gl_FragCoord.xy * 2.0 - resolution.xy) / max(resolution.x, resolution.y) * vec2(1, -1));
+  vec2 pos = ((fragCoord * 2.0 - resolution.xy) / max(resolution.x, resolution.y) * vec2(1, -1));
 
   // C̈ʒuAԕ`
   Ray ray;
-  ray.pos = camera_pos.xyz;
   ray.dir = normalize(pos.x * camera_side.xyz + pos.y * camera_up.xyz + camera_dir.xyz);
 
-  float t = 0.0, d, d2;
+  // OpX΁A^Ĉǂ̃C\ʂɓȂn߂
+  float t = 0.0, d;
+  if(resolution.z > 0.0){
+    t = texelFetch(prepassDepth, ivec2(fragCoord / resolution.z), 0).r;
+  }
+  ray.pos = camera_pos.xyz + t * ray.dir;
+
+  uint material;
   vec4 col = vec4(skyBoxColor(ray.dir), 1.0);
+  uint reason = REASON_EXHAUSTED;
 
   // C΂
-  for(int i=0 ; i < 256 ; i++)
+  int i;
+  for(i=0 ; i < MAX_STEPS ; i++)
   {
-    d = distance(ray.pos);
-
-	// qbg
-	if(d < 0.001){
-	  col = vec4(getColor(ray.pos, calcNormal(ray.pos), light_dir.xyz, light_color.xyz), 1.0);
-	  break;
-	}
-
-	// 
-	d2 = planey_d(ray.pos);
-	// qbg
-	if(d2 < 0.001) {
-	  col = vec4(getColor_plane(ray.pos, calcPlaneNormal(ray.pos), light_dir.xyz, light_color.xyz), 1.0);
-	  break;
-	}
-
-	// ̃C͍ŏd * ray.dir ̂Ԃ񂾂i߂
-	t += min(d, d2);
-	ray.pos = camera_pos.xyz + t * ray.dir;
+    d = distance(ray.pos, material);
+
+    // qbg
+    if(d < HIT_EPSILON){
+      col = vec4(getColor(ray.pos, calcNormal(ray.pos), materials[material & ~MATERIAL_PLANE_BIT], light_dir.xyz, light_color.xyz), 1.0);
+      // ʂ̃v~eBuɓǂŕ
+      reason = ((material & MATERIAL_PLANE_BIT) != 0u) ? REASON_PLANE : REASON_HIT;
+      break;
+    }
+
+    // ̃C͍ŏd * ray.dir ̂Ԃ񂾂i߂
+    t += d;
+    ray.pos = camera_pos.xyz + t * ray.dir;
   }
 
-  outColor = col;
+#ifdef MARCH_STATS
+  if(statsEnabled != 0){
+    atomicAdd(statsSteps, uint(min(i + 1, MAX_STEPS)));
+  }
+  if(statsHeatmap != 0){
+    if(reason == REASON_EXHAUSTED && t > MISS_DISTANCE){
+      reason = REASON_MISS;
+    }
+    writeHeatmap(fragCoord, uint(min(i + 1, MAX_STEPS)), reason);
+  }
+#endif
+  return col;
+}
+
+#ifdef COMPUTE_MARCH
+void main()
+{
+  // ʂ̒[̃^Cł͂ݏoXbh͉Ȃ
+  ivec2 pixel = ivec2(gl_GlobalInvocationID.xy);
+  if(any(greaterThanEqual(pixel, ivec2(resolution.xy)))){
+    return;
+  }
+  imageStore(outImage, pixel, march(vec2(pixel) + 0.5));
+}
+#else
+void main()
+{
+  outColor = march(gl_FragCoord.xy);
 }
+#endif
+#endif
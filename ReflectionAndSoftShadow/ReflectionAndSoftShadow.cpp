@@ -14,58 +14,36 @@ using namespace std;
 // 準備
 void ReflectionAndSoftShadow::prepare()
 {
-	// 頂点情報構築
-	prepareGeometry();
-
-	// ユニフォームバッファ
-	prepareUniformBuffer();
+	// 統計を書くシェーダー（MARCH_STATS を定義したもの）は、取れるデバイスでビルドしてある場合だけ使う
+	m_coneMarchPrepass.setStatisticsShader(isMarchStatisticsSupported() && ifstream("shader_stats.frag.spv", std::ios::binary));
 
 	prepareDescriptorSetLayout();
 	prepareDescriptorPool();
 	prepareDescriptorSet();
 
+	// 特殊化定数を持たない古い SPIR-V では品質の設定（ステップ数の上限など）が効かない
+	if (!MarchQuality::hasSpecializationConstant(getMarchShaderFile(false)))
+	{
+		OutputDebugStringA("march shader has no specialization constants. rebuild shader.frag; quality settings are ignored.\n");
+	}
 
-	// 頂点の入力設定
-	VkVertexInputBindingDescription inputBinding{
-		0,							// binding
-		sizeof(Vertex),				// stride
-		VK_VERTEX_INPUT_RATE_VERTEX	// inputRate
-	};
 
-	array<VkVertexInputAttributeDescription, 2> inputAttribs{
-		{
-			{ 0, 0, VK_FORMAT_R32G32B32_SFLOAT, offsetof(Vertex, pos) },
-			{ 1, 0, VK_FORMAT_R32G32B32_SFLOAT, offsetof(Vertex, color) },
-		}
-	};
+	// 頂点の入力は無い（頂点シェーダーが gl_VertexIndex から画面全体を覆う三角形を作る）
 	VkPipelineVertexInputStateCreateInfo vertexInputCI{};
 	vertexInputCI.sType = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO;
-	vertexInputCI.vertexBindingDescriptionCount = 1;
-	vertexInputCI.pVertexBindingDescriptions = &inputBinding;
-	vertexInputCI.vertexAttributeDescriptionCount = uint32_t(inputAttribs.size());
-	vertexInputCI.pVertexAttributeDescriptions = inputAttribs.data();
 	
 
 	/* ビューポートの設定 */
-	VkViewport viewport;
-	{
-		viewport.x = 0.0f;
-		viewport.y = float(m_swapchainExtent.height);
-		viewport.width = float(m_swapchainExtent.width);
-		viewport.height = -1.0f * float(m_swapchainExtent.height);
-		viewport.minDepth = 0.0f;
-		viewport.maxDepth = 1.0f;
-	}
-	VkRect2D scissor = {
-		{0,0},	// offset
-		m_swapchainExtent
-	};
+	// 値は動的ステートにして記録のときに設定する（VulkanAppBase::recordCommand、ウィンドウの大きさが変わってもそのまま使う）
 	VkPipelineViewportStateCreateInfo viewportCI{};
 	viewportCI.sType = VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO;
 	viewportCI.viewportCount = 1;
-	viewportCI.pViewports = &viewport;
 	viewportCI.scissorCount = 1;
-	viewportCI.pScissors = &scissor;
+	const VkDynamicState dynamicStates[] = { VK_DYNAMIC_STATE_VIEWPORT, VK_DYNAMIC_STATE_SCISSOR };
+	VkPipelineDynamicStateCreateInfo dynamicCI{};
+	dynamicCI.sType = VK_STRUCTURE_TYPE_PIPELINE_DYNAMIC_STATE_CREATE_INFO;
+	dynamicCI.dynamicStateCount = _countof(dynamicStates);
+	dynamicCI.pDynamicStates = dynamicStates;
 	
 
 	// プリミティブトポロジー設定
@@ -112,10 +90,31 @@ void ReflectionAndSoftShadow::prepare()
 		ci.pDepthStencilState = &depthStencilCI;
 		ci.pMultisampleState = &multisampleCI;
 		ci.pViewportState = &viewportCI;
+		ci.pDynamicState = &dynamicCI;
 		ci.pColorBlendState = &cbCI;
 		ci.renderPass = m_renderPass;
 		ci.layout = m_pipelineLayout;
-		vkCreateGraphicsPipelines(m_device, VK_NULL_HANDLE, 1, &ci, nullptr, &m_pipeline_alpha);
+		vkCreateGraphicsPipelines(m_device, m_pipelineCache.getHandle(), 1, &ci, nullptr, &m_pipeline_alpha);
+
+		// 前処理パス（同じ頂点シェーダーと CONE_PREPASS を定義してコンパイルしたフラグメントシェーダー）
+		m_pipeline_prepass = VK_NULL_HANDLE;
+		if (ifstream(getMarchShaderFile(true), std::ios::binary))
+		{
+			VkPipelineShaderStageCreateInfo prepassStages[] = {
+				shaderStages[0],
+				loadShaderModule(getMarchShaderFile(true), VK_SHADER_STAGE_FRAGMENT_BIT)
+			};
+			prepassStages[1].pSpecializationInfo = &m_marchSpecialization;
+			ci.stageCount = _countof(prepassStages);
+			ci.pStages = prepassStages;
+			m_pipeline_prepass = m_coneMarchPrepass.createPipeline(ci, m_pipelineCache.getHandle());
+			m_coneMarchPrepass.setAvailable(true);
+			shaderStages.push_back(prepassStages[1]);
+		}
+		else
+		{
+			OutputDebugStringA("prepass shader not found. cone march prepass unavailable.\n");
+		}
 
 		// ShaderModule はもう不要なので破棄
 		for (const auto& v : shaderStages)
@@ -128,78 +127,69 @@ void ReflectionAndSoftShadow::prepare()
 // クリーンアップ
 void ReflectionAndSoftShadow::cleanup()
 {
-	for (auto& v : m_uniformBuffers)
-	{
-		vkDestroyBuffer(m_device, v.shaderParameters.buffer, nullptr);
-		vkFreeMemory(m_device, v.shaderParameters.memory, nullptr);
-		vkDestroyBuffer(m_device, v.shaderMaterials.buffer, nullptr);
-		vkFreeMemory(m_device, v.shaderMaterials.memory, nullptr);
-		vkDestroyBuffer(m_device, v.shaderTransforms.buffer, nullptr);
-		vkFreeMemory(m_device, v.shaderTransforms.memory, nullptr);
-	}
-
 	vkDestroyPipelineLayout(m_device, m_pipelineLayout, nullptr);
 	vkDestroyPipeline(m_device, m_pipeline_alpha, nullptr);
+	vkDestroyPipeline(m_device, m_pipeline_prepass, nullptr);
 
 	vkDestroyDescriptorPool(m_device, m_descriptorPool, nullptr);
 	vkDestroyDescriptorSetLayout(m_device, m_descriptorSetLayout, nullptr);
+}
 
-	vkFreeMemory(m_device, m_vertexBuffer.memory, nullptr);
-	vkFreeMemory(m_device, m_indexBuffer.memory, nullptr);
-	vkDestroyBuffer(m_device, m_vertexBuffer.buffer, nullptr);
-	vkDestroyBuffer(m_device, m_indexBuffer.buffer, nullptr);
+// フレームごとのパラメータを更新
+void ReflectionAndSoftShadow::update()
+{
+	// 3つのユニフォームバッファはリングバッファに続けて書き、動的オフセットで参照する
+	m_uniformOffsets[0] = m_uniformRing.push(createShaderParameters());
+	m_uniformOffsets[1] = m_uniformRing.push(createShaderMaterials());
+	m_uniformOffsets[2] = m_uniformRing.push(createShaderTransforms());
 }
 
 // コマンド作成
 void ReflectionAndSoftShadow::makeCommand(VkCommandBuffer command)
 {
 	{
-		auto shaderParam = createShaderParameters();
-		{
-			auto memory = m_uniformBuffers[m_imageIndex].shaderParameters.memory;
-			void* p;
-			vkMapMemory(m_device, memory, 0, VK_WHOLE_SIZE, 0, &p);
-			memcpy(p, &shaderParam, sizeof(shaderParam));
-			vkUnmapMemory(m_device, memory);
-		}
-
-		auto shaderMaterial = createShaderMaterials();
-		{
-			auto memory = m_uniformBuffers[m_imageIndex].shaderMaterials.memory;
-			void* p;
-			vkMapMemory(m_device, memory, 0, VK_WHOLE_SIZE, 0, &p);
-			memcpy(p, &shaderMaterial, sizeof(shaderMaterial));
-			vkUnmapMemory(m_device, memory);
-		}
-
-		auto shaderTransform = createShaderTransforms();
-		{
-			auto memory = m_uniformBuffers[m_imageIndex].shaderTransforms.memory;
-			void* p;
-			vkMapMemory(m_device, memory, 0, VK_WHOLE_SIZE, 0, &p);
-			memcpy(p, &shaderTransform, sizeof(shaderTransform));
-			vkUnmapMemory(m_device, memory);
-		}
+		beginProfileSection(command, "alpha");
 
 		// 作成したパイプラインをセット
 		vkCmdBindPipeline(command, VK_PIPELINE_BIND_POINT_GRAPHICS, m_pipeline_alpha);
 
-		// 各バッファオブジェクトのセット
-		VkDeviceSize offset = 0;
-		vkCmdBindVertexBuffers(command, 0, 1, &m_vertexBuffer.buffer, &offset);
-		vkCmdBindIndexBuffer(command, m_indexBuffer.buffer, offset, VK_INDEX_TYPE_UINT32);
-
 		// ディスクリプタセットをセット
 		VkDescriptorSet descriptorSets[] = {
-			m_descriptorSet[m_imageIndex]
+			m_descriptorSet[m_frameIndex]
 		};
-		vkCmdBindDescriptorSets(command, VK_PIPELINE_BIND_POINT_GRAPHICS, m_pipelineLayout, 0, 1, descriptorSets, 0, nullptr);
+		vkCmdBindDescriptorSets(command, VK_PIPELINE_BIND_POINT_GRAPHICS, m_pipelineLayout, 0, 1, descriptorSets, _countof(m_uniformOffsets), m_uniformOffsets);
 
 		// 三角形描画
-		vkCmdDrawIndexed(command, m_indexCount, 1, 0, 0, 0);
+		vkCmdDraw(command, 3, 1, 0, 0);
+
+		endProfileSection(command);
 	}
 }
 
+// 前処理パスのコマンド作成
+void ReflectionAndSoftShadow::makePrepassCommand(VkCommandBuffer command)
+{
+	// ユニフォームバッファは update で書き込み済み
+	if (m_coneMarchPrepass.begin(command, m_frameIndex))
+	{
+		vkCmdBindPipeline(command, VK_PIPELINE_BIND_POINT_GRAPHICS, m_pipeline_prepass);
+
+		VkDescriptorSet descriptorSets[] = {
+			m_descriptorSet[m_frameIndex]
+		};
+		vkCmdBindDescriptorSets(command, VK_PIPELINE_BIND_POINT_GRAPHICS, m_pipelineLayout, 0, 1, descriptorSets, _countof(m_uniformOffsets), m_uniformOffsets);
+
+		vkCmdDraw(command, 3, 1, 0, 0);
+	}
+	m_coneMarchPrepass.end(command);
+}
+
+// ウィンドウの大きさに合わせて作り直した前処理パスの描画先を参照する（パイプラインはビューポートが動的ステートなのでそのまま使う）
+void ReflectionAndSoftShadow::onSwapchainRecreated()
+{
+	updateTargetDescriptorSet();
+}
+
 
 // Private ==================================================================
 
@@ -211,24 +201,9 @@ ReflectionAndSoftShadow::BufferObject ReflectionAndSoftShadow::createBuffer(uint
 	ci.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
 	ci.usage = usage;
 	ci.size = size;
-	auto result = vkCreateBuffer(m_device, &ci, nullptr, &obj.buffer);
+	// ブロックから切り出してバインドする（vkAllocateMemory はブロックを足すときだけ）
+	auto result = m_memoryAllocator.createBuffer(ci, flags, &obj.buffer, &obj.memory);
 	checkResult(result);
-
-	// メモリ量の算出
-	VkMemoryRequirements reqs;
-	vkGetBufferMemoryRequirements(m_device, obj.buffer, &reqs);
-	VkMemoryAllocateInfo info{};
-	info.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-	info.allocationSize = reqs.size;
-
-	// メモリタイプの判定
-	info.memoryTypeIndex = getMemoryTypeIndex(reqs.memoryTypeBits, flags);
-
-	// メモリの割当
-	vkAllocateMemory(m_device, &info, nullptr, &obj.memory);
-
-	// メモリのバインド
-	vkBindBufferMemory(m_device, obj.buffer, obj.memory, 0);
 	return obj;
 }
 
@@ -236,7 +211,7 @@ ReflectionAndSoftShadow::ShaderParameters ReflectionAndSoftShadow::createShaderP
 {
 	// ユニフォームバッファの中身を更新する
 	ShaderParameters shaderParam{};
-	shaderParam.resolution = vec4(width, height, 0.0f, 0.0f);
+	shaderParam.resolution = vec4(width, height, m_coneMarchPrepass.getShaderTileSize(), 0.0f);
 
 	auto rotation = glm::rotate(glm::identity<glm::mat4>(), glm::radians(float(15.0 * currentTime)), glm::vec3(0, 1.0, 0));
 	auto translation = glm::translate(glm::identity<glm::mat4>(), vec3(0, 1.0, -4.0));
@@ -314,49 +289,6 @@ ReflectionAndSoftShadow::ShaderTransforms ReflectionAndSoftShadow::createShaderT
 	return shaderTransforms;
 }
 
-void ReflectionAndSoftShadow::prepareGeometry()
-{
-	Vertex vertices[] = {
-		{ vec3(-1.0f, 1.0f, 0.0f), blue },
-		{ vec3(-1.0f, -1.0f, 0.0f), lightBlue},
-		{ vec3(1.0f, 1.0f, 0.0f), blue },
-		{ vec3(1.0f, -1.0f, 0.0f), lightBlue },
-	};
-	uint32_t indices[] = { 0,1,2, 2,1,3 };
-
-	m_vertexBuffer = createBuffer(sizeof(vertices), VK_BUFFER_USAGE_VERTEX_BUFFER_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT);
-	m_indexBuffer = createBuffer(sizeof(indices), VK_BUFFER_USAGE_INDEX_BUFFER_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT);
-
-	// 頂点データの書き込み
-	{
-		void* p;
-		vkMapMemory(m_device, m_vertexBuffer.memory, 0, VK_WHOLE_SIZE, 0, &p);
-		memcpy(p, vertices, sizeof(vertices));
-		vkUnmapMemory(m_device, m_vertexBuffer.memory);
-	}
-	// インデックスデータの書き込み
-	{
-		void* p;
-		vkMapMemory(m_device, m_indexBuffer.memory, 0, VK_WHOLE_SIZE, 0, &p);
-		memcpy(p, indices, sizeof(indices));
-		vkUnmapMemory(m_device, m_indexBuffer.memory);
-	}
-	m_indexCount = _countof(indices);
-}
-
-void ReflectionAndSoftShadow::prepareUniformBuffer()
-{
-	// ユニフォームバッファ
-	m_uniformBuffers.resize(m_swapchainViews.size());
-	for (auto& v : m_uniformBuffers)
-	{
-		VkMemoryPropertyFlags uboFlags = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
-		v.shaderParameters = createBuffer(sizeof(ShaderParameters), VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT, uboFlags);
-		v.shaderMaterials = createBuffer(sizeof(ShaderMaterials), VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT, uboFlags);
-		v.shaderTransforms = createBuffer(sizeof(ShaderTransforms), VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT, uboFlags);
-	}
-}
-
 VkPipelineShaderStageCreateInfo ReflectionAndSoftShadow::loadShaderModule(const char* fileName, VkShaderStageFlagBits stage)
 {
 	ifstream infile(fileName, std::ios::binary);
@@ -383,6 +315,15 @@ VkPipelineShaderStageCreateInfo ReflectionAndSoftShadow::loadShaderModule(const
 	return shaderStageCI;
 }
 
+const char* ReflectionAndSoftShadow::getMarchShaderFile(bool prepass) const
+{
+	if (m_coneMarchPrepass.hasStatisticsShader())
+	{
+		return prepass ? "shader_prepass_stats.frag.spv" : "shader_stats.frag.spv";
+	}
+	return prepass ? "shader_prepass.frag.spv" : "shader.frag.spv";
+}
+
 void ReflectionAndSoftShadow::createAlphaPipelineInfo(
 	vector<VkPipelineShaderStageCreateInfo>* shaderStages,
 	VkPipelineDepthStencilStateCreateInfo* depthStencilCI,
@@ -416,7 +357,9 @@ void ReflectionAndSoftShadow::createAlphaPipelineInfo(
 
 	// シェーダーバイナリ読み込み
 	shaderStages->push_back(loadShaderModule("shader.vert.spv", VK_SHADER_STAGE_VERTEX_BIT));
-	shaderStages->push_back(loadShaderModule("shader.frag.spv", VK_SHADER_STAGE_FRAGMENT_BIT));
+	shaderStages->push_back(loadShaderModule(getMarchShaderFile(false), VK_SHADER_STAGE_FRAGMENT_BIT));
+	// ステップ数の上限などは品質の設定で特殊化する
+	shaderStages->back().pSpecializationInfo = &m_marchSpecialization;
 }
 
 void ReflectionAndSoftShadow::prepareDescriptorSetLayout()
@@ -426,7 +369,7 @@ void ReflectionAndSoftShadow::prepareDescriptorSetLayout()
 		// ShaderParams
 		VkDescriptorSetLayoutBinding bindingUBO{};
 		bindingUBO.binding = 0;
-		bindingUBO.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+		bindingUBO.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
 		bindingUBO.stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT;
 		bindingUBO.descriptorCount = 1;
 		bindings.push_back(bindingUBO);
@@ -435,7 +378,7 @@ void ReflectionAndSoftShadow::prepareDescriptorSetLayout()
 		// Materials
 		VkDescriptorSetLayoutBinding bindingUBO{};
 		bindingUBO.binding = 1;
-		bindingUBO.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+		bindingUBO.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
 		bindingUBO.stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT;
 		bindingUBO.descriptorCount = 1;
 		bindings.push_back(bindingUBO);
@@ -444,11 +387,29 @@ void ReflectionAndSoftShadow::prepareDescriptorSetLayout()
 		// Transform
 		VkDescriptorSetLayoutBinding bindingUBO{};
 		bindingUBO.binding = 2;
-		bindingUBO.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+		bindingUBO.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
 		bindingUBO.stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT;
 		bindingUBO.descriptorCount = 1;
 		bindings.push_back(bindingUBO);
 	}
+	{
+		// コーンマーチングの前処理パスの結果
+		VkDescriptorSetLayoutBinding bindingPrepass{};
+		bindingPrepass.binding = 3;
+		bindingPrepass.descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+		bindingPrepass.stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT;
+		bindingPrepass.descriptorCount = 1;
+		bindings.push_back(bindingPrepass);
+	}
+	{
+		// ステップ数の統計
+		VkDescriptorSetLayoutBinding bindingStats{};
+		bindingStats.binding = 4;
+		bindingStats.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+		bindingStats.stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT;
+		bindingStats.descriptorCount = 1;
+		bindings.push_back(bindingStats);
+	}
 
 	VkDescriptorSetLayoutCreateInfo ci{};
 	ci.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
@@ -459,13 +420,17 @@ void ReflectionAndSoftShadow::prepareDescriptorSetLayout()
 
 void ReflectionAndSoftShadow::prepareDescriptorPool()
 {
-	array<VkDescriptorPoolSize, 1> descPoolSize;
-	descPoolSize[0].descriptorCount = 3;
-	descPoolSize[0].type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+	array<VkDescriptorPoolSize, 3> descPoolSize;
+	descPoolSize[0].descriptorCount = m_framesInFlight * 3;
+	descPoolSize[0].type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
+	descPoolSize[1].descriptorCount = m_framesInFlight;
+	descPoolSize[1].type = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+	descPoolSize[2].descriptorCount = m_framesInFlight;
+	descPoolSize[2].type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
 
 	VkDescriptorPoolCreateInfo ci{};
 	ci.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
-	ci.maxSets = uint32_t(m_uniformBuffers.size());
+	ci.maxSets = m_framesInFlight;
 	ci.poolSizeCount = uint32_t(descPoolSize.size());
 	ci.pPoolSizes = descPoolSize.data();
 	vkCreateDescriptorPool(m_device, &ci, nullptr, &m_descriptorPool);
@@ -474,57 +439,49 @@ void ReflectionAndSoftShadow::prepareDescriptorPool()
 void ReflectionAndSoftShadow::prepareDescriptorSet()
 {
 	vector<VkDescriptorSetLayout> layouts;
-	for (int i = 0; i< int(m_uniformBuffers.size()); ++i)
+	for (int i = 0; i< int(m_framesInFlight); ++i)
 	{
 		layouts.push_back(m_descriptorSetLayout);
 	}
 	VkDescriptorSetAllocateInfo ai{};
 	ai.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
 	ai.descriptorPool = m_descriptorPool;
-	ai.descriptorSetCount = uint32_t(m_uniformBuffers.size());
+	ai.descriptorSetCount = m_framesInFlight;
 	ai.pSetLayouts = layouts.data();
-	m_descriptorSet.resize(m_uniformBuffers.size());
+	m_descriptorSet.resize(m_framesInFlight);
 	vkAllocateDescriptorSets(m_device, &ai, m_descriptorSet.data());
 
 	// ディスクリプタセットへ書き込み
-	for (int i = 0;i<int(m_uniformBuffers.size()); ++i)
+	for (int i = 0;i<int(m_framesInFlight); ++i)
 	{
-		VkDescriptorBufferInfo descUBO{};
-		descUBO.buffer = m_uniformBuffers[i].shaderParameters.buffer;
-		descUBO.offset = 0;
-		descUBO.range = VK_WHOLE_SIZE;
+		// 位置は描画時に動的オフセットで指定する
+		VkDescriptorBufferInfo descUBO = m_uniformRing.getDescriptorInfo(sizeof(ShaderParameters));
 
 		VkWriteDescriptorSet ubo{};
 		ubo.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
 		ubo.dstBinding = 0;
 		ubo.descriptorCount = 1;
-		ubo.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+		ubo.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
 		ubo.pBufferInfo = &descUBO;
 		ubo.dstSet = m_descriptorSet[i];
 
-		VkDescriptorBufferInfo descUBO2{};
-		descUBO2.buffer = m_uniformBuffers[i].shaderMaterials.buffer;
-		descUBO2.offset = 0;
-		descUBO2.range = VK_WHOLE_SIZE;
+		VkDescriptorBufferInfo descUBO2 = m_uniformRing.getDescriptorInfo(sizeof(ShaderMaterials));
 
 		VkWriteDescriptorSet ubo2{};
 		ubo2.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
 		ubo2.dstBinding = 1;
 		ubo2.descriptorCount = 1;
-		ubo2.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+		ubo2.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
 		ubo2.pBufferInfo = &descUBO2;
 		ubo2.dstSet = m_descriptorSet[i];
 
-		VkDescriptorBufferInfo descUBO3{};
-		descUBO3.buffer = m_uniformBuffers[i].shaderTransforms.buffer;
-		descUBO3.offset = 0;
-		descUBO3.range = VK_WHOLE_SIZE;
+		VkDescriptorBufferInfo descUBO3 = m_uniformRing.getDescriptorInfo(sizeof(ShaderTransforms));
 
 		VkWriteDescriptorSet ubo3{};
 		ubo3.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
 		ubo3.dstBinding = 2;
 		ubo3.descriptorCount = 1;
-		ubo3.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+		ubo3.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
 		ubo3.pBufferInfo = &descUBO3;
 		ubo3.dstSet = m_descriptorSet[i];
 
@@ -533,4 +490,34 @@ void ReflectionAndSoftShadow::prepareDescriptorSet()
 		};
 		vkUpdateDescriptorSets(m_device, uint32_t(writeSets.size()), writeSets.data(), 0, nullptr);
 	}
+	updateTargetDescriptorSet();
+}
+
+void ReflectionAndSoftShadow::updateTargetDescriptorSet()
+{
+	for (int i = 0; i < int(m_framesInFlight); ++i)
+	{
+		VkDescriptorImageInfo descPrepass = m_coneMarchPrepass.getImageInfo(i);
+		VkWriteDescriptorSet prepass{};
+		prepass.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+		prepass.dstBinding = 3;
+		prepass.descriptorCount = 1;
+		prepass.descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+		prepass.pImageInfo = &descPrepass;
+		prepass.dstSet = m_descriptorSet[i];
+
+		VkDescriptorBufferInfo descStats = m_coneMarchPrepass.getStatisticsBufferInfo(i);
+		VkWriteDescriptorSet stats{};
+		stats.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+		stats.dstBinding = 4;
+		stats.descriptorCount = 1;
+		stats.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+		stats.pBufferInfo = &descStats;
+		stats.dstSet = m_descriptorSet[i];
+
+		vector<VkWriteDescriptorSet> writeSets = {
+			prepass, stats
+		};
+		vkUpdateDescriptorSets(m_device, uint32_t(writeSets.size()), writeSets.data(), 0, nullptr);
+	}
 }
\ No newline at end of file
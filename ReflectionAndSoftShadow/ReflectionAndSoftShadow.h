@@ -7,32 +7,22 @@
 class ReflectionAndSoftShadow : public VulkanAppBase
 {
 public:
-	ReflectionAndSoftShadow() : VulkanAppBase() {}
+	ReflectionAndSoftShadow() : VulkanAppBase(), m_uniformOffsets{} {}
 
 	virtual void prepare() override;
 	virtual void cleanup() override;
 
+	virtual void update() override;
 	virtual void makeCommand(VkCommandBuffer command) override;
-
-	struct Vertex
-	{
-		glm::vec3 pos;
-		glm::vec3 color;
-	};
+	virtual void makePrepassCommand(VkCommandBuffer command) override;
+	virtual void onSwapchainRecreated() override;
 
 private:
 	// バッファを管理するオブジェクト
 	struct BufferObject
 	{
 		VkBuffer buffer;		// バッファ
-		VkDeviceMemory memory;	// デバイスメモリオブジェクトのOpaqueハンドル
-	};
-
-	struct UniformBufferObject
-	{
-		BufferObject shaderParameters;
-		BufferObject shaderMaterials;
-		BufferObject shaderTransforms;
+		DeviceMemoryAllocator::Allocation memory;	// 切り出したデバイスメモリ（ホストから見える場合は mapped に書き込む）
 	};
 
 	struct ShaderParameters
@@ -65,8 +55,6 @@ private:
 	const glm::vec3 lightBlue = glm::vec3(0.7f, 0.8f, 0.99f);
 	const glm::vec3 blue = glm::vec3(0.1f, 0.1f, 0.6f);
 
-	void prepareGeometry();
-	void prepareUniformBuffer();
 	ShaderParameters createShaderParameters();
 	ShaderMaterials createShaderMaterials();
 	ShaderTransforms createShaderTransforms();
@@ -74,6 +62,9 @@ private:
 	BufferObject createBuffer(uint32_t size, VkBufferUsageFlags usage, VkMemoryPropertyFlags flags);
 	VkPipelineShaderStageCreateInfo loadShaderModule(const char* fileName, VkShaderStageFlagBits stage);
 
+	// レイマーチングのフラグメントシェーダーのファイル名（ConeMarchPrepass::hasStatisticsShader なら MARCH_STATS を定義してコンパイルしたもの）
+	const char* getMarchShaderFile(bool prepass) const;
+
 	void createAlphaPipelineInfo(
 		std::vector<VkPipelineShaderStageCreateInfo>* shaderStages,
 		VkPipelineDepthStencilStateCreateInfo* depthStencilCI,
@@ -83,10 +74,11 @@ private:
 	void prepareDescriptorSetLayout();
 	void prepareDescriptorPool();
 	void prepareDescriptorSet();
+	// 描画先の大きさに依存するもの（前処理パスの結果と統計）を書く
+	void updateTargetDescriptorSet();
 
-	BufferObject m_vertexBuffer;
-	BufferObject m_indexBuffer;
-	std::vector<UniformBufferObject> m_uniformBuffers;
+	// 今のフレームの Parameters, Materials, Transforms（m_uniformRing の動的オフセット）
+	uint32_t m_uniformOffsets[3];
 
 	VkDescriptorSetLayout m_descriptorSetLayout;
 	VkDescriptorPool m_descriptorPool;
@@ -94,5 +86,5 @@ private:
 
 	VkPipelineLayout m_pipelineLayout;
 	VkPipeline m_pipeline_alpha;
-	uint32_t m_indexCount;
+	VkPipeline m_pipeline_prepass;
 };
\ No newline at end of file
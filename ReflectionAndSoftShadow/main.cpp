@@ -1,5 +1,7 @@
+#ifdef _WIN32
 #define WIN32_LEAN_AND_MEAN
 #include <windows.h>
+#endif
 
 #include <vector>
 #include <array>
@@ -8,22 +10,25 @@
 #include <numeric>
 
 #include "ReflectionAndSoftShadow.h"
+#include "Benchmark.h"
 
+#ifdef _WIN32
 // VulkanCũN
 #pragma comment(lib, "vulkan-1.lib")
+#endif
 
 const int WindowWidth = 1280;
 const int WindowHeight = 1024;
 
 const char* AppTitle = "RayMarching - ReflectionAndSoftShadow";
 
+#ifdef _WIN32
 int WINAPI wWinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, LPWSTR lpCmdLine, int nCmdShow)
 {
 	UNREFERENCED_PARAMETER(hPrevInstance);
-	UNREFERENCED_PARAMETER(lpCmdLine);
 	glfwInit();
 	glfwWindowHint(GLFW_CLIENT_API, GLFW_NO_API);
-	glfwWindowHint(GLFW_RESIZABLE, 0);
+	glfwWindowHint(GLFW_RESIZABLE, 1);
 	auto window = glfwCreateWindow(WindowWidth, WindowHeight, AppTitle, nullptr, nullptr);
 
 	//::AllocConsole();
@@ -32,7 +37,24 @@ int WINAPI wWinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, LPWSTR lpCmdLi
 	//freopen_s(&fp, "CONIN$", "r", stdin);
 
 	// Vulkan 
+	// present=<fifo|fifo_relaxed|mailbox|immediate> w肷Ƃ̕\[hgiEBhȆ傫͕ςj
+	// prepass w肷ƃR[}[`ȎOpXg
 	ReflectionAndSoftShadow theApp;
+	theApp.getConeMarchPrepass().setEnabled(wcsstr(lpCmdLine, L"prepass") != nullptr);
+	if (auto present = wcsstr(lpCmdLine, L"present="))
+	{
+		// ̋󔒂܂łoififo / fifo_relaxed / mailbox / immediateAΉĂȂ fifo ɂȂj
+		std::string name;
+		for (present += 8; *present != L'\0' && *present != L' '; present++)
+		{
+			name.push_back(char(*present));
+		}
+		VkPresentModeKHR mode;
+		if (VulkanAppBase::findPresentMode(name.c_str(), &mode))
+		{
+			theApp.setPresentMode(mode);
+		}
+	}
 	theApp.initialize(window, AppTitle);
 
 	while (glfwWindowShouldClose(window) == GLFW_FALSE)
@@ -48,4 +70,90 @@ int WINAPI wWinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, LPWSTR lpCmdLi
 	//::FreeConsole();
 
 	return 0;
-}
\ No newline at end of file
+}
+#else
+// argv[first] ȍ~ɕĩvZbg̖Oipreview / finaljAprepassAdevice=<O|UUID|ԍ> ΐݒ肷
+void applyOptions(VulkanAppBase& app, int argc, char** argv, int first)
+{
+	for (int i = first; i < argc; i++)
+	{
+		MarchQuality::Preset preset;
+		if (MarchQuality::findPreset(argv[i], &preset))
+		{
+			app.setMarchQualityPreset(preset);
+		}
+		else if (strcmp(argv[i], "prepass") == 0)
+		{
+			app.getConeMarchPrepass().setEnabled(true);
+		}
+		else if (strncmp(argv[i], "device=", 7) == 0)
+		{
+			app.setPhysicalDeviceFilter(argv[i] + 7);
+		}
+	}
+}
+
+// wbhXł̓ItXN[`悵ʂ摜Ƃĕۑ
+// : [`t[] [o̓t@C] [preview|final] [prepass] [profile] [heatmap] [device=<O|UUID|ԍ>]
+//       prepass w肷ƃR[}[`ȎOpXgiXebv̓v͑OpXȂE̗o͂j
+//       preview / final w肷ƃXebv̏ȂǂĩvZbgɍ킹ishader.frag ̓ꉻ萔j
+//       profile w肷Ƒēt[`悵AGPU ̋ԂƂ̏Ԃo͂
+//       heatmap w肷ƍŌɃsNZƂ̃XebvWvA[J[̉摜 heatmap.ppm ɕۑ
+//       device= w肷ƖÖꕔEUUID ̐擪E񋓂ԍv镨foCXŕ`悷i͓_ł́j
+//       bench [vt[] [EH[Abṽt[] [𑜓x] [o̓t@C] [preview|final] [prepass] [device=...] ̏ꍇ͌Œ̎ԍ݂ŕ`悵A
+//       𑜓xi1280x1024,640x480 ̂悤ɃJ}ŋ؂jƂ CPUEGPU ̎Ԃ CSV ƓO JSON ɏo͂
+int main(int argc, char** argv)
+{
+	if (argc > 1 && strcmp(argv[1], "bench") == 0)
+	{
+		auto settings = Benchmark::getDefaultSettings();
+		settings.resolutions = { { WindowWidth, WindowHeight } };
+		const char* benchFile = "benchmark.csv";
+		int next = Benchmark::parseArguments(argc, argv, 2, &settings, &benchFile);
+
+		std::vector<Benchmark::Result> results;
+		for (auto extent : settings.resolutions)
+		{
+			ReflectionAndSoftShadow theApp;
+			applyOptions(theApp, argc, argv, next);
+			results.push_back(Benchmark::run(theApp, AppTitle, extent, settings));
+			OutputDebugStringA(Benchmark::createReport(results.back()).c_str());
+		}
+		bool written = Benchmark::writeCsv(benchFile, results);
+		written &= Benchmark::writeJson(Benchmark::getJsonFileName(benchFile).c_str(), results);
+		return written ? 0 : 1;
+	}
+
+	int frameCount = argc > 1 ? atoi(argv[1]) : 1;
+	const char* outputFile = argc > 2 ? argv[2] : "output.ppm";
+
+	// Vulkan 
+	ReflectionAndSoftShadow theApp;
+	bool profile = false, heatmap = false;
+	for (int i = 3; i < argc; i++)
+	{
+		profile |= strcmp(argv[i], "profile") == 0;
+		heatmap |= strcmp(argv[i], "heatmap") == 0;
+	}
+	applyOptions(theApp, argc, argv, 3);
+	theApp.setGpuProfilingEnabled(profile);
+	theApp.initializeOffscreen(WindowWidth, WindowHeight, AppTitle);
+
+	// OpXȂẼXebvׁAw肵ݒŕ`悵ʂۑ
+	theApp.renderWithMarchStatistics(frameCount);
+	if (profile)
+	{
+		theApp.renderWithGpuProfile(frameCount);
+	}
+	theApp.saveImage(outputFile);
+	if (heatmap)
+	{
+		theApp.renderWithMarchHeatmap("heatmap.ppm");
+	}
+
+	// Vulkan I
+	theApp.terminate();
+
+	return 0;
+}
+#endif
\ No newline at end of file
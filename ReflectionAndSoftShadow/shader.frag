@@ -33,6 +33,52 @@ layout(binding = 2) uniform Transform
   mat4 rotation_torus;
 }transform;
 
+// R[}[`ȎOpXiConeMarchPrepassj
+// resolution.z:^C̑傫i0 ̏ꍇ͑OȂj
+#ifndef CONE_PREPASS
+layout(binding = 3) uniform sampler2D prepassDepth;
+#endif
+
+#ifdef MARCH_STATS
+// Xebv̓viConeMarchPrepass::Counters ƓCAEgj
+// tOgVF[_[珑ɂ fragmentStoresAndAtomics KvȂ̂ŁAΉĂꍇ MARCH_STATS `
+// statsHeatmap  0 ȊOȂsNZƂ̃XebvƏIRiMarchHeatmapj statsPixels ɏ
+layout(std430, binding = 4) buffer MarchStats
+{
+  uint statsEnabled;
+  uint statsSteps;
+  uint statsPrepassSteps;
+  uint statsHeatmap;
+  uint statsPixels[];
+};
+#endif
+
+// iiMarchQuality ̓ꉻ萔Al MarchQuality::getDefaultSettings Ɠj
+layout(constant_id = 0) const int MAX_STEPS = 256;
+layout(constant_id = 1) const float HIT_EPSILON = 0.001;
+layout(constant_id = 2) const float NORMAL_EPSILON = 0.0001;
+layout(constant_id = 3) const int PREPASS_STEPS = 64;
+layout(constant_id = 4) const int MAX_BOUNCES = 8;
+layout(constant_id = 5) const float FOG_NEAR = 30.0;
+layout(constant_id = 6) const float FOG_FAR = 50.0;
+
+// IRiMarchHeatmap::Reason Ɠlj
+const uint REASON_HIT = 0;
+const uint REASON_MISS = 1;
+const uint REASON_PLANE = 2;
+const uint REASON_EXHAUSTED = 3;
+
+// 炸ɏ܂Ői񂾃ĈAJ炱艓܂Ői񂾂̂͋ɔƂ݂Ȃ
+const float MISS_DISTANCE = 100.0;
+
+#ifdef MARCH_STATS
+void writeHeatmap(vec2 fragCoord, uint steps, uint reason)
+{
+  ivec2 p = ivec2(fragCoord);
+  statsPixels[p.y * int(resolution.x) + p.x] = steps | (reason << 16);
+}
+#endif
+
 vec3 rotate(vec3 p, mat4 rotation)
 {
   vec4 pos = vec4(p, 0);
@@ -75,8 +121,7 @@ float planey_d(vec3 rp)
 
 vec3 calcPlaneNormal(vec3 pos)
 {
-  const float eps = 0.0001;
-  const vec2 h = vec2(eps, 0);
+  const vec2 h = vec2(NORMAL_EPSILON, 0);
   return normalize (vec3 (planey_d(pos + h.xyy) - planey_d(pos - h.xyy),
                           planey_d(pos + h.yxy) - planey_d(pos - h.yxy),
 						  planey_d(pos + h.yyx) - planey_d(pos - h.yyx)));
@@ -85,8 +130,7 @@ vec3 calcPlaneNormal(vec3 pos)
 vec3 reflectionPlane(vec3 pos, vec3 dir)
 {
   // @Zo
-  const float eps = 0.0001;
-  const vec2 h = vec2(eps, 0);
+  const vec2 h = vec2(NORMAL_EPSILON, 0);
   vec3 normal = normalize (vec3 (planey_d(pos + h.xyy) - planey_d(pos - h.xyy),
                           planey_d(pos + h.yxy) - planey_d(pos - h.yxy),
 						  planey_d(pos + h.yyx) - planey_d(pos - h.yyx)));
@@ -103,8 +147,7 @@ float distanceFunc(vec3 pos)
 // @
 vec3 calcNormal(vec3 pos)
 {
-  const float eps = 0.0001;
-  const vec2 h = vec2(eps, 0);
+  const vec2 h = vec2(NORMAL_EPSILON, 0);
   return normalize (vec3 (distanceFunc(pos + h.xyy) - distanceFunc(pos - h.xyy),
                           distanceFunc(pos + h.yxy) - distanceFunc(pos - h.yxy),
 						  distanceFunc(pos + h.yyx) - distanceFunc(pos - h.yyx)));
@@ -120,8 +163,7 @@ float reflectionDistance(vec3 pos)
 vec3 calcReflectionDir(vec3 pos, vec3 dir)
 {
   // @Zo
-  const float eps = 0.0001;
-  const vec2 h = vec2(eps, 0);
+  const vec2 h = vec2(NORMAL_EPSILON, 0);
   vec3 normal = normalize (vec3 (reflectionDistance(pos + h.xyy) - reflectionDistance(pos - h.xyy),
                           reflectionDistance(pos + h.yxy) - reflectionDistance(pos - h.yxy),
 						  reflectionDistance(pos + h.yyx) - reflectionDistance(pos - h.yyx)));
@@ -180,37 +222,42 @@ vec3 skyBoxColor(vec3 ray_dir)
 // fog
 vec3 fog(float depth, vec3 dir, vec3 color)
 {
-  float minLength = 30;
-  float maxLength = 50;
-  float w = clamp((depth - minLength) / (maxLength - minLength), 0, 1);
+  float w = clamp((depth - FOG_NEAR) / (FOG_FAR - FOG_NEAR), 0, 1);
   return mix(color, skyBoxColor(dir), w);
 }
 
-vec3 getRay(Ray ray)
+// reason:IRiʂŔ˂ɋɔC REASON_PLANEj
+vec3 getRay(Ray ray, out int steps, out uint reason)
 {
   float d, dr1, dr2;
   float depth = 1000;
   vec3 col = vec3(0,0,0);
+  bool reflectedOnPlane = false;
+  int bounces = 0;
+  reason = REASON_EXHAUSTED;
 
   // C΂
-  for(int i=0 ; i < 256 ; i++)
+  int i;
+  for(i=0 ; i < MAX_STEPS ; i++)
   {
 
     d = distanceFunc(ray.pos);
 
 	// qbg
-	if(d < 0.001){
+	if(d < HIT_EPSILON){
 	  col = getColor(ray.pos, calcNormal(ray.pos), light_dir.xyz, light_color.xyz);
 	  depth = min(depth, distance(camera_pos.xyz, ray.pos));
+	  reason = REASON_HIT;
 	  break;
 	}
 
     dr1 = reflectionDistance(ray.pos);
 	
 	// qbg
-	if (dr1 < 0.001) {
+	if (dr1 < HIT_EPSILON) {
 	  ray.dir = calcReflectionDir(ray.pos, ray.dir);
 	  ray.color *= vec3(0.8,0.8,0.9);
+	  bounces++;
 	  depth = min(depth, distance(camera_pos.xyz, ray.pos));
 	}
 	else {
@@ -220,10 +267,12 @@ vec3 getRay(Ray ray)
 	// 
 	// qbg
 	dr2 = planey_d(ray.pos);
-	if(dr2 < 0.001) {
+	if(dr2 < HIT_EPSILON) {
 	  ray.dir = reflectionPlane(ray.pos, ray.dir);
 	  ray.color *= getColor_plane(ray.pos);
 	  depth = min(depth, distance(camera_pos.xyz, ray.pos));
+	  reflectedOnPlane = true;
+	  bounces++;
 	}
 	else{
 	  d = min(d, dr2);
@@ -231,25 +280,86 @@ vec3 getRay(Ray ray)
 
 	col = skyBoxColor(ray.dir);
 
+	// ˂̉񐔂ɒBA˂̋̐Főł؂
+	if(bounces >= MAX_BOUNCES && (dr1 < HIT_EPSILON || dr2 < HIT_EPSILON)){
+	  reason = reflectedOnPlane ? REASON_PLANE : REASON_HIT;
+	  break;
+	}
+
 	// ̃C͍ŏd * ray.dir ̂Ԃ񂾂i߂
 	ray.pos += ray.dir * d;
   }
 
+  steps = min(i + 1, MAX_STEPS);
+  if(reason == REASON_EXHAUSTED && distance(camera_pos.xyz, ray.pos) > MISS_DISTANCE){
+    reason = reflectedOnPlane ? REASON_PLANE : REASON_MISS;
+  }
   return fog(depth, ray.dir, col * ray.color);
 }
 
+#ifdef CONE_PREPASS
+// 𑜓x1eNZi^Cj𕢂R[i߁A^Ĉǂ̃Cŏ̕\ʂɓȂo
+// ˂̃C͑ΏۊOŁAJŏɓ܂ł̋Ԃ΂
+void main()
+{
+  // ^C̒Sit𑜓x̃sNZWjʂ郌C
+  float tile = resolution.z;
+  vec2 pos = ((gl_FragCoord.xy * tile * 2.0 - resolution.xy) / max(resolution.x, resolution.y) * vec2(1, -1));
+  vec3 dir = normalize(pos.x * camera_side.xyz + pos.y * camera_up.xyz + camera_dir.xyz);
+
+  //  1 ̃R[̔ai^C̑Ίp̔ɗ]Tj
+  float k = tile * 1.5 / max(resolution.x, resolution.y);
+
+  // _ t ł̋̋a k*t ̒fʂ܂ފԂ́A̐ (d - k*t) / (1 + k) ܂ŕ\ʂ͖
+  float t = 0.0;
+  uint steps = 0;
+  for(int i=0 ; i < PREPASS_STEPS ; i++)
+  {
+    vec3 p = camera_pos.xyz + t * dir;
+    float d = min(distanceFunc(p), min(reflectionDistance(p), planey_d(p)));
+    steps++;
+    if(d <= k * t + HIT_EPSILON){
+      break;
+    }
+    t += (d - k * t) / (1.0 + k);
+  }
+
+#ifdef MARCH_STATS
+  if(statsEnabled != 0){
+    atomicAdd(statsPrepassSteps, steps);
+  }
+#endif
+  outColor = vec4(t);
+}
+#else
 void main()
 {
   // ʍW̐KB
   vec2 pos = ((gl_FragCoord.xy * 2.0 - resolution.xy) / max(resolution.x, resolution.y) * vec2(1, -1));
 
   // C̈ʒuAԕ`
+  // OpX΁A^Ĉǂ̃C\ʂɓȂn߂
+  float t = 0.0;
+  if(resolution.z > 0.0){
+    t = texelFetch(prepassDepth, ivec2(gl_FragCoord.xy / resolution.z), 0).r;
+  }
   Ray ray;
-  ray.pos = camera_pos.xyz;
   ray.dir = normalize(pos.x * camera_side.xyz + pos.y * camera_up.xyz + camera_dir.xyz);
+  ray.pos = camera_pos.xyz + t * ray.dir;
   ray.color = vec3(1.0,1.0,1.0);
   
-  vec4 col = vec4(getRay(ray), 1.0);
+  int steps;
+  uint reason;
+  vec4 col = vec4(getRay(ray, steps, reason), 1.0);
 
+#ifdef MARCH_STATS
+  if(statsEnabled != 0){
+    atomicAdd(statsSteps, uint(steps));
+  }
+  if(statsHeatmap != 0){
+    writeHeatmap(gl_FragCoord.xy, uint(steps), reason);
+  }
+#endif
   outColor = col;
 }
+#endif
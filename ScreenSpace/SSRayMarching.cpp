@@ -14,77 +14,18 @@ using namespace std;
 // 準備
 void SSRayMarching::prepare()
 {
-	// 頂点情報構築
-	prepareGeometry();
-
-	// ユニフォームバッファ
-	prepareUniformBuffer();
+	// 統計を書くシェーダー（MARCH_STATS を定義したもの）は、取れるデバイスでビルドしてある場合だけ使う
+	m_coneMarchPrepass.setStatisticsShader(isMarchStatisticsSupported() && ifstream("shader_stats.frag.spv", std::ios::binary));
 
 	prepareDescriptorSetLayout();
 	prepareDescriptorPool();
 	prepareDescriptorSet();
 
-
-	// 頂点の入力設定
-	VkVertexInputBindingDescription inputBinding{
-		0,							// binding
-		sizeof(Vertex),				// stride
-		VK_VERTEX_INPUT_RATE_VERTEX	// inputRate
-	};
-
-	array<VkVertexInputAttributeDescription, 2> inputAttribs{
-		{
-			{ 0, 0, VK_FORMAT_R32G32B32_SFLOAT, offsetof(Vertex, pos) },
-			{ 1, 0, VK_FORMAT_R32G32B32_SFLOAT, offsetof(Vertex, color) },
-		}
-	};
-	VkPipelineVertexInputStateCreateInfo vertexInputCI{};
-	vertexInputCI.sType = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO;
-	vertexInputCI.vertexBindingDescriptionCount = 1;
-	vertexInputCI.pVertexBindingDescriptions = &inputBinding;
-	vertexInputCI.vertexAttributeDescriptionCount = uint32_t(inputAttribs.size());
-	vertexInputCI.pVertexAttributeDescriptions = inputAttribs.data();
-	
-
-	/* ビューポートの設定 */
-	VkViewport viewport;
+	// 特殊化定数を持たない古い SPIR-V では品質の設定（ステップ数の上限など）が効かない
+	if (!MarchQuality::hasSpecializationConstant(getMarchShaderFile(false)))
 	{
-		viewport.x = 0.0f;
-		viewport.y = float(m_swapchainExtent.height);
-		viewport.width = float(m_swapchainExtent.width);
-		viewport.height = -1.0f * float(m_swapchainExtent.height);
-		viewport.minDepth = 0.0f;
-		viewport.maxDepth = 1.0f;
+		OutputDebugStringA("march shader has no specialization constants. rebuild shader.frag; quality settings are ignored.\n");
 	}
-	VkRect2D scissor = {
-		{0,0},	// offset
-		m_swapchainExtent
-	};
-	VkPipelineViewportStateCreateInfo viewportCI{};
-	viewportCI.sType = VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO;
-	viewportCI.viewportCount = 1;
-	viewportCI.pViewports = &viewport;
-	viewportCI.scissorCount = 1;
-	viewportCI.pScissors = &scissor;
-	
-
-	// プリミティブトポロジー設定
-	VkPipelineInputAssemblyStateCreateInfo inputAssemblyCI{};
-	inputAssemblyCI.sType = VK_STRUCTURE_TYPE_PIPELINE_INPUT_ASSEMBLY_STATE_CREATE_INFO;
-	inputAssemblyCI.topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST;
-
-	// ラスタライザステート
-	VkPipelineRasterizationStateCreateInfo rasterizerCI{};
-	rasterizerCI.sType = VK_STRUCTURE_TYPE_PIPELINE_RASTERIZATION_STATE_CREATE_INFO;
-	rasterizerCI.polygonMode = VK_POLYGON_MODE_FILL;
-	rasterizerCI.cullMode = VK_CULL_MODE_NONE;
-	rasterizerCI.frontFace = VK_FRONT_FACE_COUNTER_CLOCKWISE;
-	rasterizerCI.lineWidth = 1.0f;
-
-	// マルチサンプル設定
-	VkPipelineMultisampleStateCreateInfo multisampleCI{};
-	multisampleCI.sType = VK_STRUCTURE_TYPE_PIPELINE_MULTISAMPLE_STATE_CREATE_INFO;
-	multisampleCI.rasterizationSamples = VK_SAMPLE_COUNT_1_BIT;
 
 	// パイプラインレイアウト
 	VkPipelineLayoutCreateInfo pipelineLayoutCI{};
@@ -92,90 +33,47 @@ void SSRayMarching::prepare()
 	pipelineLayoutCI.setLayoutCount = 1;
 	pipelineLayoutCI.pSetLayouts = &m_descriptorSetLayout;
 	vkCreatePipelineLayout(m_device, &pipelineLayoutCI, nullptr, &m_pipelineLayout);
-	
-	// SkyboxPipeline
-	{
-		VkPipelineColorBlendAttachmentState blendAttachment{};
-		VkPipelineColorBlendStateCreateInfo cbCI{};
-		VkPipelineDepthStencilStateCreateInfo depthStencilCI{};
-		vector<VkPipelineShaderStageCreateInfo> shaderStages{};
-		createSkyboxPipelineInfo(&shaderStages, &depthStencilCI, &blendAttachment, &cbCI);
 
-		// パイプラインの構築
-		VkGraphicsPipelineCreateInfo ci{};
-		ci.sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO;
-		ci.stageCount = uint32_t(shaderStages.size());
-		ci.pStages = shaderStages.data();
-		ci.pInputAssemblyState = &inputAssemblyCI;
-		ci.pVertexInputState = &vertexInputCI;
-		ci.pRasterizationState = &rasterizerCI;
-		ci.pDepthStencilState = &depthStencilCI;
-		ci.pMultisampleState = &multisampleCI;
-		ci.pViewportState = &viewportCI;
-		ci.pColorBlendState = &cbCI;
-		ci.renderPass = m_renderPass;
-		ci.layout = m_pipelineLayout;
-		vkCreateGraphicsPipelines(m_device, VK_NULL_HANDLE, 1, &ci, nullptr, &m_pipeline_skybox);
-
-		// ShaderModule はもう不要なので破棄
-		for (const auto& v : shaderStages)
-		{
-			vkDestroyShaderModule(m_device, v.module, nullptr);
-		}
+	// パイプラインは SPIR-V の読み込みから作成までをワーカースレッドで並列に行い、最初に使うときに完了を待つ
+	for (uint32_t i = 0; i < PipelineCount; i++)
+	{
+		m_pipelines[i] = VK_NULL_HANDLE;
+		m_pipelineTickets[i] = PipelineBuilder::InvalidTicket;
 	}
+	m_pipelineTickets[PipelineSkybox] = m_pipelineBuilder.submit("skybox", [this]() { return createPipeline(PipelineSkybox); });
+	m_pipelineTickets[PipelineAlpha] = m_pipelineBuilder.submit("alpha", [this]() { return createPipeline(PipelineAlpha); });
 
-	// AlphaPipeline
+	// 前処理パス（同じ頂点シェーダーと CONE_PREPASS を定義してコンパイルしたフラグメントシェーダー）
+	if (ifstream(getMarchShaderFile(true), std::ios::binary))
+	{
+		m_pipelineTickets[PipelinePrepass] = m_pipelineBuilder.submit("prepass", [this]() { return createPipeline(PipelinePrepass); });
+		m_coneMarchPrepass.setAvailable(true);
+	}
+	else
 	{
-		VkPipelineColorBlendAttachmentState blendAttachment{};
-		VkPipelineColorBlendStateCreateInfo cbCI{};
-		VkPipelineDepthStencilStateCreateInfo depthStencilCI{};
-		vector<VkPipelineShaderStageCreateInfo> shaderStages{};
-		createAlphaPipelineInfo(&shaderStages, &depthStencilCI, &blendAttachment, &cbCI);
-
-		// パイプラインの構築
-		VkGraphicsPipelineCreateInfo ci{};
-		ci.sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO;
-		ci.stageCount = uint32_t(shaderStages.size());
-		ci.pStages = shaderStages.data();
-		ci.pInputAssemblyState = &inputAssemblyCI;
-		ci.pVertexInputState = &vertexInputCI;
-		ci.pRasterizationState = &rasterizerCI;
-		ci.pDepthStencilState = &depthStencilCI;
-		ci.pMultisampleState = &multisampleCI;
-		ci.pViewportState = &viewportCI;
-		ci.pColorBlendState = &cbCI;
-		ci.renderPass = m_renderPass;
-		ci.layout = m_pipelineLayout;
-		vkCreateGraphicsPipelines(m_device, VK_NULL_HANDLE, 1, &ci, nullptr, &m_pipeline_alpha);
-
-		// ShaderModule はもう不要なので破棄
-		for (const auto& v : shaderStages)
-		{
-			vkDestroyShaderModule(m_device, v.module, nullptr);
-		}
+		OutputDebugStringA("prepass shader not found. cone march prepass unavailable.\n");
 	}
 }
 
 // クリーンアップ
 void SSRayMarching::cleanup()
 {
-	for (auto& v : m_uniformBuffers)
+	OutputDebugStringA(m_pipelineBuilder.createReport().c_str());
+	vkDestroyPipelineLayout(m_device, m_pipelineLayout, nullptr);
+	for (uint32_t i = 0; i < PipelineCount; i++)
 	{
-		vkDestroyBuffer(m_device, v.buffer, nullptr);
-		vkFreeMemory(m_device, v.memory, nullptr);
+		vkDestroyPipeline(m_device, getPipeline(PipelineId(i)), nullptr);
 	}
 
-	vkDestroyPipelineLayout(m_device, m_pipelineLayout, nullptr);
-	vkDestroyPipeline(m_device, m_pipeline_alpha, nullptr);
-	vkDestroyPipeline(m_device, m_pipeline_skybox, nullptr);
-
 	vkDestroyDescriptorPool(m_device, m_descriptorPool, nullptr);
 	vkDestroyDescriptorSetLayout(m_device, m_descriptorSetLayout, nullptr);
+}
 
-	vkFreeMemory(m_device, m_vertexBuffer.memory, nullptr);
-	vkFreeMemory(m_device, m_indexBuffer.memory, nullptr);
-	vkDestroyBuffer(m_device, m_vertexBuffer.buffer, nullptr);
-	vkDestroyBuffer(m_device, m_indexBuffer.buffer, nullptr);
+// フレームごとのパラメータを更新
+void SSRayMarching::update()
+{
+	// シェーダーパラメータはリングバッファに書き、動的オフセットで参照する
+	m_parameterOffset = m_uniformRing.push(createShaderParameters());
 }
 
 // コマンド作成
@@ -183,54 +81,67 @@ void SSRayMarching::makeCommand(VkCommandBuffer command)
 {
 	{
 		// skybox
-		// 作成したパイプラインをセット
-		vkCmdBindPipeline(command, VK_PIPELINE_BIND_POINT_GRAPHICS, m_pipeline_skybox);
+		beginProfileSection(command, "skybox");
 
-		// 各バッファオブジェクトのセット
-		VkDeviceSize offset = 0;
-		vkCmdBindVertexBuffers(command, 0, 1, &m_vertexBuffer.buffer, &offset);
-		vkCmdBindIndexBuffer(command, m_indexBuffer.buffer, offset, VK_INDEX_TYPE_UINT32);
+		// 作成したパイプラインをセット
+		vkCmdBindPipeline(command, VK_PIPELINE_BIND_POINT_GRAPHICS, getPipeline(PipelineSkybox));
 
 		// ディスクリプタセットをセット
 		//VkDescriptorSet descriptorSets[] = {
-		//	m_descriptorSet[m_imageIndex]
+		//	m_descriptorSet[m_frameIndex]
 		//};
 		//vkCmdBindDescriptorSets(command, VK_PIPELINE_BIND_POINT_GRAPHICS, m_pipelineLayout, 0, 1, descriptorSets, 0, nullptr);
 
 		// 三角形描画
-		vkCmdDrawIndexed(command, m_indexCount, 1, 0, 0, 0);
+		vkCmdDraw(command, 3, 1, 0, 0);
+
+		endProfileSection(command);
 	}
 
 	{
 		// Alpha
-		auto shaderParam = createShaderParameters();
-		{
-			auto memory = m_uniformBuffers[m_imageIndex].memory;
-			void* p;
-			vkMapMemory(m_device, memory, 0, VK_WHOLE_SIZE, 0, &p);
-			memcpy(p, &shaderParam, sizeof(shaderParam));
-			vkUnmapMemory(m_device, memory);
-		}
+		beginProfileSection(command, "alpha");
 
 		// 作成したパイプラインをセット
-		vkCmdBindPipeline(command, VK_PIPELINE_BIND_POINT_GRAPHICS, m_pipeline_alpha);
-
-		// 各バッファオブジェクトのセット
-		VkDeviceSize offset = 0;
-		vkCmdBindVertexBuffers(command, 0, 1, &m_vertexBuffer.buffer, &offset);
-		vkCmdBindIndexBuffer(command, m_indexBuffer.buffer, offset, VK_INDEX_TYPE_UINT32);
+		vkCmdBindPipeline(command, VK_PIPELINE_BIND_POINT_GRAPHICS, getPipeline(PipelineAlpha));
 
 		// ディスクリプタセットをセット
 		VkDescriptorSet descriptorSets[] = {
-			m_descriptorSet[m_imageIndex]
+			m_descriptorSet[m_frameIndex]
 		};
-		vkCmdBindDescriptorSets(command, VK_PIPELINE_BIND_POINT_GRAPHICS, m_pipelineLayout, 0, 1, descriptorSets, 0, nullptr);
+		vkCmdBindDescriptorSets(command, VK_PIPELINE_BIND_POINT_GRAPHICS, m_pipelineLayout, 0, 1, descriptorSets, 1, &m_parameterOffset);
 
 		// 三角形描画
-		vkCmdDrawIndexed(command, m_indexCount, 1, 0, 0, 0);
+		vkCmdDraw(command, 3, 1, 0, 0);
+
+		endProfileSection(command);
 	}
 }
 
+// 前処理パスのコマンド作成
+void SSRayMarching::makePrepassCommand(VkCommandBuffer command)
+{
+	// ユニフォームバッファは update で書き込み済み
+	if (m_coneMarchPrepass.begin(command, m_frameIndex))
+	{
+		vkCmdBindPipeline(command, VK_PIPELINE_BIND_POINT_GRAPHICS, getPipeline(PipelinePrepass));
+
+		VkDescriptorSet descriptorSets[] = {
+			m_descriptorSet[m_frameIndex]
+		};
+		vkCmdBindDescriptorSets(command, VK_PIPELINE_BIND_POINT_GRAPHICS, m_pipelineLayout, 0, 1, descriptorSets, 1, &m_parameterOffset);
+
+		vkCmdDraw(command, 3, 1, 0, 0);
+	}
+	m_coneMarchPrepass.end(command);
+}
+
+// ウィンドウの大きさに合わせて作り直した前処理パスの描画先を参照する（パイプラインはビューポートが動的ステートなのでそのまま使う）
+void SSRayMarching::onSwapchainRecreated()
+{
+	updateTargetDescriptorSet();
+}
+
 
 // Private ==================================================================
 
@@ -242,24 +153,9 @@ SSRayMarching::BufferObject SSRayMarching::createBuffer(uint32_t size, VkBufferU
 	ci.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
 	ci.usage = usage;
 	ci.size = size;
-	auto result = vkCreateBuffer(m_device, &ci, nullptr, &obj.buffer);
+	// ブロックから切り出してバインドする（vkAllocateMemory はブロックを足すときだけ）
+	auto result = m_memoryAllocator.createBuffer(ci, flags, &obj.buffer, &obj.memory);
 	checkResult(result);
-
-	// メモリ量の算出
-	VkMemoryRequirements reqs;
-	vkGetBufferMemoryRequirements(m_device, obj.buffer, &reqs);
-	VkMemoryAllocateInfo info{};
-	info.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-	info.allocationSize = reqs.size;
-
-	// メモリタイプの判定
-	info.memoryTypeIndex = getMemoryTypeIndex(reqs.memoryTypeBits, flags);
-
-	// メモリの確保
-	vkAllocateMemory(m_device, &info, nullptr, &obj.memory);
-
-	// メモリのバインド
-	vkBindBufferMemory(m_device, obj.buffer, obj.memory, 0);
 	return obj;
 }
 
@@ -267,7 +163,7 @@ SSRayMarching::ShaderParameters SSRayMarching::createShaderParameters()
 {
 	// ユニフォームバッファの中身を更新する
 	ShaderParameters shaderParam{};
-	shaderParam.resolution = vec4(width, height, 0.0f, 0.0f);
+	shaderParam.resolution = vec4(width, height, m_coneMarchPrepass.getShaderTileSize(), 0.0f);
 	shaderParam.camera_pos = vec4(0.0f, 0.0f, -4.0f, 0.0f);
 	shaderParam.camera_dir = vec4(0.0f, 0.0f, 1.0f, 0.0f);
 	shaderParam.camera_up = vec4(0.0f, 1.0f, 0.0f, 0.0f);
@@ -292,52 +188,102 @@ SSRayMarching::ShaderParameters SSRayMarching::createShaderParameters()
 	return shaderParam;
 }
 
-void SSRayMarching::prepareGeometry()
+// ワーカースレッドで呼ばれるので、メンバーは読むだけにする
+VkPipeline SSRayMarching::createPipeline(PipelineId id)
 {
-	/* VERTEX */
-	//const vec3 red(1.0f, 0.0f, 0.0f);
-	//const vec3 green(0.0f, 1.0f, 0.0f);
-	//const vec3 blue(0.0f, 0.0f, 1.0f);
-	//const vec3 lightBlue(0.7f, 0.93f, 0.96f);
-	//const vec3 blue(0.14f, 0.14f, 0.5f);
-
-	Vertex vertices[] = {
-		{ vec3(-1.0f, 1.0f, 0.0f), blue },
-		{ vec3(-1.0f, -1.0f, 0.0f), lightBlue},
-		{ vec3(1.0f, 1.0f, 0.0f), blue },
-		{ vec3(1.0f, -1.0f, 0.0f), lightBlue },
-	};
-	uint32_t indices[] = { 0,1,2, 2,1,3 };
-
-	m_vertexBuffer = createBuffer(sizeof(vertices), VK_BUFFER_USAGE_VERTEX_BUFFER_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT);
-	m_indexBuffer = createBuffer(sizeof(indices), VK_BUFFER_USAGE_INDEX_BUFFER_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT);
-
-	// 頂点データの書き込み
+	// 頂点の入力は無い（頂点シェーダーが gl_VertexIndex から画面全体を覆う三角形を作る）
+	VkPipelineVertexInputStateCreateInfo vertexInputCI{};
+	vertexInputCI.sType = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO;
+	
+
+	/* ビューポートの設定 */
+	// 値は動的ステートにして記録のときに設定する（VulkanAppBase::recordCommand、ウィンドウの大きさが変わってもそのまま使う）
+	VkPipelineViewportStateCreateInfo viewportCI{};
+	viewportCI.sType = VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO;
+	viewportCI.viewportCount = 1;
+	viewportCI.scissorCount = 1;
+	const VkDynamicState dynamicStates[] = { VK_DYNAMIC_STATE_VIEWPORT, VK_DYNAMIC_STATE_SCISSOR };
+	VkPipelineDynamicStateCreateInfo dynamicCI{};
+	dynamicCI.sType = VK_STRUCTURE_TYPE_PIPELINE_DYNAMIC_STATE_CREATE_INFO;
+	dynamicCI.dynamicStateCount = _countof(dynamicStates);
+	dynamicCI.pDynamicStates = dynamicStates;
+	
+
+	// プリミティブトポロジー設定
+	VkPipelineInputAssemblyStateCreateInfo inputAssemblyCI{};
+	inputAssemblyCI.sType = VK_STRUCTURE_TYPE_PIPELINE_INPUT_ASSEMBLY_STATE_CREATE_INFO;
+	inputAssemblyCI.topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST;
+
+	// ラスタライザステート
+	VkPipelineRasterizationStateCreateInfo rasterizerCI{};
+	rasterizerCI.sType = VK_STRUCTURE_TYPE_PIPELINE_RASTERIZATION_STATE_CREATE_INFO;
+	rasterizerCI.polygonMode = VK_POLYGON_MODE_FILL;
+	rasterizerCI.cullMode = VK_CULL_MODE_NONE;
+	rasterizerCI.frontFace = VK_FRONT_FACE_COUNTER_CLOCKWISE;
+	rasterizerCI.lineWidth = 1.0f;
+
+	// マルチサンプル設定
+	VkPipelineMultisampleStateCreateInfo multisampleCI{};
+	multisampleCI.sType = VK_STRUCTURE_TYPE_PIPELINE_MULTISAMPLE_STATE_CREATE_INFO;
+	multisampleCI.rasterizationSamples = VK_SAMPLE_COUNT_1_BIT;
+
+	VkPipelineColorBlendAttachmentState blendAttachment{};
+	VkPipelineColorBlendStateCreateInfo cbCI{};
+	VkPipelineDepthStencilStateCreateInfo depthStencilCI{};
+	vector<VkPipelineShaderStageCreateInfo> shaderStages{};
+	if (id == PipelineSkybox)
+	{
+		createSkyboxPipelineInfo(&shaderStages, &depthStencilCI, &blendAttachment, &cbCI);
+	}
+	else
+	{
+		// 前処理パスはアルファのパイプラインの設定を元に ConeMarchPrepass が置き換える
+		const char* fragmentShader = getMarchShaderFile(id == PipelinePrepass);
+		createAlphaPipelineInfo(&shaderStages, &depthStencilCI, &blendAttachment, &cbCI, fragmentShader);
+	}
+
+	// パイプラインの構築
+	VkGraphicsPipelineCreateInfo ci{};
+	ci.sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO;
+	ci.stageCount = uint32_t(shaderStages.size());
+	ci.pStages = shaderStages.data();
+	ci.pInputAssemblyState = &inputAssemblyCI;
+	ci.pVertexInputState = &vertexInputCI;
+	ci.pRasterizationState = &rasterizerCI;
+	ci.pDepthStencilState = &depthStencilCI;
+	ci.pMultisampleState = &multisampleCI;
+	ci.pViewportState = &viewportCI;
+	ci.pDynamicState = &dynamicCI;
+	ci.pColorBlendState = &cbCI;
+	ci.renderPass = m_renderPass;
+	ci.layout = m_pipelineLayout;
+
+	VkPipeline pipeline = VK_NULL_HANDLE;
+	if (id == PipelinePrepass)
 	{
-		void* p;
-		vkMapMemory(m_device, m_vertexBuffer.memory, 0, VK_WHOLE_SIZE, 0, &p);
-		memcpy(p, vertices, sizeof(vertices));
-		vkUnmapMemory(m_device, m_vertexBuffer.memory);
+		pipeline = m_coneMarchPrepass.createPipeline(ci, m_pipelineCache.getHandle());
 	}
-	// インデックスデータの書き込み
+	else
 	{
-		void* p;
-		vkMapMemory(m_device, m_indexBuffer.memory, 0, VK_WHOLE_SIZE, 0, &p);
-		memcpy(p, indices, sizeof(indices));
-		vkUnmapMemory(m_device, m_indexBuffer.memory);
+		vkCreateGraphicsPipelines(m_device, m_pipelineCache.getHandle(), 1, &ci, nullptr, &pipeline);
 	}
-	m_indexCount = _countof(indices);
+
+	// ShaderModule はもう不要なので破棄
+	for (const auto& v : shaderStages)
+	{
+		vkDestroyShaderModule(m_device, v.module, nullptr);
+	}
+	return pipeline;
 }
 
-void SSRayMarching::prepareUniformBuffer()
+VkPipeline SSRayMarching::getPipeline(PipelineId id)
 {
-	// ユニフォームバッファ
-	m_uniformBuffers.resize(m_swapchainViews.size());
-	for (auto& v : m_uniformBuffers)
+	// 作成中なら完了を待つ（一度受け取れば以降は待たない）
+	if (m_pipelines[id] == VK_NULL_HANDLE)
 	{
-		VkMemoryPropertyFlags uboFlags = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
-		v = createBuffer(sizeof(ShaderParameters), VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT, uboFlags);
+		m_pipelines[id] = m_pipelineBuilder.get(m_pipelineTickets[id]);
 	}
+	return m_pipelines[id];
 }
 
 VkPipelineShaderStageCreateInfo SSRayMarching::loadShaderModule(const char* fileName, VkShaderStageFlagBits stage)
@@ -402,11 +348,21 @@ void SSRayMarching::createSkyboxPipelineInfo(
 	shaderStages->push_back(loadShaderModule("skyboxshader.frag.spv", VK_SHADER_STAGE_FRAGMENT_BIT));
 }
 
+const char* SSRayMarching::getMarchShaderFile(bool prepass) const
+{
+	if (m_coneMarchPrepass.hasStatisticsShader())
+	{
+		return prepass ? "shader_prepass_stats.frag.spv" : "shader_stats.frag.spv";
+	}
+	return prepass ? "shader_prepass.frag.spv" : "shader.frag.spv";
+}
+
 void SSRayMarching::createAlphaPipelineInfo(
 	vector<VkPipelineShaderStageCreateInfo>* shaderStages,
 	VkPipelineDepthStencilStateCreateInfo* depthStencilCI,
 	VkPipelineColorBlendAttachmentState* blendAttachment,
-	VkPipelineColorBlendStateCreateInfo* cbCI)
+	VkPipelineColorBlendStateCreateInfo* cbCI,
+	const char* fragmentShader)
 {
 	/* ブレンディングの設定 */
 	const auto colorWriteAll = \
@@ -435,7 +391,9 @@ void SSRayMarching::createAlphaPipelineInfo(
 
 	// シェーダーバイナリ読み込み
 	shaderStages->push_back(loadShaderModule("shader.vert.spv", VK_SHADER_STAGE_VERTEX_BIT));
-	shaderStages->push_back(loadShaderModule("shader.frag.spv", VK_SHADER_STAGE_FRAGMENT_BIT));
+	shaderStages->push_back(loadShaderModule(fragmentShader, VK_SHADER_STAGE_FRAGMENT_BIT));
+	// ステップ数の上限などは品質の設定で特殊化する
+	shaderStages->back().pSpecializationInfo = &m_marchSpecialization;
 }
 
 void SSRayMarching::prepareDescriptorSetLayout()
@@ -443,10 +401,28 @@ void SSRayMarching::prepareDescriptorSetLayout()
 	vector<VkDescriptorSetLayoutBinding> bindings;
 	VkDescriptorSetLayoutBinding bindingUBO{};
 	bindingUBO.binding = 0;
-	bindingUBO.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+	bindingUBO.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
 	bindingUBO.stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT;
 	bindingUBO.descriptorCount = 1;
 	bindings.push_back(bindingUBO);
+	{
+		// コーンマーチングの前処理パスの結果
+		VkDescriptorSetLayoutBinding bindingPrepass{};
+		bindingPrepass.binding = 1;
+		bindingPrepass.descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+		bindingPrepass.stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT;
+		bindingPrepass.descriptorCount = 1;
+		bindings.push_back(bindingPrepass);
+	}
+	{
+		// ステップ数の統計
+		VkDescriptorSetLayoutBinding bindingStats{};
+		bindingStats.binding = 2;
+		bindingStats.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+		bindingStats.stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT;
+		bindingStats.descriptorCount = 1;
+		bindings.push_back(bindingStats);
+	}
 
 	VkDescriptorSetLayoutCreateInfo ci{};
 	ci.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
@@ -457,13 +433,17 @@ void SSRayMarching::prepareDescriptorSetLayout()
 
 void SSRayMarching::prepareDescriptorPool()
 {
-	array<VkDescriptorPoolSize, 1> descPoolSize;
-	descPoolSize[0].descriptorCount = 1;
-	descPoolSize[0].type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+	array<VkDescriptorPoolSize, 3> descPoolSize;
+	descPoolSize[0].descriptorCount = m_framesInFlight * 1;
+	descPoolSize[0].type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
+	descPoolSize[1].descriptorCount = m_framesInFlight;
+	descPoolSize[1].type = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+	descPoolSize[2].descriptorCount = m_framesInFlight;
+	descPoolSize[2].type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
 
 	VkDescriptorPoolCreateInfo ci{};
 	ci.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
-	ci.maxSets = uint32_t(m_uniformBuffers.size());
+	ci.maxSets = m_framesInFlight;
 	ci.poolSizeCount = uint32_t(descPoolSize.size());
 	ci.pPoolSizes = descPoolSize.data();
 	vkCreateDescriptorPool(m_device, &ci, nullptr, &m_descriptorPool);
@@ -472,31 +452,29 @@ void SSRayMarching::prepareDescriptorPool()
 void SSRayMarching::prepareDescriptorSet()
 {
 	vector<VkDescriptorSetLayout> layouts;
-	for (int i = 0; i< int(m_uniformBuffers.size()); ++i)
+	for (int i = 0; i< int(m_framesInFlight); ++i)
 	{
 		layouts.push_back(m_descriptorSetLayout);
 	}
 	VkDescriptorSetAllocateInfo ai{};
 	ai.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
 	ai.descriptorPool = m_descriptorPool;
-	ai.descriptorSetCount = uint32_t(m_uniformBuffers.size());
+	ai.descriptorSetCount = m_framesInFlight;
 	ai.pSetLayouts = layouts.data();
-	m_descriptorSet.resize(m_uniformBuffers.size());
+	m_descriptorSet.resize(m_framesInFlight);
 	vkAllocateDescriptorSets(m_device, &ai, m_descriptorSet.data());
 
 	// ディスクリプタセットへ書き込み
-	for (int i = 0;i<int(m_uniformBuffers.size()); ++i)
+	for (int i = 0;i<int(m_framesInFlight); ++i)
 	{
-		VkDescriptorBufferInfo descUBO{};
-		descUBO.buffer = m_uniformBuffers[i].buffer;
-		descUBO.offset = 0;
-		descUBO.range = VK_WHOLE_SIZE;
+		// 位置は描画時に動的オフセットで指定する
+		VkDescriptorBufferInfo descUBO = m_uniformRing.getDescriptorInfo(sizeof(ShaderParameters));
 
 		VkWriteDescriptorSet ubo{};
 		ubo.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
 		ubo.dstBinding = 0;
 		ubo.descriptorCount = 1;
-		ubo.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+		ubo.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
 		ubo.pBufferInfo = &descUBO;
 		ubo.dstSet = m_descriptorSet[i];
 
@@ -505,4 +483,34 @@ void SSRayMarching::prepareDescriptorSet()
 		};
 		vkUpdateDescriptorSets(m_device, uint32_t(writeSets.size()), writeSets.data(), 0, nullptr);
 	}
+	updateTargetDescriptorSet();
+}
+
+void SSRayMarching::updateTargetDescriptorSet()
+{
+	for (int i = 0; i < int(m_framesInFlight); ++i)
+	{
+		VkDescriptorImageInfo descPrepass = m_coneMarchPrepass.getImageInfo(i);
+		VkWriteDescriptorSet prepass{};
+		prepass.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+		prepass.dstBinding = 1;
+		prepass.descriptorCount = 1;
+		prepass.descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+		prepass.pImageInfo = &descPrepass;
+		prepass.dstSet = m_descriptorSet[i];
+
+		VkDescriptorBufferInfo descStats = m_coneMarchPrepass.getStatisticsBufferInfo(i);
+		VkWriteDescriptorSet stats{};
+		stats.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+		stats.dstBinding = 2;
+		stats.descriptorCount = 1;
+		stats.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+		stats.pBufferInfo = &descStats;
+		stats.dstSet = m_descriptorSet[i];
+
+		vector<VkWriteDescriptorSet> writeSets = {
+			prepass, stats
+		};
+		vkUpdateDescriptorSets(m_device, uint32_t(writeSets.size()), writeSets.data(), 0, nullptr);
+	}
 }
\ No newline at end of file
@@ -7,25 +7,27 @@
 class SSRayMarching : public VulkanAppBase
 {
 public:
-	SSRayMarching() : VulkanAppBase() {}
+	SSRayMarching() : VulkanAppBase(), m_parameterOffset(0)
+	{
+		// 球だけのシーンなので 64 ステップで足りる（法線は片側の差分で求める）
+		m_marchQualityBase.maxSteps = 64;
+		m_marchQualityBase.normalEpsilon = 0.001f;
+	}
 
 	virtual void prepare() override;
 	virtual void cleanup() override;
 
+	virtual void update() override;
 	virtual void makeCommand(VkCommandBuffer command) override;
-
-	struct Vertex
-	{
-		glm::vec3 pos;
-		glm::vec3 color;
-	};
+	virtual void makePrepassCommand(VkCommandBuffer command) override;
+	virtual void onSwapchainRecreated() override;
 
 private:
 	// バッファを管理するオブジェクト
 	struct BufferObject
 	{
 		VkBuffer buffer;		// バッファ
-		VkDeviceMemory memory;	// デバイスメモリオブジェクトのOpaqueハンドル
+		DeviceMemoryAllocator::Allocation memory;	// 切り出したデバイスメモリ（ホストから見える場合は mapped に書き込む）
 	};
 
 	struct ShaderParameters
@@ -41,41 +43,57 @@ private:
 		glm::vec4 sky_color;
 	};
 
+	// パイプラインの種類（PipelineBuilder でワーカースレッドから作成する）
+	enum PipelineId
+	{
+		PipelineSkybox,
+		PipelineAlpha,
+		PipelinePrepass,
+		PipelineCount
+	};
+
 	const glm::vec3 lightBlue = glm::vec3(0.35f, 0.45f, 0.5f);
 	const glm::vec3 blue = glm::vec3(0.07f, 0.07f, 0.25f);
 
-	void prepareGeometry();
-	void prepareUniformBuffer();
 	ShaderParameters createShaderParameters();
 
 	BufferObject createBuffer(uint32_t size, VkBufferUsageFlags usage, VkMemoryPropertyFlags flags);
 	VkPipelineShaderStageCreateInfo loadShaderModule(const char* fileName, VkShaderStageFlagBits stage);
 
+	// パイプラインを作成する（ワーカースレッドで呼ばれる）
+	VkPipeline createPipeline(PipelineId id);
+	// 作成したパイプライン（作成中なら完了を待つ、前処理パスのシェーダーが無い場合は VK_NULL_HANDLE）
+	VkPipeline getPipeline(PipelineId id);
+
 	void createSkyboxPipelineInfo(
 		std::vector<VkPipelineShaderStageCreateInfo>* shaderStages,
 		VkPipelineDepthStencilStateCreateInfo* depthStencilCI,
 		VkPipelineColorBlendAttachmentState* blendAttachment,
 		VkPipelineColorBlendStateCreateInfo* cbCI);
+	// レイマーチングのフラグメントシェーダーのファイル名（ConeMarchPrepass::hasStatisticsShader なら MARCH_STATS を定義してコンパイルしたもの）
+	const char* getMarchShaderFile(bool prepass) const;
+
 	void createAlphaPipelineInfo(
 		std::vector<VkPipelineShaderStageCreateInfo>* shaderStages,
 		VkPipelineDepthStencilStateCreateInfo* depthStencilCI,
 		VkPipelineColorBlendAttachmentState* blendAttachment,
-		VkPipelineColorBlendStateCreateInfo* cbCI);
+		VkPipelineColorBlendStateCreateInfo* cbCI,
+		const char* fragmentShader);
 
 	void prepareDescriptorSetLayout();
 	void prepareDescriptorPool();
 	void prepareDescriptorSet();
+	// 描画先の大きさに依存するもの（前処理パスの結果と統計）を書く
+	void updateTargetDescriptorSet();
 
-	BufferObject m_vertexBuffer;
-	BufferObject m_indexBuffer;
-	std::vector<BufferObject> m_uniformBuffers;
+	// 今のフレームのシェーダーパラメータ（m_uniformRing の動的オフセット）
+	uint32_t m_parameterOffset;
 
 	VkDescriptorSetLayout m_descriptorSetLayout;
 	VkDescriptorPool m_descriptorPool;
 	std::vector<VkDescriptorSet> m_descriptorSet;
 
 	VkPipelineLayout m_pipelineLayout;
-	VkPipeline m_pipeline_skybox;
-	VkPipeline m_pipeline_alpha;
-	uint32_t m_indexCount;
+	VkPipeline m_pipelines[PipelineCount];
+	PipelineBuilder::Ticket m_pipelineTickets[PipelineCount];
 };
\ No newline at end of file
@@ -18,6 +18,48 @@ layout(std140) uniform Resolution
   vec4 sky_color;
 };
 
+// R[}[`ȎOpXiConeMarchPrepassj
+// resolution.z:^C̑傫i0 ̏ꍇ͑OȂj
+#ifndef CONE_PREPASS
+layout(binding=1) uniform sampler2D prepassDepth;
+#endif
+
+#ifdef MARCH_STATS
+// Xebv̓viConeMarchPrepass::Counters ƓCAEgj
+// tOgVF[_[珑ɂ fragmentStoresAndAtomics KvȂ̂ŁAΉĂꍇ MARCH_STATS `
+// statsHeatmap  0 ȊOȂsNZƂ̃XebvƏIRiMarchHeatmapj statsPixels ɏ
+layout(std430, binding=2) buffer MarchStats
+{
+  uint statsEnabled;
+  uint statsSteps;
+  uint statsPrepassSteps;
+  uint statsHeatmap;
+  uint statsPixels[];
+};
+#endif
+
+// iiMarchQuality ̓ꉻ萔Al SSRayMarching ̊lƓj
+layout(constant_id = 0) const int MAX_STEPS = 64;
+layout(constant_id = 1) const float HIT_EPSILON = 0.001;
+layout(constant_id = 2) const float NORMAL_EPSILON = 0.001;
+layout(constant_id = 3) const int PREPASS_STEPS = 64;
+
+// IRiMarchHeatmap::Reason ƓlA̕ʂ͖j
+const uint REASON_HIT = 0;
+const uint REASON_MISS = 1;
+const uint REASON_EXHAUSTED = 3;
+
+// 炸ɏ܂Ői񂾃ĈA艓܂Ői񂾂̂͋ɔƂ݂Ȃ
+const float MISS_DISTANCE = 100.0;
+
+#ifdef MARCH_STATS
+void writeHeatmap(vec2 fragCoord, uint steps, uint reason)
+{
+  ivec2 p = ivec2(fragCoord);
+  statsPixels[p.y * int(resolution.x) + p.x] = steps | (reason << 16);
+}
+#endif
+
 // ̋֐
 float sphere_d(vec3 p){
   const vec3 sphere_pos = vec3(0.0, 0.0, 3.0);
@@ -33,7 +75,7 @@ float sphere2_d(vec3 p) {
 
 // @xNg
 vec3 sphere_normal(vec3 pos){
-  float delta = 0.001;
+  float delta = NORMAL_EPSILON;
   return normalize( 
     vec3 (
       sphere_d(pos + vec3(delta, 0.0, 0.0)) - sphere_d(pos),
@@ -44,7 +86,7 @@ vec3 sphere_normal(vec3 pos){
 
 // @xNg2
 vec3 sphere2_normal(vec3 pos){
-  float delta = 0.001;
+  float delta = NORMAL_EPSILON;
   return normalize( 
     vec3 (
       sphere2_d(pos + vec3(delta, 0.0, 0.0)) - sphere2_d(pos),
@@ -90,6 +132,40 @@ float getAlpha2(vec3 pos)
   return pow(1.0 - (d*2), 5) * 2.0;
 }
 
+#ifdef CONE_PREPASS
+// 𑜓x1eNZi^Cj𕢂R[i߁A^Ĉǂ̃C\ʂɓȂo
+void main()
+{
+  // ^C̒Sit𑜓x̃sNZWjʂ郌C
+  float tile = resolution.z;
+  vec2 pos = (gl_FragCoord.xy * tile * 2.0 - resolution.xy) / max(resolution.x, resolution.y);
+  vec3 dir = normalize(pos.x * camera_side.xyz + pos.y * camera_up.xyz + camera_dir.xyz);
+
+  //  1 ̃R[̔ai^C̑Ίp̔ɗ]Tj
+  float k = tile * 1.5 / max(resolution.x, resolution.y);
+
+  // _ t ł̋̋a k*t ̒fʂ܂ފԂ́A̐ (d - k*t) / (1 + k) ܂ŕ\ʂ͖
+  float t = 0.0;
+  uint steps = 0;
+  for(int i=0 ; i < PREPASS_STEPS ; i++)
+  {
+    vec3 p = camera_pos.xyz + t * dir;
+    float d = min(sphere_d(p), sphere2_d(p));
+    steps++;
+    if(d <= k * t + HIT_EPSILON){
+      break;
+    }
+    t += (d - k * t) / (1.0 + k);
+  }
+
+#ifdef MARCH_STATS
+  if(statsEnabled != 0){
+    atomicAdd(statsPrepassSteps, steps);
+  }
+#endif
+  outColor = vec4(t);
+}
+#else
 void main()
 {
   // ʍW̐KB
@@ -97,27 +173,36 @@ void main()
 
   // C̈ʒuAԕ`
   Ray ray;
-  ray.pos = camera_pos.xyz;
   ray.dir = normalize(pos.x * camera_side.xyz + pos.y * camera_up.xyz + camera_dir.xyz);
 
+  // OpX΁A^Ĉǂ̃C\ʂɓȂn߂
   float t = 0.0, d, d2;
+  if(resolution.z > 0.0){
+    t = texelFetch(prepassDepth, ivec2(gl_FragCoord.xy / resolution.z), 0).r;
+  }
+  ray.pos = camera_pos.xyz + t * ray.dir;
+
   vec4 col = vec4(0, 0, 0, 0);
+  uint reason = REASON_EXHAUSTED;
 
   // C΂
-  for(int i=0 ; i < 64 ; i++)
+  int i;
+  for(i=0 ; i < MAX_STEPS ; i++)
   {
     d = sphere_d(ray.pos);
 	d2 = sphere2_d(ray.pos);
 	
 	// qbg
-	if(d < 0.001){
+	if(d < HIT_EPSILON){
 	  col = vec4(getColor(ray.pos, sphere_normal(ray.pos), light_pos.xyz, light_color.xyz), 1.0);
+	  reason = REASON_HIT;
 	  break;
 	}
-	if(d2 < 0.001) {
+	if(d2 < HIT_EPSILON) {
 	  col = vec4(light_color.xyz, getAlpha2(ray.pos));
 	  //float c = getAlpha2(ray.pos);
 	  //col = vec4(c,c,c, 1.0);
+	  reason = REASON_HIT;
 	  break;
 	}
 
@@ -126,5 +211,17 @@ void main()
 	ray.pos = camera_pos.xyz + t * ray.dir;
   }
 
+#ifdef MARCH_STATS
+  if(statsEnabled != 0){
+    atomicAdd(statsSteps, uint(min(i + 1, MAX_STEPS)));
+  }
+  if(statsHeatmap != 0){
+    if(reason == REASON_EXHAUSTED && t > MISS_DISTANCE){
+      reason = REASON_MISS;
+    }
+    writeHeatmap(gl_FragCoord.xy, uint(min(i + 1, MAX_STEPS)), reason);
+  }
+#endif
   outColor = col;
-}
\ No newline at end of file
+}
+#endif
@@ -1,8 +1,9 @@
 #version 450
 
-// 入力情報
-layout(location=0) in vec3 inPos;
-layout(location=1) in vec3 inColor;
+// 頂点バッファを使わずに、gl_VertexIndex（0, 1, 2）から画面全体を覆う大きな三角形を作る
+// (-1,-1), (3,-1), (-1,3) を結ぶ三角形はビューポートの外が切り取られ、1枚で画面全体を覆う
+// 四角形（2枚の三角形）と違い、対角線上のピクセルを両方の三角形でシェーディングすることが無い
+// 頂点入力は無いので vkCmdDraw(command, 3, 1, 0, 0) で描画する
 
 // 出力情報
 layout(location=0) out vec4 outColor;
@@ -14,8 +15,15 @@ out gl_PerVertex
   vec4 gl_Position;
 };
 
+// 上端と下端の色（SSRayMarching の blue と lightBlue）
+const vec4 blue = vec4(0.07, 0.07, 0.25, 1.0);
+const vec4 lightBlue = vec4(0.35, 0.45, 0.5, 1.0);
+
 void main()
 {
-  gl_Position = vec4(inPos, 1.0);
-  outColor = vec4(inColor, 1.0);
+  vec2 uv = vec2((gl_VertexIndex << 1) & 2, gl_VertexIndex & 2);
+  gl_Position = vec4(uv * 2.0 - 1.0, 0.0, 1.0);
+
+  // 以前の四角形の頂点色と同じく、y = 1 で blue、y = -1 で lightBlue になるグラデーション
+  outColor = lightBlue + (blue - lightBlue) * uv.y;
 }
\ No newline at end of file
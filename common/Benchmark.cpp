@@ -0,0 +1,271 @@
+﻿#include "Benchmark.h"
+
+#include <sstream>
+#include <fstream>
+#include <iomanip>
+#include <algorithm>
+#include <chrono>
+#include <stdlib.h>
+
+using namespace std;
+
+namespace
+{
+	// 最小・平均・99パーセンタイル（GpuProfiler と同じ求め方）
+	void summarize(vector<double> times, double* minMs, double* avgMs, double* p99Ms)
+	{
+		*minMs = *avgMs = *p99Ms = 0.0;
+		if (times.empty())
+		{
+			return;
+		}
+		sort(times.begin(), times.end());
+
+		double sum = 0.0;
+		for (auto t : times)
+		{
+			sum += t;
+		}
+		*minMs = times.front();
+		*avgMs = sum / double(times.size());
+		size_t rank = (times.size() * 99 + 99) / 100;
+		*p99Ms = times[(std::min)(rank, times.size()) - 1];
+	}
+
+	// JSON の文字列（区間の名前とサンプル名だけなので、引用符とバックスラッシュだけエスケープする）
+	string quote(const string& str)
+	{
+		string result = "\"";
+		for (auto c : str)
+		{
+			if (c == '"' || c == '\\')
+			{
+				result += '\\';
+			}
+			result += c;
+		}
+		return result + "\"";
+	}
+
+	// CSV の文字列（引用符は2つ重ねる）
+	string quoteCsv(const string& str)
+	{
+		string result = "\"";
+		for (auto c : str)
+		{
+			if (c == '"')
+			{
+				result += '"';
+			}
+			result += c;
+		}
+		return result + "\"";
+	}
+
+	void writeSectionJson(ostream& os, const GpuProfiler::SectionStatistics& stats)
+	{
+		os << "{ \"name\": " << quote(stats.name)
+			<< ", \"frames\": " << stats.frames
+			<< ", \"min_ms\": " << stats.minMs
+			<< ", \"avg_ms\": " << stats.avgMs
+			<< ", \"p99_ms\": " << stats.p99Ms;
+		if (stats.hasPipelineStatistics)
+		{
+			os << ", \"vs_invocations\": " << stats.vertexInvocations
+				<< ", \"clipping_primitives\": " << stats.clippingPrimitives
+				<< ", \"fs_invocations\": " << stats.fragmentInvocations
+				<< ", \"cs_invocations\": " << stats.computeInvocations;
+		}
+		os << " }";
+	}
+}
+
+
+// public ===================================================================
+
+Benchmark::Settings Benchmark::getDefaultSettings()
+{
+	Settings settings;
+	settings.warmupFrames = 30;
+	settings.frames = 300;
+	settings.timeStep = 1.0 / 60.0;
+	return settings;
+}
+
+int Benchmark::parseArguments(int argc, char** argv, int first, Settings* settings, const char** outputFile)
+{
+	int i = first;
+	if (i < argc)
+	{
+		settings->frames = uint32_t((std::max)(atoi(argv[i++]), 1));
+	}
+	if (i < argc)
+	{
+		settings->warmupFrames = uint32_t((std::max)(atoi(argv[i++]), 0));
+	}
+	if (i < argc)
+	{
+		vector<VkExtent2D> resolutions;
+		stringstream ss(argv[i++]);
+		string item;
+		while (getline(ss, item, ','))
+		{
+			uint32_t width = 0, height = 0;
+			char separator = 0;
+			stringstream is(item);
+			if (is >> width >> separator >> height && separator == 'x' && width > 0 && height > 0)
+			{
+				resolutions.push_back({ width, height });
+			}
+		}
+		if (!resolutions.empty())
+		{
+			settings->resolutions = resolutions;
+		}
+	}
+	if (i < argc)
+	{
+		*outputFile = argv[i++];
+	}
+	return i;
+}
+
+Benchmark::Result Benchmark::run(VulkanAppBase& app, const char* sample, VkExtent2D extent, const Settings& settings)
+{
+	app.setFixedTimeStep(settings.timeStep);
+	app.setGpuProfilingEnabled(true);
+	app.initializeOffscreen(extent.width, extent.height, sample);
+
+	auto& profiler = app.getGpuProfiler();
+	profiler.setHistorySize(settings.frames);
+
+	for (uint32_t i = 0; i < settings.warmupFrames; i++)
+	{
+		app.render();
+	}
+
+	// ウォームアップの分の結果は捨てる
+	app.waitIdle();
+	profiler.flush();
+	profiler.clearStatistics();
+
+	vector<double> cpuTimes;
+	cpuTimes.reserve(settings.frames);
+	auto begin = chrono::steady_clock::now();
+	for (uint32_t i = 0; i < settings.frames; i++)
+	{
+		auto frameBegin = chrono::steady_clock::now();
+		app.render();
+		cpuTimes.push_back(chrono::duration<double, milli>(chrono::steady_clock::now() - frameBegin).count());
+	}
+	app.waitIdle();
+	double elapsed = chrono::duration<double>(chrono::steady_clock::now() - begin).count();
+	profiler.flush();
+
+	Result result{};
+	result.sample = sample;
+	result.device = app.getPhysicalDeviceName();
+	result.extent = extent;
+	result.warmupFrames = settings.warmupFrames;
+	result.frames = settings.frames;
+	result.timeStep = settings.timeStep;
+	result.quality = app.getMarchQuality();
+	summarize(cpuTimes, &result.cpuMinMs, &result.cpuAvgMs, &result.cpuP99Ms);
+	result.fps = (elapsed > 0.0) ? double(settings.frames) / elapsed : 0.0;
+	result.megapixelsPerSecond = result.fps * double(extent.width) * double(extent.height) / 1000000.0;
+	result.gpuFrame = profiler.getFrameStatistics();
+	result.gpuSections = profiler.getStatistics();
+
+	app.terminate();
+	return result;
+}
+
+string Benchmark::createReport(const Result& result)
+{
+	stringstream ss;
+	ss << fixed << setprecision(3);
+	ss << "[Benchmark] " << result.sample << " (" << result.device << ") " << result.extent.width << "x" << result.extent.height
+		<< ": max steps " << result.quality.maxSteps << ", frames " << result.frames
+		<< ", cpu avg " << result.cpuAvgMs << " ms (p99 " << result.cpuP99Ms << ")"
+		<< ", gpu avg " << result.gpuFrame.avgMs << " ms (p99 " << result.gpuFrame.p99Ms << ")"
+		<< ", " << setprecision(1) << result.fps << " fps, " << result.megapixelsPerSecond << " Mpixels/s" << endl;
+	return ss.str();
+}
+
+bool Benchmark::writeCsv(const char* fileName, const vector<Result>& results)
+{
+	ofstream ofs(fileName);
+	if (!ofs)
+	{
+		return false;
+	}
+
+	ofs << "sample,device,width,height,warmup_frames,frames,time_step,max_steps,hit_epsilon,"
+		<< "cpu_min_ms,cpu_avg_ms,cpu_p99_ms,gpu_min_ms,gpu_avg_ms,gpu_p99_ms,fps,mpixels_per_s" << endl;
+	ofs << fixed << setprecision(6);
+	for (const auto& result : results)
+	{
+		ofs << quoteCsv(result.sample) << "," << quoteCsv(result.device) << ","
+			<< result.extent.width << "," << result.extent.height << ","
+			<< result.warmupFrames << "," << result.frames << "," << result.timeStep << ","
+			<< result.quality.maxSteps << "," << result.quality.hitEpsilon << ","
+			<< result.cpuMinMs << "," << result.cpuAvgMs << "," << result.cpuP99Ms << ","
+			<< result.gpuFrame.minMs << "," << result.gpuFrame.avgMs << "," << result.gpuFrame.p99Ms << ","
+			<< result.fps << "," << result.megapixelsPerSecond << endl;
+	}
+	return bool(ofs);
+}
+
+bool Benchmark::writeJson(const char* fileName, const vector<Result>& results)
+{
+	ofstream ofs(fileName);
+	if (!ofs)
+	{
+		return false;
+	}
+
+	ofs << fixed << setprecision(6);
+	ofs << "[" << endl;
+	for (size_t i = 0; i < results.size(); ++i)
+	{
+		const auto& result = results[i];
+		ofs << "  {" << endl
+			<< "    \"sample\": " << quote(result.sample) << "," << endl
+			<< "    \"device\": " << quote(result.device) << "," << endl
+			<< "    \"width\": " << result.extent.width << "," << endl
+			<< "    \"height\": " << result.extent.height << "," << endl
+			<< "    \"warmup_frames\": " << result.warmupFrames << "," << endl
+			<< "    \"frames\": " << result.frames << "," << endl
+			<< "    \"time_step\": " << result.timeStep << "," << endl
+			<< "    \"quality\": { \"max_steps\": " << result.quality.maxSteps << ", \"hit_epsilon\": " << result.quality.hitEpsilon
+			<< ", \"normal_epsilon\": " << result.quality.normalEpsilon << ", \"prepass_steps\": " << result.quality.prepassSteps
+			<< ", \"max_bounces\": " << result.quality.maxBounces << " }," << endl
+			<< "    \"cpu\": { \"min_ms\": " << result.cpuMinMs << ", \"avg_ms\": " << result.cpuAvgMs << ", \"p99_ms\": " << result.cpuP99Ms << " }," << endl
+			<< "    \"fps\": " << result.fps << "," << endl
+			<< "    \"mpixels_per_s\": " << result.megapixelsPerSecond << "," << endl
+			<< "    \"gpu\": ";
+		writeSectionJson(ofs, result.gpuFrame);
+		ofs << "," << endl << "    \"gpu_sections\": [";
+		for (size_t j = 0; j < result.gpuSections.size(); ++j)
+		{
+			ofs << (j == 0 ? "" : ",") << endl << "      ";
+			writeSectionJson(ofs, result.gpuSections[j]);
+		}
+		ofs << endl << "    ]" << endl
+			<< "  }" << (i + 1 < results.size() ? "," : "") << endl;
+	}
+	ofs << "]" << endl;
+	return bool(ofs);
+}
+
+string Benchmark::getJsonFileName(const char* fileName)
+{
+	string name = fileName;
+	auto dot = name.find_last_of('.');
+	auto slash = name.find_last_of("/\\");
+	if (dot != string::npos && (slash == string::npos || dot > slash))
+	{
+		name.erase(dot);
+	}
+	return name + ".json";
+}
@@ -0,0 +1,65 @@
+﻿#pragma once
+
+#include "VulkanAppBase.h"
+
+#include <vector>
+#include <string>
+#include <stdint.h>
+
+// 固定の時間刻みでサンプルを描画し、CPU・GPU のフレーム時間とスループットを CSV / JSON に出力する
+// 時刻は VulkanAppBase::setFixedTimeStep で進めるので、同じ設定なら毎回同じ画面を計測する
+// ウォームアップのフレームは集計せず、その後の frames フレームを計測する
+//
+// GPU の時間は GpuProfiler の区間（最初の区間の開始から最後の区間の終了までをフレーム全体とする）
+// CPU の時間は render の呼び出し1回分（フェンスを待つ時間も含む）
+class Benchmark
+{
+public:
+	struct Settings
+	{
+		uint32_t warmupFrames;
+		uint32_t frames;
+		double timeStep;					// 1フレームで進める時刻（秒）
+		std::vector<VkExtent2D> resolutions;
+	};
+
+	// 1つの解像度の計測結果
+	struct Result
+	{
+		std::string sample;
+		std::string device;				// 計測した物理デバイスの名前
+		VkExtent2D extent;
+		uint32_t warmupFrames;
+		uint32_t frames;
+		double timeStep;
+		MarchQuality::Settings quality;	// 計測したときの品質（特殊化定数）
+
+		double cpuMinMs;
+		double cpuAvgMs;
+		double cpuP99Ms;
+		double fps;					// 計測したフレーム全体の経過時間から求めたもの
+		double megapixelsPerSecond;
+
+		GpuProfiler::SectionStatistics gpuFrame;
+		std::vector<GpuProfiler::SectionStatistics> gpuSections;
+	};
+
+	static Settings getDefaultSettings();
+
+	// 引数 [計測フレーム数] [ウォームアップのフレーム数] [解像度] [出力ファイル名] を argv[first] から読む
+	// 解像度は 1280x1024,640x480 のようにカンマで区切る。省略した引数は settings と outputFile の値のまま
+	// 読んだ次の引数の位置を返す
+	static int parseArguments(int argc, char** argv, int first, Settings* settings, const char** outputFile);
+
+	// app は initializeOffscreen の前の状態で渡す（計測の設定をして初期化し、terminate まで行う）
+	static Result run(VulkanAppBase& app, const char* sample, VkExtent2D extent, const Settings& settings);
+
+	static std::string createReport(const Result& result);
+
+	// 1行に1つの解像度（区間ごとの時間は JSON にだけ書く）
+	static bool writeCsv(const char* fileName, const std::vector<Result>& results);
+	static bool writeJson(const char* fileName, const std::vector<Result>& results);
+
+	// fileName の拡張子を .json に置き換えたもの
+	static std::string getJsonFileName(const char* fileName);
+};
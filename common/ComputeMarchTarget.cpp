@@ -0,0 +1,160 @@
+﻿#include "ComputeMarchTarget.h"
+#include "VulkanAppBase.h"
+
+using namespace std;
+
+namespace
+{
+	// 結果チェック（VulkanAppBase::checkResult と同じ）
+	void checkResult(VkResult result)
+	{
+		if (result != VK_SUCCESS)
+		{
+			DebugBreak();
+		}
+	}
+}
+
+
+// public ===================================================================
+
+ComputeMarchTarget::ComputeMarchTarget()
+	: m_device(VK_NULL_HANDLE)
+	, m_allocator(nullptr)
+	, m_extent{ 0, 0 }
+{
+}
+
+// ストレージイメージとして書き込み、ブリット元にできるか
+bool ComputeMarchTarget::isSupported(VkPhysicalDevice physDev)
+{
+	VkFormatProperties props;
+	vkGetPhysicalDeviceFormatProperties(physDev, Format, &props);
+	const VkFormatFeatureFlags required = VK_FORMAT_FEATURE_STORAGE_IMAGE_BIT | VK_FORMAT_FEATURE_BLIT_SRC_BIT;
+	return (props.optimalTilingFeatures & required) == required;
+}
+
+void ComputeMarchTarget::create(VkDevice device, DeviceMemoryAllocator& allocator, VkExtent2D extent, uint32_t frameCount)
+{
+	m_device = device;
+	m_allocator = &allocator;
+	m_extent = extent;
+
+	m_frames.resize(frameCount);
+	for (auto& frame : m_frames)
+	{
+		VkImageCreateInfo ci{};
+		ci.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+		ci.imageType = VK_IMAGE_TYPE_2D;
+		ci.format = Format;
+		ci.extent = { m_extent.width, m_extent.height, 1 };
+		ci.mipLevels = 1;
+		ci.arrayLayers = 1;
+		ci.samples = VK_SAMPLE_COUNT_1_BIT;
+		ci.tiling = VK_IMAGE_TILING_OPTIMAL;
+		ci.usage = VK_IMAGE_USAGE_STORAGE_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT;
+		ci.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+		auto result = m_allocator->createImage(ci, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &frame.image, &frame.memory);
+		checkResult(result);
+
+		VkImageViewCreateInfo viewCI{};
+		viewCI.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
+		viewCI.viewType = VK_IMAGE_VIEW_TYPE_2D;
+		viewCI.image = frame.image;
+		viewCI.format = Format;
+		viewCI.components = { VK_COMPONENT_SWIZZLE_R, VK_COMPONENT_SWIZZLE_G, VK_COMPONENT_SWIZZLE_B, VK_COMPONENT_SWIZZLE_A };
+		viewCI.subresourceRange = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1 };
+		result = vkCreateImageView(m_device, &viewCI, nullptr, &frame.view);
+		checkResult(result);
+	}
+}
+
+void ComputeMarchTarget::destroy()
+{
+	for (auto& frame : m_frames)
+	{
+		vkDestroyImageView(m_device, frame.view, nullptr);
+		m_allocator->destroyImage(frame.image, frame.memory);
+	}
+	m_frames.clear();
+}
+
+// 描画先の大きさが変わった場合に作り直す
+void ComputeMarchTarget::resize(VkExtent2D extent)
+{
+	uint32_t frameCount = uint32_t(m_frames.size());
+	destroy();
+	create(m_device, *m_allocator, extent, frameCount);
+}
+
+// 画面全体をタイルに分けてディスパッチする
+void ComputeMarchTarget::dispatch(VkCommandBuffer command, uint32_t frameIndex)
+{
+	// 前のフレームのブリットが読み終えてから書く（全体を書き直すので前の内容は破棄する）
+	VkImageMemoryBarrier barrier{};
+	barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+	barrier.srcAccessMask = 0;
+	barrier.dstAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+	barrier.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+	barrier.newLayout = VK_IMAGE_LAYOUT_GENERAL;
+	barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+	barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+	barrier.image = m_frames[frameIndex].image;
+	barrier.subresourceRange = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1 };
+	vkCmdPipelineBarrier(command, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 0, nullptr, 0, nullptr, 1, &barrier);
+
+	// 端のタイルははみ出した分をシェーダー側で捨てる
+	uint32_t groupsX = (m_extent.width + TileSize - 1) / TileSize;
+	uint32_t groupsY = (m_extent.height + TileSize - 1) / TileSize;
+	vkCmdDispatch(command, groupsX, groupsY, 1);
+}
+
+// 描画結果を dstImage へブリットする
+void ComputeMarchTarget::blit(VkCommandBuffer command, uint32_t frameIndex, VkImage dstImage, VkImageLayout dstFinalLayout)
+{
+	// 書き込み結果 -> 転送元、描画先 -> 転送先
+	VkImageMemoryBarrier barriers[2]{};
+	barriers[0].sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+	barriers[0].srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+	barriers[0].dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+	barriers[0].oldLayout = VK_IMAGE_LAYOUT_GENERAL;
+	barriers[0].newLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+	barriers[0].srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+	barriers[0].dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+	barriers[0].image = m_frames[frameIndex].image;
+	barriers[0].subresourceRange = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1 };
+
+	barriers[1] = barriers[0];
+	barriers[1].srcAccessMask = 0;
+	barriers[1].dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+	barriers[1].oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+	barriers[1].newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+	barriers[1].image = dstImage;
+	// 描画先はスワップチェインの取得を待つセマフォ（TRANSFER で待つ）の後に遷移させる
+	VkPipelineStageFlags srcStages = VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT | VK_PIPELINE_STAGE_TRANSFER_BIT;
+	vkCmdPipelineBarrier(command, srcStages, VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, nullptr, 0, nullptr, _countof(barriers), barriers);
+
+	// 同じ大きさなので形式の変換だけ行う
+	VkImageBlit region{};
+	region.srcSubresource = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 0, 1 };
+	region.srcOffsets[1] = { int32_t(m_extent.width), int32_t(m_extent.height), 1 };
+	region.dstSubresource = region.srcSubresource;
+	region.dstOffsets[1] = region.srcOffsets[1];
+	vkCmdBlitImage(command,
+		m_frames[frameIndex].image, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+		dstImage, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+		1, &region, VK_FILTER_NEAREST);
+
+	// Present または読み戻しの状態へ遷移する
+	VkImageMemoryBarrier barrier = barriers[1];
+	barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+	barrier.dstAccessMask = (dstFinalLayout == VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL) ? VK_ACCESS_TRANSFER_READ_BIT : 0;
+	barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+	barrier.newLayout = dstFinalLayout;
+	vkCmdPipelineBarrier(command, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT | VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, 0, 0, nullptr, 0, nullptr, 1, &barrier);
+}
+
+VkDescriptorImageInfo ComputeMarchTarget::getImageInfo(uint32_t frameIndex) const
+{
+	return VkDescriptorImageInfo{ VK_NULL_HANDLE, m_frames[frameIndex].view, VK_IMAGE_LAYOUT_GENERAL };
+}
@@ -0,0 +1,65 @@
+﻿#pragma once
+
+#include <vulkan/vulkan.h>
+
+#include <vector>
+#include <stdint.h>
+
+#include "DeviceMemoryAllocator.h"
+
+// コンピュートシェーダーでレイマーチングする場合の描画先
+// 8x8 ピクセルのタイルごとにディスパッチしてストレージイメージに書き込み、
+// それをスワップチェイン（オフスクリーン時は描画先イメージ）へブリットする
+// フラグメントシェーダーと違い、タイル内で共有メモリを使った処理や早期終了ができる
+//
+// シェーダー側の決まり（各サンプルの shader.frag）
+//   COMPUTE_MARCH を定義してコンピュートシェーダーとしてコンパイルする
+//   local_size は TileSize x TileSize、gl_GlobalInvocationID.xy + 0.5 を gl_FragCoord.xy の代わりに使う
+//   描画先は rgba8 の image2D（getImageInfo のディスクリプタ）
+class ComputeMarchTarget
+{
+public:
+	ComputeMarchTarget();
+
+	static const uint32_t TileSize = 8;
+
+	// ストレージイメージの形式（ブリットで描画先の形式に変換する）
+	static const VkFormat Format = VK_FORMAT_R8G8B8A8_UNORM;
+
+	// ストレージイメージとして書き込み、ブリット元にできるか
+	static bool isSupported(VkPhysicalDevice physDev);
+
+	// allocator:イメージのメモリを確保する（destroy まで使う）
+	// extent:描画先の大きさ frameCount:同時に処理するフレーム数（フレームごとに描画先を持つ）
+	void create(VkDevice device, DeviceMemoryAllocator& allocator, VkExtent2D extent, uint32_t frameCount);
+	void destroy();
+	// 描画先の大きさが変わった場合にイメージを作り直す（デバイスがアイドルのときに呼ぶこと）
+	// getImageInfo のディスクリプタは呼び出し側で書き直す
+	void resize(VkExtent2D extent);
+
+	// 画面全体をタイルに分けてディスパッチする（パイプラインとディスクリプタセットは呼び出し側でセットする）
+	void dispatch(VkCommandBuffer command, uint32_t frameIndex);
+
+	// 描画結果を dstImage へブリットし、dstFinalLayout に遷移する
+	// dstImage は TRANSFER_DST を指定して作成したイメージで、以前の内容は破棄する
+	void blit(VkCommandBuffer command, uint32_t frameIndex, VkImage dstImage, VkImageLayout dstFinalLayout);
+
+	VkExtent2D getExtent() const { return m_extent; }
+
+	// シェーダーのディスクリプタ（STORAGE_IMAGE）
+	VkDescriptorImageInfo getImageInfo(uint32_t frameIndex) const;
+
+private:
+	// 1フレーム分のリソース
+	struct Frame
+	{
+		VkImage image;
+		DeviceMemoryAllocator::Allocation memory;
+		VkImageView view;
+	};
+
+	VkDevice m_device;
+	DeviceMemoryAllocator* m_allocator;
+	VkExtent2D m_extent;
+	std::vector<Frame> m_frames;
+};
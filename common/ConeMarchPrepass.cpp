@@ -0,0 +1,401 @@
+﻿#include "ConeMarchPrepass.h"
+#include "VulkanAppBase.h"
+
+#include <sstream>
+#include <iomanip>
+#include <array>
+
+using namespace std;
+
+namespace
+{
+	// 結果チェック（VulkanAppBase::checkResult と同じ）
+	void checkResult(VkResult result)
+	{
+		if (result != VK_SUCCESS)
+		{
+			DebugBreak();
+		}
+	}
+}
+
+
+// public ===================================================================
+
+ConeMarchPrepass::ConeMarchPrepass()
+	: m_device(VK_NULL_HANDLE)
+	, m_allocator(nullptr)
+	, m_tileSize(DefaultTileSize)
+	, m_enabled(false)
+	, m_available(false)
+	, m_statisticsShader(false)
+	, m_statisticsEnabled(false)
+	, m_heatmapEnabled(false)
+	, m_renderPass(VK_NULL_HANDLE)
+	, m_sampler(VK_NULL_HANDLE)
+	, m_total{}
+{
+}
+
+void ConeMarchPrepass::create(VkDevice device, DeviceMemoryAllocator& allocator, VkExtent2D extent, uint32_t frameCount, uint32_t tileSize)
+{
+	m_device = device;
+	m_allocator = &allocator;
+	m_tileSize = tileSize;
+
+	// 毎フレーム全体を書き直すので前の内容は読まない
+	// 終了時にフル解像度のパスから読む状態へ遷移する
+	VkAttachmentDescription attachment{};
+	attachment.format = VK_FORMAT_R32_SFLOAT;
+	attachment.samples = VK_SAMPLE_COUNT_1_BIT;
+	attachment.loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
+	attachment.storeOp = VK_ATTACHMENT_STORE_OP_STORE;
+	attachment.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
+	attachment.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+	attachment.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+	attachment.finalLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+
+	VkAttachmentReference colorReference{};
+	colorReference.attachment = 0;
+	colorReference.layout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+
+	VkSubpassDescription subpassDesc{};
+	subpassDesc.pipelineBindPoint = VK_PIPELINE_BIND_POINT_GRAPHICS;
+	subpassDesc.colorAttachmentCount = 1;
+	subpassDesc.pColorAttachments = &colorReference;
+
+	// 前のフレームのフル解像度のパスが読み終えてから書き、書き終えてからフル解像度のパスで読む
+	// フル解像度のパスはフラグメントシェーダーかコンピュートシェーダー（ComputeMarchTarget）
+	const VkPipelineStageFlags marchStages = VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT;
+	array<VkSubpassDependency, 2> dependencies{};
+	dependencies[0].srcSubpass = VK_SUBPASS_EXTERNAL;
+	dependencies[0].dstSubpass = 0;
+	dependencies[0].srcStageMask = marchStages;
+	dependencies[0].dstStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
+	dependencies[0].srcAccessMask = VK_ACCESS_SHADER_READ_BIT;
+	dependencies[0].dstAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
+	dependencies[1].srcSubpass = 0;
+	dependencies[1].dstSubpass = VK_SUBPASS_EXTERNAL;
+	dependencies[1].srcStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
+	dependencies[1].dstStageMask = marchStages;
+	dependencies[1].srcAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
+	dependencies[1].dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+
+	VkRenderPassCreateInfo renderPassCI{};
+	renderPassCI.sType = VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO;
+	renderPassCI.attachmentCount = 1;
+	renderPassCI.pAttachments = &attachment;
+	renderPassCI.subpassCount = 1;
+	renderPassCI.pSubpasses = &subpassDesc;
+	renderPassCI.dependencyCount = uint32_t(dependencies.size());
+	renderPassCI.pDependencies = dependencies.data();
+	auto result = vkCreateRenderPass(m_device, &renderPassCI, nullptr, &m_renderPass);
+	checkResult(result);
+
+	// タイルの値をそのまま読む
+	VkSamplerCreateInfo samplerCI{};
+	samplerCI.sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO;
+	samplerCI.magFilter = VK_FILTER_NEAREST;
+	samplerCI.minFilter = VK_FILTER_NEAREST;
+	samplerCI.mipmapMode = VK_SAMPLER_MIPMAP_MODE_NEAREST;
+	samplerCI.addressModeU = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+	samplerCI.addressModeV = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+	samplerCI.addressModeW = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+	samplerCI.maxLod = 0.0f;
+	result = vkCreateSampler(m_device, &samplerCI, nullptr, &m_sampler);
+	checkResult(result);
+
+	createFrames(extent, frameCount);
+}
+
+void ConeMarchPrepass::destroy()
+{
+	destroyFrames();
+
+	vkDestroySampler(m_device, m_sampler, nullptr);
+	vkDestroyRenderPass(m_device, m_renderPass, nullptr);
+}
+
+// フル解像度が変わった場合に作り直す（デバイスがアイドルのときに呼ぶこと）
+void ConeMarchPrepass::resize(VkExtent2D extent)
+{
+	uint32_t frameCount = uint32_t(m_frames.size());
+	for (auto& frame : m_frames)
+	{
+		// 読み終えたカウンタは今までの統計に入れておく
+		accumulate(frame);
+	}
+	destroyFrames();
+	createFrames(extent, frameCount);
+}
+
+// 前処理パスのパイプラインを作成する
+VkPipeline ConeMarchPrepass::createPipeline(VkGraphicsPipelineCreateInfo ci, VkPipelineCache cache) const
+{
+	// ビューポートとシザーは begin で低解像度の全体に設定する（大きさが変わってもパイプラインは作り直さない）
+	VkPipelineViewportStateCreateInfo viewportCI{};
+	viewportCI.sType = VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO;
+	viewportCI.viewportCount = 1;
+	viewportCI.scissorCount = 1;
+	const VkDynamicState dynamicStates[] = { VK_DYNAMIC_STATE_VIEWPORT, VK_DYNAMIC_STATE_SCISSOR };
+	VkPipelineDynamicStateCreateInfo dynamicCI{};
+	dynamicCI.sType = VK_STRUCTURE_TYPE_PIPELINE_DYNAMIC_STATE_CREATE_INFO;
+	dynamicCI.dynamicStateCount = _countof(dynamicStates);
+	dynamicCI.pDynamicStates = dynamicStates;
+
+	// 距離をそのまま書く
+	VkPipelineColorBlendAttachmentState blendAttachment{};
+	blendAttachment.blendEnable = VK_FALSE;
+	blendAttachment.colorWriteMask = VK_COLOR_COMPONENT_R_BIT;
+	VkPipelineColorBlendStateCreateInfo cbCI{};
+	cbCI.sType = VK_STRUCTURE_TYPE_PIPELINE_COLOR_BLEND_STATE_CREATE_INFO;
+	cbCI.attachmentCount = 1;
+	cbCI.pAttachments = &blendAttachment;
+
+	ci.pViewportState = &viewportCI;
+	ci.pDynamicState = &dynamicCI;
+	ci.pColorBlendState = &cbCI;
+	ci.pDepthStencilState = nullptr;
+	ci.renderPass = m_renderPass;
+	ci.subpass = 0;
+
+	VkPipeline pipeline;
+	auto result = vkCreateGraphicsPipelines(m_device, cache, 1, &ci, nullptr, &pipeline);
+	checkResult(result);
+	return pipeline;
+}
+
+// 前処理パスのレンダーパスを開始する
+void ConeMarchPrepass::beginFrame(uint32_t frameIndex)
+{
+	auto& frame = m_frames[frameIndex];
+
+	// フェンスを待った後なので、同じ枠を使った前のフレームのカウンタは書き終わっている
+	accumulate(frame);
+	frame.counters->enabled = m_statisticsEnabled ? 1 : 0;
+	frame.counters->heatmap = m_heatmapEnabled ? 1 : 0;
+	if (m_statisticsEnabled)
+	{
+		frame.pending.frames = 1;
+		frame.pending.pixels = uint64_t(m_fullExtent.width) * m_fullExtent.height;
+		frame.pending.prepassTexels = isEnabled() ? uint64_t(m_extent.width) * m_extent.height : 0;
+	}
+}
+
+bool ConeMarchPrepass::begin(VkCommandBuffer command, uint32_t frameIndex)
+{
+	auto& frame = m_frames[frameIndex];
+
+	// 無効の場合は 0（カメラ位置から始める）でクリアするだけ
+	VkClearValue clearValue{};
+	VkRenderPassBeginInfo renderPassBI{};
+	renderPassBI.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
+	renderPassBI.renderPass = m_renderPass;
+	renderPassBI.framebuffer = frame.framebuffer;
+	renderPassBI.renderArea.offset = VkOffset2D{ 0,0 };
+	renderPassBI.renderArea.extent = m_extent;
+	renderPassBI.pClearValues = &clearValue;
+	renderPassBI.clearValueCount = 1;
+	vkCmdBeginRenderPass(command, &renderPassBI, VK_SUBPASS_CONTENTS_INLINE);
+
+	// 低解像度の全体に描く（フル解像度のパスと同じく上下反転する）
+	VkViewport viewport{ 0.0f, float(m_extent.height), float(m_extent.width), -1.0f * float(m_extent.height), 0.0f, 1.0f };
+	VkRect2D scissor{ { 0, 0 }, m_extent };
+	vkCmdSetViewport(command, 0, 1, &viewport);
+	vkCmdSetScissor(command, 0, 1, &scissor);
+	return isEnabled();
+}
+
+void ConeMarchPrepass::end(VkCommandBuffer command)
+{
+	vkCmdEndRenderPass(command);
+}
+
+// カウンタをホストから読めるようにする
+void ConeMarchPrepass::makeStatisticsBarrier(VkCommandBuffer command, uint32_t frameIndex)
+{
+	if (!m_statisticsEnabled && !m_heatmapEnabled)
+	{
+		return;
+	}
+	VkBufferMemoryBarrier barrier{};
+	barrier.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+	barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+	barrier.dstAccessMask = VK_ACCESS_HOST_READ_BIT;
+	barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+	barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+	barrier.buffer = m_frames[frameIndex].statsBuffer;
+	barrier.offset = 0;
+	barrier.size = VK_WHOLE_SIZE;
+	vkCmdPipelineBarrier(command, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_HOST_BIT, 0, 0, nullptr, 1, &barrier, 0, nullptr);
+}
+
+// これまでの統計を集計して返す
+ConeMarchPrepass::Statistics ConeMarchPrepass::collectStatistics()
+{
+	for (auto& frame : m_frames)
+	{
+		accumulate(frame);
+	}
+	Statistics stats = m_total;
+	m_total = Statistics{};
+	return stats;
+}
+
+string ConeMarchPrepass::createReport(const char* label, const Statistics& stats)
+{
+	stringstream ss;
+	ss << fixed << setprecision(2);
+	ss << "[ConeMarchPrepass] " << label << ": frames " << stats.frames;
+	if (stats.pixels == 0)
+	{
+		ss << " (no statistics)" << endl;
+		return ss.str();
+	}
+
+	// 前処理パスのステップ数はフル解像度の1ピクセルあたりに換算して合計する
+	double steps = double(stats.steps) / double(stats.pixels);
+	double prepass = double(stats.prepassSteps) / double(stats.pixels);
+	ss << ", steps/pixel " << steps;
+	if (stats.prepassTexels > 0)
+	{
+		ss << " + prepass " << prepass
+			<< " (" << double(stats.prepassSteps) / double(stats.prepassTexels) << " per tile)"
+			<< " = " << steps + prepass;
+	}
+	ss << endl;
+	return ss.str();
+}
+
+// 統計を書くシェーダーかどうか（ピクセルごとのコードの分を確保するかが変わる）
+void ConeMarchPrepass::setStatisticsShader(bool statisticsShader)
+{
+	if (m_statisticsShader == statisticsShader)
+	{
+		return;
+	}
+	m_statisticsShader = statisticsShader;
+	if (!m_frames.empty())
+	{
+		resize(m_fullExtent);
+	}
+}
+
+// frameIndex の枠に書かれたピクセルごとのコードを読む
+void ConeMarchPrepass::readHeatmap(uint32_t frameIndex, vector<uint32_t>* codes) const
+{
+	if (!m_statisticsShader)
+	{
+		codes->clear();
+		return;
+	}
+	// カウンタの直後に行の順で並んでいる
+	const uint32_t* pixels = reinterpret_cast<const uint32_t*>(m_frames[frameIndex].counters + 1);
+	codes->assign(pixels, pixels + size_t(m_fullExtent.width) * m_fullExtent.height);
+}
+
+VkDescriptorImageInfo ConeMarchPrepass::getImageInfo(uint32_t frameIndex) const
+{
+	return VkDescriptorImageInfo{ m_sampler, m_frames[frameIndex].view, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL };
+}
+
+VkDescriptorBufferInfo ConeMarchPrepass::getStatisticsBufferInfo(uint32_t frameIndex) const
+{
+	return VkDescriptorBufferInfo{ m_frames[frameIndex].statsBuffer, 0, VK_WHOLE_SIZE };
+}
+
+
+// private ==================================================================
+
+// フル解像度に合わせたフレームごとのリソース
+void ConeMarchPrepass::createFrames(VkExtent2D extent, uint32_t frameCount)
+{
+	m_fullExtent = extent;
+	m_extent = { (extent.width + m_tileSize - 1) / m_tileSize, (extent.height + m_tileSize - 1) / m_tileSize };
+
+	VkResult result;
+	m_frames.resize(frameCount);
+	for (auto& frame : m_frames)
+	{
+		VkImageCreateInfo ci{};
+		ci.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+		ci.imageType = VK_IMAGE_TYPE_2D;
+		ci.format = VK_FORMAT_R32_SFLOAT;
+		ci.extent = { m_extent.width, m_extent.height, 1 };
+		ci.mipLevels = 1;
+		ci.arrayLayers = 1;
+		ci.samples = VK_SAMPLE_COUNT_1_BIT;
+		ci.tiling = VK_IMAGE_TILING_OPTIMAL;
+		ci.usage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_SAMPLED_BIT;
+		ci.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+		result = m_allocator->createImage(ci, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &frame.image, &frame.memory);
+		checkResult(result);
+
+		VkImageViewCreateInfo viewCI{};
+		viewCI.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
+		viewCI.viewType = VK_IMAGE_VIEW_TYPE_2D;
+		viewCI.image = frame.image;
+		viewCI.format = VK_FORMAT_R32_SFLOAT;
+		viewCI.components = { VK_COMPONENT_SWIZZLE_R, VK_COMPONENT_SWIZZLE_G, VK_COMPONENT_SWIZZLE_B, VK_COMPONENT_SWIZZLE_A };
+		viewCI.subresourceRange = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1 };
+		result = vkCreateImageView(m_device, &viewCI, nullptr, &frame.view);
+		checkResult(result);
+
+		VkFramebufferCreateInfo fbCI{};
+		fbCI.sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO;
+		fbCI.renderPass = m_renderPass;
+		fbCI.attachmentCount = 1;
+		fbCI.pAttachments = &frame.view;
+		fbCI.width = m_extent.width;
+		fbCI.height = m_extent.height;
+		fbCI.layers = 1;
+		result = vkCreateFramebuffer(m_device, &fbCI, nullptr, &frame.framebuffer);
+		checkResult(result);
+
+		// 統計のカウンタとピクセルごとのコード（マップしたままにする）
+		// 統計を書かないシェーダーでもディスクリプタが指すので、カウンタの分だけは確保する
+		VkBufferCreateInfo bufferCI{};
+		bufferCI.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+		bufferCI.usage = VK_BUFFER_USAGE_STORAGE_BUFFER_BIT;
+		bufferCI.size = sizeof(Counters);
+		if (m_statisticsShader)
+		{
+			bufferCI.size += VkDeviceSize(sizeof(uint32_t)) * m_fullExtent.width * m_fullExtent.height;
+		}
+		result = m_allocator->createBuffer(bufferCI, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, &frame.statsBuffer, &frame.statsMemory);
+		checkResult(result);
+		frame.counters = static_cast<Counters*>(frame.statsMemory.mapped);
+		*frame.counters = Counters{};
+		frame.pending = Statistics{};
+	}
+}
+
+void ConeMarchPrepass::destroyFrames()
+{
+	for (auto& frame : m_frames)
+	{
+		m_allocator->destroyBuffer(frame.statsBuffer, frame.statsMemory);
+		vkDestroyFramebuffer(m_device, frame.framebuffer, nullptr);
+		vkDestroyImageView(m_device, frame.view, nullptr);
+		m_allocator->destroyImage(frame.image, frame.memory);
+	}
+	m_frames.clear();
+}
+
+// 書き終わったフレームのカウンタを合算して空にする
+void ConeMarchPrepass::accumulate(Frame& frame)
+{
+	if (frame.pending.frames > 0)
+	{
+		frame.pending.steps = frame.counters->steps;
+		frame.pending.prepassSteps = frame.counters->prepassSteps;
+		m_total.frames += frame.pending.frames;
+		m_total.pixels += frame.pending.pixels;
+		m_total.steps += frame.pending.steps;
+		m_total.prepassTexels += frame.pending.prepassTexels;
+		m_total.prepassSteps += frame.pending.prepassSteps;
+	}
+	frame.pending = Statistics{};
+	frame.counters->steps = 0;
+	frame.counters->prepassSteps = 0;
+}
@@ -0,0 +1,152 @@
+﻿#pragma once
+
+#include <vulkan/vulkan.h>
+
+#include <vector>
+#include <string>
+#include <stdint.h>
+
+#include "DeviceMemoryAllocator.h"
+
+// 低解像度でコーンマーチングし、タイルごとにレイを始めてよい距離を書き出す前処理パス
+// タイル（tileSize x tileSize ピクセル）を覆うコーンが表面に触れる手前までの距離を R32_SFLOAT に書き、
+// フル解像度のパスはカメラ位置ではなくそこからマーチングを始める
+// コーンは表面の手前で止まるので当たる表面は変わらないが、次のピクセルは前処理なしと色が変わりうる
+//   前処理なしではステップ数の上限に達していたレイ（始める位置が進んだ分、上限内で当たるようになる）
+//   輪郭や市松模様の境目をヒット判定の距離以内でかすめるレイ（標本化する位置が変わり、隣の表面の色になる）
+//
+// シェーダー側の決まり（各サンプルの shader.frag）
+//   CONE_PREPASS を定義してコンパイルしたものが前処理パスのフラグメントシェーダー
+//   resolution.z がタイルの大きさ（0 の場合は前処理なしで t = 0 から始める）
+//   ビューポートはフル解像度のパスと同じく上下反転する（y = 高さ、height < 0）
+//   フル解像度のパスは texelFetch(prepassDepth, ivec2(gl_FragCoord.xy / resolution.z), 0).r から始める
+//   MarchStats（ストレージバッファ、Counters と同じ並び）にステップ数を加算する
+//   heatmap が 0 以外なら、続く uint の配列（横 resolution.x の行の順）にピクセルごとの MarchHeatmap のコードを書く
+class ConeMarchPrepass
+{
+public:
+	ConeMarchPrepass();
+
+	static const uint32_t DefaultTileSize = 8;
+
+	// シェーダーの MarchStats と同じ並び
+	struct Counters
+	{
+		uint32_t enabled;		// 0 以外ならシェーダーがステップ数を加算する
+		uint32_t steps;			// フル解像度のパスのステップ数の合計
+		uint32_t prepassSteps;	// 前処理パスのステップ数の合計
+		uint32_t heatmap;		// 0 以外ならシェーダーがピクセルごとのステップ数と終了理由を書く
+	};
+
+	// 集計したステップ数
+	struct Statistics
+	{
+		uint64_t frames;
+		uint64_t pixels;
+		uint64_t steps;
+		uint64_t prepassTexels;
+		uint64_t prepassSteps;
+	};
+
+	// allocator:イメージと統計のバッファのメモリを確保する（destroy まで使う）
+	// extent:フル解像度 frameCount:同時に処理するフレーム数（フレームごとに結果と統計を持つ）
+	void create(VkDevice device, DeviceMemoryAllocator& allocator, VkExtent2D extent, uint32_t frameCount, uint32_t tileSize = DefaultTileSize);
+	void destroy();
+	// フル解像度が変わった場合にイメージと統計のバッファを作り直す（デバイスがアイドルのときに呼ぶこと）
+	// 作り直したものを参照するディスクリプタは呼び出し側で書き直す（パイプラインはそのまま使える）
+	void resize(VkExtent2D extent);
+
+	// 前処理パスのパイプラインを作成する
+	// ci:フル解像度のパスの設定（シェーダーは前処理用に差し替えておく）
+	//    ビューポート（動的ステートにして begin で設定する）・ブレンド・デプス・レンダーパスを前処理パス用に置き換える
+	// cache:パイプラインキャッシュ（VulkanAppBase::m_pipelineCache）
+	VkPipeline createPipeline(VkGraphicsPipelineCreateInfo ci, VkPipelineCache cache) const;
+
+	// フレームの最初に呼ぶ（フェンスを待った後、コマンドの記録より前）
+	// 同じ枠を使った前のフレームのステップ数を集計し、このフレームで統計を取るかをシェーダーに伝える
+	void beginFrame(uint32_t frameIndex);
+
+	// 前処理パスのレンダーパスを開始する（メインのレンダーパスの前に記録する）
+	// 無効の場合も 0 でクリアしてフル解像度のパスから読める状態にする
+	// 記録する内容は isEnabled と統計の有無で変わるので、記録したコマンドを使い回す場合は設定を変えたら記録し直すこと
+	// true を返した場合だけ、前処理用のパイプラインで全画面を描画すること
+	bool begin(VkCommandBuffer command, uint32_t frameIndex);
+	void end(VkCommandBuffer command);
+
+	// フル解像度のパスが加算したカウンタをホストから読めるようにする（メインのレンダーパスの後に呼ぶ）
+	void makeStatisticsBarrier(VkCommandBuffer command, uint32_t frameIndex);
+
+	// 前処理パスの有効・無効（既定は無効、シェーダーに渡す resolution.z は getShaderTileSize で得る）
+	// 前処理用のパイプラインが無い場合は有効にしても使わない
+	void setEnabled(bool enable) { m_enabled = enable; }
+	bool isEnabled() const { return m_enabled && m_available; }
+	float getShaderTileSize() const { return isEnabled() ? float(m_tileSize) : 0.0f; }
+
+	// 前処理用のパイプラインがあるかどうか（サンプルがパイプラインを用意したら設定する）
+	void setAvailable(bool available) { m_available = available; }
+	bool isAvailable() const { return m_available; }
+
+	// 読み込んだシェーダーが統計を書くもの（MARCH_STATS を定義してコンパイルしたもの）か（サンプルがシェーダーを用意したら設定する）
+	// false の場合はステップ数の統計もヒートマップも取れないので、統計のバッファはカウンタの分だけにする
+	// 変えた場合は統計のバッファを作り直すので、デバイスがアイドルのときに呼び、参照するディスクリプタは呼び出し側で書き直す
+	void setStatisticsShader(bool statisticsShader);
+	bool hasStatisticsShader() const { return m_statisticsShader; }
+
+	// ステップ数の統計を取るかどうか（シェーダーでアトミック加算するので計測するときだけ有効にする）
+	void setStatisticsEnabled(bool enable) { m_statisticsEnabled = enable; }
+
+	// ピクセルごとのステップ数と終了理由を書かせるかどうか（記録したコマンドを使い回す場合は記録し直すこと）
+	void setHeatmapEnabled(bool enable) { m_heatmapEnabled = enable; }
+	bool isHeatmapEnabled() const { return m_heatmapEnabled; }
+	// frameIndex の枠に書かれたピクセルごとのコード（MarchHeatmap）を読む（デバイスがアイドルのときに呼ぶこと）
+	// 統計を書くシェーダーでない場合は空にする
+	void readHeatmap(uint32_t frameIndex, std::vector<uint32_t>* codes) const;
+
+	// これまでの統計を集計して返し、カウンタを空にする（デバイスがアイドルのときに呼ぶこと）
+	Statistics collectStatistics();
+	static std::string createReport(const char* label, const Statistics& stats);
+
+	uint32_t getTileSize() const { return m_tileSize; }
+	VkExtent2D getExtent() const { return m_extent; }
+	VkRenderPass getRenderPass() const { return m_renderPass; }
+
+	// フル解像度のパスのディスクリプタ（COMBINED_IMAGE_SAMPLER と STORAGE_BUFFER）
+	VkDescriptorImageInfo getImageInfo(uint32_t frameIndex) const;
+	VkDescriptorBufferInfo getStatisticsBufferInfo(uint32_t frameIndex) const;
+
+private:
+	// 1フレーム分のリソース
+	struct Frame
+	{
+		VkImage image;
+		DeviceMemoryAllocator::Allocation memory;
+		VkImageView view;
+		VkFramebuffer framebuffer;
+
+		// 統計（ホストから見えるメモリに置き、フェンスを待った後に読む）
+		VkBuffer statsBuffer;
+		DeviceMemoryAllocator::Allocation statsMemory;
+		Counters* counters;
+		Statistics pending;		// 描画中のフレームの分（カウンタを読んだときに合算する）
+	};
+
+	void createFrames(VkExtent2D extent, uint32_t frameCount);
+	void destroyFrames();
+	void accumulate(Frame& frame);
+
+	VkDevice m_device;
+	DeviceMemoryAllocator* m_allocator;
+	VkExtent2D m_fullExtent;
+	VkExtent2D m_extent;
+	uint32_t m_tileSize;
+	bool m_enabled;
+	bool m_available;
+	bool m_statisticsShader;
+	bool m_statisticsEnabled;
+	bool m_heatmapEnabled;
+
+	VkRenderPass m_renderPass;
+	VkSampler m_sampler;
+	std::vector<Frame> m_frames;
+	Statistics m_total;
+};
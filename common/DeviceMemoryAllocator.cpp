@@ -0,0 +1,379 @@
+﻿#include "DeviceMemoryAllocator.h"
+#include "VulkanAppBase.h"
+
+#include <sstream>
+#include <algorithm>
+
+using namespace std;
+
+namespace
+{
+	VkDeviceSize alignUp(VkDeviceSize value, VkDeviceSize alignment)
+	{
+		return (alignment > 1) ? (value + alignment - 1) / alignment * alignment : value;
+	}
+}
+
+
+// public ===================================================================
+
+DeviceMemoryAllocator::DeviceMemoryAllocator()
+	:m_device(VK_NULL_HANDLE)
+	,m_memProps{}
+	,m_blockSize(DefaultBlockSize)
+	,m_totalDeviceAllocations(0)
+{
+}
+
+void DeviceMemoryAllocator::create(VkDevice device, VkPhysicalDevice physDev, VkDeviceSize blockSize)
+{
+	m_device = device;
+	vkGetPhysicalDeviceMemoryProperties(physDev, &m_memProps);
+	m_blockSize = blockSize;
+	m_blocks.clear();
+	m_totalDeviceAllocations = 0;
+}
+
+void DeviceMemoryAllocator::destroy()
+{
+	// 解放し忘れた領域
+	for (size_t i = 0; i < m_blocks.size(); ++i)
+	{
+		const auto& block = m_blocks[i];
+		if (block.memory != VK_NULL_HANDLE && block.allocations > 0)
+		{
+			stringstream ss;
+			ss << "[DeviceMemoryAllocator] leak: block " << i << " (memory type " << block.memoryTypeIndex << ") has "
+				<< block.allocations << " allocations, " << block.usedBytes << " bytes" << endl;
+			OutputDebugStringA(ss.str().c_str());
+		}
+	}
+
+	for (auto& block : m_blocks)
+	{
+		destroyBlock(block);
+	}
+	m_blocks.clear();
+}
+
+bool DeviceMemoryAllocator::allocate(const VkMemoryRequirements& reqs, VkMemoryPropertyFlags props, bool optimalImage, Strategy strategy, Allocation* allocation)
+{
+	allocation->memory = VK_NULL_HANDLE;
+	allocation->mapped = nullptr;
+
+	uint32_t memoryTypeIndex = getMemoryTypeIndex(reqs.memoryTypeBits, props);
+	if (memoryTypeIndex == UINT32_MAX)
+	{
+		OutputDebugStringA("[DeviceMemoryAllocator] no memory type matches.\n");
+		return false;
+	}
+
+	// ヒープが小さいデバイスでは1ブロックでヒープを使い切らないようにする
+	const auto& heap = m_memProps.memoryHeaps[m_memProps.memoryTypes[memoryTypeIndex].heapIndex];
+	const VkDeviceSize blockSize = (std::max)((std::min)(m_blockSize, heap.size / 4), VkDeviceSize(1));
+
+	uint32_t blockIndex = UINT32_MAX;
+	VkDeviceSize offset = 0;
+	const bool dedicated = reqs.size > blockSize / 2;
+	if (!dedicated)
+	{
+		for (uint32_t i = 0; i < uint32_t(m_blocks.size()); i++)
+		{
+			auto& block = m_blocks[i];
+			if (block.memory != VK_NULL_HANDLE && !block.dedicated && block.memoryTypeIndex == memoryTypeIndex &&
+				block.optimalImage == optimalImage && block.strategy == strategy &&
+				allocateFromBlock(block, reqs.size, reqs.alignment, &offset))
+			{
+				blockIndex = i;
+				break;
+			}
+		}
+	}
+	if (blockIndex == UINT32_MAX)
+	{
+		// 大きいものは専用のブロックにする
+		blockIndex = createBlock(memoryTypeIndex, dedicated ? reqs.size : blockSize, optimalImage, dedicated, strategy);
+		if (blockIndex == UINT32_MAX || !allocateFromBlock(m_blocks[blockIndex], reqs.size, reqs.alignment, &offset))
+		{
+			return false;
+		}
+	}
+
+	auto& block = m_blocks[blockIndex];
+	block.allocations++;
+	block.usedBytes += reqs.size;
+
+	allocation->memory = block.memory;
+	allocation->offset = offset;
+	allocation->size = reqs.size;
+	allocation->mapped = block.mapped ? block.mapped + offset : nullptr;
+	allocation->block = blockIndex;
+	return true;
+}
+
+void DeviceMemoryAllocator::free(Allocation& allocation)
+{
+	if (allocation.memory == VK_NULL_HANDLE || allocation.block >= m_blocks.size())
+	{
+		return;
+	}
+	auto& block = m_blocks[allocation.block];
+	block.allocations--;
+	block.usedBytes -= allocation.size;
+
+	if (block.dedicated)
+	{
+		destroyBlock(block);
+	}
+	else if (block.strategy == StrategyLinear)
+	{
+		// 積んだものがすべて解放されたら先頭に戻る
+		if (block.allocations == 0)
+		{
+			block.top = 0;
+		}
+	}
+	else
+	{
+		// offset の順に挿入し、前後の空き領域と結合する
+		auto& regions = block.freeRegions;
+		Region region = { allocation.offset, allocation.size };
+		auto it = lower_bound(regions.begin(), regions.end(), region, [](const Region& a, const Region& b) { return a.offset < b.offset; });
+		it = regions.insert(it, region);
+		auto next = it + 1;
+		if (next != regions.end() && it->offset + it->size == next->offset)
+		{
+			it->size += next->size;
+			regions.erase(next);
+		}
+		if (it != regions.begin())
+		{
+			auto prev = it - 1;
+			if (prev->offset + prev->size == it->offset)
+			{
+				prev->size += it->size;
+				regions.erase(it);
+			}
+		}
+	}
+
+	allocation.memory = VK_NULL_HANDLE;
+	allocation.mapped = nullptr;
+}
+
+VkResult DeviceMemoryAllocator::createBuffer(const VkBufferCreateInfo& ci, VkMemoryPropertyFlags props, VkBuffer* buffer, Allocation* allocation, Strategy strategy)
+{
+	auto result = vkCreateBuffer(m_device, &ci, nullptr, buffer);
+	if (result != VK_SUCCESS)
+	{
+		return result;
+	}
+
+	VkMemoryRequirements reqs;
+	vkGetBufferMemoryRequirements(m_device, *buffer, &reqs);
+	if (!allocate(reqs, props, false, strategy, allocation))
+	{
+		vkDestroyBuffer(m_device, *buffer, nullptr);
+		*buffer = VK_NULL_HANDLE;
+		return VK_ERROR_OUT_OF_DEVICE_MEMORY;
+	}
+	return vkBindBufferMemory(m_device, *buffer, allocation->memory, allocation->offset);
+}
+
+VkResult DeviceMemoryAllocator::createImage(const VkImageCreateInfo& ci, VkMemoryPropertyFlags props, VkImage* image, Allocation* allocation)
+{
+	auto result = vkCreateImage(m_device, &ci, nullptr, image);
+	if (result != VK_SUCCESS)
+	{
+		return result;
+	}
+
+	VkMemoryRequirements reqs;
+	vkGetImageMemoryRequirements(m_device, *image, &reqs);
+	if (!allocate(reqs, props, ci.tiling == VK_IMAGE_TILING_OPTIMAL, StrategyFreeList, allocation))
+	{
+		vkDestroyImage(m_device, *image, nullptr);
+		*image = VK_NULL_HANDLE;
+		return VK_ERROR_OUT_OF_DEVICE_MEMORY;
+	}
+	return vkBindImageMemory(m_device, *image, allocation->memory, allocation->offset);
+}
+
+void DeviceMemoryAllocator::destroyBuffer(VkBuffer buffer, Allocation& allocation)
+{
+	vkDestroyBuffer(m_device, buffer, nullptr);
+	free(allocation);
+}
+
+void DeviceMemoryAllocator::destroyImage(VkImage image, Allocation& allocation)
+{
+	vkDestroyImage(m_device, image, nullptr);
+	free(allocation);
+}
+
+uint32_t DeviceMemoryAllocator::getMemoryTypeIndex(uint32_t requestBits, VkMemoryPropertyFlags requestProps) const
+{
+	for (uint32_t i = 0; i < m_memProps.memoryTypeCount; ++i)
+	{
+		if ((requestBits & (1u << i)) && (m_memProps.memoryTypes[i].propertyFlags & requestProps) == requestProps)
+		{
+			return i;
+		}
+	}
+	return UINT32_MAX;
+}
+
+DeviceMemoryAllocator::Statistics DeviceMemoryAllocator::getStatistics() const
+{
+	Statistics stats{};
+	for (const auto& block : m_blocks)
+	{
+		if (block.memory == VK_NULL_HANDLE)
+		{
+			continue;
+		}
+		stats.blocks++;
+		stats.dedicatedBlocks += block.dedicated ? 1 : 0;
+		stats.allocations += block.allocations;
+		stats.blockBytes += block.size;
+		stats.usedBytes += block.usedBytes;
+		if (!block.dedicated && block.strategy == StrategyFreeList)
+		{
+			VkDeviceSize largest = 0;
+			for (const auto& region : block.freeRegions)
+			{
+				stats.freeRegions++;
+				stats.freeBytes += region.size;
+				largest = (std::max)(largest, region.size);
+			}
+			stats.largestFreeBytes += largest;
+		}
+	}
+	stats.totalDeviceAllocations = m_totalDeviceAllocations;
+	return stats;
+}
+
+string DeviceMemoryAllocator::createReport() const
+{
+	auto stats = getStatistics();
+	const double MiB = 1024.0 * 1024.0;
+	double fragmentation = (stats.freeBytes > 0) ? 1.0 - double(stats.largestFreeBytes) / double(stats.freeBytes) : 0.0;
+
+	stringstream ss;
+	ss << "[DeviceMemoryAllocator] blocks " << stats.blocks << " (dedicated " << stats.dedicatedBlocks << ")"
+		<< ", allocations " << stats.allocations
+		<< ", used " << double(stats.usedBytes) / MiB << " / " << double(stats.blockBytes) / MiB << " MiB"
+		<< ", free regions " << stats.freeRegions << " (fragmentation " << int(fragmentation * 100.0 + 0.5) << "%)"
+		<< ", vkAllocateMemory " << stats.totalDeviceAllocations << " times" << endl;
+	return ss.str();
+}
+
+
+// private ==================================================================
+
+bool DeviceMemoryAllocator::allocateFromBlock(Block& block, VkDeviceSize size, VkDeviceSize alignment, VkDeviceSize* offset)
+{
+	if (block.dedicated)
+	{
+		// 専用のブロックは1つしか置かない
+		if (block.allocations > 0 || size > block.size)
+		{
+			return false;
+		}
+		*offset = 0;
+		return true;
+	}
+
+	if (block.strategy == StrategyLinear)
+	{
+		VkDeviceSize aligned = alignUp(block.top, alignment);
+		if (aligned + size > block.size)
+		{
+			return false;
+		}
+		block.top = aligned + size;
+		*offset = aligned;
+		return true;
+	}
+
+	// 最初に入る空き領域から取り、前後の余りは空き領域として残す
+	auto& regions = block.freeRegions;
+	for (size_t i = 0; i < regions.size(); ++i)
+	{
+		Region region = regions[i];
+		VkDeviceSize aligned = alignUp(region.offset, alignment);
+		if (aligned + size > region.offset + region.size)
+		{
+			continue;
+		}
+		regions.erase(regions.begin() + i);
+		VkDeviceSize tail = region.offset + region.size - (aligned + size);
+		if (tail > 0)
+		{
+			regions.insert(regions.begin() + i, Region{ aligned + size, tail });
+		}
+		if (aligned > region.offset)
+		{
+			regions.insert(regions.begin() + i, Region{ region.offset, aligned - region.offset });
+		}
+		*offset = aligned;
+		return true;
+	}
+	return false;
+}
+
+uint32_t DeviceMemoryAllocator::createBlock(uint32_t memoryTypeIndex, VkDeviceSize size, bool optimalImage, bool dedicated, Strategy strategy)
+{
+	VkMemoryAllocateInfo ai{};
+	ai.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+	ai.allocationSize = size;
+	ai.memoryTypeIndex = memoryTypeIndex;
+
+	Block block{};
+	auto result = vkAllocateMemory(m_device, &ai, nullptr, &block.memory);
+	if (result != VK_SUCCESS)
+	{
+		OutputDebugStringA("[DeviceMemoryAllocator] vkAllocateMemory failed.\n");
+		return UINT32_MAX;
+	}
+	m_totalDeviceAllocations++;
+
+	block.size = size;
+	block.memoryTypeIndex = memoryTypeIndex;
+	block.optimalImage = optimalImage;
+	block.dedicated = dedicated;
+	block.strategy = strategy;
+	block.freeRegions.push_back({ 0, size });
+	if (m_memProps.memoryTypes[memoryTypeIndex].propertyFlags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT)
+	{
+		void* p = nullptr;
+		vkMapMemory(m_device, block.memory, 0, VK_WHOLE_SIZE, 0, &p);
+		block.mapped = static_cast<uint8_t*>(p);
+	}
+
+	// 解放済みの番号があれば使い回す
+	for (uint32_t i = 0; i < uint32_t(m_blocks.size()); i++)
+	{
+		if (m_blocks[i].memory == VK_NULL_HANDLE)
+		{
+			m_blocks[i] = block;
+			return i;
+		}
+	}
+	m_blocks.push_back(block);
+	return uint32_t(m_blocks.size() - 1);
+}
+
+void DeviceMemoryAllocator::destroyBlock(Block& block)
+{
+	if (block.memory == VK_NULL_HANDLE)
+	{
+		return;
+	}
+	if (block.mapped)
+	{
+		vkUnmapMemory(m_device, block.memory);
+	}
+	vkFreeMemory(m_device, block.memory, nullptr);
+	block = Block{};
+}
@@ -0,0 +1,113 @@
+﻿#pragma once
+
+#include <vulkan/vulkan.h>
+
+#include <vector>
+#include <string>
+#include <stdint.h>
+
+// デバイスメモリをメモリタイプごとの大きなブロックで確保し、バッファやイメージに切り分けて渡す
+// vkAllocateMemory の回数（とドライバーの上限 maxMemoryAllocationCount）がリソースの数に比例しないようにする
+//
+// ブロックは使い方（Strategy）とリソースの種類（バッファ・リニアのイメージか最適タイリングのイメージか）ごとに分け、
+// bufferImageGranularity を気にせず同じブロックに並べられるようにする
+// blockSize の半分を超える大きさは専用のブロックで確保し、解放したらすぐに返す
+// ホストから見えるメモリのブロックは確保したときに1度だけマップし、Allocation::mapped で各領域を指す
+// （HOST_COHERENT と組み合わせて使うこと。ブロックをマップし直すので領域ごとに vkMapMemory しないこと）
+//
+// スレッドセーフではない（確保・解放はメインスレッドから行う）
+class DeviceMemoryAllocator
+{
+public:
+	DeviceMemoryAllocator();
+
+	static const VkDeviceSize DefaultBlockSize = 64 * 1024 * 1024;
+
+	enum Strategy
+	{
+		StrategyFreeList,	// 空き領域のリストから確保し、解放した領域は隣と結合する（長く使うリソース）
+		StrategyLinear,		// ブロックの末尾に積むだけで、ブロック内をすべて解放したら先頭に戻る（ステージングなどすぐ解放するもの）
+	};
+
+	// 確保した領域
+	struct Allocation
+	{
+		VkDeviceMemory memory;
+		VkDeviceSize offset;
+		VkDeviceSize size;
+		void* mapped;		// ホストから見えるメモリならこの領域の先頭のアドレス（それ以外は nullptr）
+		uint32_t block;		// 確保したブロック（解放に使う）
+	};
+
+	// 今の使用状況
+	struct Statistics
+	{
+		uint32_t blocks;				// 今あるブロック（vkAllocateMemory した数）
+		uint32_t dedicatedBlocks;		// そのうち専用に確保したもの
+		uint32_t allocations;			// 確保中の領域の数
+		VkDeviceSize blockBytes;
+		VkDeviceSize usedBytes;
+		uint32_t freeRegions;			// StrategyFreeList のブロックの空き領域の数
+		VkDeviceSize freeBytes;			// その合計
+		VkDeviceSize largestFreeBytes;	// ブロックごとの最大の空き領域の合計（断片化の目安）
+		uint64_t totalDeviceAllocations;	// これまでに vkAllocateMemory した回数
+	};
+
+	// blockSize:1ブロックの大きさ（デバイスのヒープより大きい場合はヒープの 1/4 にする）
+	void create(VkDevice device, VkPhysicalDevice physDev, VkDeviceSize blockSize = DefaultBlockSize);
+	// 解放し忘れた領域があれば出力してから、すべてのブロックを解放する
+	void destroy();
+
+	// reqs を満たす領域を確保する（メモリタイプが無いか、デバイスメモリが足りない場合は false）
+	// optimalImage:最適タイリングのイメージに使う場合は true
+	bool allocate(const VkMemoryRequirements& reqs, VkMemoryPropertyFlags props, bool optimalImage, Strategy strategy, Allocation* allocation);
+	void free(Allocation& allocation);
+
+	// バッファ・イメージを作成し、確保した領域をバインドする
+	VkResult createBuffer(const VkBufferCreateInfo& ci, VkMemoryPropertyFlags props, VkBuffer* buffer, Allocation* allocation, Strategy strategy = StrategyFreeList);
+	VkResult createImage(const VkImageCreateInfo& ci, VkMemoryPropertyFlags props, VkImage* image, Allocation* allocation);
+	void destroyBuffer(VkBuffer buffer, Allocation& allocation);
+	void destroyImage(VkImage image, Allocation& allocation);
+
+	// 条件に合うメモリタイプ（無ければ UINT32_MAX）
+	uint32_t getMemoryTypeIndex(uint32_t requestBits, VkMemoryPropertyFlags requestProps) const;
+
+	Statistics getStatistics() const;
+	// 使用状況と断片化の度合い（空き領域のうち最大のものに入らない割合）
+	std::string createReport() const;
+
+private:
+	// 空き領域
+	struct Region
+	{
+		VkDeviceSize offset;
+		VkDeviceSize size;
+	};
+
+	struct Block
+	{
+		VkDeviceMemory memory;			// VK_NULL_HANDLE なら解放済み（次のブロックで使い回す）
+		VkDeviceSize size;
+		uint32_t memoryTypeIndex;
+		bool optimalImage;
+		bool dedicated;
+		Strategy strategy;
+		uint8_t* mapped;
+		std::vector<Region> freeRegions;	// StrategyFreeList のとき、offset の順
+		VkDeviceSize top;					// StrategyLinear のとき、次に積む位置
+		uint32_t allocations;
+		VkDeviceSize usedBytes;
+	};
+
+	// block から確保できれば offset を返す
+	static bool allocateFromBlock(Block& block, VkDeviceSize size, VkDeviceSize alignment, VkDeviceSize* offset);
+	// 新しいブロックを確保して番号を返す（失敗した場合は UINT32_MAX）
+	uint32_t createBlock(uint32_t memoryTypeIndex, VkDeviceSize size, bool optimalImage, bool dedicated, Strategy strategy);
+	void destroyBlock(Block& block);
+
+	VkDevice m_device;
+	VkPhysicalDeviceMemoryProperties m_memProps;
+	VkDeviceSize m_blockSize;
+	std::vector<Block> m_blocks;
+	uint64_t m_totalDeviceAllocations;
+};
@@ -0,0 +1,134 @@
+﻿#include "ExtensionSet.h"
+#include "VulkanAppBase.h"
+
+#include <sstream>
+#include <iomanip>
+#include <cstring>
+
+using namespace std;
+
+
+// public ===================================================================
+
+ExtensionSet::ExtensionSet()
+	: m_availableCount(0)
+{
+}
+
+void ExtensionSet::require(const char* name, const char* module)
+{
+	add(name, module, true);
+}
+
+void ExtensionSet::request(const char* name, const char* module)
+{
+	add(name, module, false);
+}
+
+void ExtensionSet::clear()
+{
+	m_entries.clear();
+	m_enabled.clear();
+	m_availableCount = 0;
+}
+
+bool ExtensionSet::resolve(const vector<VkExtensionProperties>& available)
+{
+	m_enabled.clear();
+	m_availableCount = available.size();
+
+	bool satisfied = true;
+	for (auto& entry : m_entries)
+	{
+		entry.available = false;
+		for (const auto& v : available)
+		{
+			if (entry.name == v.extensionName)
+			{
+				entry.available = true;
+				break;
+			}
+		}
+		if (entry.available)
+		{
+			m_enabled.push_back(entry.name.c_str());
+		}
+		satisfied &= entry.available || !entry.required;
+	}
+	return satisfied;
+}
+
+bool ExtensionSet::isEnabled(const char* name) const
+{
+	for (auto v : m_enabled)
+	{
+		if (strcmp(v, name) == 0)
+		{
+			return true;
+		}
+	}
+	return false;
+}
+
+vector<const char*> ExtensionSet::getRequiredNames() const
+{
+	vector<const char*> names;
+	for (const auto& entry : m_entries)
+	{
+		if (entry.required)
+		{
+			names.push_back(entry.name.c_str());
+		}
+	}
+	return names;
+}
+
+string ExtensionSet::createReport(const char* label, double createMs) const
+{
+	stringstream ss;
+	ss << fixed << setprecision(3);
+	ss << "[ExtensionSet] " << label << ": " << m_enabled.size() << " of " << m_availableCount
+		<< " available extensions enabled, created in " << createMs << " ms" << endl;
+	for (const auto& entry : m_entries)
+	{
+		ss << "[ExtensionSet]   " << (entry.available ? "+ " : "- ") << entry.name
+			<< " (" << (entry.required ? "required" : "optional") << ", " << entry.modules << ")"
+			<< (entry.available ? "" : " not available") << endl;
+	}
+	return ss.str();
+}
+
+vector<VkExtensionProperties> ExtensionSet::enumerateInstance()
+{
+	uint32_t count = 0;
+	vkEnumerateInstanceExtensionProperties(nullptr, &count, nullptr);
+	vector<VkExtensionProperties> props(count);
+	vkEnumerateInstanceExtensionProperties(nullptr, &count, props.data());
+	return props;
+}
+
+vector<VkExtensionProperties> ExtensionSet::enumerateDevice(VkPhysicalDevice physDev)
+{
+	uint32_t count = 0;
+	vkEnumerateDeviceExtensionProperties(physDev, nullptr, &count, nullptr);
+	vector<VkExtensionProperties> props(count);
+	vkEnumerateDeviceExtensionProperties(physDev, nullptr, &count, props.data());
+	return props;
+}
+
+
+// private ==================================================================
+
+void ExtensionSet::add(const char* name, const char* module, bool required)
+{
+	for (auto& entry : m_entries)
+	{
+		if (entry.name == name)
+		{
+			entry.modules += string(", ") + module;
+			entry.required |= required;
+			return;
+		}
+	}
+	m_entries.push_back({ name, module, required, false });
+}
@@ -0,0 +1,54 @@
+﻿#pragma once
+
+#include <vulkan/vulkan.h>
+
+#include <vector>
+#include <string>
+#include <stdint.h>
+
+// インスタンスかデバイスで有効にする拡張の一覧
+// 使う機能（モジュール）ごとに必須・任意の拡張を登録し、ドライバーが対応しているものだけを有効にする
+// 使わない拡張まで有効にすると、作成に時間がかかったりドライバーやレイヤーが余計な追跡をしたりするので、
+// 登録したもの以外は有効にしない
+class ExtensionSet
+{
+public:
+	ExtensionSet();
+
+	// 必須の拡張（対応していなければ resolve が false を返す）
+	// module:使う機能の名前（レポート用）
+	void require(const char* name, const char* module);
+	// 任意の拡張（対応していれば有効にする、isEnabled で確認してから使う）
+	void request(const char* name, const char* module);
+	void clear();
+
+	// 対応している拡張と照らし合わせて有効にするものを決める（登録はこれより前に済ませること）
+	bool resolve(const std::vector<VkExtensionProperties>& available);
+
+	bool isEnabled(const char* name) const;
+	// 有効にする拡張の名前（VkInstanceCreateInfo / VkDeviceCreateInfo にそのまま渡す）
+	const std::vector<const char*>& getEnabledNames() const { return m_enabled; }
+	// 必須の拡張の名前（物理デバイスの選択に使う）
+	std::vector<const char*> getRequiredNames() const;
+
+	// label:instance / device createMs:作成にかかった時間
+	std::string createReport(const char* label, double createMs) const;
+
+	static std::vector<VkExtensionProperties> enumerateInstance();
+	static std::vector<VkExtensionProperties> enumerateDevice(VkPhysicalDevice physDev);
+
+private:
+	struct Entry
+	{
+		std::string name;
+		std::string modules;	// 同じ拡張を複数の機能が登録した場合はカンマで区切る
+		bool required;
+		bool available;
+	};
+
+	void add(const char* name, const char* module, bool required);
+
+	std::vector<Entry> m_entries;
+	std::vector<const char*> m_enabled;
+	size_t m_availableCount;
+};
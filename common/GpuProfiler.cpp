@@ -0,0 +1,404 @@
+﻿#include "GpuProfiler.h"
+#include "VulkanAppBase.h"
+
+#include <sstream>
+#include <iomanip>
+#include <algorithm>
+
+using namespace std;
+
+namespace
+{
+	// 結果チェック（VulkanAppBase::checkResult と同じ）
+	void checkResult(VkResult result)
+	{
+		if (result != VK_SUCCESS)
+		{
+			DebugBreak();
+		}
+	}
+}
+
+
+// public ===================================================================
+
+GpuProfiler::GpuProfiler()
+	: m_device(VK_NULL_HANDLE)
+	, m_timestampPeriod(1.0)
+	, m_timestampMask(~0ull)
+	, m_pipelineStatistics(false)
+	, m_historySize(DefaultHistorySize)
+	, m_frameNext(0)
+{
+}
+
+// queueFamilyIndex のキューでタイムスタンプを書けるか
+bool GpuProfiler::isSupported(VkPhysicalDevice physDev, uint32_t queueFamilyIndex)
+{
+	uint32_t count = 0;
+	vkGetPhysicalDeviceQueueFamilyProperties(physDev, &count, nullptr);
+	vector<VkQueueFamilyProperties> props(count);
+	vkGetPhysicalDeviceQueueFamilyProperties(physDev, &count, props.data());
+	return queueFamilyIndex < count && props[queueFamilyIndex].timestampValidBits > 0;
+}
+
+void GpuProfiler::create(VkDevice device, VkPhysicalDevice physDev, uint32_t queueFamilyIndex, uint32_t frameCount, bool pipelineStatistics)
+{
+	if (!isSupported(physDev, queueFamilyIndex))
+	{
+		OutputDebugStringA("[GpuProfiler] timestamps are not supported on this queue\n");
+		return;
+	}
+
+	m_device = device;
+	m_pipelineStatistics = pipelineStatistics;
+
+	VkPhysicalDeviceProperties physProps;
+	vkGetPhysicalDeviceProperties(physDev, &physProps);
+	m_timestampPeriod = physProps.limits.timestampPeriod;
+
+	uint32_t count = 0;
+	vkGetPhysicalDeviceQueueFamilyProperties(physDev, &count, nullptr);
+	vector<VkQueueFamilyProperties> props(count);
+	vkGetPhysicalDeviceQueueFamilyProperties(physDev, &count, props.data());
+	uint32_t validBits = props[queueFamilyIndex].timestampValidBits;
+	m_timestampMask = (validBits >= 64) ? ~0ull : ((1ull << validBits) - 1);
+
+	m_frames.resize(frameCount);
+	for (auto& frame : m_frames)
+	{
+		VkQueryPoolCreateInfo ci{};
+		ci.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+		ci.queryType = VK_QUERY_TYPE_TIMESTAMP;
+		ci.queryCount = MaxSections * 2;
+		auto result = vkCreateQueryPool(m_device, &ci, nullptr, &frame.timestampPool);
+		checkResult(result);
+
+		frame.statisticsPool = VK_NULL_HANDLE;
+		if (m_pipelineStatistics)
+		{
+			ci.queryType = VK_QUERY_TYPE_PIPELINE_STATISTICS;
+			ci.queryCount = MaxSections;
+			ci.pipelineStatistics = StatisticFlags;
+			result = vkCreateQueryPool(m_device, &ci, nullptr, &frame.statisticsPool);
+			checkResult(result);
+		}
+
+		frame.inSection = false;
+		frame.submitted = false;
+	}
+}
+
+void GpuProfiler::destroy()
+{
+	for (auto& frame : m_frames)
+	{
+		vkDestroyQueryPool(m_device, frame.timestampPool, nullptr);
+		if (frame.statisticsPool != VK_NULL_HANDLE)
+		{
+			vkDestroyQueryPool(m_device, frame.statisticsPool, nullptr);
+		}
+	}
+	m_frames.clear();
+	m_sections.clear();
+}
+
+void GpuProfiler::beginFrame(uint32_t frameIndex)
+{
+	if (!isEnabled())
+	{
+		return;
+	}
+
+	// フェンスを待った後なので、同じ枠を使った前のフレームのクエリは書き終わっている
+	readResults(m_frames[frameIndex]);
+}
+
+void GpuProfiler::endFrame(uint32_t frameIndex)
+{
+	if (!isEnabled())
+	{
+		return;
+	}
+	m_frames[frameIndex].submitted = true;
+}
+
+void GpuProfiler::reset(VkCommandBuffer command, uint32_t frameIndex)
+{
+	if (!isEnabled())
+	{
+		return;
+	}
+
+	auto& frame = m_frames[frameIndex];
+	vkCmdResetQueryPool(command, frame.timestampPool, 0, MaxSections * 2);
+	if (frame.statisticsPool != VK_NULL_HANDLE)
+	{
+		vkCmdResetQueryPool(command, frame.statisticsPool, 0, MaxSections);
+	}
+
+	// 区間は記録し直す（使い回す場合は前に記録したときと同じ区間になる）
+	frame.sections.clear();
+	frame.inSection = false;
+}
+
+void GpuProfiler::beginSection(VkCommandBuffer command, uint32_t frameIndex, const char* name)
+{
+	if (!isEnabled())
+	{
+		return;
+	}
+
+	auto& frame = m_frames[frameIndex];
+	if (frame.inSection || frame.sections.size() >= MaxSections)
+	{
+		// 入れ子、または区間が多すぎる
+		DebugBreak();
+		return;
+	}
+
+	uint32_t query = uint32_t(frame.sections.size());
+	frame.sections.push_back(findSection(name));
+	frame.inSection = true;
+
+	vkCmdWriteTimestamp(command, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, frame.timestampPool, query * 2);
+	if (frame.statisticsPool != VK_NULL_HANDLE)
+	{
+		vkCmdBeginQuery(command, frame.statisticsPool, query, 0);
+	}
+}
+
+void GpuProfiler::endSection(VkCommandBuffer command, uint32_t frameIndex)
+{
+	if (!isEnabled())
+	{
+		return;
+	}
+
+	auto& frame = m_frames[frameIndex];
+	if (!frame.inSection)
+	{
+		DebugBreak();
+		return;
+	}
+
+	uint32_t query = uint32_t(frame.sections.size()) - 1;
+	frame.inSection = false;
+
+	if (frame.statisticsPool != VK_NULL_HANDLE)
+	{
+		vkCmdEndQuery(command, frame.statisticsPool, query);
+	}
+	// 区間内のすべての処理が終わった時刻
+	vkCmdWriteTimestamp(command, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, frame.timestampPool, query * 2 + 1);
+}
+
+// 描画中だったフレームの結果もすべて集計する
+void GpuProfiler::flush()
+{
+	for (auto& frame : m_frames)
+	{
+		readResults(frame);
+	}
+}
+
+vector<GpuProfiler::SectionStatistics> GpuProfiler::getStatistics() const
+{
+	vector<SectionStatistics> result;
+	for (const auto& section : m_sections)
+	{
+		SectionStatistics stats{};
+		stats.name = section.name;
+		summarize(section.times, &stats);
+
+		stats.hasPipelineStatistics = section.statisticsFrames > 0;
+		if (stats.hasPipelineStatistics)
+		{
+			double frames = double(section.statisticsFrames);
+			stats.vertexInvocations = double(section.statistics.vertexInvocations) / frames;
+			stats.clippingPrimitives = double(section.statistics.clippingPrimitives) / frames;
+			stats.fragmentInvocations = double(section.statistics.fragmentInvocations) / frames;
+			stats.computeInvocations = double(section.statistics.computeInvocations) / frames;
+		}
+		result.push_back(stats);
+	}
+	return result;
+}
+
+GpuProfiler::SectionStatistics GpuProfiler::getFrameStatistics() const
+{
+	SectionStatistics stats{};
+	stats.name = "frame";
+	summarize(m_frameTimes, &stats);
+	return stats;
+}
+
+void GpuProfiler::clearStatistics()
+{
+	// 区間の添字は記録済みのコマンドの分が残っているので、名前は消さずに履歴だけ空にする
+	for (auto& section : m_sections)
+	{
+		section.times.clear();
+		section.next = 0;
+		section.statisticsFrames = 0;
+		section.statistics = PipelineStatistics{};
+	}
+	m_frameTimes.clear();
+	m_frameNext = 0;
+}
+
+void GpuProfiler::setHistorySize(uint32_t size)
+{
+	m_historySize = (std::max)(size, 1u);
+	clearStatistics();
+}
+
+string GpuProfiler::createReport() const
+{
+	stringstream ss;
+	ss << fixed << setprecision(3);
+	if (!isEnabled())
+	{
+		ss << "[GpuProfiler] disabled" << endl;
+		return ss.str();
+	}
+
+	auto sections = getStatistics();
+	if (!sections.empty())
+	{
+		sections.insert(sections.begin(), getFrameStatistics());
+	}
+	for (const auto& stats : sections)
+	{
+		ss << "[GpuProfiler] " << stats.name << ": frames " << stats.frames;
+		if (stats.frames == 0)
+		{
+			ss << " (no samples)" << endl;
+			continue;
+		}
+		ss << ", min " << stats.minMs << " ms, avg " << stats.avgMs << " ms, p99 " << stats.p99Ms << " ms";
+		if (stats.hasPipelineStatistics)
+		{
+			ss << setprecision(0)
+				<< ", vs " << stats.vertexInvocations
+				<< ", prims " << stats.clippingPrimitives
+				<< ", fs " << stats.fragmentInvocations
+				<< ", cs " << stats.computeInvocations
+				<< setprecision(3);
+		}
+		ss << endl;
+	}
+	return ss.str();
+}
+
+
+// private ==================================================================
+
+uint32_t GpuProfiler::findSection(const char* name)
+{
+	for (uint32_t i = 0; i < uint32_t(m_sections.size()); ++i)
+	{
+		if (m_sections[i].name == name)
+		{
+			return i;
+		}
+	}
+
+	Section section{};
+	section.name = name;
+	m_sections.push_back(section);
+	return uint32_t(m_sections.size()) - 1;
+}
+
+void GpuProfiler::readResults(Frame& frame)
+{
+	if (!frame.submitted)
+	{
+		return;
+	}
+	frame.submitted = false;
+
+	uint32_t count = uint32_t(frame.sections.size());
+	if (count == 0)
+	{
+		return;
+	}
+
+	// WAIT を付けないので、万一書き終わっていなければ VK_NOT_READY が返り、このフレームは捨てる
+	uint64_t timestamps[MaxSections * 2];
+	auto result = vkGetQueryPoolResults(m_device, frame.timestampPool, 0, count * 2,
+		sizeof(uint64_t) * count * 2, timestamps, sizeof(uint64_t), VK_QUERY_RESULT_64_BIT);
+	if (result != VK_SUCCESS)
+	{
+		return;
+	}
+
+	PipelineStatistics statistics[MaxSections];
+	bool hasStatistics = false;
+	if (frame.statisticsPool != VK_NULL_HANDLE)
+	{
+		result = vkGetQueryPoolResults(m_device, frame.statisticsPool, 0, count,
+			sizeof(PipelineStatistics) * count, statistics, sizeof(PipelineStatistics), VK_QUERY_RESULT_64_BIT);
+		hasStatistics = (result == VK_SUCCESS);
+	}
+
+	for (uint32_t i = 0; i < count; ++i)
+	{
+		auto& section = m_sections[frame.sections[i]];
+
+		uint64_t ticks = (timestamps[i * 2 + 1] - timestamps[i * 2]) & m_timestampMask;
+		pushTime(section.times, section.next, double(ticks) * m_timestampPeriod / 1000000.0);
+
+		if (hasStatistics)
+		{
+			section.statisticsFrames++;
+			section.statistics.vertexInvocations += statistics[i].vertexInvocations;
+			section.statistics.clippingPrimitives += statistics[i].clippingPrimitives;
+			section.statistics.fragmentInvocations += statistics[i].fragmentInvocations;
+			section.statistics.computeInvocations += statistics[i].computeInvocations;
+		}
+	}
+
+	// フレーム全体（区間の間の処理も含む）
+	uint64_t ticks = (timestamps[count * 2 - 1] - timestamps[0]) & m_timestampMask;
+	pushTime(m_frameTimes, m_frameNext, double(ticks) * m_timestampPeriod / 1000000.0);
+}
+
+// 直近 m_historySize 個を残すリングバッファに追加する
+void GpuProfiler::pushTime(vector<double>& times, uint32_t& next, double ms) const
+{
+	if (times.size() < m_historySize)
+	{
+		times.push_back(ms);
+	}
+	else
+	{
+		times[next] = ms;
+	}
+	next = (next + 1) % m_historySize;
+}
+
+// 最小・平均・99パーセンタイル
+void GpuProfiler::summarize(const vector<double>& times, SectionStatistics* stats)
+{
+	stats->frames = uint32_t(times.size());
+	if (times.empty())
+	{
+		return;
+	}
+
+	vector<double> sorted = times;
+	sort(sorted.begin(), sorted.end());
+
+	double sum = 0.0;
+	for (auto t : sorted)
+	{
+		sum += t;
+	}
+	stats->minMs = sorted.front();
+	stats->avgMs = sum / double(sorted.size());
+
+	// 99パーセンタイル（その値以下に99%のフレームが収まる最小の値）
+	size_t rank = (sorted.size() * 99 + 99) / 100;
+	stats->p99Ms = sorted[(std::min)(rank, sorted.size()) - 1];
+}
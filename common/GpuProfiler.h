@@ -0,0 +1,135 @@
+﻿#pragma once
+
+#include <vulkan/vulkan.h>
+
+#include <vector>
+#include <string>
+#include <stdint.h>
+
+// GPU 上の処理時間とパイプライン統計を区間ごとに計測する
+// 区間の前後に vkCmdWriteTimestamp を、区間全体にパイプライン統計クエリを記録する
+// クエリプールは同時に処理するフレーム数だけ用意し、フェンスを待った後（frameCount フレーム後）に
+// 同じ枠の結果を読むので、結果を待って GPU を止めることはない
+// 区間ごとに直近 getHistorySize フレーム分の時間を残し、最小・平均・99パーセンタイルを出す
+// 最初の区間の開始から最後の区間の終了までをフレーム全体の時間として同じように集計する
+//
+// 区間は入れ子にできない（パイプライン統計クエリは同じ種類のものを同時に1つしか開始できない）
+// 記録したコマンドを使い回す場合も、同じ区間を同じ順番で記録していれば毎フレーム集計できる
+class GpuProfiler
+{
+public:
+	GpuProfiler();
+
+	// 1フレームで計測できる区間の数
+	static const uint32_t MaxSections = 16;
+
+	// 区間ごとに残すフレーム数の既定値
+	static const uint32_t DefaultHistorySize = 256;
+
+	// パイプライン統計クエリで取る値（結果はこのビットの順に並ぶ）
+	static const VkQueryPipelineStatisticFlags StatisticFlags =
+		VK_QUERY_PIPELINE_STATISTIC_VERTEX_SHADER_INVOCATIONS_BIT |
+		VK_QUERY_PIPELINE_STATISTIC_CLIPPING_PRIMITIVES_BIT |
+		VK_QUERY_PIPELINE_STATISTIC_FRAGMENT_SHADER_INVOCATIONS_BIT |
+		VK_QUERY_PIPELINE_STATISTIC_COMPUTE_SHADER_INVOCATIONS_BIT;
+
+	// StatisticFlags と同じ並び
+	struct PipelineStatistics
+	{
+		uint64_t vertexInvocations;
+		uint64_t clippingPrimitives;
+		uint64_t fragmentInvocations;
+		uint64_t computeInvocations;
+	};
+
+	// 区間ごとの集計結果（時間はミリ秒、パイプライン統計は1フレームあたりの平均）
+	struct SectionStatistics
+	{
+		std::string name;
+		uint32_t frames;
+		double minMs;
+		double avgMs;
+		double p99Ms;
+		bool hasPipelineStatistics;
+		double vertexInvocations;
+		double clippingPrimitives;
+		double fragmentInvocations;
+		double computeInvocations;
+	};
+
+	// queueFamilyIndex のキューでタイムスタンプを書けるか
+	static bool isSupported(VkPhysicalDevice physDev, uint32_t queueFamilyIndex);
+
+	// frameCount:同時に処理するフレーム数（フレームごとにクエリプールを持つ）
+	// pipelineStatistics:デバイスの作成時に pipelineStatisticsQuery を有効にした場合だけ true にする
+	void create(VkDevice device, VkPhysicalDevice physDev, uint32_t queueFamilyIndex, uint32_t frameCount, bool pipelineStatistics);
+	void destroy();
+
+	bool isEnabled() const { return !m_frames.empty(); }
+
+	// フレームの最初に呼ぶ（フェンスを待った後）
+	// 同じ枠を使った前のフレームの結果を読んで集計する
+	void beginFrame(uint32_t frameIndex);
+	// コマンドを送信した後に呼ぶ（次に同じ枠の beginFrame を呼んだときに結果を読む）
+	void endFrame(uint32_t frameIndex);
+
+	// コマンドの記録の最初（レンダーパスの外）に呼び、この枠のクエリをリセットする
+	void reset(VkCommandBuffer command, uint32_t frameIndex);
+
+	// 区間の開始・終了（レンダーパスの中で開始した場合は同じサブパスの中で終えること）
+	void beginSection(VkCommandBuffer command, uint32_t frameIndex, const char* name);
+	void endSection(VkCommandBuffer command, uint32_t frameIndex);
+
+	// 描画中だったフレームの結果もすべて集計する（デバイスがアイドルのときに呼ぶこと）
+	void flush();
+
+	// 区間ごとの集計結果（最初に計測した順）
+	std::vector<SectionStatistics> getStatistics() const;
+	// フレーム全体（最初の区間の開始から最後の区間の終了まで）の集計結果、パイプライン統計は持たない
+	SectionStatistics getFrameStatistics() const;
+	void clearStatistics();
+
+	// 区間ごとに残すフレーム数（これまでの履歴は空にする）
+	void setHistorySize(uint32_t size);
+	uint32_t getHistorySize() const { return m_historySize; }
+	std::string createReport() const;
+
+private:
+	// 1フレーム分のクエリ
+	struct Frame
+	{
+		VkQueryPool timestampPool;		// 区間ごとに開始・終了の2つ
+		VkQueryPool statisticsPool;		// 区間ごとに1つ（パイプライン統計を使わない場合は VK_NULL_HANDLE）
+		std::vector<uint32_t> sections;	// 記録した区間（m_sections の添字）
+		bool inSection;
+		bool submitted;
+	};
+
+	// 区間ごとの履歴
+	struct Section
+	{
+		std::string name;
+		std::vector<double> times;	// 直近 m_historySize フレーム分（ミリ秒）
+		uint32_t next;				// 次に書く times の位置
+		uint64_t statisticsFrames;
+		PipelineStatistics statistics;	// 合計
+	};
+
+	uint32_t findSection(const char* name);
+	void readResults(Frame& frame);
+	void pushTime(std::vector<double>& times, uint32_t& next, double ms) const;
+	static void summarize(const std::vector<double>& times, SectionStatistics* stats);
+
+	VkDevice m_device;
+	double m_timestampPeriod;	// 1カウントあたりのナノ秒
+	uint64_t m_timestampMask;	// timestampValidBits の分
+	bool m_pipelineStatistics;
+
+	std::vector<Frame> m_frames;
+	std::vector<Section> m_sections;
+	uint32_t m_historySize;
+
+	// フレーム全体の時間の履歴
+	std::vector<double> m_frameTimes;
+	uint32_t m_frameNext;
+};
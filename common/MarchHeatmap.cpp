@@ -0,0 +1,168 @@
+﻿#include "MarchHeatmap.h"
+
+#include <sstream>
+#include <iomanip>
+
+using namespace std;
+
+namespace
+{
+	// 上位から rank 番目（1 始まり）のピクセルのステップ数
+	uint32_t findRank(const vector<uint64_t>& histogram, uint64_t rank)
+	{
+		uint64_t count = 0;
+		for (size_t i = 0; i < histogram.size(); ++i)
+		{
+			count += histogram[i];
+			if (count >= rank)
+			{
+				return uint32_t(i);
+			}
+		}
+		return histogram.empty() ? 0 : uint32_t(histogram.size() - 1);
+	}
+
+	// 全体の p パーセント（その値以下に p% のピクセルが収まる最小のステップ数）
+	uint32_t findPercentile(const vector<uint64_t>& histogram, uint64_t pixels, uint32_t percent)
+	{
+		return findRank(histogram, (std::max)((pixels * percent + 99) / 100, uint64_t(1)));
+	}
+}
+
+
+// public ===================================================================
+
+const char* MarchHeatmap::getReasonName(Reason reason)
+{
+	switch (reason)
+	{
+	case ReasonHit:
+		return "hit";
+	case ReasonMiss:
+		return "miss";
+	case ReasonPlane:
+		return "plane";
+	case ReasonExhausted:
+		return "exhausted";
+	default:
+		return "unknown";
+	}
+}
+
+MarchHeatmap::Statistics MarchHeatmap::analyze(const vector<uint32_t>& codes)
+{
+	Statistics stats{};
+	for (auto code : codes)
+	{
+		uint32_t steps = getSteps(code);
+		Reason reason = getReason(code);
+		if (steps >= stats.histogram.size())
+		{
+			stats.histogram.resize(steps + 1, 0);
+		}
+		stats.histogram[steps]++;
+		stats.pixels++;
+		stats.steps += steps;
+		stats.maxSteps = (std::max)(stats.maxSteps, steps);
+		stats.reasonPixels[reason]++;
+		stats.reasonSteps[reason] += steps;
+	}
+
+	if (stats.pixels > 0)
+	{
+		stats.p50 = findPercentile(stats.histogram, stats.pixels, 50);
+		stats.p90 = findPercentile(stats.histogram, stats.pixels, 90);
+		stats.p99 = findPercentile(stats.histogram, stats.pixels, 99);
+	}
+	return stats;
+}
+
+string MarchHeatmap::createReport(const char* label, const Statistics& stats)
+{
+	stringstream ss;
+	ss << fixed << setprecision(2);
+	ss << "[MarchHeatmap] " << label << ": pixels " << stats.pixels;
+	if (stats.pixels == 0)
+	{
+		ss << " (no heatmap)" << endl;
+		return ss.str();
+	}
+
+	ss << ", steps/pixel " << double(stats.steps) / double(stats.pixels)
+		<< ", p50 " << stats.p50 << ", p90 " << stats.p90 << ", p99 " << stats.p99 << ", max " << stats.maxSteps << endl;
+
+	// 終了理由ごとのピクセルの割合と、全ステップ数に占める割合（どこでステップを使っているか）
+	for (int i = 0; i < ReasonCount; ++i)
+	{
+		if (stats.reasonPixels[i] == 0)
+		{
+			continue;
+		}
+		ss << "  " << setw(9) << left << getReasonName(Reason(i)) << right
+			<< " pixels " << setw(6) << 100.0 * double(stats.reasonPixels[i]) / double(stats.pixels) << "%"
+			<< ", steps " << setw(6) << 100.0 * double(stats.reasonSteps[i]) / double(stats.steps) << "%"
+			<< ", steps/pixel " << double(stats.reasonSteps[i]) / double(stats.reasonPixels[i]) << endl;
+	}
+
+	// ヒストグラム（最大のステップ数までを8区間に分ける）
+	const uint32_t Buckets = 8;
+	uint32_t width = (stats.maxSteps + Buckets) / Buckets;
+	for (uint32_t b = 0; b < Buckets; ++b)
+	{
+		uint32_t first = b * width;
+		uint32_t last = (std::min)(first + width, uint32_t(stats.histogram.size()));
+		if (first >= last)
+		{
+			break;
+		}
+		uint64_t count = 0;
+		for (uint32_t i = first; i < last; ++i)
+		{
+			count += stats.histogram[i];
+		}
+		double ratio = double(count) / double(stats.pixels);
+		ss << "  [" << setw(4) << first << ", " << setw(4) << last << ") " << setw(6) << 100.0 * ratio << "% "
+			<< string(size_t(ratio * 50.0 + 0.5), '#') << endl;
+	}
+	return ss.str();
+}
+
+void MarchHeatmap::createImage(const vector<uint32_t>& codes, uint32_t maxSteps, vector<uint8_t>* rgba)
+{
+	rgba->resize(codes.size() * 4);
+	float scale = 1.0f / float((std::max)(maxSteps, 1u));
+	for (size_t i = 0; i < codes.size(); ++i)
+	{
+		uint8_t* pixel = &(*rgba)[i * 4];
+		pixel[3] = 255;
+		if (getReason(codes[i]) == ReasonExhausted)
+		{
+			pixel[0] = 255;
+			pixel[1] = 0;
+			pixel[2] = 255;
+			continue;
+		}
+
+		// 0:青 1/3:緑 2/3:黄 1:赤
+		float x = (std::min)(float(getSteps(codes[i])) * scale, 1.0f) * 3.0f;
+		float r = 0.0f, g = 0.0f, b = 0.0f;
+		if (x < 1.0f)
+		{
+			g = x;
+			b = 1.0f - x;
+		}
+		else if (x < 2.0f)
+		{
+			r = x - 1.0f;
+			g = 1.0f;
+		}
+		else
+		{
+			r = 1.0f;
+			g = 3.0f - x;
+		}
+		pixel[0] = uint8_t(r * 255.0f + 0.5f);
+		pixel[1] = uint8_t(g * 255.0f + 0.5f);
+		pixel[2] = uint8_t(b * 255.0f + 0.5f);
+	}
+}
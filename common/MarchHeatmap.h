@@ -0,0 +1,51 @@
+﻿#pragma once
+
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <stdint.h>
+
+// レイマーチングのピクセルごとのステップ数と終了理由を集計し、擬似カラーの画像にする
+// コードはシェーダーが ConeMarchPrepass の MarchStats の後ろに書いたもの（readHeatmap で読み戻す）
+//
+// シェーダー側の決まり（各サンプルの shader.frag）
+//   コードは ステップ数 | (終了理由 << 16)、終了理由は Reason と同じ値
+//   ステップ数は距離関数を評価した回数（ConeMarchPrepass の統計と同じ数え方）
+class MarchHeatmap
+{
+public:
+	// 終了理由
+	enum Reason
+	{
+		ReasonHit,			// 物体に当たった
+		ReasonMiss,			// 何にも当たらずに十分遠くまで進んだ（空に抜けた）
+		ReasonPlane,		// 床の平面に当たった、または平面で反射した後に空に抜けた
+		ReasonExhausted,	// 当たらないままステップ数の上限に達した
+		ReasonCount
+	};
+
+	static uint32_t getSteps(uint32_t code) { return code & 0xffff; }
+	static Reason getReason(uint32_t code) { return Reason((std::min)(code >> 16, uint32_t(ReasonExhausted))); }
+	static const char* getReasonName(Reason reason);
+
+	// 集計結果
+	struct Statistics
+	{
+		uint64_t pixels;
+		uint64_t steps;
+		uint32_t maxSteps;
+		uint32_t p50;
+		uint32_t p90;
+		uint32_t p99;
+		uint64_t reasonPixels[ReasonCount];
+		uint64_t reasonSteps[ReasonCount];
+		std::vector<uint64_t> histogram;	// ステップ数ごとのピクセル数
+	};
+
+	static Statistics analyze(const std::vector<uint32_t>& codes);
+	static std::string createReport(const char* label, const Statistics& stats);
+
+	// ステップ数を 0 から maxSteps まで 青 -> 緑 -> 黄 -> 赤 で塗り、上限に達したピクセルはマゼンタにする
+	// rgba:RGBA8 のピクセル列（VulkanAppBase::writePPM に渡せる）
+	static void createImage(const std::vector<uint32_t>& codes, uint32_t maxSteps, std::vector<uint8_t>* rgba);
+};
@@ -0,0 +1,150 @@
+﻿#include "MarchQuality.h"
+
+#include <sstream>
+#include <fstream>
+#include <vector>
+#include <algorithm>
+#include <string.h>
+#include <stddef.h>
+
+using namespace std;
+
+namespace
+{
+	// MarchHeatmap のコードは下位 16 ビットがステップ数
+	const int32_t MaxStepsLimit = 0xffff;
+
+	// Constant の順に Settings のメンバーを指す
+	const VkSpecializationMapEntry MapEntries[] = {
+		{ MarchQuality::ConstantMaxSteps, offsetof(MarchQuality::Settings, maxSteps), sizeof(int32_t) },
+		{ MarchQuality::ConstantHitEpsilon, offsetof(MarchQuality::Settings, hitEpsilon), sizeof(float) },
+		{ MarchQuality::ConstantNormalEpsilon, offsetof(MarchQuality::Settings, normalEpsilon), sizeof(float) },
+		{ MarchQuality::ConstantPrepassSteps, offsetof(MarchQuality::Settings, prepassSteps), sizeof(int32_t) },
+		{ MarchQuality::ConstantMaxBounces, offsetof(MarchQuality::Settings, maxBounces), sizeof(int32_t) },
+		{ MarchQuality::ConstantFogNear, offsetof(MarchQuality::Settings, fogNear), sizeof(float) },
+		{ MarchQuality::ConstantFogFar, offsetof(MarchQuality::Settings, fogFar), sizeof(float) },
+	};
+	static_assert(sizeof(MapEntries) / sizeof(MapEntries[0]) == MarchQuality::ConstantCount, "MapEntries must cover all constants");
+
+	// SPIR-V の命令と装飾の番号
+	const uint32_t SpirvMagic = 0x07230203;
+	const uint32_t SpirvHeaderWords = 5;
+	const uint32_t OpDecorate = 71;
+	const uint32_t DecorationSpecId = 1;
+
+	const char* PresetNames[] = { "preview", "default", "final" };
+	static_assert(sizeof(PresetNames) / sizeof(PresetNames[0]) == MarchQuality::PresetCount, "PresetNames must cover all presets");
+}
+
+
+// public ===================================================================
+
+MarchQuality::Settings MarchQuality::getDefaultSettings()
+{
+	Settings settings;
+	settings.maxSteps = 256;
+	settings.hitEpsilon = 0.001f;
+	settings.normalEpsilon = 0.0001f;
+	settings.prepassSteps = 64;
+	settings.maxBounces = 8;
+	settings.fogNear = 30.0f;
+	settings.fogFar = 50.0f;
+	return settings;
+}
+
+MarchQuality::Settings MarchQuality::getPreset(Preset preset, const Settings& base)
+{
+	Settings settings = base;
+	switch (preset)
+	{
+	case PresetPreview:
+		// 遠くの細かい形は諦め、早めに当たったことにする
+		settings.maxSteps = (std::max)(base.maxSteps / 4, 16);
+		settings.hitEpsilon = base.hitEpsilon * 4.0f;
+		settings.prepassSteps = (std::max)(base.prepassSteps / 2, 16);
+		settings.maxBounces = (std::min)(base.maxBounces, 1);
+		break;
+	case PresetFinal:
+		settings.maxSteps = base.maxSteps * 2;
+		settings.hitEpsilon = base.hitEpsilon * 0.5f;
+		settings.prepassSteps = base.prepassSteps * 2;
+		settings.maxBounces = base.maxBounces * 2;
+		break;
+	default:
+		break;
+	}
+	settings.maxSteps = (std::min)(settings.maxSteps, MaxStepsLimit);
+	return settings;
+}
+
+const char* MarchQuality::getPresetName(Preset preset)
+{
+	return (preset >= 0 && preset < PresetCount) ? PresetNames[preset] : "unknown";
+}
+
+bool MarchQuality::findPreset(const char* name, Preset* preset)
+{
+	for (int i = 0; i < PresetCount; i++)
+	{
+		if (strcmp(name, PresetNames[i]) == 0)
+		{
+			*preset = Preset(i);
+			return true;
+		}
+	}
+	return false;
+}
+
+VkSpecializationInfo MarchQuality::getSpecializationInfo(const Settings& settings)
+{
+	VkSpecializationInfo info{};
+	info.mapEntryCount = ConstantCount;
+	info.pMapEntries = MapEntries;
+	info.dataSize = sizeof(Settings);
+	info.pData = &settings;
+	return info;
+}
+
+bool MarchQuality::hasSpecializationConstant(const char* fileName, Constant constant)
+{
+	ifstream infile(fileName, std::ios::binary);
+	if (!infile)
+	{
+		return false;
+	}
+	vector<uint32_t> code(size_t(infile.seekg(0, ifstream::end).tellg()) / sizeof(uint32_t));
+	infile.seekg(0, ifstream::beg).read(reinterpret_cast<char*>(code.data()), code.size() * sizeof(uint32_t));
+	if (code.size() < SpirvHeaderWords || code[0] != SpirvMagic)
+	{
+		return false;
+	}
+
+	// OpDecorate <id> SpecId <constant> を探す（上位 16 ビットが命令のワード数、下位 16 ビットが命令の番号）
+	for (size_t i = SpirvHeaderWords; i < code.size();)
+	{
+		uint32_t wordCount = code[i] >> 16;
+		uint32_t opcode = code[i] & 0xffff;
+		if (wordCount == 0 || i + wordCount > code.size())
+		{
+			return false;
+		}
+		if (opcode == OpDecorate && wordCount >= 4 && code[i + 2] == DecorationSpecId && code[i + 3] == uint32_t(constant))
+		{
+			return true;
+		}
+		i += wordCount;
+	}
+	return false;
+}
+
+string MarchQuality::createReport(const char* label, const Settings& settings)
+{
+	stringstream ss;
+	ss << "[MarchQuality] " << label << ": max steps " << settings.maxSteps
+		<< ", hit epsilon " << settings.hitEpsilon
+		<< ", normal epsilon " << settings.normalEpsilon
+		<< ", prepass steps " << settings.prepassSteps
+		<< ", max bounces " << settings.maxBounces
+		<< ", fog " << settings.fogNear << " - " << settings.fogFar << endl;
+	return ss.str();
+}
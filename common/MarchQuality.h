@@ -0,0 +1,72 @@
+﻿#pragma once
+
+#include <vulkan/vulkan.h>
+
+#include <string>
+#include <stdint.h>
+
+// レイマーチングの品質（ステップ数の上限・ヒット判定の距離など）をシェーダーの特殊化定数で渡す
+// 同じ SPIR-V から品質ごとのパイプラインを作れるので、シェーダーを書き分けずに速度と品質を選べる
+// 定数はパイプラインの作成時に決まるので、ドライバーはループの展開などの最適化をそのまま行える
+//
+// シェーダー側の決まり（各サンプルの shader.frag）
+//   layout(constant_id = N) const で Constant と同じ番号・Settings と同じ型の定数を宣言する
+//   使わない定数は宣言しなくてよい（宣言していない番号は無視される）
+//   宣言の初期値はそのサンプルの既定値（特殊化情報を渡さなかった場合の値）と同じにしておく
+class MarchQuality
+{
+public:
+	// 品質のプリセット（サンプルの既定値を基準に増減する）
+	enum Preset
+	{
+		PresetPreview,		// ステップ数を 1/4 にし、ヒット判定を粗くする
+		PresetDefault,		// サンプルの既定値のまま
+		PresetFinal,		// ステップ数を 2 倍にし、ヒット判定を細かくする
+		PresetCount
+	};
+
+	// 特殊化定数の番号（constant_id）
+	enum Constant
+	{
+		ConstantMaxSteps,
+		ConstantHitEpsilon,
+		ConstantNormalEpsilon,
+		ConstantPrepassSteps,
+		ConstantMaxBounces,
+		ConstantFogNear,
+		ConstantFogFar,
+		ConstantCount
+	};
+
+	// 特殊化定数の値（Constant と同じ並び）
+	struct Settings
+	{
+		int32_t maxSteps;		// フル解像度のパスのステップ数の上限（MarchHeatmap のコードに入るよう 0xffff まで）
+		float hitEpsilon;		// 距離がこれより小さければ表面に当たったとみなす
+		float normalEpsilon;	// 法線を求める差分の幅
+		int32_t prepassSteps;	// 前処理パス（ConeMarchPrepass）のステップ数の上限
+		int32_t maxBounces;		// 反射する回数の上限
+		float fogNear;			// フォグがかかり始める距離
+		float fogFar;			// 空の色になる距離
+	};
+
+	// shader.frag の初期値と同じ既定値
+	static Settings getDefaultSettings();
+
+	// base を基準にしたプリセットの値
+	static Settings getPreset(Preset preset, const Settings& base);
+
+	static const char* getPresetName(Preset preset);
+	// 名前（preview / default / final）からプリセットを探す
+	static bool findPreset(const char* name, Preset* preset);
+
+	// パイプラインの作成時に VkPipelineShaderStageCreateInfo::pSpecializationInfo に渡す情報
+	// settings を指すので、パイプラインを作成し終えるまで settings を残しておくこと
+	static VkSpecializationInfo getSpecializationInfo(const Settings& settings);
+
+	// SPIR-V のファイルが constant の特殊化定数（SpecId の装飾）を持っているか
+	// 持っていない古いバイナリでは品質の設定が効かないので、読み込む前に確かめて警告を出すのに使う
+	static bool hasSpecializationConstant(const char* fileName, Constant constant = ConstantMaxSteps);
+
+	static std::string createReport(const char* label, const Settings& settings);
+};
@@ -0,0 +1,268 @@
+﻿#include "PhysicalDeviceSelector.h"
+#include "VulkanAppBase.h"
+
+#include <sstream>
+#include <iomanip>
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+
+using namespace std;
+
+namespace
+{
+	// 種類ごとの点数（ヒープの大きさや機能の分より十分大きくして、種類を優先する）
+	int64_t getTypeScore(VkPhysicalDeviceType type)
+	{
+		switch (type)
+		{
+		case VK_PHYSICAL_DEVICE_TYPE_DISCRETE_GPU:		return 100000;
+		case VK_PHYSICAL_DEVICE_TYPE_INTEGRATED_GPU:	return 50000;
+		case VK_PHYSICAL_DEVICE_TYPE_VIRTUAL_GPU:		return 20000;
+		case VK_PHYSICAL_DEVICE_TYPE_CPU:				return 0;
+		default:										return 10000;
+		}
+	}
+
+	const char* getTypeName(VkPhysicalDeviceType type)
+	{
+		switch (type)
+		{
+		case VK_PHYSICAL_DEVICE_TYPE_DISCRETE_GPU:		return "discrete";
+		case VK_PHYSICAL_DEVICE_TYPE_INTEGRATED_GPU:	return "integrated";
+		case VK_PHYSICAL_DEVICE_TYPE_VIRTUAL_GPU:		return "virtual";
+		case VK_PHYSICAL_DEVICE_TYPE_CPU:				return "cpu";
+		default:										return "other";
+		}
+	}
+
+	string toLower(string s)
+	{
+		transform(s.begin(), s.end(), s.begin(), [](char c) { return char(tolower(static_cast<unsigned char>(c))); });
+		return s;
+	}
+}
+
+
+// public ===================================================================
+
+vector<PhysicalDeviceSelector::Candidate> PhysicalDeviceSelector::enumerate(VkInstance instance, const Requirements& requirements)
+{
+	uint32_t devCount = 0;
+	vkEnumeratePhysicalDevices(instance, &devCount, nullptr);
+	vector<VkPhysicalDevice> physDevs(devCount);
+	vkEnumeratePhysicalDevices(instance, &devCount, physDevs.data());
+
+	vector<Candidate> candidates;
+	for (uint32_t i = 0; i < devCount; i++)
+	{
+		Candidate candidate{};
+		candidate.device = physDevs[i];
+		candidate.index = i;
+
+		VkPhysicalDeviceProperties props;
+		vkGetPhysicalDeviceProperties(candidate.device, &props);
+		candidate.name = props.deviceName;
+		candidate.type = props.deviceType;
+		candidate.apiVersion = props.apiVersion;
+
+		// UUID は Vulkan 1.1 から取れる（同じ型番のデバイスが複数ある場合に区別する）
+		if (props.apiVersion >= VK_API_VERSION_1_1)
+		{
+			VkPhysicalDeviceIDProperties idProps{};
+			idProps.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_ID_PROPERTIES;
+			VkPhysicalDeviceProperties2 props2{};
+			props2.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2;
+			props2.pNext = &idProps;
+			vkGetPhysicalDeviceProperties2(candidate.device, &props2);
+
+			stringstream ss;
+			for (uint32_t j = 0; j < VK_UUID_SIZE; j++)
+			{
+				ss << hex << setw(2) << setfill('0') << uint32_t(idProps.deviceUUID[j]);
+			}
+			candidate.uuid = ss.str();
+		}
+
+		VkPhysicalDeviceMemoryProperties memProps;
+		vkGetPhysicalDeviceMemoryProperties(candidate.device, &memProps);
+		for (uint32_t j = 0; j < memProps.memoryHeapCount; j++)
+		{
+			if (memProps.memoryHeaps[j].flags & VK_MEMORY_HEAP_DEVICE_LOCAL_BIT)
+			{
+				candidate.deviceLocalBytes = (max)(candidate.deviceLocalBytes, memProps.memoryHeaps[j].size);
+			}
+		}
+
+		// キューファミリー（グラフィックスは Present もできるものを優先する）
+		uint32_t familyCount = 0;
+		vkGetPhysicalDeviceQueueFamilyProperties(candidate.device, &familyCount, nullptr);
+		vector<VkQueueFamilyProperties> families(familyCount);
+		vkGetPhysicalDeviceQueueFamilyProperties(candidate.device, &familyCount, families.data());
+		candidate.graphicsQueueFamily = UINT32_MAX;
+		for (uint32_t j = 0; j < familyCount; j++)
+		{
+			if (!(families[j].queueFlags & VK_QUEUE_GRAPHICS_BIT))
+			{
+				continue;
+			}
+			VkBool32 present = VK_TRUE;
+			if (requirements.surface != VK_NULL_HANDLE)
+			{
+				vkGetPhysicalDeviceSurfaceSupportKHR(candidate.device, j, requirements.surface, &present);
+			}
+			if (present == VK_TRUE)
+			{
+				candidate.graphicsQueueFamily = j;
+				break;
+			}
+		}
+		candidate.computeQueueFamily = findQueueFamily(families, VK_QUEUE_COMPUTE_BIT, VK_QUEUE_GRAPHICS_BIT);
+		candidate.transferQueueFamily = findQueueFamily(families, VK_QUEUE_TRANSFER_BIT, VK_QUEUE_GRAPHICS_BIT | VK_QUEUE_COMPUTE_BIT);
+
+		// 必須の条件
+		uint32_t extCount = 0;
+		vkEnumerateDeviceExtensionProperties(candidate.device, nullptr, &extCount, nullptr);
+		vector<VkExtensionProperties> extensions(extCount);
+		vkEnumerateDeviceExtensionProperties(candidate.device, nullptr, &extCount, extensions.data());
+
+		candidate.suitable = true;
+		if (props.apiVersion < requirements.apiVersion)
+		{
+			candidate.suitable = false;
+			candidate.reason = "api version too old";
+		}
+		for (auto name : requirements.extensions)
+		{
+			auto found = find_if(extensions.begin(), extensions.end(), [name](const VkExtensionProperties& v) { return strcmp(v.extensionName, name) == 0; });
+			if (candidate.suitable && found == extensions.end())
+			{
+				candidate.suitable = false;
+				candidate.reason = string("missing ") + name;
+			}
+		}
+		if (candidate.suitable && candidate.graphicsQueueFamily == UINT32_MAX)
+		{
+			candidate.suitable = false;
+			candidate.reason = (requirements.surface != VK_NULL_HANDLE) ? "no graphics queue with present support" : "no graphics queue";
+		}
+
+		// 点数（ヒープは 1GiB ごとに 100 点、10GiB を超えた分は数えない）
+		VkPhysicalDeviceFeatures features;
+		vkGetPhysicalDeviceFeatures(candidate.device, &features);
+		candidate.fragmentStoresAndAtomics = (features.fragmentStoresAndAtomics == VK_TRUE);
+		const VkDeviceSize GiB = 1024ull * 1024ull * 1024ull;
+		candidate.score = getTypeScore(candidate.type);
+		candidate.score += int64_t((min)(candidate.deviceLocalBytes / GiB, VkDeviceSize(10))) * 100;
+		// 無くても動く（統計を取らないだけ）ので、必須にはせず点数を足す
+		if (requirements.fragmentStoresAndAtomics && candidate.fragmentStoresAndAtomics)
+		{
+			candidate.score += 500;
+		}
+		if (requirements.pipelineStatisticsQuery && features.pipelineStatisticsQuery)
+		{
+			candidate.score += 200;
+		}
+		candidate.score += (candidate.transferQueueFamily != UINT32_MAX) ? 100 : 0;
+
+		candidates.push_back(candidate);
+	}
+	return candidates;
+}
+
+// 使うデバイスの添字
+int PhysicalDeviceSelector::select(const vector<Candidate>& candidates, const char* filter)
+{
+	if (filter != nullptr && filter[0] != '\0')
+	{
+		for (size_t i = 0; i < candidates.size(); i++)
+		{
+			if (!matches(candidates[i], filter))
+			{
+				continue;
+			}
+			if (candidates[i].suitable)
+			{
+				return int(i);
+			}
+			stringstream ss;
+			ss << "[PhysicalDeviceSelector] " << candidates[i].name << " matches \"" << filter << "\" but is not suitable (" << candidates[i].reason << ")." << endl;
+			OutputDebugStringA(ss.str().c_str());
+		}
+		stringstream ss;
+		ss << "[PhysicalDeviceSelector] no suitable device matches \"" << filter << "\". selecting by score." << endl;
+		OutputDebugStringA(ss.str().c_str());
+	}
+
+	// 点数が同じなら列挙の順番が早いもの
+	int selected = -1;
+	for (size_t i = 0; i < candidates.size(); i++)
+	{
+		if (candidates[i].suitable && (selected < 0 || candidates[i].score > candidates[selected].score))
+		{
+			selected = int(i);
+		}
+	}
+	return selected;
+}
+
+string PhysicalDeviceSelector::createReport(const vector<Candidate>& candidates, int selected)
+{
+	const double GiB = 1024.0 * 1024.0 * 1024.0;
+	stringstream ss;
+	for (size_t i = 0; i < candidates.size(); i++)
+	{
+		const auto& c = candidates[i];
+		ss << "[PhysicalDeviceSelector] " << (int(i) == selected ? "* " : "  ") << c.index << ": " << c.name
+			<< " (" << getTypeName(c.type) << ", " << fixed << setprecision(1) << double(c.deviceLocalBytes) / GiB << " GiB";
+		if (!c.uuid.empty())
+		{
+			ss << ", uuid " << c.uuid;
+		}
+		ss << ")";
+		if (c.suitable)
+		{
+			ss << " score " << c.score
+				<< ", transfer queue " << (c.transferQueueFamily != UINT32_MAX ? "yes" : "no")
+				<< ", compute queue " << (c.computeQueueFamily != UINT32_MAX ? "yes" : "no")
+				<< ", march statistics " << (c.fragmentStoresAndAtomics ? "yes" : "no (fragmentStoresAndAtomics)");
+		}
+		else
+		{
+			ss << " not suitable: " << c.reason;
+		}
+		ss << endl;
+	}
+	return ss.str();
+}
+
+// required をすべて持ち、excluded をどれも持たないキューファミリー
+uint32_t PhysicalDeviceSelector::findQueueFamily(const vector<VkQueueFamilyProperties>& props, VkQueueFlags required, VkQueueFlags excluded)
+{
+	for (uint32_t i = 0; i < uint32_t(props.size()); i++)
+	{
+		if ((props[i].queueFlags & required) == required && !(props[i].queueFlags & excluded) && props[i].queueCount > 0)
+		{
+			return i;
+		}
+	}
+	return UINT32_MAX;
+}
+
+
+// private ==================================================================
+
+// 数字だけなら列挙した番号、それ以外は名前の一部（大文字小文字は区別しない）か UUID の先頭
+bool PhysicalDeviceSelector::matches(const Candidate& candidate, const string& filter)
+{
+	if (all_of(filter.begin(), filter.end(), [](char c) { return isdigit(static_cast<unsigned char>(c)) != 0; }))
+	{
+		return uint32_t(atoi(filter.c_str())) == candidate.index;
+	}
+	const string lower = toLower(filter);
+	if (toLower(candidate.name).find(lower) != string::npos)
+	{
+		return true;
+	}
+	return !candidate.uuid.empty() && candidate.uuid.compare(0, lower.size(), lower) == 0;
+}
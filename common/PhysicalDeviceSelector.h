@@ -0,0 +1,60 @@
+﻿#pragma once
+
+#include <vulkan/vulkan.h>
+
+#include <vector>
+#include <string>
+#include <stdint.h>
+
+// 物理デバイスを点数付けして選ぶ
+// 必須の条件（Vulkan のバージョン・拡張・グラフィックスのキュー・Present）を満たさないものは除き、
+// 残りを種類（ディスクリート > 統合 > 仮想 > CPU）・デバイスローカルのヒープの大きさ・
+// 望ましい機能・転送専用のキューファミリーの有無で比べる
+// 名前の一部・UUID（先頭の一部でよい）・列挙した番号で特定のデバイスに固定できる
+class PhysicalDeviceSelector
+{
+public:
+	// 必須の条件と望ましい機能
+	struct Requirements
+	{
+		uint32_t apiVersion;					// 必須
+		VkSurfaceKHR surface;					// Present できるキューが必須（オフスクリーンは VK_NULL_HANDLE）
+		std::vector<const char*> extensions;	// 必須
+		bool fragmentStoresAndAtomics;			// 望ましい（無いデバイスではステップ数の統計とヒートマップを取らない）
+		bool pipelineStatisticsQuery;			// 望ましい
+	};
+
+	struct Candidate
+	{
+		VkPhysicalDevice device;
+		uint32_t index;					// vkEnumeratePhysicalDevices の順番
+		std::string name;
+		std::string uuid;				// deviceUUID の16進表記
+		VkPhysicalDeviceType type;
+		uint32_t apiVersion;
+		VkDeviceSize deviceLocalBytes;	// デバイスローカルのヒープのうち最大のもの
+		uint32_t graphicsQueueFamily;	// グラフィックス（surface を指定した場合は Present も）できるもの
+		uint32_t computeQueueFamily;	// グラフィックスなしでコンピュートできるもの（無ければ UINT32_MAX、報告するだけで点数には入れない）
+		uint32_t transferQueueFamily;	// 転送専用のもの（無ければ UINT32_MAX）
+		bool fragmentStoresAndAtomics;	// フラグメントシェーダーからストレージバッファに書けるか
+		bool suitable;					// 必須の条件を満たすか
+		std::string reason;				// 満たさない場合の理由
+		int64_t score;
+	};
+
+	// すべての物理デバイスを調べる
+	static std::vector<Candidate> enumerate(VkInstance instance, const Requirements& requirements);
+
+	// 使うデバイスの添字（使えるものが無ければ -1）
+	// filter:名前の一部・UUID の先頭・番号（数字だけの場合）のどれか（nullptr か空なら点数が最も高いもの）
+	//        一致するものが無いか条件を満たさない場合は出力して点数で選ぶ
+	static int select(const std::vector<Candidate>& candidates, const char* filter);
+
+	static std::string createReport(const std::vector<Candidate>& candidates, int selected);
+
+	// required をすべて持ち、excluded をどれも持たないキューファミリー（無ければ UINT32_MAX）
+	static uint32_t findQueueFamily(const std::vector<VkQueueFamilyProperties>& props, VkQueueFlags required, VkQueueFlags excluded);
+
+private:
+	static bool matches(const Candidate& candidate, const std::string& filter);
+};
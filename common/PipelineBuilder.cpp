@@ -0,0 +1,103 @@
+﻿#include "PipelineBuilder.h"
+
+#include <sstream>
+#include <iomanip>
+#include <chrono>
+
+using namespace std;
+
+
+// public ===================================================================
+
+PipelineBuilder::PipelineBuilder()
+	:m_waitMs(0.0)
+{
+}
+
+PipelineBuilder::~PipelineBuilder()
+{
+	end();
+}
+
+PipelineBuilder::Ticket PipelineBuilder::submit(const char* name, function<VkPipeline()> build)
+{
+	if (!m_pool)
+	{
+		m_pool.reset(new ThreadPool());
+	}
+
+	Ticket ticket;
+	{
+		lock_guard<mutex> lock(m_mutex);
+		ticket = Ticket(m_entries.size());
+		m_entries.push_back({ name, VK_NULL_HANDLE, false, 0.0 });
+	}
+
+	m_pool->submit([this, ticket, build]()
+	{
+		auto begin = chrono::steady_clock::now();
+		VkPipeline pipeline = build();
+		double ms = chrono::duration<double, milli>(chrono::steady_clock::now() - begin).count();
+		{
+			lock_guard<mutex> lock(m_mutex);
+			auto& entry = m_entries[ticket];
+			entry.pipeline = pipeline;
+			entry.buildMs = ms;
+			entry.ready = true;
+		}
+		m_readyCv.notify_all();
+	});
+	return ticket;
+}
+
+bool PipelineBuilder::isReady(Ticket ticket) const
+{
+	lock_guard<mutex> lock(m_mutex);
+	return ticket < m_entries.size() && m_entries[ticket].ready;
+}
+
+VkPipeline PipelineBuilder::get(Ticket ticket)
+{
+	unique_lock<mutex> lock(m_mutex);
+	if (ticket >= m_entries.size())
+	{
+		return VK_NULL_HANDLE;
+	}
+	if (!m_entries[ticket].ready)
+	{
+		auto begin = chrono::steady_clock::now();
+		m_readyCv.wait(lock, [this, ticket] { return m_entries[ticket].ready; });
+		m_waitMs += chrono::duration<double, milli>(chrono::steady_clock::now() - begin).count();
+	}
+	return m_entries[ticket].pipeline;
+}
+
+void PipelineBuilder::end()
+{
+	if (m_pool)
+	{
+		m_pool->wait();
+		m_pool.reset();
+	}
+}
+
+string PipelineBuilder::createReport() const
+{
+	lock_guard<mutex> lock(m_mutex);
+	stringstream ss;
+	ss << fixed << setprecision(3);
+	ss << "[PipelineBuilder] " << m_entries.size() << " pipelines, waited " << m_waitMs << " ms" << endl;
+	for (const auto& entry : m_entries)
+	{
+		ss << "  " << entry.name << ": ";
+		if (entry.ready)
+		{
+			ss << entry.buildMs << " ms" << endl;
+		}
+		else
+		{
+			ss << "building" << endl;
+		}
+	}
+	return ss.str();
+}
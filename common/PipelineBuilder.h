@@ -0,0 +1,63 @@
+﻿#pragma once
+
+#include <vulkan/vulkan.h>
+
+#include "ThreadPool.h"
+
+#include <vector>
+#include <string>
+#include <memory>
+#include <functional>
+#include <mutex>
+#include <condition_variable>
+#include <stdint.h>
+
+// パイプラインの作成（SPIR-V の読み込み・シェーダーモジュールの作成・vkCreate*Pipelines）をワーカースレッドで並列に行う
+// 作成を始めた後、呼び出し側は get で使うパイプラインだけを待つ（最初のフレームで使わないものは待たない）
+//
+// 作成する関数はワーカースレッドで呼ばれるので、共有する状態を書き換えないこと
+// パイプラインキャッシュは VK_PIPELINE_CACHE_CREATE_EXTERNALLY_SYNCHRONIZED_BIT を付けずに作成したもの
+// （PipelineCache）ならドライバーが同期するので、すべての作成で同じものを渡してよい
+class PipelineBuilder
+{
+public:
+	PipelineBuilder();
+	~PipelineBuilder();
+
+	PipelineBuilder(const PipelineBuilder&) = delete;
+	PipelineBuilder& operator=(const PipelineBuilder&) = delete;
+
+	typedef uint32_t Ticket;
+	static const Ticket InvalidTicket = UINT32_MAX;
+
+	// build をワーカースレッドで実行する（最初の呼び出しでワーカースレッドを起動する）
+	// name:createReport に出す名前
+	Ticket submit(const char* name, std::function<VkPipeline()> build);
+
+	bool isReady(Ticket ticket) const;
+
+	// 作成が終わるまで待って返す（InvalidTicket の場合は VK_NULL_HANDLE）
+	VkPipeline get(Ticket ticket);
+
+	// すべての作成を待ち、ワーカースレッドを終了する（パイプラインを破棄する前に呼ぶ）
+	void end();
+
+	// パイプラインごとの作成時間と、get で待った時間
+	std::string createReport() const;
+
+private:
+	struct Entry
+	{
+		std::string name;
+		VkPipeline pipeline;
+		bool ready;
+		double buildMs;
+	};
+
+	std::unique_ptr<ThreadPool> m_pool;
+
+	mutable std::mutex m_mutex;
+	std::condition_variable m_readyCv;
+	std::vector<Entry> m_entries;
+	double m_waitMs;
+};
@@ -0,0 +1,185 @@
+﻿#include "PipelineCache.h"
+#include "VulkanAppBase.h"
+
+#include <fstream>
+#include <sstream>
+#include <stdio.h>
+#include <string.h>
+
+using namespace std;
+
+namespace
+{
+	// 結果チェック（VulkanAppBase::checkResult と同じ）
+	void checkResult(VkResult result)
+	{
+		if (result != VK_SUCCESS)
+		{
+			DebugBreak();
+		}
+	}
+}
+
+
+// public ===================================================================
+
+PipelineCache::PipelineCache()
+	: m_device(VK_NULL_HANDLE)
+	, m_physProps{}
+	, m_cache(VK_NULL_HANDLE)
+	, m_loaded(false)
+{
+}
+
+void PipelineCache::create(VkDevice device, VkPhysicalDevice physDev, const char* fileName)
+{
+	m_device = device;
+	vkGetPhysicalDeviceProperties(physDev, &m_physProps);
+	m_fileName = fileName ? fileName : "";
+	m_loaded = false;
+
+	// 今のデバイスのものであれば、ファイルの内容を初期データにする
+	string data;
+	if (!m_fileName.empty())
+	{
+		ifstream ifs(m_fileName, ios::binary | ios::ate);
+		uint64_t fileSize = ifs ? uint64_t(ifs.tellg()) : 0;
+		ifs.seekg(0);
+		FileHeader header{};
+		if (fileSize >= sizeof(header) && ifs.read(reinterpret_cast<char*>(&header), sizeof(header)))
+		{
+			// 壊れたファイルで大きな領域を確保しないよう、先にファイルの大きさと比べる
+			if (header.dataSize == fileSize - sizeof(header))
+			{
+				data.resize(header.dataSize);
+				ifs.read(&data[0], data.size());
+			}
+			if (!ifs || data.empty() || !validate(header, data))
+			{
+				OutputDebugStringA("[PipelineCache] cache file does not match this device, starting empty\n");
+				data.clear();
+			}
+		}
+	}
+
+	VkPipelineCacheCreateInfo ci{};
+	ci.sType = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO;
+	ci.initialDataSize = data.size();
+	ci.pInitialData = data.empty() ? nullptr : data.data();
+	auto result = vkCreatePipelineCache(m_device, &ci, nullptr, &m_cache);
+	if (result != VK_SUCCESS && !data.empty())
+	{
+		// ドライバーが受け付けなかった場合も空から始める
+		ci.initialDataSize = 0;
+		ci.pInitialData = nullptr;
+		data.clear();
+		result = vkCreatePipelineCache(m_device, &ci, nullptr, &m_cache);
+	}
+	checkResult(result);
+	m_loaded = !data.empty();
+
+	if (m_loaded)
+	{
+		stringstream ss;
+		ss << "[PipelineCache] loaded " << data.size() << " bytes from " << m_fileName << endl;
+		OutputDebugStringA(ss.str().c_str());
+	}
+}
+
+void PipelineCache::destroy()
+{
+	if (m_cache == VK_NULL_HANDLE)
+	{
+		return;
+	}
+	save();
+	vkDestroyPipelineCache(m_device, m_cache, nullptr);
+	m_cache = VK_NULL_HANDLE;
+}
+
+// キャッシュの内容をファイルに書く
+bool PipelineCache::save()
+{
+	if (m_fileName.empty() || m_cache == VK_NULL_HANDLE)
+	{
+		return false;
+	}
+
+	size_t size = 0;
+	auto result = vkGetPipelineCacheData(m_device, m_cache, &size, nullptr);
+	if (result != VK_SUCCESS || size == 0)
+	{
+		return false;
+	}
+	string data(size, '\0');
+	result = vkGetPipelineCacheData(m_device, m_cache, &size, &data[0]);
+	if (result != VK_SUCCESS)
+	{
+		return false;
+	}
+	data.resize(size);
+
+	FileHeader header{};
+	header.magic = Magic;
+	header.version = Version;
+	header.vendorID = m_physProps.vendorID;
+	header.deviceID = m_physProps.deviceID;
+	header.driverVersion = m_physProps.driverVersion;
+	memcpy(header.pipelineCacheUUID, m_physProps.pipelineCacheUUID, VK_UUID_SIZE);
+	header.dataSize = uint32_t(data.size());
+
+	// 同時に起動した別のプロセスが書きかけのファイルを読まないよう、一時ファイルから置き換える
+	string tempName = m_fileName + ".tmp";
+	{
+		ofstream ofs(tempName, ios::binary | ios::trunc);
+		ofs.write(reinterpret_cast<const char*>(&header), sizeof(header));
+		ofs.write(data.data(), data.size());
+		if (!ofs)
+		{
+			remove(tempName.c_str());
+			return false;
+		}
+	}
+	remove(m_fileName.c_str());
+	return rename(tempName.c_str(), m_fileName.c_str()) == 0;
+}
+
+
+// private ==================================================================
+
+// 読み込んだデータが今のデバイスのものか
+bool PipelineCache::validate(const FileHeader& header, const string& data) const
+{
+	if (header.magic != Magic || header.version != Version)
+	{
+		return false;
+	}
+	if (header.vendorID != m_physProps.vendorID ||
+		header.deviceID != m_physProps.deviceID ||
+		header.driverVersion != m_physProps.driverVersion ||
+		memcmp(header.pipelineCacheUUID, m_physProps.pipelineCacheUUID, VK_UUID_SIZE) != 0)
+	{
+		return false;
+	}
+
+	// キャッシュ自身のヘッダー（VkPipelineCacheHeaderVersionOne と同じ並び）
+	struct CacheHeader
+	{
+		uint32_t headerSize;
+		uint32_t headerVersion;
+		uint32_t vendorID;
+		uint32_t deviceID;
+		uint8_t pipelineCacheUUID[VK_UUID_SIZE];
+	};
+	if (data.size() < sizeof(CacheHeader))
+	{
+		return false;
+	}
+	CacheHeader cacheHeader;
+	memcpy(&cacheHeader, data.data(), sizeof(cacheHeader));
+	return cacheHeader.headerSize >= sizeof(CacheHeader) &&
+		cacheHeader.headerVersion == VK_PIPELINE_CACHE_HEADER_VERSION_ONE &&
+		cacheHeader.vendorID == m_physProps.vendorID &&
+		cacheHeader.deviceID == m_physProps.deviceID &&
+		memcmp(cacheHeader.pipelineCacheUUID, m_physProps.pipelineCacheUUID, VK_UUID_SIZE) == 0;
+}
@@ -0,0 +1,57 @@
+﻿#pragma once
+
+#include <vulkan/vulkan.h>
+
+#include <string>
+#include <stdint.h>
+
+// パイプラインキャッシュをファイルに保存し、次の起動で読み込む
+// ドライバーがシェーダーをコンパイルし直さなくて済むので、レイマーチングの大きなシェーダーの起動時間を短くできる
+//
+// ファイルは FileHeader に続けて vkGetPipelineCacheData の内容を書く
+// 読み込むときは FileHeader（ベンダー・デバイス・ドライバーのバージョン・キャッシュの UUID）と
+// キャッシュ自身のヘッダーを今のデバイスと比べ、違う場合は読み込まずに空のキャッシュから始める
+class PipelineCache
+{
+public:
+	PipelineCache();
+
+	// ファイルの先頭に置くヘッダー
+	struct FileHeader
+	{
+		uint32_t magic;
+		uint32_t version;
+		uint32_t vendorID;
+		uint32_t deviceID;
+		uint32_t driverVersion;
+		uint8_t pipelineCacheUUID[VK_UUID_SIZE];
+		uint32_t dataSize;
+	};
+
+	static const uint32_t Magic = 0x43504d52;	// "RMPC"
+	static const uint32_t Version = 1;
+
+	// fileName から読み込んでキャッシュを作成する（nullptr の場合はファイルを使わない）
+	void create(VkDevice device, VkPhysicalDevice physDev, const char* fileName);
+	// save を呼んでから破棄する
+	void destroy();
+
+	// キャッシュの内容をファイルに書く（書きかけのファイルを読まないよう、一時ファイルに書いてから置き換える）
+	bool save();
+
+	// vkCreateGraphicsPipelines / vkCreateComputePipelines に渡すキャッシュ
+	VkPipelineCache getHandle() const { return m_cache; }
+
+	// ファイルから読み込んだデータを使えたかどうか
+	bool isLoaded() const { return m_loaded; }
+
+private:
+	// 読み込んだデータが今のデバイスのものか
+	bool validate(const FileHeader& header, const std::string& data) const;
+
+	VkDevice m_device;
+	VkPhysicalDeviceProperties m_physProps;
+	VkPipelineCache m_cache;
+	std::string m_fileName;
+	bool m_loaded;
+};
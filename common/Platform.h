@@ -0,0 +1,24 @@
+﻿#pragma once
+
+// プラットフォームの差を吸収する定義（Vulkan・GLFW を使わないモジュールもこれだけを読み込む）
+#ifdef _WIN32
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#else
+// Windows 以外（ヘッドレスのレンダーノード等）向けの代替定義
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+inline void OutputDebugStringA(const char* str) { fputs(str, stderr); }
+inline void DebugBreak() { abort(); }
+#ifndef _countof
+#define _countof(a) (sizeof(a) / sizeof((a)[0]))
+#endif
+#endif
+
+#ifndef M_PI
+#define M_PI 3.14159265359
+#endif
@@ -0,0 +1,350 @@
+﻿#include "SdfBrickMap.h"
+#include "ThreadPool.h"
+#include "Platform.h"
+
+#include <sstream>
+#include <iomanip>
+#include <chrono>
+#include <random>
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+using namespace glm;
+using namespace std;
+
+
+// public ===================================================================
+
+SdfBrickMap::SdfBrickMap()
+	:m_origin(0.0f)
+	,m_boundsMin(0.0f)
+	,m_boundsMax(0.0f)
+	,m_cellSize(1.0f)
+	,m_brickSize(1)
+	,m_gridSize(0)
+	,m_atlasBricks(0)
+	,m_brickCount(0)
+	,m_bakeTime(0.0)
+{
+}
+
+SdfBrickMap::Settings SdfBrickMap::getDefaultSettings()
+{
+	Settings settings;
+	settings.resolution = 256;
+	settings.brickSize = 8;
+	settings.bandWidth = 2.0f;
+	settings.maxAtlasDimension = 256;
+	return settings;
+}
+
+// BVH の境界を持つグループを焼き込む
+bool SdfBrickMap::bake(const SdfBvh& bvh, const Settings& settings, ThreadPool& pool)
+{
+	auto start = chrono::steady_clock::now();
+	m_atlas.clear();
+	m_cells.clear();
+	m_brickCount = 0;
+
+	vec3 boundsMin, boundsMax;
+	if (!bvh.getBounds(&boundsMin, &boundsMax))
+	{
+		OutputDebugStringA("[SdfBrickMap] scene has no bounded primitives.\n");
+		return false;
+	}
+
+	// 最も長い軸を resolution ボクセルに分ける
+	m_brickSize = (std::max)(settings.brickSize, 1u);
+	vec3 extent = boundsMax - boundsMin;
+	const float voxelSize = (std::max)((std::max)(extent.x, (std::max)(extent.y, extent.z)), 1.0e-3f) / float((std::max)(settings.resolution, 1u));
+	m_cellSize = voxelSize * float(m_brickSize);
+
+	// 境界ボックスの外側に1セルずつ余白を取る
+	m_boundsMin = boundsMin;
+	m_boundsMax = boundsMax;
+	m_origin = boundsMin - vec3(m_cellSize);
+	m_gridSize = uvec3(
+		uint32_t(std::ceil(extent.x / m_cellSize)) + 2,
+		uint32_t(std::ceil(extent.y / m_cellSize)) + 2,
+		uint32_t(std::ceil(extent.z / m_cellSize)) + 2);
+	const uint32_t cellCount = m_gridSize.x * m_gridSize.y * m_gridSize.z;
+
+	// セルの中心からの距離がこれ以下なら、セル内に表面があるかナローバンドに掛かる
+	const float halfDiagonal = m_cellSize * 0.8660254f;
+	const float band = settings.bandWidth * voxelSize;
+
+	// セルの中心の距離で分類する
+	vector<float> centerDistance(cellCount);
+	vector<uint32_t> centerMaterial(cellCount);
+	pool.parallelFor(m_gridSize.y * m_gridSize.z, [&](uint32_t row)
+	{
+		uint32_t y = row % m_gridSize.y;
+		uint32_t z = row / m_gridSize.y;
+		for (uint32_t x = 0; x < m_gridSize.x; x++)
+		{
+			uint32_t index = cellIndex(uvec3(x, y, z));
+			vec3 center = m_origin + (vec3(x, y, z) + vec3(0.5f)) * m_cellSize;
+			centerDistance[index] = bvh.boundedDistance(center, &centerMaterial[index]);
+		}
+	});
+
+	// ブリックの番号は並びが毎回同じになるよう逐次で振る
+	m_cells.resize(cellCount);
+	vector<uint32_t> brickCells;
+	for (uint32_t i = 0; i < cellCount; i++)
+	{
+		float d = centerDistance[i];
+		if (std::abs(d) <= halfDiagonal + band)
+		{
+			m_cells[i].brick = float(brickCells.size());
+			m_cells[i].value = float(centerMaterial[i]);
+			brickCells.push_back(i);
+		}
+		else
+		{
+			// 距離関数は1リプシッツなので、中心から半対角線だけ離れても符号は変わらない
+			m_cells[i].brick = -1.0f;
+			m_cells[i].value = d > 0.0f ? d - halfDiagonal : d + halfDiagonal;
+		}
+	}
+	m_brickCount = uint32_t(brickCells.size());
+
+	// アトラスにはブリックをなるべく立方体に近い形で並べる
+	const uint32_t capacity = settings.maxAtlasDimension / (m_brickSize + 1);
+	const uint32_t count = (std::max)(m_brickCount, 1u);
+	uint32_t ax = (std::min)((std::max)(uint32_t(std::ceil(std::cbrt(double(count)))), 1u), (std::max)(capacity, 1u));
+	uint32_t ay = (std::min)((std::max)(uint32_t(std::ceil(std::sqrt(std::ceil(double(count) / ax)))), 1u), (std::max)(capacity, 1u));
+	uint32_t az = (count + ax * ay - 1) / (ax * ay);
+	if (capacity == 0 || az > capacity)
+	{
+		stringstream ss;
+		ss << "[SdfBrickMap] too many bricks (" << m_brickCount << ") for atlas dimension " << settings.maxAtlasDimension << "." << endl;
+		OutputDebugStringA(ss.str().c_str());
+		m_cells.clear();
+		m_brickCount = 0;
+		return false;
+	}
+	m_atlasBricks = uvec3(ax, ay, az);
+
+	// ブリックの中身（セルの角を含む (brickSize + 1)^3 点）
+	const uvec3 atlasSize = getAtlasSize();
+	const uint32_t samples = m_brickSize + 1;
+	m_atlas.assign(size_t(atlasSize.x) * atlasSize.y * atlasSize.z, floatToHalf(m_cellSize));
+	pool.parallelFor(m_brickCount, [&](uint32_t brick)
+	{
+		uint32_t index = brickCells[brick];
+		uvec3 cell(index % m_gridSize.x, (index / m_gridSize.x) % m_gridSize.y, index / (m_gridSize.x * m_gridSize.y));
+		vec3 corner = m_origin + vec3(cell) * m_cellSize;
+		uvec3 base = brickOrigin(brick);
+		for (uint32_t z = 0; z < samples; z++)
+		{
+			for (uint32_t y = 0; y < samples; y++)
+			{
+				size_t row = (size_t(base.z + z) * atlasSize.y + base.y + y) * atlasSize.x + base.x;
+				for (uint32_t x = 0; x < samples; x++)
+				{
+					vec3 pos = corner + vec3(x, y, z) * voxelSize;
+					m_atlas[row + x] = floatToHalf(bvh.boundedDistance(pos));
+				}
+			}
+		}
+	});
+
+	m_bakeTime = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+	return true;
+}
+
+// シェーダーと同じ方法で標本化した距離
+float SdfBrickMap::distance(const vec3& pos, uint32_t* material) const
+{
+	if (material)
+	{
+		*material = 0;
+	}
+	if (m_cells.empty())
+	{
+		return 1.0e10f;
+	}
+
+	// グリッドの外は焼き込んだ形状の境界ボックスまでの距離
+	vec3 g;
+	const Cell* cell = findCell(pos, &g);
+	if (!cell)
+	{
+		vec3 q = max(m_boundsMin - pos, pos - m_boundsMax);
+		return length(max(q, 0.0f));
+	}
+
+	const Cell& c = *cell;
+	if (c.brick < 0.0f)
+	{
+		return c.value;
+	}
+	if (material)
+	{
+		*material = uint32_t(c.value);
+	}
+
+	// ブリック内で三線形補間する
+	vec3 local = clamp((g - floor(g)) * float(m_brickSize), vec3(0.0f), vec3(float(m_brickSize)));
+	uvec3 i0 = min(uvec3(local), uvec3(m_brickSize - 1));
+	vec3 f = local - vec3(i0);
+	uvec3 base = brickOrigin(uint32_t(c.brick)) + i0;
+
+	const uvec3 atlasSize = getAtlasSize();
+	auto texel = [&](uint32_t x, uint32_t y, uint32_t z)
+	{
+		return halfToFloat(m_atlas[(size_t(base.z + z) * atlasSize.y + base.y + y) * atlasSize.x + base.x + x]);
+	};
+	float d00 = mix(texel(0, 0, 0), texel(1, 0, 0), f.x);
+	float d10 = mix(texel(0, 1, 0), texel(1, 1, 0), f.x);
+	float d01 = mix(texel(0, 0, 1), texel(1, 0, 1), f.x);
+	float d11 = mix(texel(0, 1, 1), texel(1, 1, 1), f.x);
+	return mix(mix(d00, d10, f.y), mix(d01, d11, f.y), f.z);
+}
+
+// メモリ使用量と誤差の報告
+string SdfBrickMap::createReport(const SdfBvh& bvh, uint32_t sampleCount) const
+{
+	stringstream ss;
+	if (m_cells.empty())
+	{
+		ss << "[SdfBrickMap] not baked." << endl;
+		return ss.str();
+	}
+
+	const float voxelSize = getVoxelSize();
+	const uint32_t cellCount = uint32_t(m_cells.size());
+	const uvec3 atlasSize = getAtlasSize();
+
+	// 同じボクセルの大きさで全体を密に持った場合（R16_SFLOAT）
+	const uvec3 denseSize = m_gridSize * m_brickSize + uvec3(1);
+	const double denseBytes = double(denseSize.x) * denseSize.y * denseSize.z * sizeof(uint16_t);
+	const double totalBytes = double(getAtlasBytes() + getCellBytes());
+
+	// グリッド内の点で解析的な距離と比べる
+	// ブリックのあるセルは補間の誤差、無いセルは解析的な距離をどれだけ超えたかを測る
+	// 八面体のように真の距離より小さい値を返す形状があるので、超えた分がすぐに突き抜けにつながるわけではない
+	mt19937 random(1234);
+	uniform_real_distribution<float> unit(0.0f, 1.0f);
+	const vec3 gridExtent = vec3(m_gridSize) * m_cellSize;
+	uint32_t brickSamples = 0;
+	double errorSum = 0.0, errorMax = 0.0, excessMax = 0.0;
+	for (uint32_t i = 0; i < sampleCount; i++)
+	{
+		vec3 pos = m_origin + vec3(unit(random), unit(random), unit(random)) * gridExtent;
+		vec3 g;
+		const Cell* cell = findCell(pos, &g);
+		if (!cell)
+		{
+			continue;
+		}
+		float reference = bvh.boundedDistance(pos);
+		float cached = distance(pos);
+		if (cell->brick >= 0.0f)
+		{
+			double error = std::abs(double(cached) - reference);
+			errorSum += error * error;
+			errorMax = (std::max)(errorMax, error);
+			brickSamples++;
+		}
+		else
+		{
+			// 内側では 0 に近い側が安全側
+			excessMax = (std::max)(excessMax, double(std::abs(cached)) - std::abs(reference));
+		}
+	}
+	const double errorRms = brickSamples > 0 ? std::sqrt(errorSum / brickSamples) : 0.0;
+
+	ss << fixed << setprecision(4);
+	ss << "[SdfBrickMap] grid " << m_gridSize.x << "x" << m_gridSize.y << "x" << m_gridSize.z
+		<< " cells, brick " << m_brickSize << "^3 voxels, voxel " << voxelSize << ", bake " << m_bakeTime << " ms" << endl;
+	ss << "  bricks: " << m_brickCount << " / " << cellCount << " cells (" << 100.0 * m_brickCount / cellCount << "%), atlas "
+		<< atlasSize.x << "x" << atlasSize.y << "x" << atlasSize.z << endl;
+	ss << "  memory: atlas " << getAtlasBytes() / 1024.0 << " KB + table " << getCellBytes() / 1024.0 << " KB = " << totalBytes / 1024.0
+		<< " KB (dense " << denseBytes / 1024.0 << " KB, " << denseBytes / (std::max)(totalBytes, 1.0) << "x smaller)" << endl;
+	ss << "  error in bricks (" << brickSamples << " samples): max " << errorMax << " (" << errorMax / voxelSize << " voxels), rms "
+		<< errorRms << " (" << errorRms / voxelSize << " voxels)" << endl;
+	ss << "  max excess over analytic distance in empty cells: " << excessMax << endl;
+	return ss.str();
+}
+
+
+// private ==================================================================
+
+// 点を含むセル（グリッドの外は nullptr）
+// g:グリッド座標（セル単位）
+const SdfBrickMap::Cell* SdfBrickMap::findCell(const vec3& pos, vec3* g) const
+{
+	*g = (pos - m_origin) / m_cellSize;
+	if (g->x < 0.0f || g->y < 0.0f || g->z < 0.0f || g->x >= float(m_gridSize.x) || g->y >= float(m_gridSize.y) || g->z >= float(m_gridSize.z))
+	{
+		return nullptr;
+	}
+	uvec3 cell = min(uvec3(*g), m_gridSize - uvec3(1));
+	return &m_cells[cellIndex(cell)];
+}
+
+// ブリック番号からアトラス内のテクセル位置
+uvec3 SdfBrickMap::brickOrigin(uint32_t brick) const
+{
+	uvec3 b(brick % m_atlasBricks.x, (brick / m_atlasBricks.x) % m_atlasBricks.y, brick / (m_atlasBricks.x * m_atlasBricks.y));
+	return b * (m_brickSize + 1);
+}
+
+// float -> half（最近接丸め、範囲外は最大値に飽和させる）
+uint16_t SdfBrickMap::floatToHalf(float value)
+{
+	uint32_t bits;
+	memcpy(&bits, &value, sizeof(bits));
+	uint16_t sign = uint16_t((bits >> 16) & 0x8000);
+	int32_t exponent = int32_t((bits >> 23) & 0xff) - 127 + 15;
+	uint32_t mantissa = bits & 0x7fffff;
+
+	if (exponent >= 31)
+	{
+		return sign | 0x7bff;
+	}
+	if (exponent <= 0)
+	{
+		// 非正規化数
+		if (exponent < -10)
+		{
+			return sign;
+		}
+		mantissa |= 0x800000;
+		uint32_t shift = uint32_t(14 - exponent);
+		uint32_t half = mantissa >> shift;
+		if ((mantissa >> (shift - 1)) & 1)
+		{
+			half++;
+		}
+		return sign | uint16_t(half);
+	}
+
+	uint32_t half = (uint32_t(exponent) << 10) | (mantissa >> 13);
+	if (mantissa & 0x1000)
+	{
+		half++;
+	}
+	return sign | uint16_t((std::min)(half, 0x7bffu));
+}
+
+// half -> float
+float SdfBrickMap::halfToFloat(uint16_t value)
+{
+	uint32_t sign = uint32_t(value & 0x8000) << 16;
+	uint32_t exponent = (value >> 10) & 0x1f;
+	uint32_t mantissa = value & 0x3ff;
+
+	float result;
+	if (exponent == 0)
+	{
+		result = std::ldexp(float(mantissa), -24);
+		return sign ? -result : result;
+	}
+	uint32_t bits = sign | ((exponent + 127 - 15) << 23) | (mantissa << 13);
+	memcpy(&result, &bits, sizeof(result));
+	return result;
+}
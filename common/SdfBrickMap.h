@@ -0,0 +1,93 @@
+﻿#pragma once
+
+#include <vector>
+#include <string>
+#include <stdint.h>
+#include "SdfBvh.h"
+
+class ThreadPool;
+
+// 境界を持つグループの距離場を焼き込んだ疎なブリックマップ
+// 空間を brickSize^3 ボクセルのセルに分け、表面の近く（ナローバンド）のセルだけに
+// ボクセルの角で標本化した距離（brickSize + 1)^3 を持つブリックを割り当てる
+// それ以外のセルはセル内のどこでも成り立つ距離の下限を1つだけ持つ
+//
+// シェーダーには以下の2つの3Dテクスチャとして渡す
+//   アトラス:ブリックを並べたもの（R16_SFLOAT、線形補間で標本化する）
+//   インダイレクションテーブル:セルごとの Cell（R32G32_SFLOAT）
+//
+// 平面のように境界を持たないグループは対象外なので、解析的に評価して合成すること
+class SdfBrickMap
+{
+public:
+	SdfBrickMap();
+
+	struct Settings
+	{
+		uint32_t resolution;		// 境界ボックスの最も長い軸のボクセル数
+		uint32_t brickSize;			// ブリック1辺のボクセル数
+		float bandWidth;			// ナローバンドの幅（ボクセル数）
+		uint32_t maxAtlasDimension;	// アトラス1辺の最大テクセル数（maxImageDimension3D）
+	};
+	static Settings getDefaultSettings();
+
+	// インダイレクションテーブルの1要素（シェーダーの texelFetch の結果と同じ並び）
+	struct Cell
+	{
+		float brick;		// ブリック番号（無い場合は -1）
+		float value;		// ブリックがある場合はマテリアル番号、無い場合はセル内の距離の下限
+	};
+
+	// BVH の境界を持つグループを焼き込む
+	bool bake(const SdfBvh& bvh, const Settings& settings, ThreadPool& pool);
+
+	// シェーダーと同じ方法で標本化した距離（境界を持つグループのみ）
+	float distance(const glm::vec3& pos, uint32_t* material = nullptr) const;
+
+	// メモリ使用量と、解析的な距離に対する誤差の報告
+	// sampleCount:誤差を測る点の数
+	std::string createReport(const SdfBvh& bvh, uint32_t sampleCount = 200000) const;
+
+	bool isEmpty() const { return m_cells.empty(); }
+
+	const glm::vec3& getOrigin() const { return m_origin; }
+	float getCellSize() const { return m_cellSize; }
+	float getVoxelSize() const { return m_cellSize / float(m_brickSize); }
+	uint32_t getBrickSize() const { return m_brickSize; }
+	const glm::uvec3& getGridSize() const { return m_gridSize; }
+	const glm::uvec3& getAtlasBricks() const { return m_atlasBricks; }
+	glm::uvec3 getAtlasSize() const { return m_atlasBricks * (m_brickSize + 1); }
+	uint32_t getBrickCount() const { return m_brickCount; }
+
+	// アトラスのテクセル（half float）とインダイレクションテーブル
+	const std::vector<uint16_t>& getAtlas() const { return m_atlas; }
+	const std::vector<Cell>& getCells() const { return m_cells; }
+
+	size_t getAtlasBytes() const { return m_atlas.size() * sizeof(uint16_t); }
+	size_t getCellBytes() const { return m_cells.size() * sizeof(Cell); }
+
+private:
+	uint32_t cellIndex(const glm::uvec3& cell) const { return (cell.z * m_gridSize.y + cell.y) * m_gridSize.x + cell.x; }
+
+	// 点を含むセル（グリッドの外は nullptr）
+	const Cell* findCell(const glm::vec3& pos, glm::vec3* g) const;
+
+	// ブリック番号からアトラス内のテクセル位置
+	glm::uvec3 brickOrigin(uint32_t brick) const;
+
+	static uint16_t floatToHalf(float value);
+	static float halfToFloat(uint16_t value);
+
+	glm::vec3 m_origin;			// グリッドの最小の角
+	glm::vec3 m_boundsMin;		// 焼き込んだ形状の境界ボックス
+	glm::vec3 m_boundsMax;
+	float m_cellSize;
+	uint32_t m_brickSize;
+	glm::uvec3 m_gridSize;		// セル数
+	glm::uvec3 m_atlasBricks;	// アトラスに並べるブリック数
+	uint32_t m_brickCount;
+	double m_bakeTime;			// 焼き込みにかかった時間（ミリ秒）
+
+	std::vector<uint16_t> m_atlas;
+	std::vector<Cell> m_cells;
+};
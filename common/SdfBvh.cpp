@@ -0,0 +1,226 @@
+﻿#include "SdfBvh.h"
+
+#include <algorithm>
+#include <float.h>
+
+using namespace glm;
+using namespace std;
+
+
+// public ===================================================================
+
+// シーンからBVHを構築する
+void SdfBvh::build(const SdfScene& scene, uint32_t maxLeafGroups)
+{
+	const auto& source = scene.getPrimitives();
+	m_primitives.clear();
+	m_nodes.clear();
+
+	// union から次の union の手前までをグループにする
+	vector<Group> groups;
+	for (uint32_t i = 0; i < uint32_t(source.size()); i++)
+	{
+		if (groups.empty() || source[i].info.y == SdfScene::OpUnion)
+		{
+			Group group{};
+			group.first = i;
+			groups.push_back(group);
+		}
+		groups.back().count++;
+	}
+
+	// グループの境界を求める
+	// subtract / intersect は先頭の形を削るだけなので、先頭と smooth の境界を合わせればよい
+	vector<Group> bounded;
+	for (auto& group : groups)
+	{
+		bool hasBounds = true;
+		group.boundsMin = vec3(FLT_MAX);
+		group.boundsMax = vec3(-FLT_MAX);
+		for (uint32_t i = group.first; i < group.first + group.count; i++)
+		{
+			const auto& prim = source[i];
+			if (i != group.first && prim.info.y != SdfScene::OpSmoothUnion)
+			{
+				continue;
+			}
+
+			vec3 boundsMin, boundsMax;
+			if (!SdfScene::primitiveBounds(prim, &boundsMin, &boundsMax))
+			{
+				hasBounds = false;
+				break;
+			}
+			if (prim.info.y == SdfScene::OpSmoothUnion)
+			{
+				// なめらかに繋いだ部分がはみ出す分を広げる
+				boundsMin -= vec3(prim.size.w);
+				boundsMax += vec3(prim.size.w);
+			}
+			group.boundsMin = min(group.boundsMin, boundsMin);
+			group.boundsMax = max(group.boundsMax, boundsMax);
+		}
+
+		if (hasBounds)
+		{
+			group.center = (group.boundsMin + group.boundsMax) * 0.5f;
+			bounded.push_back(group);
+		}
+		else
+		{
+			// 境界を持たないグループは先頭に置き、常に評価する
+			m_primitives.insert(m_primitives.end(), source.begin() + group.first, source.begin() + group.first + group.count);
+		}
+	}
+	m_unboundedCount = uint32_t(m_primitives.size());
+
+	if (!bounded.empty())
+	{
+		buildNode(bounded, 0, uint32_t(bounded.size()), 0, (std::max)(maxLeafGroups, 1u), source);
+	}
+}
+
+// SdfScene::distance と同じ結果をBVHを使って求める
+float SdfBvh::distance(const vec3& pos, uint32_t* material) const
+{
+	float d = 1.0e10f;
+	uint32_t mat = 0;
+
+	// 境界を持たないグループ
+	SdfScene::evaluate(m_primitives.data(), m_unboundedCount, pos, &d, &mat);
+	traverse(pos, &d, &mat);
+
+	if (material)
+	{
+		*material = mat;
+	}
+	return d;
+}
+
+// 境界を持つグループだけの距離
+float SdfBvh::boundedDistance(const vec3& pos, uint32_t* material) const
+{
+	float d = 1.0e10f;
+	uint32_t mat = 0;
+	traverse(pos, &d, &mat);
+
+	if (material)
+	{
+		*material = mat;
+	}
+	return d;
+}
+
+// 境界を持つグループ全体の境界ボックス
+bool SdfBvh::getBounds(vec3* boundsMin, vec3* boundsMax) const
+{
+	if (m_nodes.empty())
+	{
+		return false;
+	}
+	*boundsMin = vec3(m_nodes[0].boundsMin);
+	*boundsMax = vec3(m_nodes[0].boundsMax);
+	return true;
+}
+
+SdfBvh::Header SdfBvh::getHeader() const
+{
+	Header header{};
+	header.info = uvec4(m_unboundedCount, uint32_t(m_nodes.size()), 0, 0);
+	return header;
+}
+
+
+// private ==================================================================
+
+// ノードをたどり、これまでの最小距離より遠いノードは評価しない
+void SdfBvh::traverse(const vec3& pos, float* d, uint32_t* material) const
+{
+	if (m_nodes.empty())
+	{
+		return;
+	}
+
+	uint32_t stack[MaxDepth + 1];
+	uint32_t sp = 0;
+	stack[sp++] = 0;
+	while (sp > 0)
+	{
+		const Node& node = m_nodes[stack[--sp]];
+		if (boxDistance(pos, node) >= *d)
+		{
+			continue;
+		}
+
+		if (node.info.z > 0)
+		{
+			SdfScene::evaluate(&m_primitives[node.info.x], node.info.z, pos, d, material);
+			continue;
+		}
+
+		// 近い方の子を後に積み、先に評価する
+		uint32_t nearChild = node.info.x, farChild = node.info.y;
+		if (boxDistance(pos, m_nodes[farChild]) < boxDistance(pos, m_nodes[nearChild]))
+		{
+			std::swap(nearChild, farChild);
+		}
+		stack[sp++] = farChild;
+		stack[sp++] = nearChild;
+	}
+}
+
+// groups[begin, end) のノードを作る
+uint32_t SdfBvh::buildNode(vector<Group>& groups, uint32_t begin, uint32_t end, uint32_t depth, uint32_t maxLeafGroups, const vector<SdfScene::Primitive>& source)
+{
+	const uint32_t index = uint32_t(m_nodes.size());
+	m_nodes.push_back(Node{});
+
+	vec3 boundsMin = vec3(FLT_MAX), boundsMax = vec3(-FLT_MAX);
+	vec3 centerMin = vec3(FLT_MAX), centerMax = vec3(-FLT_MAX);
+	for (uint32_t i = begin; i < end; i++)
+	{
+		boundsMin = min(boundsMin, groups[i].boundsMin);
+		boundsMax = max(boundsMax, groups[i].boundsMax);
+		centerMin = min(centerMin, groups[i].center);
+		centerMax = max(centerMax, groups[i].center);
+	}
+
+	Node node{};
+	node.boundsMin = vec4(boundsMin, 0.0f);
+	node.boundsMax = vec4(boundsMax, 0.0f);
+
+	// 深さの上限に達したら、残りのグループをすべて1つのリーフに入れる
+	if (end - begin <= maxLeafGroups || depth >= MaxDepth)
+	{
+		// リーフ：グループのプリミティブを連続して並べる
+		uint32_t first = uint32_t(m_primitives.size());
+		for (uint32_t i = begin; i < end; i++)
+		{
+			m_primitives.insert(m_primitives.end(), source.begin() + groups[i].first, source.begin() + groups[i].first + groups[i].count);
+		}
+		node.info = uvec4(first, 0, uint32_t(m_primitives.size()) - first, 0);
+	}
+	else
+	{
+		// 中心の広がりが最も大きい軸の中央値で分割する
+		vec3 extent = centerMax - centerMin;
+		int axis = (extent.x > extent.y && extent.x > extent.z) ? 0 : (extent.y > extent.z ? 1 : 2);
+		uint32_t mid = (begin + end) / 2;
+		nth_element(groups.begin() + begin, groups.begin() + mid, groups.begin() + end,
+			[axis](const Group& a, const Group& b) { return a.center[axis] < b.center[axis]; });
+
+		uint32_t left = buildNode(groups, begin, mid, depth + 1, maxLeafGroups, source);
+		uint32_t right = buildNode(groups, mid, end, depth + 1, maxLeafGroups, source);
+		node.info = uvec4(left, right, 0, 0);
+	}
+
+	m_nodes[index] = node;
+	return index;
+}
+
+// 点から境界ボックスまでの距離
+float SdfBvh::boxDistance(const vec3& pos, const Node& node)
+{
+	vec3 d = max(vec3(node.boundsMin) - pos, pos - vec3(node.boundsMax));
+	return length(max(d, 0.0f));
+}
@@ -0,0 +1,76 @@
+﻿#pragma once
+
+#include <vector>
+#include <stdint.h>
+#include "SdfScene.h"
+
+// SdfScene のグループに対する BVH（境界ボリューム階層）
+// レイの現在位置から見て、これまでに得た最小距離より遠いノードは評価せずに飛ばす
+//
+// プリミティブはリーフの順に並べ替えて保持し、リーフは [first, first + count) の範囲を指す
+// 平面のように境界を持たないグループは先頭にまとめ、常に評価する
+class SdfBvh
+{
+public:
+	SdfBvh() : m_unboundedCount(0) {}
+
+	// シェーダーの BvhNode と同じレイアウト（std430）
+	struct Node
+	{
+		glm::vec4 boundsMin;
+		glm::vec4 boundsMax;
+		glm::uvec4 info;		// 内部ノード x:左の子 y:右の子 z:0 / リーフ x:先頭のプリミティブ z:プリミティブ数
+	};
+
+	// シェーダーの Bvh バッファの先頭と同じレイアウト
+	struct Header
+	{
+		glm::uvec4 info;		// x:常に評価するプリミティブ数 y:ノード数
+	};
+
+	// 木の深さ（根が 0）の上限
+	// たどるときのスタックには最大 MaxDepth + 1 個積むので、シェーダーの BVH_STACK_SIZE(32) に収まる
+	static const uint32_t MaxDepth = 31;
+
+	// maxLeafGroups:1リーフに入れる最大グループ数（MaxDepth に達した場合はそれより多くなる）
+	void build(const SdfScene& scene, uint32_t maxLeafGroups = 4);
+
+	// SdfScene::distance と同じ結果をBVHを使って求める
+	float distance(const glm::vec3& pos, uint32_t* material = nullptr) const;
+
+	// 境界を持つグループだけの距離（境界を持たないグループを別に扱う場合に使う）
+	float boundedDistance(const glm::vec3& pos, uint32_t* material = nullptr) const;
+
+	// 境界を持つグループ全体の境界ボックス（無い場合は false）
+	bool getBounds(glm::vec3* boundsMin, glm::vec3* boundsMax) const;
+
+	// 並べ替えたプリミティブ（ストレージバッファにはこちらを置く）
+	const std::vector<SdfScene::Primitive>& getPrimitives() const { return m_primitives; }
+	const std::vector<Node>& getNodes() const { return m_nodes; }
+	Header getHeader() const;
+	// 先頭から何個が境界を持たないプリミティブか
+	uint32_t getUnboundedCount() const { return m_unboundedCount; }
+
+private:
+	struct Group
+	{
+		uint32_t first;
+		uint32_t count;
+		glm::vec3 boundsMin;
+		glm::vec3 boundsMax;
+		glm::vec3 center;
+	};
+
+	// groups[begin, end) の深さ depth のノードを作り、ノード番号を返す
+	uint32_t buildNode(std::vector<Group>& groups, uint32_t begin, uint32_t end, uint32_t depth, uint32_t maxLeafGroups, const std::vector<SdfScene::Primitive>& source);
+
+	// ノードをたどり、d と material を更新する
+	void traverse(const glm::vec3& pos, float* d, uint32_t* material) const;
+
+	// 点から境界ボックスまでの距離（内側は 0）
+	static float boxDistance(const glm::vec3& pos, const Node& node);
+
+	std::vector<SdfScene::Primitive> m_primitives;
+	std::vector<Node> m_nodes;
+	uint32_t m_unboundedCount;
+};
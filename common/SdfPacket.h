@@ -0,0 +1,125 @@
+﻿#pragma once
+
+// レイパケット（SoA）向けの距離関数
+// F には SimdFloat4 / SimdFloat8 / SimdFloat16 を指定し、4/8/16 本のレイを一度に評価する
+// 各関数は shader.frag の同名関数と同じ計算を行う（位置・サイズは引数で受け取る）
+
+#include "SimdFloat.h"
+
+// SimdFloat.h と同じく、命令セットごとの翻訳単位に閉じるよう無名名前空間に置く
+namespace
+{
+
+// 3成分のレイパケット
+template<class F>
+struct PacketVec3
+{
+	F x, y, z;
+};
+
+template<class F>
+inline F packetLength(F x, F y)
+{
+	return vsqrt(x * x + y * y);
+}
+
+template<class F>
+inline F packetLength(F x, F y, F z)
+{
+	return vsqrt(x * x + y * y + z * z);
+}
+
+// 符号（GLSL の sign と同じく 0 のときは 0）
+template<class F>
+inline F packetSign(F a)
+{
+	const F zero(0.0f);
+	return select(a > zero, F(1.0f), select(a < zero, F(-1.0f), zero));
+}
+
+// 球
+// c:中心 r:半径
+template<class F>
+inline F sphere_d(const PacketVec3<F>& rp, const float c[3], float r)
+{
+	return packetLength(rp.x - c[0], rp.y - c[1], rp.z - c[2]) - r;
+}
+
+// Box
+// c:中心 b:各軸の半分の大きさ
+template<class F>
+inline F box_d(const PacketVec3<F>& rp, const float c[3], const float b[3])
+{
+	const F zero(0.0f);
+	F dx = vabs(rp.x - c[0]) - b[0];
+	F dy = vabs(rp.y - c[1]) - b[1];
+	F dz = vabs(rp.z - c[2]) - b[2];
+	return packetLength(vmax(dx, zero), vmax(dy, zero), vmax(dz, zero)) + vmin(vmax(dx, vmax(dy, dz)), zero);
+}
+
+// Round Box
+// c:中心 b:各軸の半分の大きさ r:角の丸み
+template<class F>
+inline F rbox_d(const PacketVec3<F>& rp, const float c[3], const float b[3], float r)
+{
+	return box_d(rp, c, b) - r;
+}
+
+// Torus（XY平面）
+// c:中心 t:(リング半径, 断面半径)
+template<class F>
+inline F torus_d(const PacketVec3<F>& rp, const float c[3], const float t[2])
+{
+	F px = rp.x - c[0];
+	F py = rp.y - c[1];
+	F pz = rp.z - c[2];
+	F qx = packetLength(px, py) - t[0];
+	return packetLength(qx, pz) - t[1];
+}
+
+// Hexagonal Prism（SdfScene の hexprism と同じく角を丸めない）
+// c:中心 h:(半径, 奥行きの半分)
+template<class F>
+inline F hexPrism_d(const PacketVec3<F>& rp, const float c[3], const float h[2])
+{
+	const float kx = -0.8660254f, ky = 0.5f, kz = 0.57735f;
+	const F zero(0.0f);
+	F px = vabs(rp.x - c[0]);
+	F py = vabs(rp.y - c[1]);
+	F pz = vabs(rp.z - c[2]);
+	F dk = vmin(px * kx + py * ky, zero) * 2.0f;
+	px = px - dk * kx;
+	py = py - dk * ky;
+	F cx = vmin(vmax(px, F(-kz * h[0])), F(kz * h[0]));
+	F dx = packetLength(px - cx, py - h[0]) * packetSign(py - h[0]);
+	F dy = pz - h[1];
+	return vmin(vmax(dx, dy), zero) + packetLength(vmax(dx, zero), vmax(dy, zero));
+}
+
+// Hexagonal Prism（組み込みのシーン、角を 0.1 丸める）
+// c:中心 h:(半径, 奥行きの半分)
+template<class F>
+inline F hexPrizm_d(const PacketVec3<F>& rp, const float c[3], const float h[2])
+{
+	return hexPrism_d(rp, c, h) - 0.1f;
+}
+
+// Octahedron
+// c:中心 s:大きさ
+template<class F>
+inline F octahedron_d(const PacketVec3<F>& rp, const float c[3], float s)
+{
+	F px = vabs(rp.x - c[0]);
+	F py = vabs(rp.y - c[1]);
+	F pz = vabs(rp.z - c[2]);
+	return (px + py + pz - s) * 0.57735027f;
+}
+
+// Plane - Y
+// h:原点から平面までの高さ（y = -h の平面）
+template<class F>
+inline F planey_d(const PacketVec3<F>& rp, float h)
+{
+	return rp.y + h;
+}
+}
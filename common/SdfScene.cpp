@@ -0,0 +1,353 @@
+﻿#include "SdfScene.h"
+#include "Platform.h"
+
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+
+using namespace glm;
+using namespace std;
+
+namespace
+{
+	// クォータニオンの積
+	vec4 quatMul(const vec4& a, const vec4& b)
+	{
+		return vec4(
+			a.w * b.x + a.x * b.w + a.y * b.z - a.z * b.y,
+			a.w * b.y - a.x * b.z + a.y * b.w + a.z * b.x,
+			a.w * b.z + a.x * b.y - a.y * b.x + a.z * b.w,
+			a.w * b.w - a.x * b.x - a.y * b.y - a.z * b.z);
+	}
+
+	// 軸回りの回転
+	vec4 quatAxis(const vec3& axis, float degrees)
+	{
+		float half = degrees * float(M_PI) / 360.0f;
+		return vec4(axis * std::sin(half), std::cos(half));
+	}
+
+	// クォータニオンでベクトルを回転する
+	vec3 quatRotate(const vec4& q, const vec3& v)
+	{
+		vec3 u = vec3(q.x, q.y, q.z);
+		return v + 2.0f * cross(u, cross(u, v) + q.w * v);
+	}
+
+	// 種類ごとの大きさの数
+	struct TypeInfo
+	{
+		const char* name;
+		SdfScene::PrimitiveType type;
+		int sizeCount;
+	};
+	const TypeInfo typeInfos[] = {
+		{ "sphere", SdfScene::TypeSphere, 1 },
+		{ "box", SdfScene::TypeBox, 3 },
+		{ "torus", SdfScene::TypeTorus, 2 },
+		{ "hexprism", SdfScene::TypeHexPrism, 2 },
+		{ "octahedron", SdfScene::TypeOctahedron, 1 },
+		{ "planey", SdfScene::TypePlaneY, 0 },
+	};
+
+	void parseError(int line, const string& message)
+	{
+		stringstream ss;
+		ss << "[SdfScene] line " << line << ": " << message << endl;
+		OutputDebugStringA(ss.str().c_str());
+	}
+}
+
+
+// public ===================================================================
+
+// ファイルから読み込む
+bool SdfScene::load(const char* fileName)
+{
+	ifstream infile(fileName);
+	if (!infile)
+	{
+		OutputDebugStringA("file not found.\n");
+		return false;
+	}
+	stringstream ss;
+	ss << infile.rdbuf();
+	return parse(ss.str());
+}
+
+// 文字列から読み込む
+bool SdfScene::parse(const string& text)
+{
+	vector<Primitive> primitives;
+	vector<Material> materials;
+	vector<string> materialNames;
+
+	istringstream input(text);
+	string line;
+	for (int lineNo = 1; getline(input, line); lineNo++)
+	{
+		line = line.substr(0, line.find('#'));
+		istringstream ls(line);
+		string keyword;
+		if (!(ls >> keyword))
+		{
+			continue;
+		}
+
+		// マテリアル
+		if (keyword == "material")
+		{
+			string name;
+			Material mat{};
+			ls >> name
+				>> mat.color0.r >> mat.color0.g >> mat.color0.b
+				>> mat.color1.r >> mat.color1.g >> mat.color1.b
+				>> mat.checker.x >> mat.checker.y >> mat.checker.z >> mat.checker.w;
+			if (ls.fail())
+			{
+				parseError(lineNo, "invalid material.");
+				return false;
+			}
+			materialNames.push_back(name);
+			materials.push_back(mat);
+			continue;
+		}
+
+		// プリミティブ
+		const TypeInfo* typeInfo = nullptr;
+		for (const auto& v : typeInfos)
+		{
+			if (keyword == v.name)
+			{
+				typeInfo = &v;
+			}
+		}
+		if (!typeInfo)
+		{
+			parseError(lineNo, "unknown keyword '" + keyword + "'.");
+			return false;
+		}
+
+		Primitive prim{};
+		prim.rotation = vec4(0, 0, 0, 1);
+		prim.info.x = typeInfo->type;
+		ls >> prim.position.x >> prim.position.y >> prim.position.z;
+		for (int i = 0; i < typeInfo->sizeCount; i++)
+		{
+			ls >> prim.size[i];
+		}
+		if (ls.fail())
+		{
+			parseError(lineNo, "missing position or size.");
+			return false;
+		}
+
+		// オプション
+		string option;
+		while (ls >> option)
+		{
+			size_t eq = option.find('=');
+			string key = option.substr(0, eq);
+			string value = (eq == string::npos) ? string() : option.substr(eq + 1);
+			replace(value.begin(), value.end(), ',', ' ');
+			istringstream vs(value);
+
+			if (key == "rotate")
+			{
+				// X -> Y -> Z の順に回したものの逆回転を持つ
+				vec3 euler;
+				vs >> euler.x >> euler.y >> euler.z;
+				vec4 q = quatMul(quatAxis(vec3(0, 0, 1), euler.z), quatMul(quatAxis(vec3(0, 1, 0), euler.y), quatAxis(vec3(1, 0, 0), euler.x)));
+				prim.rotation = vec4(-q.x, -q.y, -q.z, q.w);
+			}
+			else if (key == "round")
+			{
+				vs >> prim.position.w;
+			}
+			else if (key == "smooth")
+			{
+				vs >> prim.size.w;
+			}
+			else if (key == "op")
+			{
+				if (value == "union") prim.info.y = OpUnion;
+				else if (value == "subtract") prim.info.y = OpSubtract;
+				else if (value == "intersect") prim.info.y = OpIntersect;
+				else if (value == "smooth") prim.info.y = OpSmoothUnion;
+				else vs.setstate(ios::failbit);
+			}
+			else if (key == "material")
+			{
+				auto it = find(materialNames.begin(), materialNames.end(), value);
+				if (it == materialNames.end())
+				{
+					parseError(lineNo, "unknown material '" + value + "'.");
+					return false;
+				}
+				prim.info.z = uint32_t(it - materialNames.begin());
+			}
+			else
+			{
+				vs.setstate(ios::failbit);
+			}
+
+			if (vs.fail())
+			{
+				parseError(lineNo, "invalid option '" + option + "'.");
+				return false;
+			}
+		}
+
+		primitives.push_back(prim);
+	}
+
+	if (primitives.empty() || materials.empty())
+	{
+		parseError(0, "scene needs at least one primitive and one material.");
+		return false;
+	}
+
+	m_primitives.swap(primitives);
+	m_materials.swap(materials);
+	return true;
+}
+
+// シェーダーの distance と同じ計算
+float SdfScene::distance(const vec3& pos, uint32_t* material) const
+{
+	float d = 1.0e10f;
+	uint32_t mat = 0;
+	evaluate(m_primitives.data(), uint32_t(m_primitives.size()), pos, &d, &mat);
+
+	if (material)
+	{
+		*material = mat;
+	}
+	return d;
+}
+
+// プリミティブ単体の距離
+float SdfScene::primitiveDistance(const Primitive& prim, const vec3& pos)
+{
+	vec3 p = quatRotate(prim.rotation, pos - vec3(prim.position));
+	const vec4& s = prim.size;
+
+	float d = 0.0f;
+	switch (prim.info.x)
+	{
+	case TypeSphere:
+		d = length(p) - s.x;
+		break;
+	case TypeBox:
+	{
+		vec3 q = abs(p) - vec3(s);
+		d = length(max(q, 0.0f)) + (std::min)((std::max)(q.x, (std::max)(q.y, q.z)), 0.0f);
+		break;
+	}
+	case TypeTorus:
+	{
+		vec2 q = vec2(length(vec2(p.x, p.y)) - s.x, p.z);
+		d = length(q) - s.y;
+		break;
+	}
+	case TypeHexPrism:
+	{
+		const vec3 k = vec3(-0.8660254f, 0.5f, 0.57735f);
+		p = abs(p);
+		vec2 pxy = vec2(p.x, p.y);
+		pxy -= 2.0f * (std::min)(dot(vec2(k.x, k.y), pxy), 0.0f) * vec2(k.x, k.y);
+		vec2 q = vec2(
+			length(pxy - vec2(glm::clamp(pxy.x, -k.z * s.x, k.z * s.x), s.x)) * glm::sign(pxy.y - s.x), p.z - s.y);
+		d = (std::min)((std::max)(q.x, q.y), 0.0f) + length(max(q, 0.0f));
+		break;
+	}
+	case TypeOctahedron:
+		p = abs(p);
+		d = (p.x + p.y + p.z - s.x) * 0.57735027f;
+		break;
+	case TypePlaneY:
+		d = p.y;
+		break;
+	}
+	return d - prim.position.w;
+}
+
+// グループ単位で並んだプリミティブ列を評価する
+void SdfScene::evaluate(const Primitive* primitives, uint32_t count, const vec3& pos, float* d, uint32_t* material)
+{
+	// グループ内の合成結果
+	float dg = 1.0e10f;
+	uint32_t mg = 0;
+
+	for (uint32_t i = 0; i < count; i++)
+	{
+		const auto& prim = primitives[i];
+		float di = primitiveDistance(prim, pos);
+		switch (prim.info.y)
+		{
+		case OpUnion:
+			// 新しいグループを始める
+			if (dg < *d)
+			{
+				*d = dg;
+				*material = mg;
+			}
+			dg = di;
+			mg = prim.info.z;
+			break;
+		case OpSubtract:
+			dg = (std::max)(dg, -di);
+			break;
+		case OpIntersect:
+			dg = (std::max)(dg, di);
+			break;
+		case OpSmoothUnion:
+		{
+			float k = (std::max)(prim.size.w, 1.0e-5f);
+			float h = glm::clamp(0.5f + 0.5f * (dg - di) / k, 0.0f, 1.0f);
+			dg = mix(dg, di, h) - k * h * (1.0f - h);
+			if (h > 0.5f)
+			{
+				mg = prim.info.z;
+			}
+			break;
+		}
+		}
+	}
+
+	if (dg < *d)
+	{
+		*d = dg;
+		*material = mg;
+	}
+}
+
+// プリミティブ単体の境界ボックス
+bool SdfScene::primitiveBounds(const Primitive& prim, vec3* boundsMin, vec3* boundsMax)
+{
+	// ローカル座標での各軸の半分の大きさ
+	const vec4& s = prim.size;
+	vec3 extent;
+	switch (prim.info.x)
+	{
+	case TypeSphere:		extent = vec3(s.x); break;
+	case TypeBox:			extent = vec3(s); break;
+	case TypeTorus:			extent = vec3(s.x + s.y, s.x + s.y, s.y); break;
+	case TypeHexPrism:		extent = vec3(s.x * 1.1547006f, s.x * 1.1547006f, s.y); break;	// 外接円の半径
+	case TypeOctahedron:	extent = vec3(s.x); break;
+	default:
+		return false;
+	}
+	// 八面体の距離は 1/√3 倍に縮めた下限なので、丸めの分もその倍だけ広がる
+	extent += vec3(prim.position.w * (prim.info.x == TypeOctahedron ? 1.7320508f : 1.0f));
+
+	// 回転している場合は外接球で包む
+	if (prim.rotation.x != 0.0f || prim.rotation.y != 0.0f || prim.rotation.z != 0.0f)
+	{
+		extent = vec3(length(extent));
+	}
+
+	*boundsMin = vec3(prim.position) - extent;
+	*boundsMax = vec3(prim.position) + extent;
+	return true;
+}
@@ -0,0 +1,86 @@
+﻿#pragma once
+
+#include <vector>
+#include <string>
+#include <stdint.h>
+#include "glm/glm.hpp"
+
+// 距離関数で表現するシーンの記述
+// テキストファイルからプリミティブ・変換・CSG演算・マテリアルを読み込み、
+// シェーダーのストレージバッファにそのまま渡せる形で保持する
+//
+// ファイル形式（1行1要素、# 以降はコメント）
+//   material <名前> <色0 r g b> <色1 r g b> <市松の周波数 x y z> <アルベドの乗数>
+//   <種類> <位置 x y z> <大きさ...> [rotate=x,y,z] [round=r] [op=union|subtract|intersect|smooth] [smooth=k] [material=名前]
+//
+//   種類と大きさの数
+//     sphere:半径 / box:各軸の半分の大きさ(3) / torus:リング半径,断面半径 /
+//     hexprism:半径,奥行きの半分 / octahedron:大きさ / planey:無し（位置の y が平面の高さ）
+//
+// union のプリミティブから次の union の手前までを1つのグループとし、
+// subtract / intersect / smooth はグループ内で先頭から順に合成する
+// グループ同士は union で合成するので、グループ単位でカリングできる
+class SdfScene
+{
+public:
+	enum PrimitiveType
+	{
+		TypeSphere,
+		TypeBox,
+		TypeTorus,
+		TypeHexPrism,
+		TypeOctahedron,
+		TypePlaneY,
+	};
+
+	// グループ内の手前までの結果との合成方法（union は新しいグループを始める）
+	enum Operation
+	{
+		OpUnion,
+		OpSubtract,
+		OpIntersect,
+		OpSmoothUnion,
+	};
+
+	// シェーダーの Primitive と同じレイアウト（std430）
+	struct Primitive
+	{
+		glm::vec4 position;		// xyz:中心 w:角の丸み
+		glm::vec4 size;			// xyz:形状ごとの大きさ w:smooth の幅
+		glm::vec4 rotation;		// ワールド -> ローカルの回転（クォータニオン）
+		glm::uvec4 info;		// x:種類 y:合成方法 z:マテリアル番号
+	};
+
+	// シェーダーの Material と同じレイアウト（std430）
+	struct Material
+	{
+		glm::vec4 color0;
+		glm::vec4 color1;
+		glm::vec4 checker;		// xyz:市松模様の周波数（0 の軸は使わない） w:アルベドの乗数
+	};
+
+	// ファイルから読み込む
+	bool load(const char* fileName);
+	// 文字列から読み込む
+	bool parse(const std::string& text);
+
+	const std::vector<Primitive>& getPrimitives() const { return m_primitives; }
+	const std::vector<Material>& getMaterials() const { return m_materials; }
+
+	// シェーダーの distance と同じ計算（CPU側で使う）
+	// material:最も近いプリミティブのマテリアル番号
+	float distance(const glm::vec3& pos, uint32_t* material = nullptr) const;
+
+	// プリミティブ単体の距離
+	static float primitiveDistance(const Primitive& prim, const glm::vec3& pos);
+
+	// グループ単位で並んだプリミティブ列を評価し、d と material を更新する
+	static void evaluate(const Primitive* primitives, uint32_t count, const glm::vec3& pos, float* d, uint32_t* material);
+
+	// プリミティブ単体の境界ボックス（平面など無限に広がる場合は false）
+	static bool primitiveBounds(const Primitive& prim, glm::vec3* boundsMin, glm::vec3* boundsMax);
+
+private:
+	std::vector<Primitive> m_primitives;
+	std::vector<Material> m_materials;
+};
@@ -0,0 +1,404 @@
+﻿#include "SdfSceneCompiler.h"
+#include "SdfBrickMap.h"
+#include "Platform.h"
+
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <chrono>
+#include <shaderc/shaderc.h>
+
+#ifdef _WIN32
+#pragma comment(lib, "shaderc_shared.lib")
+#endif
+
+using namespace glm;
+using namespace std;
+
+namespace
+{
+	const char* SceneBeginMarker = "// @SCENE_BEGIN";
+	const char* SceneEndMarker = "// @SCENE_END";
+
+	// 生成コードの形式を変えたら更新する（キャッシュを無効にするため）
+	const char* GeneratorVersion = "SdfSceneCompiler 3";
+
+	const uint32_t SpirvMagic = 0x07230203;
+
+	// distance() が返すマテリアル番号のうち、平面のプリミティブであることを表すビット（shader.frag の MATERIAL_PLANE_BIT）
+	const uint32_t MaterialPlaneBit = 0x80000000u;
+
+	// GLSL の float リテラル
+	string glslFloat(float v)
+	{
+		ostringstream ss;
+		ss << setprecision(9) << v;
+		string s = ss.str();
+		if (s.find_first_of(".e") == string::npos)
+		{
+			s += ".0";
+		}
+		return s;
+	}
+
+	string glslVec(const vec4& v, int count)
+	{
+		const float values[] = { v.x, v.y, v.z, v.w };
+		string s = "vec" + to_string(count) + "(";
+		for (int i = 0; i < count; i++)
+		{
+			s += (i > 0 ? ", " : "") + glslFloat(values[i]);
+		}
+		return s + ")";
+	}
+
+	// プリミティブ単体の距離を求める式
+	string primitiveExpression(const SdfScene::Primitive& prim)
+	{
+		// 平行移動・回転は必要なときだけ行う
+		string p = "pos";
+		if (prim.position.x != 0.0f || prim.position.y != 0.0f || prim.position.z != 0.0f)
+		{
+			p = "(pos - " + glslVec(prim.position, 3) + ")";
+		}
+		if (prim.rotation.x != 0.0f || prim.rotation.y != 0.0f || prim.rotation.z != 0.0f)
+		{
+			p = "rotate(" + glslVec(prim.rotation, 4) + ", " + p + ")";
+		}
+
+		string expr;
+		switch (prim.info.x)
+		{
+		case SdfScene::TypeSphere:		expr = "sphere_d(" + p + ", " + glslFloat(prim.size.x) + ")"; break;
+		case SdfScene::TypeBox:			expr = "box_d(" + p + ", " + glslVec(prim.size, 3) + ")"; break;
+		case SdfScene::TypeTorus:		expr = "torus_d(" + p + ", " + glslVec(prim.size, 2) + ")"; break;
+		case SdfScene::TypeHexPrism:	expr = "hexPrizm_d(" + p + ", " + glslVec(prim.size, 2) + ")"; break;
+		case SdfScene::TypeOctahedron:	expr = "octahedron_d(" + p + ", " + glslFloat(prim.size.x) + ")"; break;
+		case SdfScene::TypePlaneY:		expr = "planey_d(" + p + ")"; break;
+		}
+
+		if (prim.position.w != 0.0f)
+		{
+			expr += " - " + glslFloat(prim.position.w);
+		}
+		return expr;
+	}
+
+	// distance() が返すマテリアル番号の GLSL リテラル
+	string primitiveMaterial(const SdfScene::Primitive& prim)
+	{
+		uint32_t material = prim.info.z | (prim.info.x == SdfScene::TypePlaneY ? MaterialPlaneBit : 0u);
+		return to_string(material) + "u";
+	}
+
+	// グループ単位で並んだプリミティブ列を合成し、d と material を更新するコード
+	void emitPrimitives(ostringstream& ss, const SdfScene::Primitive* primitives, size_t count)
+	{
+		for (size_t first = 0; first < count; )
+		{
+			// グループ（union から次の union の手前まで）
+			size_t last = first + 1;
+			while (last < count && primitives[last].info.y != SdfScene::OpUnion)
+			{
+				last++;
+			}
+
+			// 1つだけのグループはそのまま合成する
+			if (last - first == 1)
+			{
+				ss << "\n  di = " << primitiveExpression(primitives[first]) << ";\n";
+				ss << "  if(di < d) { d = di; material = " << primitiveMaterial(primitives[first]) << "; }\n";
+				first = last;
+				continue;
+			}
+
+			ss << "\n  dg = " << primitiveExpression(primitives[first]) << ";\n";
+			ss << "  mg = " << primitiveMaterial(primitives[first]) << ";\n";
+			for (size_t i = first + 1; i < last; i++)
+			{
+				const auto& prim = primitives[i];
+				ss << "  di = " << primitiveExpression(prim) << ";\n";
+				switch (prim.info.y)
+				{
+				case SdfScene::OpSubtract:
+					ss << "  dg = max(dg, -di);\n";
+					break;
+				case SdfScene::OpIntersect:
+					ss << "  dg = max(dg, di);\n";
+					break;
+				case SdfScene::OpSmoothUnion:
+				{
+					string k = glslFloat((std::max)(prim.size.w, 1.0e-5f));
+					ss << "  {\n";
+					ss << "    float h = clamp(0.5 + 0.5 * (dg - di) / " << k << ", 0.0, 1.0);\n";
+					ss << "    dg = mix(dg, di, h) - " << k << " * h * (1.0 - h);\n";
+					ss << "    if(h > 0.5) { mg = " << primitiveMaterial(prim) << "; }\n";
+					ss << "  }\n";
+					break;
+				}
+				}
+			}
+			ss << "  if(dg < d) { d = dg; material = mg; }\n";
+			first = last;
+		}
+	}
+}
+
+
+// public ===================================================================
+
+// シーン専用の distance(vec3 pos, out uint material) を生成する
+string SdfSceneCompiler::generateDistanceFunction(const SdfScene& scene)
+{
+	const auto& primitives = scene.getPrimitives();
+
+	ostringstream ss;
+	ss << "// generated by SdfSceneCompiler\n";
+	ss << "float distance(vec3 pos, out uint material)\n";
+	ss << "{\n";
+	ss << "  float d = 1.0e10, dg, di;\n";
+	ss << "  uint mg;\n";
+	ss << "  material = 0u;\n";
+
+	emitPrimitives(ss, primitives.data(), primitives.size());
+
+	ss << "  return d;\n";
+	ss << "}\n";
+	return ss.str();
+}
+
+// 焼き込んだ距離場を標本化する distance(vec3 pos, out uint material) を生成する
+string SdfSceneCompiler::generateBrickMapDistanceFunction(const SdfBvh& bvh, const SdfBrickMap& brickMap)
+{
+	vec3 boundsMin, boundsMax;
+	bvh.getBounds(&boundsMin, &boundsMax);
+	const uvec3 grid = brickMap.getGridSize();
+	const uvec3 atlas = brickMap.getAtlasBricks();
+	const uvec3 atlasSize = brickMap.getAtlasSize();
+
+	ostringstream ss;
+	ss << "// generated by SdfSceneCompiler (brick map)\n";
+	ss << "layout(binding=4) uniform sampler3D brickAtlas;   // R16_SFLOAT、線形補間\n";
+	ss << "layout(binding=5) uniform sampler3D brickCells;   // SdfBrickMap::Cell\n";
+	ss << "\n";
+	ss << "const vec3 BRICK_ORIGIN = " << glslVec(vec4(brickMap.getOrigin(), 0.0f), 3) << ";\n";
+	ss << "const vec3 BRICK_BOUNDS_MIN = " << glslVec(vec4(boundsMin, 0.0f), 3) << ";\n";
+	ss << "const vec3 BRICK_BOUNDS_MAX = " << glslVec(vec4(boundsMax, 0.0f), 3) << ";\n";
+	ss << "const float BRICK_CELL_SIZE = " << glslFloat(brickMap.getCellSize()) << ";\n";
+	ss << "const float BRICK_SIZE = " << glslFloat(float(brickMap.getBrickSize())) << ";\n";
+	ss << "const ivec3 BRICK_GRID = ivec3(" << grid.x << ", " << grid.y << ", " << grid.z << ");\n";
+	ss << "const ivec3 BRICK_ATLAS = ivec3(" << atlas.x << ", " << atlas.y << ", " << atlas.z << ");\n";
+	ss << "const vec3 BRICK_ATLAS_SIZE = vec3(" << atlasSize.x << ", " << atlasSize.y << ", " << atlasSize.z << ");\n";
+	ss << "\n";
+	ss << "// 境界を持つグループ（SdfBrickMap::distance と同じ）\n";
+	ss << "float brickMap_d(vec3 pos, out uint material)\n";
+	ss << "{\n";
+	ss << "  material = 0u;\n";
+	ss << "  vec3 g = (pos - BRICK_ORIGIN) / BRICK_CELL_SIZE;\n";
+	ss << "  if(any(lessThan(g, vec3(0.0))) || any(greaterThanEqual(g, vec3(BRICK_GRID)))) {\n";
+	ss << "    vec3 q = max(BRICK_BOUNDS_MIN - pos, pos - BRICK_BOUNDS_MAX);\n";
+	ss << "    return length(max(q, 0.0));\n";
+	ss << "  }\n";
+	ss << "  ivec3 cell = min(ivec3(g), BRICK_GRID - 1);\n";
+	ss << "  vec2 c = texelFetch(brickCells, cell, 0).xy;\n";
+	ss << "  if(c.x < 0.0) {\n";
+	ss << "    return c.y;\n";
+	ss << "  }\n";
+	ss << "  material = uint(c.y);\n";
+	ss << "  int brick = int(c.x);\n";
+	ss << "  ivec3 b = ivec3(brick % BRICK_ATLAS.x, (brick / BRICK_ATLAS.x) % BRICK_ATLAS.y, brick / (BRICK_ATLAS.x * BRICK_ATLAS.y));\n";
+	ss << "  vec3 texel = vec3(b) * (BRICK_SIZE + 1.0) + 0.5 + clamp(g - vec3(cell), 0.0, 1.0) * BRICK_SIZE;\n";
+	ss << "  return textureLod(brickAtlas, texel / BRICK_ATLAS_SIZE, 0.0).r;\n";
+	ss << "}\n";
+	ss << "\n";
+	ss << "float distance(vec3 pos, out uint material)\n";
+	ss << "{\n";
+	ss << "  float d = brickMap_d(pos, material), dg, di;\n";
+	ss << "  uint mg;\n";
+
+	// 境界を持たないグループは解析的に評価する
+	emitPrimitives(ss, bvh.getPrimitives().data(), bvh.getUnboundedCount());
+
+	ss << "  return d;\n";
+	ss << "}\n";
+	return ss.str();
+}
+
+// シェーダーソースのシーン部分を置き換える
+bool SdfSceneCompiler::specializeSource(const string& source, const SdfScene& scene, string* specialized)
+{
+	return specializeSource(source, generateDistanceFunction(scene), specialized);
+}
+
+bool SdfSceneCompiler::specializeSource(const string& source, const string& distanceFunction, string* specialized)
+{
+	size_t begin = source.find(SceneBeginMarker);
+	size_t end = source.find(SceneEndMarker);
+	if (begin == string::npos || end == string::npos || end < begin)
+	{
+		OutputDebugStringA("[SdfSceneCompiler] scene markers not found.\n");
+		return false;
+	}
+	end += strlen(SceneEndMarker);
+
+	*specialized = source.substr(0, begin) + distanceFunction + source.substr(end);
+	return true;
+}
+
+// シーンに特殊化したフラグメントシェーダーの SPIR-V を得る
+bool SdfSceneCompiler::compile(const char* sourceFile, const SdfScene& scene, vector<uint32_t>* spirv, const string& defines, Stage stage)
+{
+	return compile(sourceFile, generateDistanceFunction(scene), spirv, defines, stage);
+}
+
+bool SdfSceneCompiler::compile(const char* sourceFile, const string& distanceFunction, vector<uint32_t>* spirv, const string& defines, Stage stage)
+{
+	string original, source;
+	if (!loadSource(sourceFile, &original) || !specializeSource(original, distanceFunction, &source))
+	{
+		return false;
+	}
+	return compileSource(sourceFile, source, spirv, defines, stage);
+}
+
+// シーン部分を置き換えずにコンパイルする
+bool SdfSceneCompiler::compileGeneric(const char* sourceFile, vector<uint32_t>* spirv, const string& defines, Stage stage)
+{
+	string source;
+	if (!loadSource(sourceFile, &source))
+	{
+		return false;
+	}
+	return compileSource(sourceFile, source, spirv, defines, stage);
+}
+
+// FNV-1a（64bit）
+uint64_t SdfSceneCompiler::hash(const string& text)
+{
+	uint64_t h = 14695981039346656037ull;
+	for (unsigned char c : text)
+	{
+		h ^= c;
+		h *= 1099511628211ull;
+	}
+	return h;
+}
+
+
+// private ==================================================================
+
+bool SdfSceneCompiler::loadSource(const char* sourceFile, string* source)
+{
+	ifstream infile(sourceFile, std::ios::binary);
+	if (!infile)
+	{
+		OutputDebugStringA("file not found.\n");
+		return false;
+	}
+	stringstream ss;
+	ss << infile.rdbuf();
+	*source = ss.str();
+	return true;
+}
+
+// defines を挿入してコンパイルする
+bool SdfSceneCompiler::compileSource(const char* sourceFile, string source, vector<uint32_t>* spirv, const string& defines, Stage stage)
+{
+	// #version より前には何も置けないので、その次の行に挿入する
+	if (!defines.empty())
+	{
+		size_t version = source.find("#version");
+		size_t lineEnd = (version == string::npos) ? string::npos : source.find('\n', version);
+		if (lineEnd == string::npos)
+		{
+			OutputDebugStringA("[SdfSceneCompiler] #version not found.\n");
+			return false;
+		}
+		source.insert(lineEnd + 1, defines);
+	}
+
+	// 生成したソースとジェネレーターのバージョン、ステージからキャッシュのファイル名を決める
+	stringstream cacheName;
+	cacheName << sourceFile << "." << hex << setw(16) << setfill('0') << hash(GeneratorVersion + source) << (stage == StageCompute ? ".comp" : "") << ".spv";
+
+	if (loadSpirv(cacheName.str(), spirv))
+	{
+		OutputDebugStringA(("[SdfSceneCompiler] cache hit: " + cacheName.str() + "\n").c_str());
+		return true;
+	}
+
+	auto start = chrono::steady_clock::now();
+	if (!compileGlsl(source, sourceFile, stage, spirv))
+	{
+		return false;
+	}
+	double ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+
+	stringstream log;
+	log << "[SdfSceneCompiler] compiled " << cacheName.str() << " (" << ms << " ms)" << endl;
+	OutputDebugStringA(log.str().c_str());
+
+	// キャッシュの保存に失敗しても、コンパイル結果はそのまま使える
+	saveSpirv(cacheName.str(), *spirv);
+	return true;
+}
+
+// GLSL を SPIR-V にコンパイルする
+bool SdfSceneCompiler::compileGlsl(const string& source, const char* name, Stage stage, vector<uint32_t>* spirv)
+{
+	shaderc_compiler_t compiler = shaderc_compiler_initialize();
+	shaderc_compile_options_t options = shaderc_compile_options_initialize();
+	shaderc_compile_options_set_optimization_level(options, shaderc_optimization_level_performance);
+
+	shaderc_shader_kind kind = (stage == StageCompute) ? shaderc_glsl_compute_shader : shaderc_glsl_fragment_shader;
+	shaderc_compilation_result_t result = shaderc_compile_into_spv(
+		compiler, source.c_str(), source.size(), kind, name, "main", options);
+
+	bool success = shaderc_result_get_compilation_status(result) == shaderc_compilation_status_success;
+	if (success)
+	{
+		size_t size = shaderc_result_get_length(result);
+		spirv->resize(size / sizeof(uint32_t));
+		memcpy(spirv->data(), shaderc_result_get_bytes(result), size);
+	}
+	else
+	{
+		OutputDebugStringA("[SdfSceneCompiler] compile error.\n");
+		OutputDebugStringA(shaderc_result_get_error_message(result));
+	}
+
+	shaderc_result_release(result);
+	shaderc_compile_options_release(options);
+	shaderc_compiler_release(compiler);
+	return success;
+}
+
+bool SdfSceneCompiler::loadSpirv(const string& fileName, vector<uint32_t>* spirv)
+{
+	ifstream infile(fileName, std::ios::binary);
+	if (!infile)
+	{
+		return false;
+	}
+	size_t size = size_t(infile.seekg(0, ifstream::end).tellg());
+	if (size < sizeof(uint32_t) || size % sizeof(uint32_t) != 0)
+	{
+		return false;
+	}
+	spirv->resize(size / sizeof(uint32_t));
+	infile.seekg(0, ifstream::beg).read(reinterpret_cast<char*>(spirv->data()), size);
+
+	// 書き込み途中で終わったファイルなどは使わない
+	return infile.good() && (*spirv)[0] == SpirvMagic;
+}
+
+bool SdfSceneCompiler::saveSpirv(const string& fileName, const vector<uint32_t>& spirv)
+{
+	ofstream outfile(fileName, std::ios::binary);
+	if (!outfile)
+	{
+		return false;
+	}
+	outfile.write(reinterpret_cast<const char*>(spirv.data()), spirv.size() * sizeof(uint32_t));
+	return outfile.good();
+}
@@ -0,0 +1,64 @@
+﻿#pragma once
+
+#include <vector>
+#include <string>
+#include <stdint.h>
+#include "SdfScene.h"
+#include "SdfBvh.h"
+
+class SdfBrickMap;
+
+// シーン記述からシーン専用の distance() を GLSL で生成し、SPIR-V にコンパイルする
+// プリミティブの種類・位置・合成方法を定数として展開するので、
+// ストレージバッファを解釈するループや分岐が無くなる
+//
+// シェーダーソースの "// @SCENE_BEGIN" から "// @SCENE_END" までを生成コードに置き換える
+// コンパイル結果はソースのハッシュをファイル名にしてディスクに保存し、次回以降はそれを読み込む
+// 距離場を焼き込んだ場合は、ブリックマップを標本化して平面などだけを解析的に評価するコードを生成する
+class SdfSceneCompiler
+{
+public:
+	// コンパイルするシェーダーステージ
+	enum Stage
+	{
+		StageFragment,
+		StageCompute,
+	};
+
+	// シーン専用の distance(vec3 pos, out uint material) を生成する
+	// material は平面のプリミティブなら MATERIAL_PLANE_BIT（最上位ビット）を立てる
+	static std::string generateDistanceFunction(const SdfScene& scene);
+
+	// 焼き込んだ距離場を標本化する distance(vec3 pos, out uint material) を生成する
+	// binding 4 にアトラス、binding 5 にインダイレクションテーブルを置くこと
+	static std::string generateBrickMapDistanceFunction(const SdfBvh& bvh, const SdfBrickMap& brickMap);
+
+	// シェーダーソースのシーン部分を置き換える
+	static bool specializeSource(const std::string& source, const SdfScene& scene, std::string* specialized);
+	static bool specializeSource(const std::string& source, const std::string& distanceFunction, std::string* specialized);
+
+	// シーンに特殊化したシェーダーの SPIR-V を得る
+	// sourceFile:テンプレートとなる GLSL ソース
+	// defines:#version の直後に挿入する行（"#define CONE_PREPASS\n" など）
+	// stage:同じソースをコンピュートシェーダーとしてコンパイルする場合は StageCompute
+	// キャッシュ（<sourceFile>.<ハッシュ>.spv）があればコンパイルせずに読み込む
+	static bool compile(const char* sourceFile, const SdfScene& scene, std::vector<uint32_t>* spirv, const std::string& defines = std::string(), Stage stage = StageFragment);
+	// 生成済みの distance() を埋め込む
+	static bool compile(const char* sourceFile, const std::string& distanceFunction, std::vector<uint32_t>* spirv, const std::string& defines = std::string(), Stage stage = StageFragment);
+	// シーン部分を置き換えずに（ストレージバッファのプリミティブとBVHをたどる汎用版のまま）コンパイルする
+	static bool compileGeneric(const char* sourceFile, std::vector<uint32_t>* spirv, const std::string& defines = std::string(), Stage stage = StageFragment);
+
+	// FNV-1a（64bit）
+	static uint64_t hash(const std::string& text);
+
+private:
+	static bool loadSource(const char* sourceFile, std::string* source);
+	// defines を挿入してコンパイルする（キャッシュがあれば読み込む）
+	static bool compileSource(const char* sourceFile, std::string source, std::vector<uint32_t>* spirv, const std::string& defines, Stage stage);
+
+	// GLSL を SPIR-V にコンパイルする（shaderc）
+	static bool compileGlsl(const std::string& source, const char* name, Stage stage, std::vector<uint32_t>* spirv);
+
+	static bool loadSpirv(const std::string& fileName, std::vector<uint32_t>* spirv);
+	static bool saveSpirv(const std::string& fileName, const std::vector<uint32_t>& spirv);
+};
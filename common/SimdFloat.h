@@ -0,0 +1,167 @@
+﻿#pragma once
+
+// レイパケット用のSIMD浮動小数点型
+// SimdFloat4:SSE(4レーン) SimdFloat8:AVX2(8レーン) SimdFloat16:AVX-512(16レーン)
+// AVX2/AVX-512 の型は対応する命令セットを有効にした翻訳単位でのみ使うこと
+
+#include <immintrin.h>
+#include <stdint.h>
+
+#if defined(_MSC_VER)
+#define SIMD_ALIGN(n) __declspec(align(n))
+#else
+#define SIMD_ALIGN(n) __attribute__((aligned(n)))
+#endif
+
+// 命令セットの異なる翻訳単位でインライン関数の実体が1つにまとめられないよう、すべて無名名前空間に置く（内部リンケージ）
+// 外部リンケージのままだと、SSE の翻訳単位からの呼び出しにリンカーが AVX2 の翻訳単位の実体を使うことがある
+namespace
+{
+
+// SSE =======================================================================
+
+struct SimdMask4
+{
+	__m128 v;
+};
+
+struct SimdFloat4
+{
+	static const uint32_t Width = 4;
+	typedef SimdMask4 Mask;
+
+	__m128 v;
+
+	SimdFloat4() {}
+	SimdFloat4(__m128 v) : v(v) {}
+	SimdFloat4(float s) : v(_mm_set1_ps(s)) {}
+
+	static SimdFloat4 load(const float* p) { return _mm_loadu_ps(p); }
+	void store(float* p) const { _mm_storeu_ps(p, v); }
+
+	// 先頭 count レーンが有効なマスク
+	static SimdMask4 laneMask(uint32_t count)
+	{
+		return{ _mm_castsi128_ps(_mm_cmplt_epi32(_mm_setr_epi32(0, 1, 2, 3), _mm_set1_epi32(int(count)))) };
+	}
+	static SimdMask4 noneMask() { return{ _mm_setzero_ps() }; }
+};
+
+inline SimdFloat4 operator+(SimdFloat4 a, SimdFloat4 b) { return _mm_add_ps(a.v, b.v); }
+inline SimdFloat4 operator-(SimdFloat4 a, SimdFloat4 b) { return _mm_sub_ps(a.v, b.v); }
+inline SimdFloat4 operator*(SimdFloat4 a, SimdFloat4 b) { return _mm_mul_ps(a.v, b.v); }
+inline SimdFloat4 operator/(SimdFloat4 a, SimdFloat4 b) { return _mm_div_ps(a.v, b.v); }
+inline SimdMask4 operator<(SimdFloat4 a, SimdFloat4 b) { return{ _mm_cmplt_ps(a.v, b.v) }; }
+inline SimdMask4 operator>(SimdFloat4 a, SimdFloat4 b) { return{ _mm_cmpgt_ps(a.v, b.v) }; }
+inline SimdMask4 operator&(SimdMask4 a, SimdMask4 b) { return{ _mm_and_ps(a.v, b.v) }; }
+inline SimdMask4 operator|(SimdMask4 a, SimdMask4 b) { return{ _mm_or_ps(a.v, b.v) }; }
+// a かつ b でない
+inline SimdMask4 andNot(SimdMask4 a, SimdMask4 b) { return{ _mm_andnot_ps(b.v, a.v) }; }
+inline bool any(SimdMask4 m) { return _mm_movemask_ps(m.v) != 0; }
+inline uint32_t bits(SimdMask4 m) { return uint32_t(_mm_movemask_ps(m.v)); }
+// m ? a : b
+inline SimdFloat4 select(SimdMask4 m, SimdFloat4 a, SimdFloat4 b) { return _mm_or_ps(_mm_and_ps(m.v, a.v), _mm_andnot_ps(m.v, b.v)); }
+inline SimdFloat4 vmin(SimdFloat4 a, SimdFloat4 b) { return _mm_min_ps(a.v, b.v); }
+inline SimdFloat4 vmax(SimdFloat4 a, SimdFloat4 b) { return _mm_max_ps(a.v, b.v); }
+inline SimdFloat4 vabs(SimdFloat4 a) { return _mm_andnot_ps(_mm_set1_ps(-0.0f), a.v); }
+inline SimdFloat4 vsqrt(SimdFloat4 a) { return _mm_sqrt_ps(a.v); }
+
+// AVX2 ======================================================================
+#if defined(__AVX2__) || defined(_MSC_VER)
+
+struct SimdMask8
+{
+	__m256 v;
+};
+
+struct SimdFloat8
+{
+	static const uint32_t Width = 8;
+	typedef SimdMask8 Mask;
+
+	__m256 v;
+
+	SimdFloat8() {}
+	SimdFloat8(__m256 v) : v(v) {}
+	SimdFloat8(float s) : v(_mm256_set1_ps(s)) {}
+
+	static SimdFloat8 load(const float* p) { return _mm256_loadu_ps(p); }
+	void store(float* p) const { _mm256_storeu_ps(p, v); }
+
+	// 先頭 count レーンが有効なマスク
+	static SimdMask8 laneMask(uint32_t count)
+	{
+		return{ _mm256_castsi256_ps(_mm256_cmpgt_epi32(_mm256_set1_epi32(int(count)), _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7))) };
+	}
+	static SimdMask8 noneMask() { return{ _mm256_setzero_ps() }; }
+};
+
+inline SimdFloat8 operator+(SimdFloat8 a, SimdFloat8 b) { return _mm256_add_ps(a.v, b.v); }
+inline SimdFloat8 operator-(SimdFloat8 a, SimdFloat8 b) { return _mm256_sub_ps(a.v, b.v); }
+inline SimdFloat8 operator*(SimdFloat8 a, SimdFloat8 b) { return _mm256_mul_ps(a.v, b.v); }
+inline SimdFloat8 operator/(SimdFloat8 a, SimdFloat8 b) { return _mm256_div_ps(a.v, b.v); }
+inline SimdMask8 operator<(SimdFloat8 a, SimdFloat8 b) { return{ _mm256_cmp_ps(a.v, b.v, _CMP_LT_OQ) }; }
+inline SimdMask8 operator>(SimdFloat8 a, SimdFloat8 b) { return{ _mm256_cmp_ps(a.v, b.v, _CMP_GT_OQ) }; }
+inline SimdMask8 operator&(SimdMask8 a, SimdMask8 b) { return{ _mm256_and_ps(a.v, b.v) }; }
+inline SimdMask8 operator|(SimdMask8 a, SimdMask8 b) { return{ _mm256_or_ps(a.v, b.v) }; }
+inline SimdMask8 andNot(SimdMask8 a, SimdMask8 b) { return{ _mm256_andnot_ps(b.v, a.v) }; }
+inline bool any(SimdMask8 m) { return _mm256_movemask_ps(m.v) != 0; }
+inline uint32_t bits(SimdMask8 m) { return uint32_t(_mm256_movemask_ps(m.v)); }
+inline SimdFloat8 select(SimdMask8 m, SimdFloat8 a, SimdFloat8 b) { return _mm256_blendv_ps(b.v, a.v, m.v); }
+inline SimdFloat8 vmin(SimdFloat8 a, SimdFloat8 b) { return _mm256_min_ps(a.v, b.v); }
+inline SimdFloat8 vmax(SimdFloat8 a, SimdFloat8 b) { return _mm256_max_ps(a.v, b.v); }
+inline SimdFloat8 vabs(SimdFloat8 a) { return _mm256_andnot_ps(_mm256_set1_ps(-0.0f), a.v); }
+inline SimdFloat8 vsqrt(SimdFloat8 a) { return _mm256_sqrt_ps(a.v); }
+
+#endif
+
+// AVX-512 ===================================================================
+#if defined(__AVX512F__) || defined(_MSC_VER)
+
+struct SimdMask16
+{
+	__mmask16 v;
+};
+
+struct SimdFloat16
+{
+	static const uint32_t Width = 16;
+	typedef SimdMask16 Mask;
+
+	__m512 v;
+
+	SimdFloat16() {}
+	SimdFloat16(__m512 v) : v(v) {}
+	SimdFloat16(float s) : v(_mm512_set1_ps(s)) {}
+
+	static SimdFloat16 load(const float* p) { return _mm512_loadu_ps(p); }
+	void store(float* p) const { _mm512_storeu_ps(p, v); }
+
+	// 先頭 count レーンが有効なマスク
+	static SimdMask16 laneMask(uint32_t count)
+	{
+		return{ __mmask16(count >= 16 ? 0xFFFFu : ((1u << count) - 1u)) };
+	}
+	static SimdMask16 noneMask() { return{ __mmask16(0) }; }
+};
+
+inline SimdFloat16 operator+(SimdFloat16 a, SimdFloat16 b) { return _mm512_add_ps(a.v, b.v); }
+inline SimdFloat16 operator-(SimdFloat16 a, SimdFloat16 b) { return _mm512_sub_ps(a.v, b.v); }
+inline SimdFloat16 operator*(SimdFloat16 a, SimdFloat16 b) { return _mm512_mul_ps(a.v, b.v); }
+inline SimdFloat16 operator/(SimdFloat16 a, SimdFloat16 b) { return _mm512_div_ps(a.v, b.v); }
+inline SimdMask16 operator<(SimdFloat16 a, SimdFloat16 b) { return{ _mm512_cmp_ps_mask(a.v, b.v, _CMP_LT_OQ) }; }
+inline SimdMask16 operator>(SimdFloat16 a, SimdFloat16 b) { return{ _mm512_cmp_ps_mask(a.v, b.v, _CMP_GT_OQ) }; }
+inline SimdMask16 operator&(SimdMask16 a, SimdMask16 b) { return{ __mmask16(a.v & b.v) }; }
+inline SimdMask16 operator|(SimdMask16 a, SimdMask16 b) { return{ __mmask16(a.v | b.v) }; }
+inline SimdMask16 andNot(SimdMask16 a, SimdMask16 b) { return{ __mmask16(a.v & ~b.v) }; }
+inline bool any(SimdMask16 m) { return m.v != 0; }
+inline uint32_t bits(SimdMask16 m) { return uint32_t(m.v); }
+inline SimdFloat16 select(SimdMask16 m, SimdFloat16 a, SimdFloat16 b) { return _mm512_mask_blend_ps(m.v, b.v, a.v); }
+inline SimdFloat16 vmin(SimdFloat16 a, SimdFloat16 b) { return _mm512_min_ps(a.v, b.v); }
+inline SimdFloat16 vmax(SimdFloat16 a, SimdFloat16 b) { return _mm512_max_ps(a.v, b.v); }
+inline SimdFloat16 vabs(SimdFloat16 a) { return _mm512_abs_ps(a.v); }
+inline SimdFloat16 vsqrt(SimdFloat16 a) { return _mm512_sqrt_ps(a.v); }
+
+#endif
+
+}
@@ -0,0 +1,460 @@
+﻿#include "StagingUploader.h"
+#include "VulkanAppBase.h"
+
+#include <sstream>
+
+using namespace std;
+
+namespace
+{
+	// 結果チェック（VulkanAppBase::checkResult と同じ）
+	void checkResult(VkResult result)
+	{
+		if (result != VK_SUCCESS)
+		{
+			DebugBreak();
+		}
+	}
+}
+
+
+// public ===================================================================
+
+StagingUploader::StagingUploader()
+	: m_device(VK_NULL_HANDLE)
+	, m_allocator(nullptr)
+	, m_graphicsQueueFamily(0)
+	, m_graphicsQueue(VK_NULL_HANDLE)
+	, m_transferQueueFamily(0)
+	, m_transferQueue(VK_NULL_HANDLE)
+	, m_transferPool(VK_NULL_HANDLE)
+	, m_graphicsPool(VK_NULL_HANDLE)
+	, m_timeline(VK_NULL_HANDLE)
+	, m_vkWaitSemaphoresKHR(nullptr)
+	, m_vkGetSemaphoreCounterValueKHR(nullptr)
+	, m_fence(VK_NULL_HANDLE)
+	, m_recording{}
+	, m_lastTicket(0)
+	, m_completedTicket(0)
+	, m_uploadBytes(0)
+	, m_directBytes(0)
+	, m_submitCount(0)
+{
+}
+
+void StagingUploader::requestExtensions(ExtensionSet& deviceExtensions)
+{
+	deviceExtensions.request(VK_KHR_TIMELINE_SEMAPHORE_EXTENSION_NAME, "StagingUploader");
+}
+
+void StagingUploader::create(VkDevice device, DeviceMemoryAllocator& allocator,
+	uint32_t graphicsQueueFamily, VkQueue graphicsQueue, uint32_t transferQueueFamily, VkQueue transferQueue, bool timelineSemaphore)
+{
+	m_device = device;
+	m_allocator = &allocator;
+	m_graphicsQueueFamily = graphicsQueueFamily;
+	m_graphicsQueue = graphicsQueue;
+	m_transferQueueFamily = transferQueueFamily;
+	m_transferQueue = transferQueue;
+	m_recording = Batch{};
+	m_lastTicket = 0;
+	m_completedTicket = 0;
+	m_uploadBytes = 0;
+	m_directBytes = 0;
+	m_submitCount = 0;
+
+	// コマンドバッファはバッチごとに確保し、終わったら解放する
+	VkCommandPoolCreateInfo poolCI{};
+	poolCI.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+	poolCI.flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT;
+	poolCI.queueFamilyIndex = m_transferQueueFamily;
+	auto result = vkCreateCommandPool(m_device, &poolCI, nullptr, &m_transferPool);
+	checkResult(result);
+	if (isDedicatedTransfer())
+	{
+		poolCI.queueFamilyIndex = m_graphicsQueueFamily;
+		result = vkCreateCommandPool(m_device, &poolCI, nullptr, &m_graphicsPool);
+		checkResult(result);
+	}
+
+	if (timelineSemaphore)
+	{
+		m_vkWaitSemaphoresKHR = reinterpret_cast<PFN_vkWaitSemaphoresKHR>(vkGetDeviceProcAddr(m_device, "vkWaitSemaphoresKHR"));
+		m_vkGetSemaphoreCounterValueKHR = reinterpret_cast<PFN_vkGetSemaphoreCounterValueKHR>(vkGetDeviceProcAddr(m_device, "vkGetSemaphoreCounterValueKHR"));
+	}
+	if (m_vkWaitSemaphoresKHR != nullptr && m_vkGetSemaphoreCounterValueKHR != nullptr)
+	{
+		VkSemaphoreTypeCreateInfoKHR typeCI{};
+		typeCI.sType = VK_STRUCTURE_TYPE_SEMAPHORE_TYPE_CREATE_INFO_KHR;
+		typeCI.semaphoreType = VK_SEMAPHORE_TYPE_TIMELINE_KHR;
+		typeCI.initialValue = 0;
+		VkSemaphoreCreateInfo semaphoreCI{};
+		semaphoreCI.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+		semaphoreCI.pNext = &typeCI;
+		result = vkCreateSemaphore(m_device, &semaphoreCI, nullptr, &m_timeline);
+		checkResult(result);
+	}
+	else
+	{
+		OutputDebugStringA("[StagingUploader] timeline semaphore not supported. flush waits on the host.\n");
+		VkFenceCreateInfo fenceCI{};
+		fenceCI.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+		result = vkCreateFence(m_device, &fenceCI, nullptr, &m_fence);
+		checkResult(result);
+	}
+}
+
+void StagingUploader::destroy()
+{
+	if (m_device == VK_NULL_HANDLE)
+	{
+		return;
+	}
+
+	// 記録したまま送信していないものも送ってから待つ
+	flush();
+	release(true);
+
+	if (m_timeline != VK_NULL_HANDLE)
+	{
+		vkDestroySemaphore(m_device, m_timeline, nullptr);
+		m_timeline = VK_NULL_HANDLE;
+	}
+	if (m_fence != VK_NULL_HANDLE)
+	{
+		vkDestroyFence(m_device, m_fence, nullptr);
+		m_fence = VK_NULL_HANDLE;
+	}
+	vkDestroyCommandPool(m_device, m_transferPool, nullptr);
+	if (m_graphicsPool != VK_NULL_HANDLE)
+	{
+		vkDestroyCommandPool(m_device, m_graphicsPool, nullptr);
+	}
+	m_transferPool = VK_NULL_HANDLE;
+	m_graphicsPool = VK_NULL_HANDLE;
+	m_vkWaitSemaphoresKHR = nullptr;
+	m_vkGetSemaphoreCounterValueKHR = nullptr;
+	m_device = VK_NULL_HANDLE;
+}
+
+// デバイスローカルのバッファを作成して data を転送する
+VkResult StagingUploader::createBuffer(const VkBufferCreateInfo& ci, const void* data, VkAccessFlags dstAccess, VkPipelineStageFlags dstStages,
+	VkBuffer* buffer, DeviceMemoryAllocator::Allocation* allocation)
+{
+	VkBufferCreateInfo bufferCI = ci;
+	bufferCI.usage |= VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+	auto result = m_allocator->createBuffer(bufferCI, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, buffer, allocation);
+	if (result != VK_SUCCESS)
+	{
+		return result;
+	}
+
+	// ホストからも見えるメモリなら直接書く（送信時にデバイスから見える）
+	if (allocation->mapped != nullptr)
+	{
+		memcpy(allocation->mapped, data, size_t(ci.size));
+		m_directBytes += ci.size;
+		return VK_SUCCESS;
+	}
+
+	VkBuffer staging;
+	void* p = allocateStaging(ci.size, &staging);
+	memcpy(p, data, size_t(ci.size));
+
+	VkCommandBuffer command = getTransferCommand();
+	VkBufferCopy region{};
+	region.size = ci.size;
+	vkCmdCopyBuffer(command, staging, *buffer, 1, &region);
+
+	VkBufferMemoryBarrier barrier{};
+	barrier.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+	barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+	barrier.dstAccessMask = dstAccess;
+	barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+	barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+	barrier.buffer = *buffer;
+	barrier.offset = 0;
+	barrier.size = VK_WHOLE_SIZE;
+	if (!isDedicatedTransfer())
+	{
+		vkCmdPipelineBarrier(command, VK_PIPELINE_STAGE_TRANSFER_BIT, dstStages, 0, 0, nullptr, 1, &barrier, 0, nullptr);
+		return VK_SUCCESS;
+	}
+
+	// 転送キューで解放し、描画用のキューで取得する
+	barrier.dstAccessMask = 0;
+	barrier.srcQueueFamilyIndex = m_transferQueueFamily;
+	barrier.dstQueueFamilyIndex = m_graphicsQueueFamily;
+	vkCmdPipelineBarrier(command, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, 0, 0, nullptr, 1, &barrier, 0, nullptr);
+
+	barrier.srcAccessMask = 0;
+	barrier.dstAccessMask = dstAccess;
+	vkCmdPipelineBarrier(getAcquireCommand(), VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, dstStages, 0, 0, nullptr, 1, &barrier, 0, nullptr);
+	return VK_SUCCESS;
+}
+
+// イメージ全体を1回でコピーするので、転送キューの minImageTransferGranularity に関係なく送れる
+void StagingUploader::uploadImage(VkImage image, VkImageAspectFlags aspect, const VkExtent3D& extent, const void* data, VkDeviceSize size, VkPipelineStageFlags dstStages)
+{
+	VkBuffer staging;
+	void* p = allocateStaging(size, &staging);
+	memcpy(p, data, size_t(size));
+
+	VkCommandBuffer command = getTransferCommand();
+
+	// 以前の内容は破棄して転送先の状態にする
+	VkImageMemoryBarrier barrier{};
+	barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+	barrier.srcAccessMask = 0;
+	barrier.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+	barrier.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+	barrier.newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+	barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+	barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+	barrier.image = image;
+	barrier.subresourceRange = { aspect, 0, 1, 0, 1 };
+	vkCmdPipelineBarrier(command, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, nullptr, 0, nullptr, 1, &barrier);
+
+	VkBufferImageCopy region{};
+	region.imageSubresource = { aspect, 0, 0, 1 };
+	region.imageExtent = extent;
+	vkCmdCopyBufferToImage(command, staging, image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &region);
+
+	// シェーダーから読む状態へ遷移する
+	barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+	barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+	barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+	barrier.newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+	if (!isDedicatedTransfer())
+	{
+		vkCmdPipelineBarrier(command, VK_PIPELINE_STAGE_TRANSFER_BIT, dstStages, 0, 0, nullptr, 0, nullptr, 1, &barrier);
+		return;
+	}
+
+	// 解放と取得で同じレイアウトの遷移を指定する（遷移は1回だけ行われる）
+	barrier.dstAccessMask = 0;
+	barrier.srcQueueFamilyIndex = m_transferQueueFamily;
+	barrier.dstQueueFamilyIndex = m_graphicsQueueFamily;
+	vkCmdPipelineBarrier(command, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, 0, 0, nullptr, 0, nullptr, 1, &barrier);
+
+	barrier.srcAccessMask = 0;
+	barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+	vkCmdPipelineBarrier(getAcquireCommand(), VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, dstStages, 0, 0, nullptr, 0, nullptr, 1, &barrier);
+}
+
+// まとめたコピーを送信する
+// 転送キューは ticket - 1 を、取得側（描画用のキュー）はそれを待って ticket を signal する
+StagingUploader::Ticket StagingUploader::flush()
+{
+	release(false);
+	if (m_recording.transferCommand == VK_NULL_HANDLE)
+	{
+		return m_lastTicket;
+	}
+
+	Batch batch = m_recording;
+	m_recording = Batch{};
+	m_lastTicket += 2;
+	batch.ticket = m_lastTicket;
+
+	vkEndCommandBuffer(batch.transferCommand);
+	if (batch.acquireCommand != VK_NULL_HANDLE)
+	{
+		vkEndCommandBuffer(batch.acquireCommand);
+	}
+
+	const uint64_t transferValue = batch.ticket - 1;
+	const uint64_t acquireValue = batch.ticket;
+	const VkPipelineStageFlags waitStage = VK_PIPELINE_STAGE_ALL_COMMANDS_BIT;
+
+	VkTimelineSemaphoreSubmitInfoKHR transferTimeline{};
+	transferTimeline.sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO_KHR;
+	transferTimeline.signalSemaphoreValueCount = 1;
+	transferTimeline.pSignalSemaphoreValues = (batch.acquireCommand != VK_NULL_HANDLE) ? &transferValue : &acquireValue;
+
+	VkSubmitInfo transferSubmit{};
+	transferSubmit.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+	transferSubmit.commandBufferCount = 1;
+	transferSubmit.pCommandBuffers = &batch.transferCommand;
+
+	VkTimelineSemaphoreSubmitInfoKHR acquireTimeline{};
+	acquireTimeline.sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO_KHR;
+	acquireTimeline.waitSemaphoreValueCount = 1;
+	acquireTimeline.pWaitSemaphoreValues = &transferValue;
+	acquireTimeline.signalSemaphoreValueCount = 1;
+	acquireTimeline.pSignalSemaphoreValues = &acquireValue;
+
+	VkSubmitInfo acquireSubmit{};
+	acquireSubmit.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+	acquireSubmit.commandBufferCount = 1;
+	acquireSubmit.pCommandBuffers = &batch.acquireCommand;
+
+	if (m_timeline != VK_NULL_HANDLE)
+	{
+		transferSubmit.pNext = &transferTimeline;
+		transferSubmit.signalSemaphoreCount = 1;
+		transferSubmit.pSignalSemaphores = &m_timeline;
+		auto result = vkQueueSubmit(m_transferQueue, 1, &transferSubmit, VK_NULL_HANDLE);
+		checkResult(result);
+
+		if (batch.acquireCommand != VK_NULL_HANDLE)
+		{
+			acquireSubmit.pNext = &acquireTimeline;
+			acquireSubmit.waitSemaphoreCount = 1;
+			acquireSubmit.pWaitSemaphores = &m_timeline;
+			acquireSubmit.pWaitDstStageMask = &waitStage;
+			acquireSubmit.signalSemaphoreCount = 1;
+			acquireSubmit.pSignalSemaphores = &m_timeline;
+			result = vkQueueSubmit(m_graphicsQueue, 1, &acquireSubmit, VK_NULL_HANDLE);
+			checkResult(result);
+		}
+	}
+	else
+	{
+		// 転送を待ってから取得側を送る
+		auto result = vkQueueSubmit(m_transferQueue, 1, &transferSubmit, m_fence);
+		checkResult(result);
+		vkWaitForFences(m_device, 1, &m_fence, VK_TRUE, UINT64_MAX);
+		vkResetFences(m_device, 1, &m_fence);
+
+		if (batch.acquireCommand != VK_NULL_HANDLE)
+		{
+			result = vkQueueSubmit(m_graphicsQueue, 1, &acquireSubmit, m_fence);
+			checkResult(result);
+			vkWaitForFences(m_device, 1, &m_fence, VK_TRUE, UINT64_MAX);
+			vkResetFences(m_device, 1, &m_fence);
+		}
+		m_completedTicket = batch.ticket;
+	}
+
+	m_submitCount++;
+	m_submitted.push_back(batch);
+	return batch.ticket;
+}
+
+bool StagingUploader::isComplete(Ticket ticket) const
+{
+	if (m_timeline == VK_NULL_HANDLE)
+	{
+		return ticket <= m_completedTicket;
+	}
+	uint64_t value = 0;
+	m_vkGetSemaphoreCounterValueKHR(m_device, m_timeline, &value);
+	return ticket <= value;
+}
+
+void StagingUploader::wait(Ticket ticket) const
+{
+	if (m_timeline == VK_NULL_HANDLE || ticket == 0)
+	{
+		return;
+	}
+	VkSemaphoreWaitInfoKHR waitInfo{};
+	waitInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO_KHR;
+	waitInfo.semaphoreCount = 1;
+	waitInfo.pSemaphores = &m_timeline;
+	waitInfo.pValues = &ticket;
+	m_vkWaitSemaphoresKHR(m_device, &waitInfo, UINT64_MAX);
+}
+
+string StagingUploader::createReport() const
+{
+	const double MiB = 1024.0 * 1024.0;
+	stringstream ss;
+	ss << "[StagingUploader] " << (isDedicatedTransfer() ? "transfer queue" : "graphics queue")
+		<< (m_timeline != VK_NULL_HANDLE ? ", timeline semaphore" : ", fence")
+		<< ", staged " << double(m_uploadBytes) / MiB << " MiB in " << m_submitCount << " submits"
+		<< ", direct " << double(m_directBytes) / MiB << " MiB" << endl;
+	return ss.str();
+}
+
+
+// private ==================================================================
+
+void* StagingUploader::allocateStaging(VkDeviceSize size, VkBuffer* buffer)
+{
+	VkBufferCreateInfo ci{};
+	ci.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+	ci.usage = VK_BUFFER_USAGE_TRANSFER_SRC_BIT;
+	ci.size = size;
+	DeviceMemoryAllocator::Allocation allocation;
+	auto result = m_allocator->createBuffer(ci, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, buffer, &allocation, DeviceMemoryAllocator::StrategyLinear);
+	checkResult(result);
+
+	m_recording.stagingBuffers.push_back(*buffer);
+	m_recording.stagingMemory.push_back(allocation);
+	m_uploadBytes += size;
+	return allocation.mapped;
+}
+
+VkCommandBuffer StagingUploader::getTransferCommand()
+{
+	if (m_recording.transferCommand == VK_NULL_HANDLE)
+	{
+		m_recording.transferCommand = beginCommand(m_transferPool);
+	}
+	return m_recording.transferCommand;
+}
+
+VkCommandBuffer StagingUploader::getAcquireCommand()
+{
+	if (m_recording.acquireCommand == VK_NULL_HANDLE)
+	{
+		m_recording.acquireCommand = beginCommand(m_graphicsPool);
+	}
+	return m_recording.acquireCommand;
+}
+
+VkCommandBuffer StagingUploader::beginCommand(VkCommandPool pool)
+{
+	VkCommandBufferAllocateInfo ai{};
+	ai.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+	ai.commandPool = pool;
+	ai.commandBufferCount = 1;
+	ai.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+	VkCommandBuffer command;
+	auto result = vkAllocateCommandBuffers(m_device, &ai, &command);
+	checkResult(result);
+
+	VkCommandBufferBeginInfo beginInfo{};
+	beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+	beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+	vkBeginCommandBuffer(command, &beginInfo);
+	return command;
+}
+
+// 終わったバッチを解放する（waitAll なら送信したものをすべて待つ）
+void StagingUploader::release(bool waitAll)
+{
+	if (waitAll && !m_submitted.empty())
+	{
+		wait(m_submitted.back().ticket);
+	}
+
+	size_t kept = 0;
+	for (size_t i = 0; i < m_submitted.size(); i++)
+	{
+		if (isComplete(m_submitted[i].ticket))
+		{
+			destroyBatch(m_submitted[i]);
+		}
+		else
+		{
+			m_submitted[kept++] = m_submitted[i];
+		}
+	}
+	m_submitted.resize(kept);
+}
+
+void StagingUploader::destroyBatch(Batch& batch)
+{
+	for (size_t i = 0; i < batch.stagingBuffers.size(); i++)
+	{
+		m_allocator->destroyBuffer(batch.stagingBuffers[i], batch.stagingMemory[i]);
+	}
+	vkFreeCommandBuffers(m_device, m_transferPool, 1, &batch.transferCommand);
+	if (batch.acquireCommand != VK_NULL_HANDLE)
+	{
+		vkFreeCommandBuffers(m_device, m_graphicsPool, 1, &batch.acquireCommand);
+	}
+}
@@ -0,0 +1,108 @@
+﻿#pragma once
+
+#include <vulkan/vulkan.h>
+
+#include <vector>
+#include <string>
+#include <stdint.h>
+
+#include "DeviceMemoryAllocator.h"
+#include "ExtensionSet.h"
+
+// 起動中変わらないデータ（シーンのバッファや焼き込んだ距離場）をデバイスローカルのメモリへ転送する
+// データはホストから見えるステージングバッファ（StrategyLinear）に書き、コピーは flush まで1つのコマンドバッファにまとめる
+// 転送専用のキューファミリーがあればそのキューで送信し、描画用のキューへ所有権を移す
+// （解放のバリアを転送キューで、取得のバリアを描画用のキューで記録する。イメージのレイアウトもこの組で遷移する）
+//
+// 送信ごとにタイムラインセマフォの値を2つ進め、転送キューが signal した値を描画用のキューの取得側が wait して次の値を signal する
+// 取得側の送信は描画より前に描画用のキューへ送るので、後から送るフレームは転送の完了を待たずに記録・送信してよい
+// ステージングバッファとコマンドバッファはその値に達したら次の flush か destroy で解放する
+// タイムラインセマフォが使えないデバイスでは flush の中でフェンスを待つ
+//
+// ホストから見えるデバイスローカルのメモリ（統合 GPU など）に確保できた場合はステージングせずに直接書く
+// スレッドセーフではない（メインスレッドから使う）
+class StagingUploader
+{
+public:
+	StagingUploader();
+
+	// 転送が終わったかを調べる値（flush が返す）
+	typedef uint64_t Ticket;
+
+	// 使うデバイス拡張を登録する（VK_KHR_timeline_semaphore は任意、無ければフェンスで待つ）
+	static void requestExtensions(ExtensionSet& deviceExtensions);
+
+	// graphicsQueueFamily / graphicsQueue:描画に使うキュー（取得のバリアを送る）
+	// transferQueueFamily / transferQueue:コピーに使うキュー（転送専用が無ければ描画用と同じものを渡す）
+	// timelineSemaphore:VK_KHR_timeline_semaphore の timelineSemaphore を有効にしてデバイスを作成したか
+	void create(VkDevice device, DeviceMemoryAllocator& allocator,
+		uint32_t graphicsQueueFamily, VkQueue graphicsQueue, uint32_t transferQueueFamily, VkQueue transferQueue, bool timelineSemaphore);
+	// 送信した転送を待ち、残っているステージングバッファなどを解放する
+	void destroy();
+
+	// デバイスローカルのバッファを作成して data を転送する
+	// dstAccess / dstStages:転送後にバッファを読むアクセスとステージ
+	VkResult createBuffer(const VkBufferCreateInfo& ci, const void* data, VkAccessFlags dstAccess, VkPipelineStageFlags dstStages,
+		VkBuffer* buffer, DeviceMemoryAllocator::Allocation* allocation);
+
+	// 作成済みのイメージ（TRANSFER_DST を指定し、内容は UNDEFINED）のミップ 0・レイヤー 0 に data を転送し、
+	// SHADER_READ_ONLY_OPTIMAL に遷移する
+	void uploadImage(VkImage image, VkImageAspectFlags aspect, const VkExtent3D& extent, const void* data, VkDeviceSize size, VkPipelineStageFlags dstStages);
+
+	// まとめたコピーを送信する（何も無ければ直前の値を返す）
+	Ticket flush();
+	// ticket の転送が終わったか・終わるまで待つ
+	bool isComplete(Ticket ticket) const;
+	void wait(Ticket ticket) const;
+
+	// 転送専用のキューを使っているか
+	bool isDedicatedTransfer() const { return m_transferQueueFamily != m_graphicsQueueFamily; }
+
+	// これまでの転送量と送信回数
+	std::string createReport() const;
+
+private:
+	// 1回の flush の分
+	struct Batch
+	{
+		Ticket ticket;
+		VkCommandBuffer transferCommand;
+		VkCommandBuffer acquireCommand;		// 所有権を移す場合だけ
+		std::vector<VkBuffer> stagingBuffers;
+		std::vector<DeviceMemoryAllocator::Allocation> stagingMemory;
+	};
+
+	// 記録中のバッチのステージングバッファを確保し、書き込む先を返す
+	void* allocateStaging(VkDeviceSize size, VkBuffer* buffer);
+	// 記録中のコマンドバッファ（無ければ開始する）
+	VkCommandBuffer getTransferCommand();
+	VkCommandBuffer getAcquireCommand();
+	VkCommandBuffer beginCommand(VkCommandPool pool);
+	// 終わったバッチを解放する
+	void release(bool waitAll);
+	void destroyBatch(Batch& batch);
+
+	VkDevice m_device;
+	DeviceMemoryAllocator* m_allocator;
+	uint32_t m_graphicsQueueFamily;
+	VkQueue m_graphicsQueue;
+	uint32_t m_transferQueueFamily;
+	VkQueue m_transferQueue;
+	VkCommandPool m_transferPool;
+	VkCommandPool m_graphicsPool;
+
+	// タイムラインセマフォ（使えない場合は VK_NULL_HANDLE で、flush の中でフェンスを待つ）
+	VkSemaphore m_timeline;
+	PFN_vkWaitSemaphoresKHR m_vkWaitSemaphoresKHR;
+	PFN_vkGetSemaphoreCounterValueKHR m_vkGetSemaphoreCounterValueKHR;
+	VkFence m_fence;
+
+	Batch m_recording;
+	std::vector<Batch> m_submitted;
+	Ticket m_lastTicket;
+	Ticket m_completedTicket;	// タイムラインセマフォが無い場合の完了した値
+
+	uint64_t m_uploadBytes;
+	uint64_t m_directBytes;
+	uint32_t m_submitCount;
+};
@@ -0,0 +1,158 @@
+﻿#include "ThreadPool.h"
+#include <algorithm>
+
+using namespace std;
+
+namespace
+{
+	// 現在のスレッドが属するプールとワーカー番号
+	thread_local const ThreadPool* t_currentPool = nullptr;
+	thread_local uint32_t t_workerIndex = 0;
+}
+
+
+// public ===================================================================
+
+ThreadPool::ThreadPool(uint32_t threadCount)
+	:m_queuedCount(0)
+	,m_pendingCount(0)
+	,m_nextQueue(0)
+	,m_quit(false)
+{
+	if (threadCount == 0)
+	{
+		threadCount = (std::max)(1u, thread::hardware_concurrency());
+	}
+
+	m_queues.resize(threadCount);
+	for (auto& v : m_queues)
+	{
+		v.reset(new WorkQueue());
+	}
+
+	m_threads.reserve(threadCount);
+	for (uint32_t i = 0; i < threadCount; i++)
+	{
+		m_threads.emplace_back(&ThreadPool::workerMain, this, i);
+	}
+}
+
+ThreadPool::~ThreadPool()
+{
+	{
+		lock_guard<mutex> lock(m_mutex);
+		m_quit = true;
+	}
+	m_workCv.notify_all();
+
+	for (auto& v : m_threads)
+	{
+		v.join();
+	}
+}
+
+// タスクを追加する
+void ThreadPool::submit(function<void()> task)
+{
+	// ワーカーから追加された場合は自分のキューへ、それ以外は順番に振り分ける
+	uint32_t index = (t_currentPool == this) ? t_workerIndex : (m_nextQueue++ % uint32_t(m_queues.size()));
+
+	m_pendingCount++;
+	{
+		auto& queue = *m_queues[index];
+		lock_guard<mutex> lock(queue.mutex);
+		queue.tasks.push_back(move(task));
+		m_queuedCount++;
+	}
+
+	{
+		// 待機中のワーカーが通知を取りこぼさないようにロックを経由する
+		lock_guard<mutex> lock(m_mutex);
+	}
+	m_workCv.notify_one();
+}
+
+// 追加済みのタスクがすべて完了するまで待つ
+void ThreadPool::wait()
+{
+	unique_lock<mutex> lock(m_mutex);
+	m_doneCv.wait(lock, [this] { return m_pendingCount == 0; });
+}
+
+// [0, count) の各インデックスについて func を並列に実行する
+void ThreadPool::parallelFor(uint32_t count, const function<void(uint32_t)>& func)
+{
+	for (uint32_t i = 0; i < count; i++)
+	{
+		submit([&func, i]() { func(i); });
+	}
+	wait();
+}
+
+
+// private ==================================================================
+
+// ワーカースレッドの処理
+void ThreadPool::workerMain(uint32_t index)
+{
+	t_currentPool = this;
+	t_workerIndex = index;
+
+	function<void()> task;
+	while (true)
+	{
+		if (popTask(index, &task))
+		{
+			task();
+			task = nullptr;
+
+			if (--m_pendingCount == 0)
+			{
+				lock_guard<mutex> lock(m_mutex);
+				m_doneCv.notify_all();
+			}
+			continue;
+		}
+
+		// どのキューにもタスクが無ければ追加を待つ
+		unique_lock<mutex> lock(m_mutex);
+		m_workCv.wait(lock, [this] { return m_quit || m_queuedCount > 0; });
+		if (m_quit && m_queuedCount == 0)
+		{
+			break;
+		}
+	}
+}
+
+// タスクを取り出す
+bool ThreadPool::popTask(uint32_t index, function<void()>* task)
+{
+	// 自分のキューは末尾から取り出す（直前に積んだタスクの方がキャッシュに乗っている）
+	{
+		auto& queue = *m_queues[index];
+		lock_guard<mutex> lock(queue.mutex);
+		if (!queue.tasks.empty())
+		{
+			*task = move(queue.tasks.back());
+			queue.tasks.pop_back();
+			m_queuedCount--;
+			return true;
+		}
+	}
+
+	// 他のワーカーのキューから先頭を盗む
+	const uint32_t queueCount = uint32_t(m_queues.size());
+	for (uint32_t i = 1; i < queueCount; i++)
+	{
+		auto& queue = *m_queues[(index + i) % queueCount];
+		lock_guard<mutex> lock(queue.mutex);
+		if (!queue.tasks.empty())
+		{
+			*task = move(queue.tasks.front());
+			queue.tasks.pop_front();
+			m_queuedCount--;
+			return true;
+		}
+	}
+	return false;
+}
@@ -0,0 +1,65 @@
+﻿#pragma once
+
+#include <vector>
+#include <deque>
+#include <memory>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <stdint.h>
+
+// ワークスティーリング方式のスレッドプール
+// 各ワーカーが自分のキューを持ち、空になったら他のワーカーのキューからタスクを盗む
+class ThreadPool
+{
+public:
+	// threadCount:ワーカースレッド数（0 の場合はハードウェアスレッド数）
+	explicit ThreadPool(uint32_t threadCount = 0);
+	~ThreadPool();
+
+	ThreadPool(const ThreadPool&) = delete;
+	ThreadPool& operator=(const ThreadPool&) = delete;
+
+	// タスクを追加する
+	void submit(std::function<void()> task);
+
+	// 追加済みのタスクがすべて完了するまで待つ（ワーカースレッドから呼ばないこと）
+	void wait();
+
+	// [0, count) の各インデックスについて func を並列に実行し、完了を待つ
+	void parallelFor(uint32_t count, const std::function<void(uint32_t)>& func);
+
+	uint32_t getThreadCount() const { return uint32_t(m_threads.size()); }
+
+private:
+	struct WorkQueue
+	{
+		std::mutex mutex;
+		std::deque<std::function<void()>> tasks;
+	};
+
+	// ワーカースレッドの処理
+	void workerMain(uint32_t index);
+
+	// タスクを取り出す（自分のキューの末尾 -> 他のキューの先頭の順）
+	bool popTask(uint32_t index, std::function<void()>* task);
+
+	std::vector<std::unique_ptr<WorkQueue>> m_queues;
+	std::vector<std::thread> m_threads;
+
+	// 待機・終了通知用
+	std::mutex m_mutex;
+	std::condition_variable m_workCv;
+	std::condition_variable m_doneCv;
+
+	// キューに積まれているタスク数
+	std::atomic<uint32_t> m_queuedCount;
+	// 未完了のタスク数
+	std::atomic<uint32_t> m_pendingCount;
+	// 外部スレッドから追加する際の振り分け先
+	std::atomic<uint32_t> m_nextQueue;
+
+	bool m_quit;
+};
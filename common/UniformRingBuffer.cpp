@@ -0,0 +1,98 @@
+﻿#include "UniformRingBuffer.h"
+#include "VulkanAppBase.h"
+
+using namespace std;
+
+namespace
+{
+	// 結果チェック（VulkanAppBase::checkResult と同じ）
+	void checkResult(VkResult result)
+	{
+		if (result != VK_SUCCESS)
+		{
+			DebugBreak();
+		}
+	}
+}
+
+
+// public ===================================================================
+
+UniformRingBuffer::UniformRingBuffer()
+	: m_allocator(nullptr)
+	, m_buffer(VK_NULL_HANDLE)
+	, m_memory{}
+	, m_mapped(nullptr)
+	, m_alignment(1)
+	, m_frameSize(0)
+	, m_frameBegin(0)
+	, m_offset(0)
+{
+}
+
+void UniformRingBuffer::create(DeviceMemoryAllocator& allocator, VkDeviceSize minAlignment, VkDeviceSize frameSize, uint32_t frameCount)
+{
+	m_allocator = &allocator;
+	m_alignment = (minAlignment > 0) ? minAlignment : 1;
+
+	// 各フレームの区画の先頭もアライメントに合わせる
+	m_frameSize = getAlignedSize(frameSize);
+	m_frameBegin = 0;
+	m_offset = 0;
+
+	VkBufferCreateInfo ci{};
+	ci.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+	ci.usage = VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT;
+	ci.size = m_frameSize * frameCount;
+	auto result = m_allocator->createBuffer(ci, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, &m_buffer, &m_memory);
+	checkResult(result);
+
+	// コヒーレントなメモリなので、マップしたまま書き込めば送信時に GPU から見える
+	m_mapped = static_cast<uint8_t*>(m_memory.mapped);
+}
+
+void UniformRingBuffer::destroy()
+{
+	if (m_allocator == nullptr)
+	{
+		return;
+	}
+	m_allocator->destroyBuffer(m_buffer, m_memory);
+	m_buffer = VK_NULL_HANDLE;
+	m_mapped = nullptr;
+}
+
+// frameIndex の区画の先頭から割り当て直す
+void UniformRingBuffer::beginFrame(uint32_t frameIndex)
+{
+	m_frameBegin = m_frameSize * frameIndex;
+	m_offset = m_frameBegin;
+}
+
+// data を書き込み、動的オフセットを返す
+uint32_t UniformRingBuffer::allocate(const void* data, VkDeviceSize size)
+{
+	VkDeviceSize alignedSize = getAlignedSize(size);
+	if (m_offset + alignedSize > m_frameBegin + m_frameSize)
+	{
+		// create の frameSize が足りない
+		OutputDebugStringA("[UniformRingBuffer] frame size exceeded.\n");
+		DebugBreak();
+		return uint32_t(m_frameBegin);
+	}
+
+	uint32_t offset = uint32_t(m_offset);
+	memcpy(m_mapped + offset, data, size_t(size));
+	m_offset += alignedSize;
+	return offset;
+}
+
+VkDescriptorBufferInfo UniformRingBuffer::getDescriptorInfo(VkDeviceSize range) const
+{
+	return VkDescriptorBufferInfo{ m_buffer, 0, range };
+}
+
+VkDeviceSize UniformRingBuffer::getAlignedSize(VkDeviceSize size) const
+{
+	return (size + m_alignment - 1) / m_alignment * m_alignment;
+}
@@ -0,0 +1,57 @@
+﻿#pragma once
+
+#include <vulkan/vulkan.h>
+
+#include <stdint.h>
+
+#include "DeviceMemoryAllocator.h"
+
+// フレームごとのユニフォームデータを1つのバッファから切り出すリングバッファ
+// バッファはホストから見えるメモリに置いてマップしたままにし、フレームごとに区画を分ける
+// 書き込んだ位置は VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC の動的オフセットとして
+// vkCmdBindDescriptorSets に渡す（ディスクリプタの書き換えや vkMapMemory が要らない）
+//
+// 区画は同時に処理するフレーム数だけ用意するので、フェンスを待った後の区画はいつでも上書きできる
+// 毎フレーム同じ順番で割り当てれば、オフセットもフレームの区画ごとに毎回同じ値になる
+class UniformRingBuffer
+{
+public:
+	UniformRingBuffer();
+
+	// allocator:バッファのメモリを確保する（VulkanAppBase::m_memoryAllocator、destroy まで使う）
+	// minAlignment:VkPhysicalDeviceLimits::minUniformBufferOffsetAlignment
+	// frameSize:1フレームで割り当てる最大バイト数（アライメントの分も含めて切り上げる）
+	// frameCount:同時に処理するフレーム数
+	void create(DeviceMemoryAllocator& allocator, VkDeviceSize minAlignment, VkDeviceSize frameSize, uint32_t frameCount);
+	void destroy();
+
+	// frameIndex の区画の先頭から割り当て直す（フェンスを待った後に呼ぶ）
+	void beginFrame(uint32_t frameIndex);
+
+	// data を書き込み、動的オフセットを返す
+	uint32_t allocate(const void* data, VkDeviceSize size);
+
+	template<class T>
+	uint32_t push(const T& value) { return allocate(&value, sizeof(T)); }
+
+	// 1ブロック分（range バイト）を指すディスクリプタ（オフセットは動的オフセットで指定する）
+	VkDescriptorBufferInfo getDescriptorInfo(VkDeviceSize range) const;
+
+	// size を割り当てたときに使う大きさ（create の frameSize の見積もり用）
+	VkDeviceSize getAlignedSize(VkDeviceSize size) const;
+
+	VkBuffer getBuffer() const { return m_buffer; }
+
+private:
+	DeviceMemoryAllocator* m_allocator;
+	VkBuffer m_buffer;
+	DeviceMemoryAllocator::Allocation m_memory;
+	uint8_t* m_mapped;
+
+	VkDeviceSize m_alignment;
+	VkDeviceSize m_frameSize;
+
+	// 今のフレームの区画 [m_frameBegin, m_frameBegin + m_frameSize) の中の次の位置
+	VkDeviceSize m_frameBegin;
+	VkDeviceSize m_offset;
+};
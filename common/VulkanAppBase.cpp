@@ -2,6 +2,8 @@
 #include <sstream>
 #include <algorithm>
 #include <array>
+#include <chrono>
+#include <fstream>
 #include <stdio.h>
 
 #define GetInstanceProcAddr(FuncName) \
@@ -36,22 +38,69 @@ static VkBool32 VKAPI_CALL DebugReportCallback(
 }
 
 
+// Present の方式の名前
+namespace
+{
+	struct PresentModeName
+	{
+		VkPresentModeKHR mode;
+		const char* name;
+	};
+	const PresentModeName PresentModeNames[] = {
+		{ VK_PRESENT_MODE_FIFO_KHR, "fifo" },
+		{ VK_PRESENT_MODE_FIFO_RELAXED_KHR, "fifo_relaxed" },
+		{ VK_PRESENT_MODE_MAILBOX_KHR, "mailbox" },
+		{ VK_PRESENT_MODE_IMMEDIATE_KHR, "immediate" },
+	};
+}
+
+
 // public ===================================================================
 
+const char* VulkanAppBase::DefaultPipelineCacheFile = "pipeline_cache.bin";
+
 VulkanAppBase::VulkanAppBase()
-	:m_presentMode(VK_PRESENT_MODE_FIFO_KHR)
+	:m_surface(VK_NULL_HANDLE)
+	,m_presentMode(VK_PRESENT_MODE_FIFO_KHR)
+	,m_requestedPresentMode(VK_PRESENT_MODE_FIFO_KHR)
+	,m_window(nullptr)
+	,m_swapchainOutOfDate(false)
+	,m_framebufferResized(false)
+	,m_swapchain(VK_NULL_HANDLE)
+	,m_offscreen(false)
+	,m_transferQueue(VK_NULL_HANDLE)
+	,m_timelineSemaphore(false)
+	,m_readbackBuffer(VK_NULL_HANDLE)
+	,m_readbackMemory{}
+	,m_depthBufferMemory{}
+	,m_framesInFlight(DefaultFramesInFlight)
+	,m_reuseCommands(false)
+	,m_pipelineCacheFile(DefaultPipelineCacheFile)
+	,m_marchQualityBase(MarchQuality::getDefaultSettings())
+	,m_marchQualityPreset(MarchQuality::PresetDefault)
+	,m_gpuProfiling(false)
 	,m_imageIndex(0)
+	,m_frameIndex(0)
+	,prevTime(0.0)
+	,currentTime(0.0)
+	,m_fixedTimeStep(0.0)
 {
 }
 
 void VulkanAppBase::initialize(GLFWwindow* window, const char* appName)
 {
+	m_window = window;
+	glfwSetWindowUserPointer(window, this);
+	glfwSetFramebufferSizeCallback(window, onFramebufferSize);
+
 	// Vulkan インスタンスの生成
 	initializeInstance(appName);
 
-	// 物理デバイスの選択
+	// サーフェイスの生成（Present できるキューを持つデバイスを選ぶため、デバイスの選択より前に作る）
+	glfwCreateWindowSurface(m_instance, window, nullptr, &m_surface);
+
+	// 物理デバイスとキューファミリーの選択
 	selectPhysicalDevice();
-	m_graphicsQueueIndex = searchGraphicsQueueIndex();
 
 #ifdef _DEBUG
 	// デバッグレポート関数のセット
@@ -61,17 +110,21 @@ void VulkanAppBase::initialize(GLFWwindow* window, const char* appName)
 	// 論理デバイスの生成
 	createDevice();
 
+	// デバイスメモリの割り当て（以降のバッファとイメージはここから切り出す）
+	m_memoryAllocator.create(m_device, m_physDev);
+
 	// コマンドプールの準備
 	prepareCommandPool();
 
-	// サーフェイスの生成
-	glfwCreateWindowSurface(m_instance, window, nullptr, &m_surface);
+	// デバイスローカルのメモリへの転送
+	m_uploader.create(m_device, m_memoryAllocator, m_graphicsQueueIndex, m_deviceQueue, m_transferQueueIndex, m_transferQueue, m_timelineSemaphore);
+
 	// サーフェイスのフォーマット情報選択
 	selectSurfaceFormat(VK_FORMAT_B8G8R8A8_UNORM);
 	// サーフェイスの能力値情報取得
 	vkGetPhysicalDeviceSurfaceCapabilitiesKHR(m_physDev, m_surface, &m_surfaceCaps);
-	VkBool32 isSupport;
-	vkGetPhysicalDeviceSurfaceSupportKHR(m_physDev, m_graphicsQueueIndex, m_surface, &isSupport);
+	// Present の方式
+	selectPresentMode();
 
 	// スワップチェイン作成
 	createSwapChain(window);
@@ -86,23 +139,144 @@ void VulkanAppBase::initialize(GLFWwindow* window, const char* appName)
 	// フレームバッファの生成
 	createFramebuffer();
 
+	// コーンマーチングの前処理パスの描画先
+	m_coneMarchPrepass.create(m_device, m_memoryAllocator, m_swapchainExtent, m_framesInFlight);
+
+	// パイプラインキャッシュ（prepare でパイプラインを作成する前に読み込む）
+	m_pipelineCache.create(m_device, m_physDev, m_pipelineCacheFile.empty() ? nullptr : m_pipelineCacheFile.c_str());
+
+	// レイマーチングの品質（prepare で作成するパイプラインの特殊化定数）
+	prepareMarchQuality();
+
+	// フレームごとのユニフォームデータ
+	VkPhysicalDeviceProperties physProps;
+	vkGetPhysicalDeviceProperties(m_physDev, &physProps);
+	m_uniformRing.create(m_memoryAllocator, physProps.limits.minUniformBufferOffsetAlignment, UniformFrameSize, m_framesInFlight);
+
+	// GPU の処理時間の計測（パイプライン統計はデバイスで有効にできた場合だけ取る）
+	if (m_gpuProfiling)
+	{
+		m_gpuProfiler.create(m_device, m_physDev, m_graphicsQueueIndex, m_framesInFlight, m_enabledFeatures.pipelineStatisticsQuery == VK_TRUE);
+	}
+
 	// コマンドバッファの準備
 	prepareCommandBuffers();
 
 	// 描画フレーム同期用
 	prepareSemaphores();
 
-	glfwGetWindowSize(window, &width, &height);
+	width = int(m_swapchainExtent.width);
+	height = int(m_swapchainExtent.height);
 
 	prepare();
+
+	// prepare で記録した転送をまとめて送信する（描画より前に描画用のキューで所有権を取得する）
+	m_uploader.flush();
+}
+
+void VulkanAppBase::initializeOffscreen(uint32_t width, uint32_t height, const char* appName)
+{
+	m_offscreen = true;
+
+	// Vulkan インスタンスの生成
+	initializeInstance(appName);
+
+	// 物理デバイスとキューファミリーの選択
+	selectPhysicalDevice();
+
+#ifdef _DEBUG
+	// デバッグレポート関数のセット
+	enableDebugReport();
+#endif
+
+	// 論理デバイスの生成
+	createDevice();
+
+	// デバイスメモリの割り当て（以降のバッファとイメージはここから切り出す）
+	m_memoryAllocator.create(m_device, m_physDev);
+
+	// コマンドプールの準備
+	prepareCommandPool();
+
+	// デバイスローカルのメモリへの転送
+	m_uploader.create(m_device, m_memoryAllocator, m_graphicsQueueIndex, m_deviceQueue, m_transferQueueIndex, m_transferQueue, m_timelineSemaphore);
+
+	// サーフェイスの代わりに描画先のフォーマット・サイズを決める
+	m_surfaceFormat.format = VK_FORMAT_B8G8R8A8_UNORM;
+	m_surfaceFormat.colorSpace = VK_COLOR_SPACE_SRGB_NONLINEAR_KHR;
+	m_swapchainExtent = { width, height };
+
+	// スワップチェインイメージの代わりにデバイスローカルのイメージを作成
+	createOffscreenImages(2);
+	// デプスバッファ生成
+	createDepthBuffer();
+	// 描画先イメージとデプスバッファへのImageViewを生成
+	createViews();
+
+	// レンダーパスの生成
+	createRenderPass();
+
+	// フレームバッファの生成
+	createFramebuffer();
+
+	// コーンマーチングの前処理パスの描画先
+	m_coneMarchPrepass.create(m_device, m_memoryAllocator, m_swapchainExtent, m_framesInFlight);
+
+	// パイプラインキャッシュ（prepare でパイプラインを作成する前に読み込む）
+	m_pipelineCache.create(m_device, m_physDev, m_pipelineCacheFile.empty() ? nullptr : m_pipelineCacheFile.c_str());
+
+	// レイマーチングの品質（prepare で作成するパイプラインの特殊化定数）
+	prepareMarchQuality();
+
+	// フレームごとのユニフォームデータ
+	VkPhysicalDeviceProperties physProps;
+	vkGetPhysicalDeviceProperties(m_physDev, &physProps);
+	m_uniformRing.create(m_memoryAllocator, physProps.limits.minUniformBufferOffsetAlignment, UniformFrameSize, m_framesInFlight);
+
+	// GPU の処理時間の計測（パイプライン統計はデバイスで有効にできた場合だけ取る）
+	if (m_gpuProfiling)
+	{
+		m_gpuProfiler.create(m_device, m_physDev, m_graphicsQueueIndex, m_framesInFlight, m_enabledFeatures.pipelineStatisticsQuery == VK_TRUE);
+	}
+
+	// コマンドバッファの準備
+	prepareCommandBuffers();
+
+	// 描画フレーム同期用
+	prepareSemaphores();
+
+	// 読み戻し用バッファの準備
+	createReadbackBuffer();
+
+	this->width = int(width);
+	this->height = int(height);
+
+	prepare();
+
+	// prepare で記録した転送をまとめて送信する（描画より前に描画用のキューで所有権を取得する）
+	m_uploader.flush();
 }
 
 void VulkanAppBase::terminate()
 {
 	vkDeviceWaitIdle(m_device);
 
+	// 作成中のパイプラインを待ってから派生先に破棄させる（キャッシュを書き戻す前に作成を終える）
+	m_pipelineBuilder.end();
+
+	// 転送に使ったステージングバッファを解放する
+	OutputDebugStringA(m_uploader.createReport().c_str());
+	m_uploader.destroy();
+
 	cleanup();
 
+	// パイプラインキャッシュをファイルに書き戻す
+	m_pipelineCache.destroy();
+
+	m_coneMarchPrepass.destroy();
+	m_uniformRing.destroy();
+	m_gpuProfiler.destroy();
+
 	// コマンドバッファクリア
 	vkFreeCommandBuffers(m_device, m_commandPool, uint32_t(m_commands.size()), m_commands.data());
 	m_commands.clear();
@@ -118,17 +292,32 @@ void VulkanAppBase::terminate()
 	m_framebuffers.clear();
 
 	// デプスバッファクリア
-	vkFreeMemory(m_device, m_depthBufferMemory, nullptr);
-	vkDestroyImage(m_device, m_depthBuffer, nullptr);
 	vkDestroyImageView(m_device, m_depthBufferView, nullptr);
+	m_memoryAllocator.destroyImage(m_depthBuffer, m_depthBufferMemory);
 
 	// スワップチェーンクリア
 	for (auto& v : m_swapchainViews)
 	{
 		vkDestroyImageView(m_device, v, nullptr);
 	}
+	m_swapchainViews.clear();
+	if (m_offscreen)
+	{
+		// オフスクリーン描画先イメージクリア
+		for (size_t i = 0; i < m_swapchainImages.size(); i++)
+		{
+			m_memoryAllocator.destroyImage(m_swapchainImages[i], m_offscreenImageMemory[i]);
+		}
+		m_offscreenImageMemory.clear();
+
+		// 読み戻し用バッファクリア
+		m_memoryAllocator.destroyBuffer(m_readbackBuffer, m_readbackMemory);
+	}
+	else
+	{
+		vkDestroySwapchainKHR(m_device, m_swapchain, nullptr);
+	}
 	m_swapchainImages.clear();
-	vkDestroySwapchainKHR(m_device, m_swapchain, nullptr);
 
 
 	// フェンスクリア
@@ -137,16 +326,32 @@ void VulkanAppBase::terminate()
 		vkDestroyFence(m_device, v, nullptr);
 	}
 	m_fences.clear();
+	m_imageFences.clear();
 
 	// セマフォクリア
-	vkDestroySemaphore(m_device, m_presentCompletedSem, nullptr);
-	vkDestroySemaphore(m_device, m_renderCompletedSem, nullptr);
+	for (auto& v : m_presentCompletedSems)
+	{
+		vkDestroySemaphore(m_device, v, nullptr);
+	}
+	for (auto& v : m_renderCompletedSems)
+	{
+		vkDestroySemaphore(m_device, v, nullptr);
+	}
+	m_presentCompletedSems.clear();
+	m_renderCompletedSems.clear();
 
 	// コマンドプールクリア
 	vkDestroyCommandPool(m_device, m_commandPool, nullptr);
 
 	// サーフェイスクリア
-	vkDestroySurfaceKHR(m_instance, m_surface, nullptr);
+	if (!m_offscreen)
+	{
+		vkDestroySurfaceKHR(m_instance, m_surface, nullptr);
+	}
+
+	// デバイスメモリクリア（解放し忘れたものがあれば出力される）
+	OutputDebugStringA(m_memoryAllocator.createReport().c_str());
+	m_memoryAllocator.destroy();
 
 	// 論理デバイスクリア
 	vkDestroyDevice(m_device, nullptr);
@@ -161,59 +366,96 @@ void VulkanAppBase::terminate()
 
 void VulkanAppBase::render()
 {
+	if (!m_offscreen)
+	{
+		// ウィンドウの大きさが変わったか、前のフレームで作り直しが必要と分かった場合は作り直す
+		if ((m_framebufferResized || m_swapchainOutOfDate) && !recreateSwapchain())
+		{
+			// 最小化している間は描画しない
+			return;
+		}
+	}
+
 	prevTime = currentTime;
-	currentTime = glfwGetTime();
+	currentTime = (m_fixedTimeStep > 0.0) ? currentTime + m_fixedTimeStep : getTime();
 
-	uint32_t nextImageIndex = 0;
-	vkAcquireNextImageKHR(m_device, m_swapchain, UINT64_MAX, m_presentCompletedSem, VK_NULL_HANDLE, &nextImageIndex);
-	auto commandFence = m_fences[nextImageIndex];
+	// 次のフレームのリソース（コマンドバッファ・ユニフォームバッファなど）を GPU が使い終えるのを待つ
+	// 待つのは m_framesInFlight フレーム前の分だけなので、直前のフレームの実行中に記録を始められる
+	m_frameIndex = (m_frameIndex + 1) % m_framesInFlight;
+	auto commandFence = m_fences[m_frameIndex];
 	vkWaitForFences(m_device, 1, &commandFence, VK_TRUE, UINT64_MAX);
 
-	// クリア値
-	array<VkClearValue, 2> clearValue = {
-		{ 
-		  //{0.5f, 0.25f, 0.25f, 0.0f}, //for color
-		  {.1f, .1f, .3f, 0.0f}, //for color
-		  {1.0f, 0} //for depth
+	uint32_t nextImageIndex = 0;
+	if (m_offscreen)
+	{
+		// オフスクリーン時は描画先イメージを順番に使う
+		nextImageIndex = (m_imageIndex + 1) % uint32_t(m_swapchainImages.size());
+	}
+	else
+	{
+		auto result = vkAcquireNextImageKHR(m_device, m_swapchain, UINT64_MAX, m_presentCompletedSems[m_frameIndex], VK_NULL_HANDLE, &nextImageIndex);
+		if (result == VK_ERROR_OUT_OF_DATE_KHR)
+		{
+			// セマフォは signal されないので、このフレームは描画せずに次のフレームの前に作り直す
+			m_swapchainOutOfDate = true;
+			return;
 		}
-	};
-
-	VkRenderPassBeginInfo renderPassBI{};
-	renderPassBI.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
-	renderPassBI.renderPass = m_renderPass;
-	renderPassBI.framebuffer = m_framebuffers[nextImageIndex];
-	renderPassBI.renderArea.offset = VkOffset2D{ 0,0 };
-	renderPassBI.renderArea.extent = m_swapchainExtent;
-	renderPassBI.pClearValues = clearValue.data();
-	renderPassBI.clearValueCount = uint32_t(clearValue.size());
-
-	// コマンドバッファ・レンダーパス開始
-	VkCommandBufferBeginInfo commandBI{};
-	commandBI.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
-	auto& command = m_commands[nextImageIndex];
-	vkBeginCommandBuffer(command, &commandBI);
-	vkCmdBeginRenderPass(command, &renderPassBI, VK_SUBPASS_CONTENTS_INLINE);
+		// SUBOPTIMAL の場合はこのまま描画して Present し、次のフレームの前に作り直す
+		m_swapchainOutOfDate = (result == VK_SUBOPTIMAL_KHR);
+	}
 
+	// イメージ数よりフレーム数が多い場合などは、同じイメージに描く前のフレームを待つ
+	auto imageFence = m_imageFences[nextImageIndex];
+	if (imageFence != VK_NULL_HANDLE && imageFence != commandFence)
+	{
+		vkWaitForFences(m_device, 1, &imageFence, VK_TRUE, UINT64_MAX);
+	}
+	m_imageFences[nextImageIndex] = commandFence;
 	m_imageIndex = nextImageIndex;
-	makeCommand(command);
 
-	// コマンド・レンダーパス終了
-	vkCmdEndRenderPass(command);
-	vkEndCommandBuffer(command);
+	// フレームごとのパラメータの更新（このフレームの区画に書き込む）
+	m_coneMarchPrepass.beginFrame(m_frameIndex);
+	m_uniformRing.beginFrame(m_frameIndex);
+	m_gpuProfiler.beginFrame(m_frameIndex);
+	update();
+
+	// 使い回す場合はフレームの枠とイメージの組ごとに一度だけ記録する
+	uint32_t commandIndex = m_frameIndex;
+	if (m_reuseCommands)
+	{
+		commandIndex = m_frameIndex * uint32_t(m_swapchainImages.size()) + nextImageIndex;
+	}
+	auto& command = m_commands[commandIndex];
+	if (!m_reuseCommands || !m_commandRecorded[commandIndex])
+	{
+		recordCommand(command);
+		m_commandRecorded[commandIndex] = m_reuseCommands;
+	}
 
 	// コマンドを実行（送信）
+	// スワップチェインのイメージにはカラーアタッチメントとして書くか、ブリットで書く
 	VkSubmitInfo submitInfo{};
-	VkPipelineStageFlags waitStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
+	VkPipelineStageFlags waitStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT | VK_PIPELINE_STAGE_TRANSFER_BIT;
 	submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
 	submitInfo.commandBufferCount = 1;
 	submitInfo.pCommandBuffers = &command;
 	submitInfo.pWaitDstStageMask = &waitStageMask;
-	submitInfo.waitSemaphoreCount = 1;
-	submitInfo.pWaitSemaphores = &m_presentCompletedSem;
-	submitInfo.signalSemaphoreCount = 1;
-	submitInfo.pSignalSemaphores = &m_renderCompletedSem;
+	if (!m_offscreen)
+	{
+		submitInfo.waitSemaphoreCount = 1;
+		submitInfo.pWaitSemaphores = &m_presentCompletedSems[m_frameIndex];
+		submitInfo.signalSemaphoreCount = 1;
+		submitInfo.pSignalSemaphores = &m_renderCompletedSems[m_frameIndex];
+	}
 	vkResetFences(m_device, 1, &commandFence);
 	vkQueueSubmit(m_deviceQueue, 1, &submitInfo, commandFence);
+	m_gpuProfiler.endFrame(m_frameIndex);
+
+	if (m_offscreen)
+	{
+		// オフスクリーン時はPresentしない
+		return;
+	}
 
 	// Present処理
 	VkPresentInfoKHR presentInfo{};
@@ -222,9 +464,240 @@ void VulkanAppBase::render()
 	presentInfo.pSwapchains = &m_swapchain;
 	presentInfo.pImageIndices = &nextImageIndex;
 	presentInfo.waitSemaphoreCount = 1;
-	presentInfo.pWaitSemaphores = &m_renderCompletedSem;
-	vkQueuePresentKHR(m_deviceQueue, &presentInfo);
+	presentInfo.pWaitSemaphores = &m_renderCompletedSems[m_frameIndex];
+	auto result = vkQueuePresentKHR(m_deviceQueue, &presentInfo);
+	if (result == VK_ERROR_OUT_OF_DATE_KHR || result == VK_SUBOPTIMAL_KHR)
+	{
+		m_swapchainOutOfDate = true;
+	}
+}
 
+// GPU がすべての処理を終えるのを待つ
+void VulkanAppBase::waitIdle()
+{
+	vkDeviceWaitIdle(m_device);
+}
+
+// 記録済みのコマンドバッファを破棄し、次に使うときに記録し直す
+void VulkanAppBase::invalidateCommands()
+{
+	m_commandRecorded.assign(m_commandRecorded.size(), false);
+}
+
+bool VulkanAppBase::findPresentMode(const char* name, VkPresentModeKHR* mode)
+{
+	for (const auto& v : PresentModeNames)
+	{
+		if (strcmp(name, v.name) == 0)
+		{
+			*mode = v.mode;
+			return true;
+		}
+	}
+	return false;
+}
+
+const char* VulkanAppBase::getPresentModeName(VkPresentModeKHR mode)
+{
+	for (const auto& v : PresentModeNames)
+	{
+		if (v.mode == mode)
+		{
+			return v.name;
+		}
+	}
+	return "unknown";
+}
+
+// 描画の完了を待ってステップ数の統計を集計する
+ConeMarchPrepass::Statistics VulkanAppBase::collectMarchStatistics()
+{
+	vkDeviceWaitIdle(m_device);
+	return m_coneMarchPrepass.collectStatistics();
+}
+
+// 前処理パスなし・ありでそれぞれ描画し、ステップ数の統計を出力する
+// 元の設定の方を後に描画するので、続けて保存する画像は設定どおりになる
+void VulkanAppBase::renderWithMarchStatistics(int frameCount)
+{
+	if (!isMarchStatisticsSupported() || !m_coneMarchPrepass.hasStatisticsShader())
+	{
+		OutputDebugStringA(isMarchStatisticsSupported() ?
+			"march shader without statistics (MARCH_STATS) loaded. rendering without statistics.\n" :
+			"march statistics not supported (fragmentStoresAndAtomics). rendering without statistics.\n");
+		for (int i = 0; i < frameCount; i++)
+		{
+			render();
+		}
+		return;
+	}
+
+	const bool prepassEnabled = m_coneMarchPrepass.isEnabled();
+	m_coneMarchPrepass.setStatisticsEnabled(true);
+
+	const bool passes[] = { !prepassEnabled, prepassEnabled };
+	for (bool prepass : passes)
+	{
+		if (prepass && !m_coneMarchPrepass.isAvailable())
+		{
+			continue;
+		}
+		m_coneMarchPrepass.setEnabled(prepass);
+		invalidateCommands();
+		for (int i = 0; i < frameCount; i++)
+		{
+			render();
+		}
+		OutputDebugStringA(ConeMarchPrepass::createReport(prepass ? "with prepass" : "without prepass", collectMarchStatistics()).c_str());
+	}
+	m_coneMarchPrepass.setEnabled(prepassEnabled);
+	m_coneMarchPrepass.setStatisticsEnabled(false);
+	invalidateCommands();
+}
+
+// 1フレーム描画してピクセルごとのステップ数と終了理由を集計し、擬似カラーの画像を保存する
+void VulkanAppBase::renderWithMarchHeatmap(const char* fileName)
+{
+	if (!isMarchStatisticsSupported() || !m_coneMarchPrepass.hasStatisticsShader())
+	{
+		OutputDebugStringA(isMarchStatisticsSupported() ?
+			"march shader without statistics (MARCH_STATS) loaded. heatmap skipped.\n" :
+			"march heatmap not supported (fragmentStoresAndAtomics).\n");
+		return;
+	}
+
+	m_coneMarchPrepass.setHeatmapEnabled(true);
+	invalidateCommands();
+	render();
+
+	// 描画したフレームの枠に書かれている
+	vkDeviceWaitIdle(m_device);
+	vector<uint32_t> codes;
+	m_coneMarchPrepass.readHeatmap(m_frameIndex, &codes);
+	m_coneMarchPrepass.setHeatmapEnabled(false);
+	invalidateCommands();
+
+	auto stats = MarchHeatmap::analyze(codes);
+	const char* label = m_coneMarchPrepass.isEnabled() ? "with prepass" : "without prepass";
+	OutputDebugStringA(MarchHeatmap::createReport(label, stats).c_str());
+
+	vector<uint8_t> pixels;
+	MarchHeatmap::createImage(codes, stats.maxSteps, &pixels);
+	writePPM(fileName, m_swapchainExtent.width, m_swapchainExtent.height, pixels);
+}
+
+// frameCount フレーム描画し、区間ごとの処理時間を出力する
+void VulkanAppBase::renderWithGpuProfile(int frameCount)
+{
+	// 前に描画した分は捨てる
+	vkDeviceWaitIdle(m_device);
+	m_gpuProfiler.flush();
+	m_gpuProfiler.clearStatistics();
+
+	for (int i = 0; i < frameCount; i++)
+	{
+		render();
+	}
+
+	vkDeviceWaitIdle(m_device);
+	m_gpuProfiler.flush();
+	OutputDebugStringA(m_gpuProfiler.createReport().c_str());
+}
+
+// 直近に描画したイメージを読み戻す
+// pixels:RGBA8 のピクセル列（左上原点）
+bool VulkanAppBase::readbackImage(vector<uint8_t>* pixels)
+{
+	if (!m_offscreen)
+	{
+		return false;
+	}
+
+	// 描画の完了を待つ
+	auto commandFence = m_fences[m_frameIndex];
+	vkWaitForFences(m_device, 1, &commandFence, VK_TRUE, UINT64_MAX);
+
+	VkCommandBufferAllocateInfo ai{};
+	ai.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+	ai.commandPool = m_commandPool;
+	ai.commandBufferCount = 1;
+	ai.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+	VkCommandBuffer command;
+	auto result = vkAllocateCommandBuffers(m_device, &ai, &command);
+	checkResult(result);
+
+	VkCommandBufferBeginInfo commandBI{};
+	commandBI.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+	commandBI.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+	vkBeginCommandBuffer(command, &commandBI);
+
+	// レンダーパス終了時に TRANSFER_SRC_OPTIMAL へ遷移済み
+	VkBufferImageCopy region{};
+	region.imageSubresource = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 0, 1 };
+	region.imageExtent = { m_swapchainExtent.width, m_swapchainExtent.height, 1 };
+	vkCmdCopyImageToBuffer(command, m_swapchainImages[m_imageIndex], VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, m_readbackBuffer, 1, &region);
+
+	VkBufferMemoryBarrier barrier{};
+	barrier.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+	barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+	barrier.dstAccessMask = VK_ACCESS_HOST_READ_BIT;
+	barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+	barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+	barrier.buffer = m_readbackBuffer;
+	barrier.offset = 0;
+	barrier.size = VK_WHOLE_SIZE;
+	vkCmdPipelineBarrier(command, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_HOST_BIT, 0, 0, nullptr, 1, &barrier, 0, nullptr);
+	vkEndCommandBuffer(command);
+
+	VkSubmitInfo submitInfo{};
+	submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+	submitInfo.commandBufferCount = 1;
+	submitInfo.pCommandBuffers = &command;
+	vkQueueSubmit(m_deviceQueue, 1, &submitInfo, VK_NULL_HANDLE);
+	vkQueueWaitIdle(m_deviceQueue);
+	vkFreeCommandBuffers(m_device, m_commandPool, 1, &command);
+
+	// BGRA -> RGBA に並べ替えながらコピー
+	const size_t pixelCount = size_t(m_swapchainExtent.width) * m_swapchainExtent.height;
+	pixels->resize(pixelCount * 4);
+	const uint8_t* src = static_cast<const uint8_t*>(m_readbackMemory.mapped);
+	const bool isBGRA = m_surfaceFormat.format == VK_FORMAT_B8G8R8A8_UNORM;
+	for (size_t i = 0; i < pixelCount; i++)
+	{
+		(*pixels)[i * 4 + 0] = src[i * 4 + (isBGRA ? 2 : 0)];
+		(*pixels)[i * 4 + 1] = src[i * 4 + 1];
+		(*pixels)[i * 4 + 2] = src[i * 4 + (isBGRA ? 0 : 2)];
+		(*pixels)[i * 4 + 3] = src[i * 4 + 3];
+	}
+	return true;
+}
+
+// 直近に描画したイメージをPPM形式で保存する
+bool VulkanAppBase::saveImage(const char* fileName)
+{
+	vector<uint8_t> pixels;
+	if (!readbackImage(&pixels))
+	{
+		return false;
+	}
+	return writePPM(fileName, m_swapchainExtent.width, m_swapchainExtent.height, pixels);
+}
+
+// RGBA8 のピクセル列をPPM形式で保存する
+bool VulkanAppBase::writePPM(const char* fileName, uint32_t width, uint32_t height, const vector<uint8_t>& pixels)
+{
+	ofstream outfile(fileName, std::ios::binary);
+	if (!outfile)
+	{
+		OutputDebugStringA("failed to open output file.\n");
+		return false;
+	}
+	outfile << "P6\n" << width << " " << height << "\n255\n";
+	for (size_t i = 0; i < pixels.size(); i += 4)
+	{
+		outfile.write(reinterpret_cast<const char*>(&pixels[i]), 3);
+	}
+	return true;
 }
 
 
@@ -242,8 +715,6 @@ void VulkanAppBase::checkResult(VkResult result)
 // vkInstanceを初期化する
 void VulkanAppBase::initializeInstance(const char* appName)
 {
-	vector<const char*> extensions;
-
 	// アプリケーション情報を初期化
 	VkApplicationInfo appInfo{};
 	appInfo.sType = VK_STRUCTURE_TYPE_APPLICATION_INFO;
@@ -252,23 +723,30 @@ void VulkanAppBase::initializeInstance(const char* appName)
 	appInfo.apiVersion = VK_API_VERSION_1_1;
 	appInfo.engineVersion = VK_MAKE_VERSION(1, 0, 0);
 
-	// 拡張情報の取得
-	vector<VkExtensionProperties> props;
+	// 使う機能ごとの拡張（ウィンドウのサーフェイスとデバッグレポート）
+	m_instanceExtensions.clear();
+	if (!m_offscreen)
 	{
 		uint32_t count = 0;
-		vkEnumerateInstanceExtensionProperties(nullptr, &count, nullptr);
-		props.resize(count);
-		vkEnumerateInstanceExtensionProperties(nullptr, &count, props.data());
-
-		for (const auto& v : props)
+		const char** names = glfwGetRequiredInstanceExtensions(&count);
+		for (uint32_t i = 0; i < count; i++)
 		{
-			extensions.push_back(v.extensionName);
+			m_instanceExtensions.require(names[i], "surface");
 		}
 	}
+#ifdef _DEBUG
+	m_instanceExtensions.request(VK_EXT_DEBUG_REPORT_EXTENSION_NAME, "debug report");
+#endif
+	if (!m_instanceExtensions.resolve(ExtensionSet::enumerateInstance()))
+	{
+		OutputDebugStringA(m_instanceExtensions.createReport("instance", 0.0).c_str());
+		DebugBreak();
+	}
+
 	VkInstanceCreateInfo ci{};
 	ci.sType = VK_STRUCTURE_TYPE_INSTANCE_CREATE_INFO;
-	ci.enabledExtensionCount = uint32_t(extensions.size());
-	ci.ppEnabledExtensionNames = extensions.data();
+	ci.enabledExtensionCount = uint32_t(m_instanceExtensions.getEnabledNames().size());
+	ci.ppEnabledExtensionNames = m_instanceExtensions.getEnabledNames().data();
 	ci.pApplicationInfo = &appInfo;
 
 #ifdef _DEBUG
@@ -278,82 +756,115 @@ void VulkanAppBase::initializeInstance(const char* appName)
 	ci.ppEnabledLayerNames = layers;
 #endif
 
+	auto start = chrono::steady_clock::now();
 	auto result = vkCreateInstance(&ci, nullptr, &m_instance);
 	checkResult(result);
+	OutputDebugStringA(m_instanceExtensions.createReport("instance", chrono::duration<double, milli>(chrono::steady_clock::now() - start).count()).c_str());
 }
 
-// 物理デバイスを取得する
+// 物理デバイスとキューファミリーを選ぶ
+// 点数が最も高いもの（setPhysicalDeviceFilter で指定した場合はそれに一致するもの）を使う
 void VulkanAppBase::selectPhysicalDevice()
 {
-	uint32_t devCount = 0;
-	vkEnumeratePhysicalDevices(m_instance, &devCount, nullptr);
-	vector<VkPhysicalDevice> physDevs(devCount);
-	vkEnumeratePhysicalDevices(m_instance, &devCount, physDevs.data());
+	// 使う機能ごとのデバイス拡張（必須のものに対応していないデバイスは選ばない）
+	m_deviceExtensions.clear();
+	if (!m_offscreen)
+	{
+		m_deviceExtensions.require(VK_KHR_SWAPCHAIN_EXTENSION_NAME, "swapchain");
+	}
+	StagingUploader::requestExtensions(m_deviceExtensions);
+
+	PhysicalDeviceSelector::Requirements requirements{};
+	requirements.apiVersion = VK_API_VERSION_1_1;
+	requirements.surface = m_surface;
+	requirements.extensions = m_deviceExtensions.getRequiredNames();
+	requirements.fragmentStoresAndAtomics = true;
+	requirements.pipelineStatisticsQuery = m_gpuProfiling;
+
+	auto candidates = PhysicalDeviceSelector::enumerate(m_instance, requirements);
+	int selected = PhysicalDeviceSelector::select(candidates, m_physicalDeviceFilter.c_str());
+	OutputDebugStringA(PhysicalDeviceSelector::createReport(candidates, selected).c_str());
+	if (selected < 0)
+	{
+		OutputDebugStringA("[PhysicalDeviceSelector] no suitable physical device.\n");
+		DebugBreak();
+		return;
+	}
+
+	const auto& candidate = candidates[selected];
+	m_physDev = candidate.device;
+	m_physDevName = candidate.name;
+	m_graphicsQueueIndex = candidate.graphicsQueueFamily;
 
-	// 最初のデバイスを使用する
-	m_physDev = physDevs[0];
+	// 転送専用のキューファミリー（ディスクリート GPU の DMA エンジンに当たり、描画と並行してコピーできる）
+	// 無ければグラフィックスのキューで転送する
+	m_transferQueueIndex = (candidate.transferQueueFamily != UINT32_MAX) ? candidate.transferQueueFamily : m_graphicsQueueIndex;
 
 	// メモリプロパティを取得しておく
 	vkGetPhysicalDeviceMemoryProperties(m_physDev, &m_physMemProps);
 }
 
-// デバイスキューインデックスを取得する
-uint32_t VulkanAppBase::searchGraphicsQueueIndex()
-{
-	uint32_t propCount;
-	vkGetPhysicalDeviceQueueFamilyProperties(m_physDev, &propCount, nullptr);
-	vector<VkQueueFamilyProperties> props(propCount);
-	vkGetPhysicalDeviceQueueFamilyProperties(m_physDev, &propCount, props.data());
-
-	uint32_t graphicsQueue = ~0u;
-	for (uint32_t i = 0; i < propCount; i++)
-	{
-		if (props[i].queueFlags & VK_QUEUE_GRAPHICS_BIT)
-		{
-			graphicsQueue = i;
-			break;
-		}
-	}
-
-	return graphicsQueue;
-}
-
 // 論理デバイスを作成する
 void VulkanAppBase::createDevice()
 {
 	const float defaultQueuePriority(1.0f);
-	VkDeviceQueueCreateInfo devQueueCI{};
-	devQueueCI.sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO;
-	devQueueCI.queueFamilyIndex = m_graphicsQueueIndex;
-	devQueueCI.queueCount = 1;
-	devQueueCI.pQueuePriorities = &defaultQueuePriority;
-
-	vector<VkExtensionProperties> devExtProps;
+	VkDeviceQueueCreateInfo devQueueCI[2]{};
+	devQueueCI[0].sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO;
+	devQueueCI[0].queueFamilyIndex = m_graphicsQueueIndex;
+	devQueueCI[0].queueCount = 1;
+	devQueueCI[0].pQueuePriorities = &defaultQueuePriority;
+	// 転送専用のキュー
+	devQueueCI[1] = devQueueCI[0];
+	devQueueCI[1].queueFamilyIndex = m_transferQueueIndex;
+	const uint32_t queueCount = (m_transferQueueIndex != m_graphicsQueueIndex) ? 2 : 1;
+
+	// selectPhysicalDevice で登録した拡張のうち、対応しているものだけを有効にする
+	if (!m_deviceExtensions.resolve(ExtensionSet::enumerateDevice(m_physDev)))
 	{
-		// 拡張情報の取得
-		uint32_t count = 0;
-		vkEnumerateDeviceExtensionProperties(m_physDev, nullptr, &count, nullptr);
-		devExtProps.resize(count);
-		vkEnumerateDeviceExtensionProperties(m_physDev, nullptr, &count, devExtProps.data());
+		OutputDebugStringA(m_deviceExtensions.createReport("device", 0.0).c_str());
+		DebugBreak();
 	}
 
-	vector<const char*> extensions;
-	for (const auto& v : devExtProps)
+	// フラグメントシェーダーからステップ数の統計をアトミック加算する
+	// 無いデバイスでは有効にせず、統計とヒートマップを取らない（isMarchStatisticsSupported）
+	VkPhysicalDeviceFeatures supportedFeatures, features{};
+	vkGetPhysicalDeviceFeatures(m_physDev, &supportedFeatures);
+	features.fragmentStoresAndAtomics = supportedFeatures.fragmentStoresAndAtomics;
+	// GPU の処理時間の計測でパイプライン統計クエリを使う
+	features.pipelineStatisticsQuery = m_gpuProfiling ? supportedFeatures.pipelineStatisticsQuery : VK_FALSE;
+
+	// 転送の完了をタイムラインセマフォで待つ（Vulkan 1.1 では拡張）
+	VkPhysicalDeviceTimelineSemaphoreFeaturesKHR timelineFeatures{};
+	timelineFeatures.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_TIMELINE_SEMAPHORE_FEATURES_KHR;
+	VkPhysicalDeviceProperties physProps;
+	vkGetPhysicalDeviceProperties(m_physDev, &physProps);
+	if (m_deviceExtensions.isEnabled(VK_KHR_TIMELINE_SEMAPHORE_EXTENSION_NAME) && physProps.apiVersion >= VK_API_VERSION_1_1)
 	{
-		extensions.push_back(v.extensionName);
+		VkPhysicalDeviceFeatures2 features2{};
+		features2.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2;
+		features2.pNext = &timelineFeatures;
+		vkGetPhysicalDeviceFeatures2(m_physDev, &features2);
 	}
+
 	VkDeviceCreateInfo ci{};
 	ci.sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO;
-	ci.pQueueCreateInfos = &devQueueCI;
-	ci.queueCreateInfoCount = 1;
-	ci.ppEnabledExtensionNames = extensions.data();
-	ci.enabledExtensionCount = uint32_t(extensions.size());
-
+	ci.pNext = (timelineFeatures.timelineSemaphore == VK_TRUE) ? &timelineFeatures : nullptr;
+	ci.pQueueCreateInfos = devQueueCI;
+	ci.queueCreateInfoCount = queueCount;
+	ci.ppEnabledExtensionNames = m_deviceExtensions.getEnabledNames().data();
+	ci.enabledExtensionCount = uint32_t(m_deviceExtensions.getEnabledNames().size());
+	ci.pEnabledFeatures = &features;
+
+	auto start = chrono::steady_clock::now();
 	auto result = vkCreateDevice(m_physDev, &ci, nullptr, &m_device);
 	checkResult(result);
+	OutputDebugStringA(m_deviceExtensions.createReport("device", chrono::duration<double, milli>(chrono::steady_clock::now() - start).count()).c_str());
+	m_enabledFeatures = features;
+	m_timelineSemaphore = timelineFeatures.timelineSemaphore == VK_TRUE;
 
 	// デバイスキューの取得
 	 vkGetDeviceQueue(m_device, m_graphicsQueueIndex, 0, &m_deviceQueue);
+	vkGetDeviceQueue(m_device, m_transferQueueIndex, 0, &m_transferQueue);
 }
 
 // コマンドプールの準備
@@ -389,15 +900,20 @@ void VulkanAppBase::selectSurfaceFormat(VkFormat format)
 // スワップチェイン作成
 void VulkanAppBase::createSwapChain(GLFWwindow* window)
 {
-	auto imageCount = (std::max)(2u, m_surfaceCaps.minImageCount);
+	// MAILBOX は表示中・表示待ちとは別に描くイメージが要るので3枚にする
+	uint32_t imageCount = (std::max)(m_presentMode == VK_PRESENT_MODE_MAILBOX_KHR ? 3u : 2u, m_surfaceCaps.minImageCount);
+	if (m_surfaceCaps.maxImageCount > 0)
+	{
+		imageCount = (std::min)(imageCount, m_surfaceCaps.maxImageCount);
+	}
 	auto extent = m_surfaceCaps.currentExtent;
 	if (extent.width == ~0u)
 	{
-		// 値が無効なのでウィンドウサイズを使用する
+		// 値が無効なのでフレームバッファのサイズを使用する
 		int width, height;
-		glfwGetWindowSize(window, &width, &height);
-		extent.width = uint32_t(width);
-		extent.height = uint32_t(height);
+		glfwGetFramebufferSize(window, &width, &height);
+		extent.width = (std::min)((std::max)(uint32_t(width), m_surfaceCaps.minImageExtent.width), m_surfaceCaps.maxImageExtent.width);
+		extent.height = (std::min)((std::max)(uint32_t(height), m_surfaceCaps.minImageExtent.height), m_surfaceCaps.maxImageExtent.height);
 	}
 	uint32_t queueFamilyIndices[] = { m_graphicsQueueIndex };
 	VkSwapchainCreateInfoKHR ci{};
@@ -408,12 +924,18 @@ void VulkanAppBase::createSwapChain(GLFWwindow* window)
 	ci.imageColorSpace = m_surfaceFormat.colorSpace;
 	ci.imageExtent = extent;
 	ci.imageUsage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT;
+	if (m_surfaceCaps.supportedUsageFlags & VK_IMAGE_USAGE_TRANSFER_DST_BIT)
+	{
+		// コンピュートシェーダーで描画した結果をブリットで書き込む
+		ci.imageUsage |= VK_IMAGE_USAGE_TRANSFER_DST_BIT;
+	}
 	ci.preTransform = m_surfaceCaps.currentTransform;
 	ci.imageArrayLayers = 1;
 	ci.imageSharingMode = VK_SHARING_MODE_EXCLUSIVE;
 	ci.queueFamilyIndexCount = 0;
 	ci.presentMode = m_presentMode;
-	ci.oldSwapchain = VK_NULL_HANDLE;
+	// 作り直す場合は古いスワップチェインを渡し、表示中のイメージを引き継がせる（呼び出し側で破棄する）
+	ci.oldSwapchain = m_swapchain;
 	ci.clipped = VK_TRUE;
 	ci.compositeAlpha = VK_COMPOSITE_ALPHA_OPAQUE_BIT_KHR;
 	
@@ -422,6 +944,133 @@ void VulkanAppBase::createSwapChain(GLFWwindow* window)
 	m_swapchainExtent = extent;
 }
 
+// 作り直しは次の render で行う（コールバックは glfwPollEvents の中で呼ばれる）
+void VulkanAppBase::onFramebufferSize(GLFWwindow* window, int width, int height)
+{
+	auto app = static_cast<VulkanAppBase*>(glfwGetWindowUserPointer(window));
+	if (app != nullptr)
+	{
+		app->m_framebufferResized = true;
+	}
+}
+
+// スワップチェインを作り直す
+bool VulkanAppBase::recreateSwapchain()
+{
+	int fbWidth = 0, fbHeight = 0;
+	glfwGetFramebufferSize(m_window, &fbWidth, &fbHeight);
+	if (fbWidth == 0 || fbHeight == 0)
+	{
+		return false;
+	}
+
+	// 描画中のフレームが使い終えるのを待ってから、大きさに依存するものを破棄する
+	vkDeviceWaitIdle(m_device);
+	for (auto& v : m_framebuffers)
+	{
+		vkDestroyFramebuffer(m_device, v, nullptr);
+	}
+	m_framebuffers.clear();
+	for (auto& v : m_swapchainViews)
+	{
+		vkDestroyImageView(m_device, v, nullptr);
+	}
+	m_swapchainViews.clear();
+	vkDestroyImageView(m_device, m_depthBufferView, nullptr);
+	m_memoryAllocator.destroyImage(m_depthBuffer, m_depthBufferMemory);
+
+	vkGetPhysicalDeviceSurfaceCapabilitiesKHR(m_physDev, m_surface, &m_surfaceCaps);
+	auto oldSwapchain = m_swapchain;
+	auto oldImageCount = m_swapchainImages.size();
+	createSwapChain(m_window);
+	vkDestroySwapchainKHR(m_device, oldSwapchain, nullptr);
+	createDepthBuffer();
+	createViews();
+	createFramebuffer();
+
+	// 使い回すコマンドバッファはイメージごとに用意しているので、イメージ数が変わったら用意し直す
+	if (m_reuseCommands && m_swapchainImages.size() != oldImageCount)
+	{
+		vkFreeCommandBuffers(m_device, m_commandPool, uint32_t(m_commands.size()), m_commands.data());
+		allocateCommandBuffers();
+	}
+	m_imageFences.assign(m_swapchainImages.size(), VK_NULL_HANDLE);
+	invalidateCommands();
+
+	m_coneMarchPrepass.resize(m_swapchainExtent);
+	width = int(m_swapchainExtent.width);
+	height = int(m_swapchainExtent.height);
+	onSwapchainRecreated();
+	m_swapchainOutOfDate = false;
+	m_framebufferResized = false;
+
+	stringstream ss;
+	ss << "[Swapchain] recreated " << m_swapchainExtent.width << "x" << m_swapchainExtent.height
+		<< ", " << m_swapchainImages.size() << " images, " << getPresentModeName(m_presentMode) << endl;
+	OutputDebugStringA(ss.str().c_str());
+	return true;
+}
+
+// Present の方式を選ぶ（FIFO はどのサーフェイスでも使える）
+void VulkanAppBase::selectPresentMode()
+{
+	uint32_t count = 0;
+	vkGetPhysicalDeviceSurfacePresentModesKHR(m_physDev, m_surface, &count, nullptr);
+	vector<VkPresentModeKHR> modes(count);
+	vkGetPhysicalDeviceSurfacePresentModesKHR(m_physDev, m_surface, &count, modes.data());
+
+	m_presentMode = VK_PRESENT_MODE_FIFO_KHR;
+	if (find(modes.begin(), modes.end(), m_requestedPresentMode) != modes.end())
+	{
+		m_presentMode = m_requestedPresentMode;
+	}
+
+	stringstream ss;
+	ss << "[Swapchain] present mode " << getPresentModeName(m_presentMode);
+	if (m_presentMode != m_requestedPresentMode)
+	{
+		ss << " (" << getPresentModeName(m_requestedPresentMode) << " is not supported)";
+	}
+	ss << endl;
+	OutputDebugStringA(ss.str().c_str());
+}
+
+// オフスクリーン描画先のカラーイメージ作成
+// imageCount:作成するイメージ数（スワップチェインのイメージ数に相当）
+void VulkanAppBase::createOffscreenImages(uint32_t imageCount)
+{
+	m_swapchainImages.resize(imageCount);
+	m_offscreenImageMemory.resize(imageCount);
+	for (uint32_t i = 0; i < imageCount; i++)
+	{
+		VkImageCreateInfo ci{};
+		ci.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+		ci.imageType = VK_IMAGE_TYPE_2D;
+		ci.format = m_surfaceFormat.format;
+		ci.extent.width = m_swapchainExtent.width;
+		ci.extent.height = m_swapchainExtent.height;
+		ci.extent.depth = 1;
+		ci.mipLevels = 1;
+		ci.usage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT;
+		ci.samples = VK_SAMPLE_COUNT_1_BIT;
+		ci.arrayLayers = 1;
+		ci.tiling = VK_IMAGE_TILING_OPTIMAL;
+		auto result = m_memoryAllocator.createImage(ci, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &m_swapchainImages[i], &m_offscreenImageMemory[i]);
+		checkResult(result);
+	}
+}
+
+// 読み戻し用ステージングバッファ作成
+void VulkanAppBase::createReadbackBuffer()
+{
+	VkBufferCreateInfo ci{};
+	ci.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+	ci.usage = VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+	ci.size = VkDeviceSize(m_swapchainExtent.width) * m_swapchainExtent.height * 4;
+	auto result = m_memoryAllocator.createBuffer(ci, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, &m_readbackBuffer, &m_readbackMemory);
+	checkResult(result);
+}
+
 // デプスバッファ作成
 void VulkanAppBase::createDepthBuffer()
 {
@@ -436,17 +1085,27 @@ void VulkanAppBase::createDepthBuffer()
 	ci.usage = VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT;
 	ci.samples = VK_SAMPLE_COUNT_1_BIT;
 	ci.arrayLayers = 1;
-	auto result = vkCreateImage(m_device, &ci, nullptr, &m_depthBuffer);
+	auto result = m_memoryAllocator.createImage(ci, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &m_depthBuffer, &m_depthBufferMemory);
 	checkResult(result);
+}
+
+// スワップチェインのイメージへブリットで書き込めるか
+bool VulkanAppBase::isSwapchainBlitSupported() const
+{
+	// オフスクリーン時は転送先を指定してイメージを作成している
+	if (!m_offscreen && !(m_surfaceCaps.supportedUsageFlags & VK_IMAGE_USAGE_TRANSFER_DST_BIT))
+	{
+		return false;
+	}
+	VkFormatProperties props;
+	vkGetPhysicalDeviceFormatProperties(m_physDev, m_surfaceFormat.format, &props);
+	return (props.optimalTilingFeatures & VK_FORMAT_FEATURE_BLIT_DST_BIT) != 0;
+}
 
-	VkMemoryRequirements reqs;
-	vkGetImageMemoryRequirements(m_device, m_depthBuffer, &reqs);
-	VkMemoryAllocateInfo ai{};
-	ai.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_FLAGS_INFO;
-	ai.allocationSize = reqs.size;
-	ai.memoryTypeIndex = getMemoryTypeIndex(reqs.memoryTypeBits, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
-	vkAllocateMemory(m_device, &ai, nullptr, &m_depthBufferMemory);
-	vkBindImageMemory(m_device, m_depthBuffer, m_depthBufferMemory, 0);
+// 描画後のスワップチェインのイメージのレイアウト（createRenderPass の finalLayout と同じ）
+VkImageLayout VulkanAppBase::getSwapchainFinalLayout() const
+{
+	return m_offscreen ? VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL : VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
 }
 
 // メモリタイプインデックスの取得
@@ -473,10 +1132,14 @@ uint32_t VulkanAppBase::getMemoryTypeIndex(uint32_t requestBits, VkMemoryPropert
 // VkImageView 作成
 void VulkanAppBase::createViews()
 {
-	uint32_t imageCount;
-	vkGetSwapchainImagesKHR(m_device, m_swapchain, &imageCount, nullptr);
-	m_swapchainImages.resize(imageCount);
-	vkGetSwapchainImagesKHR(m_device, m_swapchain, &imageCount, m_swapchainImages.data());
+	if (!m_offscreen)
+	{
+		uint32_t imageCount;
+		vkGetSwapchainImagesKHR(m_device, m_swapchain, &imageCount, nullptr);
+		m_swapchainImages.resize(imageCount);
+		vkGetSwapchainImagesKHR(m_device, m_swapchain, &imageCount, m_swapchainImages.data());
+	}
+	uint32_t imageCount = uint32_t(m_swapchainImages.size());
 	m_swapchainViews.resize(imageCount);
 	for (uint32_t i = 0; i < imageCount; i++)
 	{
@@ -534,7 +1197,8 @@ void VulkanAppBase::createRenderPass()
 	colorTarget.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
 	colorTarget.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
 	colorTarget.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
-	colorTarget.finalLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
+	// オフスクリーン時は読み戻しのため転送元レイアウトにしておく
+	colorTarget.finalLayout = getSwapchainFinalLayout();
 
 	depthTarget = VkAttachmentDescription{};
 	depthTarget.format = VK_FORMAT_D32_SFLOAT;
@@ -564,6 +1228,18 @@ void VulkanAppBase::createRenderPass()
 	ci.subpassCount = 1;
 	ci.pSubpasses = &subpassDesc;
 
+	// 深度バッファはフレーム間で共有するので、前のフレームの深度の書き込みが終わってからクリアする
+	// スワップチェインのイメージのレイアウト遷移も、取得のセマフォを待つ COLOR_ATTACHMENT_OUTPUT の後に行う
+	VkSubpassDependency dependency{};
+	dependency.srcSubpass = VK_SUBPASS_EXTERNAL;
+	dependency.dstSubpass = 0;
+	dependency.srcStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT | VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT | VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT;
+	dependency.dstStageMask = dependency.srcStageMask;
+	dependency.srcAccessMask = VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+	dependency.dstAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+	ci.dependencyCount = 1;
+	ci.pDependencies = &dependency;
+
 	auto result = vkCreateRenderPass(m_device, &ci, nullptr, &m_renderPass);
 	checkResult(result);
 }
@@ -595,33 +1271,114 @@ void VulkanAppBase::createFramebuffer()
 
 void VulkanAppBase::prepareSemaphores()
 {
+	// フレームごとに用意する（Present が終わる前に次のフレームが同じセマフォを使わないように）
 	VkSemaphoreCreateInfo ci{};
 	ci.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
-	vkCreateSemaphore(m_device, &ci, nullptr, &m_renderCompletedSem);
-	vkCreateSemaphore(m_device, &ci, nullptr, &m_presentCompletedSem);
+	m_renderCompletedSems.resize(m_framesInFlight);
+	m_presentCompletedSems.resize(m_framesInFlight);
+	for (uint32_t i = 0; i < m_framesInFlight; i++)
+	{
+		vkCreateSemaphore(m_device, &ci, nullptr, &m_renderCompletedSems[i]);
+		vkCreateSemaphore(m_device, &ci, nullptr, &m_presentCompletedSems[i]);
+	}
+}
+
+void VulkanAppBase::prepareMarchQuality()
+{
+	m_marchQuality = MarchQuality::getPreset(m_marchQualityPreset, m_marchQualityBase);
+	m_marchSpecialization = MarchQuality::getSpecializationInfo(m_marchQuality);
+	OutputDebugStringA(MarchQuality::createReport(MarchQuality::getPresetName(m_marchQualityPreset), m_marchQuality).c_str());
 }
 
 // コマンドバッファ作成
 void VulkanAppBase::prepareCommandBuffers()
+{
+	allocateCommandBuffers();
+
+	// フェンスはフレームの枠ごとに用意する
+	m_fences.resize(m_framesInFlight);
+	VkFenceCreateInfo ci{};
+	ci.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+	ci.flags = VK_FENCE_CREATE_SIGNALED_BIT;
+	for (auto& v : m_fences) {
+		auto result = vkCreateFence(m_device, &ci, nullptr, &v);
+		checkResult(result);
+	}
+
+	// まだどのフレームもイメージを使っていない
+	m_imageFences.assign(m_swapchainImages.size(), VK_NULL_HANDLE);
+}
+
+void VulkanAppBase::allocateCommandBuffers()
 {
 	VkCommandBufferAllocateInfo ai{};
 	ai.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
 	ai.commandPool = m_commandPool;
-	ai.commandBufferCount = uint32_t(m_swapchainViews.size());
+	ai.commandBufferCount = m_framesInFlight;
 	ai.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+	if (m_reuseCommands)
+	{
+		// 記録する内容は描画先のイメージにも依存するので、フレームの枠 x イメージの数だけ用意する
+		ai.commandBufferCount = m_framesInFlight * uint32_t(m_swapchainImages.size());
+	}
 	m_commands.resize(ai.commandBufferCount);
+	m_commandRecorded.assign(ai.commandBufferCount, false);
 	auto result = vkAllocateCommandBuffers(m_device, &ai, m_commands.data());
 	checkResult(result);
+}
 
-	// コマンドバッファのフェンスも同数用意する
-	m_fences.resize(ai.commandBufferCount);
-	VkFenceCreateInfo ci{};
-	ci.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
-	ci.flags = VK_FENCE_CREATE_SIGNALED_BIT;
-	for (auto& v : m_fences) {
-		result = vkCreateFence(m_device, &ci, nullptr, &v);
-		checkResult(result);
+// 1フレーム分のコマンドを記録する（描画先は m_imageIndex、フレームごとのリソースは m_frameIndex）
+void VulkanAppBase::recordCommand(VkCommandBuffer command)
+{
+	// クリア値
+	array<VkClearValue, 2> clearValue = {
+		{ 
+		  //{0.5f, 0.25f, 0.25f, 0.0f}, //for color
+		  {.1f, .1f, .3f, 0.0f}, //for color
+		  {1.0f, 0} //for depth
+		}
+	};
+
+	VkRenderPassBeginInfo renderPassBI{};
+	renderPassBI.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
+	renderPassBI.renderPass = m_renderPass;
+	renderPassBI.framebuffer = m_framebuffers[m_imageIndex];
+	renderPassBI.renderArea.offset = VkOffset2D{ 0,0 };
+	renderPassBI.renderArea.extent = m_swapchainExtent;
+	renderPassBI.pClearValues = clearValue.data();
+	renderPassBI.clearValueCount = uint32_t(clearValue.size());
+
+	// コマンドバッファ・レンダーパス開始
+	VkCommandBufferBeginInfo commandBI{};
+	commandBI.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+	vkBeginCommandBuffer(command, &commandBI);
+	m_gpuProfiler.reset(command, m_frameIndex);
+
+	// 前処理パス
+	beginProfileSection(command, "prepass");
+	makePrepassCommand(command);
+	endProfileSection(command);
+
+	// コンピュートシェーダーで描画した場合はメインのレンダーパスを使わない
+	if (!makeComputeCommand(command))
+	{
+		vkCmdBeginRenderPass(command, &renderPassBI, VK_SUBPASS_CONTENTS_INLINE);
+
+		// ビューポートとシザーは動的ステートにして、スワップチェインを作り直してもパイプラインはそのまま使う
+		// 上下反転して左下を原点にする（各サンプルのシェーダーと前処理パスも同じ向き）
+		VkViewport viewport{ 0.0f, float(m_swapchainExtent.height), float(m_swapchainExtent.width), -1.0f * float(m_swapchainExtent.height), 0.0f, 1.0f };
+		VkRect2D scissor{ { 0, 0 }, m_swapchainExtent };
+		vkCmdSetViewport(command, 0, 1, &viewport);
+		vkCmdSetScissor(command, 0, 1, &scissor);
+		makeCommand(command);
+
+		// レンダーパス終了
+		vkCmdEndRenderPass(command);
 	}
+
+	// コマンド終了
+	m_coneMarchPrepass.makeStatisticsBarrier(command, m_frameIndex);
+	vkEndCommandBuffer(command);
 }
 
 void VulkanAppBase::enableDebugReport()
@@ -629,6 +1386,12 @@ void VulkanAppBase::enableDebugReport()
 	GetInstanceProcAddr(vkCreateDebugReportCallbackEXT);
 	GetInstanceProcAddr(vkDebugReportMessageEXT);
 	GetInstanceProcAddr(vkDestroyDebugReportCallbackEXT);
+	// VK_EXT_debug_report に対応していないローダーでは何もしない
+	if (!m_instanceExtensions.isEnabled(VK_EXT_DEBUG_REPORT_EXTENSION_NAME) || m_vkCreateDebugReportCallbackEXT == nullptr)
+	{
+		m_vkDestroyDebugReportCallbackEXT = nullptr;
+		return;
+	}
 
 	VkDebugReportFlagsEXT flags = VK_DEBUG_REPORT_ERROR_BIT_EXT | VK_DEBUG_REPORT_WARNING_BIT_EXT;
 
@@ -646,4 +1409,17 @@ void VulkanAppBase::disableDebugReport()
 	{
 		m_vkDestroyDebugReportCallbackEXT(m_instance, m_debugReport, nullptr);
 	}
+}
+
+// 現在時刻（秒）を取得
+double VulkanAppBase::getTime() const
+{
+	if (!m_offscreen)
+	{
+		return glfwGetTime();
+	}
+
+	// オフスクリーン時はGLFWを初期化しないため標準ライブラリの時計を使う
+	static const auto startTime = chrono::steady_clock::now();
+	return chrono::duration<double>(chrono::steady_clock::now() - startTime).count();
 }
\ No newline at end of file
@@ -1,19 +1,35 @@
 ﻿#pragma once
-#define WIN32_LEAN_AND_MEAN
-#include <windows.h>
+#include "Platform.h"
 
+#ifdef _WIN32
 #define VK_USE_PLATFORM_WIN32_KHR
-#define GLFW_INCLUDE_VULKAN
 #define GLFW_EXPOSE_NATIVE_WIN32
-
-#define M_PI 3.14159265359
+#endif
+#define GLFW_INCLUDE_VULKAN
 
 #include <GLFW/glfw3.h>
 #include <GLFW/glfw3native.h>
 #include <vulkan/vk_layer.h>
+#ifdef _WIN32
 #include <vulkan/vulkan_win32.h>
+#endif
 
 #include <vector>
+#include <string>
+#include <algorithm>
+#include <stdint.h>
+
+#include "DeviceMemoryAllocator.h"
+#include "ExtensionSet.h"
+#include "PhysicalDeviceSelector.h"
+#include "StagingUploader.h"
+#include "ConeMarchPrepass.h"
+#include "UniformRingBuffer.h"
+#include "GpuProfiler.h"
+#include "MarchHeatmap.h"
+#include "PipelineCache.h"
+#include "PipelineBuilder.h"
+#include "MarchQuality.h"
 
 class VulkanAppBase
 {
@@ -21,15 +37,115 @@ public:
 	VulkanAppBase();
 	virtual ~VulkanAppBase() {}
 
+	static const uint32_t DefaultFramesInFlight = 2;
+
+	// 1フレームで m_uniformRing から割り当てられるバイト数
+	static const uint32_t UniformFrameSize = 4096;
+
+	// パイプラインキャッシュのファイルの既定値（作業ディレクトリ、つまりサンプルごとに置く）
+	static const char* DefaultPipelineCacheFile;
+
+	// 同時に処理するフレーム数（CPU が記録するフレームと GPU が実行するフレームを重ねる数）
+	// コマンドバッファ・フェンス・セマフォと派生先のフレームごとのリソースをこの数だけ用意する
+	// initialize の前に呼ぶこと
+	void setFramesInFlight(uint32_t count) { m_framesInFlight = (std::max)(count, 1u); }
+	uint32_t getFramesInFlight() const { return m_framesInFlight; }
+
+	// 記録したコマンドバッファを使い回し、毎フレームは送信だけを行う（initialize の前に呼ぶこと）
+	// コマンドはフレームの枠とイメージの組ごとに一度だけ記録するので、記録する内容は毎フレーム同じであること
+	// （update で m_uniformRing に同じ順番で書き込めば動的オフセットも同じになる。プッシュ定数は使えない）
+	// パイプライン・描画先・シーン・前処理パスの設定を変えた場合は invalidateCommands を呼ぶ
+	void setReuseCommands(bool enable) { m_reuseCommands = enable; }
+	bool isReuseCommands() const { return m_reuseCommands; }
+	void invalidateCommands();
+
+	// アニメーションの時刻を実時間ではなく1フレームごとに seconds ずつ進める（0 の場合は実時間）
+	// 同じフレーム数を描画すれば毎回同じ画面になるので、ベンチマークの結果を比べられる
+	void setFixedTimeStep(double seconds) { m_fixedTimeStep = seconds; }
+
+	// 使う物理デバイスを名前の一部・UUID の先頭・列挙した番号で指定する（initialize の前に呼ぶこと）
+	// 空の場合と、一致するものが条件を満たさない場合は点数が最も高いものを使う（PhysicalDeviceSelector）
+	void setPhysicalDeviceFilter(const char* filter) { m_physicalDeviceFilter = filter ? filter : ""; }
+	// 選んだ物理デバイスの名前
+	const std::string& getPhysicalDeviceName() const { return m_physDevName; }
+
+	// パイプラインキャッシュのファイル（initialize で読み込み、terminate で書き戻す。nullptr の場合は保存しない）
+	// initialize の前に呼ぶこと
+	void setPipelineCacheFile(const char* fileName) { m_pipelineCacheFile = fileName ? fileName : ""; }
+
+	// レイマーチングの品質（シェーダーの特殊化定数、initialize の前に呼ぶこと）
+	// プリセットは派生先が m_marchQualityBase に設定した既定値を基準にステップ数などを増減する
+	void setMarchQualityPreset(MarchQuality::Preset preset) { m_marchQualityPreset = preset; }
+	// プリセットを使わずに値を指定する
+	void setMarchQuality(const MarchQuality::Settings& settings) { m_marchQualityBase = settings; m_marchQualityPreset = MarchQuality::PresetDefault; }
+	// initialize で決まった値
+	const MarchQuality::Settings& getMarchQuality() const { return m_marchQuality; }
+
+	// GPU の処理時間とパイプライン統計を区間ごとに計測する（initialize の前に呼ぶこと）
+	// 派生先は beginProfileSection / endProfileSection で計測する区間を囲む
+	void setGpuProfilingEnabled(bool enable) { m_gpuProfiling = enable; }
+	GpuProfiler& getGpuProfiler() { return m_gpuProfiler; }
+	// frameCount フレーム描画し、区間ごとの処理時間を出力する
+	void renderWithGpuProfile(int frameCount);
+
+	// Present の方式（initialize の前に呼ぶこと）
+	// FIFO 以外はサーフェイスが対応していれば使い、対応していなければ FIFO にする
+	// MAILBOX / IMMEDIATE は垂直同期を待たないので、描画のスループットを測る場合に使う
+	void setPresentMode(VkPresentModeKHR mode) { m_requestedPresentMode = mode; }
+	VkPresentModeKHR getPresentMode() const { return m_presentMode; }
+	// fifo / fifo_relaxed / mailbox / immediate
+	static bool findPresentMode(const char* name, VkPresentModeKHR* mode);
+	static const char* getPresentModeName(VkPresentModeKHR mode);
+
 	void initialize(GLFWwindow* window, const char* appName);
+	// ウィンドウ・スワップチェインを使わないオフスクリーン描画で初期化する
+	void initializeOffscreen(uint32_t width, uint32_t height, const char* appName);
 	void terminate();
 
 	virtual void render();
 
+	// GPU がすべての処理を終えるのを待つ
+	void waitIdle();
+
+	// 直近に描画したイメージをRGBA8で読み戻す（オフスクリーン時のみ）
+	bool readbackImage(std::vector<uint8_t>* pixels);
+	// 直近に描画したイメージをPPM形式で保存する（オフスクリーン時のみ）
+	bool saveImage(const char* fileName);
+
+	// RGBA8 のピクセル列をPPM形式で保存する
+	static bool writePPM(const char* fileName, uint32_t width, uint32_t height, const std::vector<uint8_t>& pixels);
+
+	bool isOffscreen() const { return m_offscreen; }
+
+	// コーンマーチングの前処理パス（タイルごとのレイの開始距離とステップ数の統計）
+	ConeMarchPrepass& getConeMarchPrepass() { return m_coneMarchPrepass; }
+	// ステップ数の統計とヒートマップを取れるか（フラグメントシェーダーから書くので fragmentStoresAndAtomics が必要）
+	// 取れる場合、派生先は MARCH_STATS を定義してコンパイルしたシェーダーを使い、ConeMarchPrepass::setStatisticsShader で知らせる
+	bool isMarchStatisticsSupported() const { return m_enabledFeatures.fragmentStoresAndAtomics == VK_TRUE; }
+	// 描画の完了を待ってステップ数の統計を集計する
+	ConeMarchPrepass::Statistics collectMarchStatistics();
+	// 前処理パスなし・ありでそれぞれ frameCount フレーム描画し、ステップ数の統計を出力する（終わると元の設定に戻す）
+	// 統計を書くシェーダーを読み込んでいない場合は frameCount フレーム描画するだけ
+	void renderWithMarchStatistics(int frameCount);
+	// 1フレーム描画してピクセルごとのステップ数と終了理由を集計し、擬似カラーの画像を PPM 形式で保存する（統計を書くシェーダーを読み込んでいない場合は何もしない）
+	void renderWithMarchHeatmap(const char* fileName);
+
 	// 以下、派生先で内容をオーバーライドする
 	virtual void prepare() {}
 	virtual void cleanup() {}
+	// フレームごとのパラメータを更新する（コマンドの記録より前に呼ぶ）
+	// ユニフォームデータは m_uniformRing に書き込み、動的オフセットを記録のときに使う
+	virtual void update() {}
+	// ビューポートとシザーは記録の前に設定済み（パイプラインでは VIEWPORT / SCISSOR を動的ステートにする）
 	virtual void makeCommand(VkCommandBuffer command) {}
+	// メインのレンダーパスの前に記録するコマンド（前処理パス）
+	virtual void makePrepassCommand(VkCommandBuffer command) {}
+	// メインのレンダーパスの代わりにコンピュートシェーダーで描画する場合は、
+	// 描画先のイメージ（m_swapchainImages[m_imageIndex]）まで書き込んで true を返す
+	virtual bool makeComputeCommand(VkCommandBuffer command) { return false; }
+	// スワップチェインを作り直した後に呼ぶ（デバイスはアイドル、m_swapchainExtent と width / height は新しい大きさ）
+	// 大きさに依存するリソースを作り直し、m_coneMarchPrepass を参照するディスクリプタを書き直す
+	virtual void onSwapchainRecreated() {}
 
 protected:
 	// 各処理メソッド（を書く予定）
@@ -40,12 +156,9 @@ protected:
 	// vkInstanceを初期化する
 	void initializeInstance(const char* appName);
 
-	//物理デバイスを取得する
+	// 物理デバイスとキューファミリー（描画用・転送用）を選ぶ（ウィンドウの場合はサーフェイスを作った後に呼ぶ）
 	void selectPhysicalDevice();
 
-	// デバイスキューインデックスを取得する
-	uint32_t searchGraphicsQueueIndex();
-
 	// 論理デバイスを作成する
 	void createDevice();
 
@@ -55,9 +168,22 @@ protected:
 	// サーフェイスフォーマット設定
 	void selectSurfaceFormat(VkFormat format);
 
-	// スワップチェイン作成
+	// Present の方式を選ぶ
+	void selectPresentMode();
+
+	// スワップチェイン作成（m_swapchain があれば oldSwapchain に渡す）
 	void createSwapChain(GLFWwindow* window);
 
+	// ウィンドウの大きさが変わった場合などにスワップチェインと大きさに依存するリソースを作り直す
+	// 最小化していて作れない場合は false
+	bool recreateSwapchain();
+
+	// オフスクリーン描画先のカラーイメージ作成
+	void createOffscreenImages(uint32_t imageCount);
+
+	// 読み戻し用ステージングバッファ作成
+	void createReadbackBuffer();
+
 	// デプスバッファ作成
 	void createDepthBuffer();
 
@@ -72,19 +198,40 @@ protected:
 
 	// コマンドバッファの作成
 	void prepareCommandBuffers();
+	void allocateCommandBuffers();
+	void recordCommand(VkCommandBuffer command);
+
+	// GPU の計測区間（記録中のフレームのクエリに書く、入れ子にはできない）
+	void beginProfileSection(VkCommandBuffer command, const char* name) { m_gpuProfiler.beginSection(command, m_frameIndex, name); }
+	void endProfileSection(VkCommandBuffer command) { m_gpuProfiler.endSection(command, m_frameIndex); }
 
 	// セマフォの用意
 	void prepareSemaphores();
 
+	// プリセットからレイマーチングの品質を決め、特殊化情報を用意する
+	void prepareMarchQuality();
+
 	// メモリタイプインデックスを取得
 	uint32_t getMemoryTypeIndex(uint32_t requestBits, VkMemoryPropertyFlags requestProps)const;
 
+	// スワップチェインのイメージへ転送（ブリット）で書き込めるか
+	bool isSwapchainBlitSupported() const;
+
+	// 描画後のスワップチェインのイメージのレイアウト（Present か読み戻し）
+	VkImageLayout getSwapchainFinalLayout() const;
+
 	// デバッグレポート有効化
 	void enableDebugReport();
 
 	// デバッグレポート無効化
 	void disableDebugReport();
 
+	// 現在時刻（秒）を取得
+	double getTime() const;
+
+	// ウィンドウのフレームバッファの大きさが変わった（glfwSetFramebufferSizeCallback）
+	static void onFramebufferSize(GLFWwindow* window, int width, int height);
+
 
 	// インスタンス
 	VkInstance  m_instance;
@@ -94,10 +241,19 @@ protected:
 
 	// 物理デバイス
 	VkPhysicalDevice m_physDev;
+	std::string m_physDevName;
+	std::string m_physicalDeviceFilter;
 
 	// 物理デバイスのメモリプロパティ
 	VkPhysicalDeviceMemoryProperties m_physMemProps;
 
+	// 論理デバイスで有効にした機能
+	VkPhysicalDeviceFeatures m_enabledFeatures;
+
+	// 有効にした拡張（使う機能ごとに登録したもののうち、対応しているもの）
+	ExtensionSet m_instanceExtensions;
+	ExtensionSet m_deviceExtensions;
+
 	// Surface
 	VkSurfaceKHR m_surface;
 
@@ -111,11 +267,28 @@ protected:
 	uint32_t m_graphicsQueueIndex;
 	VkQueue m_deviceQueue;
 
+	// 転送用のキュー（転送専用のキューファミリーが無ければ m_deviceQueue と同じ）
+	uint32_t m_transferQueueIndex;
+	VkQueue m_transferQueue;
+
+	// VK_KHR_timeline_semaphore を有効にできたか
+	bool m_timelineSemaphore;
+
 	// コマンドプール
 	VkCommandPool m_commandPool;
 
 	// Present
 	VkPresentModeKHR m_presentMode;
+	VkPresentModeKHR m_requestedPresentMode;
+
+	// 描画先のウィンドウ（オフスクリーン時は nullptr）
+	GLFWwindow* m_window;
+
+	// 次のフレームの前にスワップチェインを作り直すか（OUT_OF_DATE / SUBOPTIMAL が返った）
+	bool m_swapchainOutOfDate;
+	// 前に作り直してからウィンドウの大きさが変わったか
+	// スワップチェインの大きさはサーフェイスの範囲に丸めるので、フレームバッファの大きさとは比べない
+	bool m_framebufferResized;
 
 	//Swapchain
 	VkSwapchainKHR m_swapchain;
@@ -129,11 +302,21 @@ protected:
 	// Swapchain Views
 	std::vector<VkImageView> m_swapchainViews;
 
+	// オフスクリーン描画かどうか
+	bool m_offscreen;
+
+	// オフスクリーン描画先イメージのデバイスメモリ
+	std::vector<DeviceMemoryAllocator::Allocation> m_offscreenImageMemory;
+
+	// 読み戻し用ステージングバッファ
+	VkBuffer m_readbackBuffer;
+	DeviceMemoryAllocator::Allocation m_readbackMemory;
+
 	// デプスバッファテクスチャ
 	VkImage m_depthBuffer;
 
 	// デプスバッファ デバイスメモリ
-	VkDeviceMemory m_depthBufferMemory;
+	DeviceMemoryAllocator::Allocation m_depthBufferMemory;
 
 	// デプスバッファビュー
 	VkImageView m_depthBufferView;
@@ -144,11 +327,17 @@ protected:
 	// Framebuffer
 	std::vector<VkFramebuffer> m_framebuffers;
 
-	// Fence
+	// 同時に処理するフレーム数
+	uint32_t m_framesInFlight;
+
+	// Fence（フレームごと）
 	std::vector<VkFence> m_fences;
 
-	// セマフォ
-	VkSemaphore m_renderCompletedSem, m_presentCompletedSem;
+	// スワップチェインのイメージを最後に使ったフレームのフェンス（イメージごと）
+	std::vector<VkFence> m_imageFences;
+
+	// セマフォ（フレームごと）
+	std::vector<VkSemaphore> m_renderCompletedSems, m_presentCompletedSems;
 
 	// デバッグレポート関連
 	PFN_vkCreateDebugReportCallbackEXT m_vkCreateDebugReportCallbackEXT;
@@ -156,15 +345,54 @@ protected:
 	PFN_vkDestroyDebugReportCallbackEXT m_vkDestroyDebugReportCallbackEXT;
 	VkDebugReportCallbackEXT m_debugReport;
 
-	// コマンドバッファ
+	// コマンドバッファ（フレームごと、使い回す場合はフレームの枠 x イメージごと）
 	std::vector<VkCommandBuffer> m_commands;
+	bool m_reuseCommands;
+	std::vector<bool> m_commandRecorded;
 
+	// デバイスメモリ（バッファとイメージはすべて m_memoryAllocator の createBuffer / createImage で作成する）
+	DeviceMemoryAllocator m_memoryAllocator;
+
+	// 起動中変わらないデータをデバイスローカルのメモリへ転送する（prepare で記録し、prepare の後にまとめて送信する）
+	StagingUploader m_uploader;
+
+	// コーンマーチングの前処理パス
+	ConeMarchPrepass m_coneMarchPrepass;
+
+	// フレームごとのユニフォームデータ（マップしたまま、動的オフセットで参照する）
+	UniformRingBuffer m_uniformRing;
+
+	// パイプラインキャッシュ（パイプラインの作成にはすべて m_pipelineCache.getHandle() を渡す）
+	std::string m_pipelineCacheFile;
+	PipelineCache m_pipelineCache;
+
+	// パイプラインの並列作成（prepare で作成を始め、使うときに get で待つ。terminate で cleanup の前にすべて待つ）
+	PipelineBuilder m_pipelineBuilder;
+
+	// レイマーチングの品質（派生先はコンストラクタで m_marchQualityBase にサンプルの既定値を設定する）
+	// レイマーチングするシェーダーのステージには pSpecializationInfo に &m_marchSpecialization を渡す
+	MarchQuality::Settings m_marchQualityBase;
+	MarchQuality::Preset m_marchQualityPreset;
+	MarchQuality::Settings m_marchQuality;
+	VkSpecializationInfo m_marchSpecialization;
+
+	// GPU の処理時間の計測
+	bool m_gpuProfiling;
+	GpuProfiler m_gpuProfiler;
+
+	// 描画先のスワップチェインのイメージ
 	uint32_t m_imageIndex;
 
+	// 記録中のフレーム（派生先のユニフォームバッファやディスクリプタセットなど、フレームごとのリソースの添字）
+	uint32_t m_frameIndex;
+
 	int width;
 	int height;
 
 	double prevTime;
 	double currentTime;
+
+	// 固定の時間刻み（0 の場合は実時間）
+	double m_fixedTimeStep;
 };
 